@@ -1,6 +1,9 @@
+#include <float.h>
 #include "aabox.h"
 #include "surf.h"
 
+static inline float box_center(const struct aabox *box, int axis);
+
 int ray_aabox(const struct aabox *box, const cgm_ray *ray, struct surf_hit *hit)
 {
 	int sign[3];
@@ -56,3 +59,135 @@ int ray_aabox(const struct aabox *box, const cgm_ray *ray, struct surf_hit *hit)
 	}
 	return 1;
 }
+
+void aabox_init(struct aabox *box)
+{
+	cgm_vcons(&box->vmin, FLT_MAX, FLT_MAX, FLT_MAX);
+	cgm_vcons(&box->vmax, -FLT_MAX, -FLT_MAX, -FLT_MAX);
+}
+
+void aabox_add(struct aabox *box, const struct aabox *b)
+{
+	if(b->vmin.x < box->vmin.x) box->vmin.x = b->vmin.x;
+	if(b->vmax.x > box->vmax.x) box->vmax.x = b->vmax.x;
+	if(b->vmin.y < box->vmin.y) box->vmin.y = b->vmin.y;
+	if(b->vmax.y > box->vmax.y) box->vmax.y = b->vmax.y;
+	if(b->vmin.z < box->vmin.z) box->vmin.z = b->vmin.z;
+	if(b->vmax.z > box->vmax.z) box->vmax.z = b->vmax.z;
+}
+
+void aabox_add_point(struct aabox *box, const cgm_vec3 *p)
+{
+	if(p->x < box->vmin.x) box->vmin.x = p->x;
+	if(p->x > box->vmax.x) box->vmax.x = p->x;
+	if(p->y < box->vmin.y) box->vmin.y = p->y;
+	if(p->y > box->vmax.y) box->vmax.y = p->y;
+	if(p->z < box->vmin.z) box->vmin.z = p->z;
+	if(p->z > box->vmax.z) box->vmax.z = p->z;
+}
+
+float aabox_area(const struct aabox *box)
+{
+	float dx = box->vmax.x - box->vmin.x;
+	float dy = box->vmax.y - box->vmin.y;
+	float dz = box->vmax.z - box->vmin.z;
+
+	if(dx < 0.0f || dy < 0.0f || dz < 0.0f) {
+		return 0.0f;	/* empty */
+	}
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+int aabox_sah_split(struct aabox_split *split, const void *items, int count,
+		aabox_item_func get_box, const struct aabox *bbox, float node_cost,
+		float item_cost, float leaf_cost)
+{
+	int i, j, axis, bin, best_split, num_left;
+	int bin_count[AABOX_SAH_BINS];
+	float c, cmin, cmax, scale, area, cost, best_cost;
+	float right_area[AABOX_SAH_BINS];
+	struct aabox cbox, bin_box[AABOX_SAH_BINS], left, right;
+	const struct aabox *b;
+
+	aabox_init(&cbox);
+	for(i=0; i<count; i++) {
+		b = get_box(items, i);
+		for(j=0; j<3; j++) {
+			c = box_center(b, j);
+			if(c < (&cbox.vmin.x)[j]) (&cbox.vmin.x)[j] = c;
+			if(c > (&cbox.vmax.x)[j]) (&cbox.vmax.x)[j] = c;
+		}
+	}
+
+	axis = 0;
+	for(j=1; j<3; j++) {
+		if((&cbox.vmax.x)[j] - (&cbox.vmin.x)[j] >
+				(&cbox.vmax.x)[axis] - (&cbox.vmin.x)[axis]) {
+			axis = j;
+		}
+	}
+	cmin = (&cbox.vmin.x)[axis];
+	cmax = (&cbox.vmax.x)[axis];
+	if(cmax <= cmin) return 0;
+	scale = AABOX_SAH_BINS / (cmax - cmin);
+
+	for(i=0; i<AABOX_SAH_BINS; i++) {
+		bin_count[i] = 0;
+		aabox_init(bin_box + i);
+	}
+	for(i=0; i<count; i++) {
+		b = get_box(items, i);
+		bin = (int)((box_center(b, axis) - cmin) * scale);
+		if(bin >= AABOX_SAH_BINS) bin = AABOX_SAH_BINS - 1;
+		bin_count[bin]++;
+		aabox_add(bin_box + bin, b);
+	}
+
+	/* sweep from the right for the areas right of each split, then from the
+	 * left for the costs
+	 */
+	aabox_init(&right);
+	for(i=AABOX_SAH_BINS-1; i>0; i--) {
+		aabox_add(&right, bin_box + i);
+		right_area[i] = aabox_area(&right);
+	}
+
+	area = aabox_area(bbox);
+	best_split = 0;
+	best_cost = leaf_cost;
+	aabox_init(&left);
+	num_left = 0;
+	for(i=1; i<AABOX_SAH_BINS; i++) {
+		aabox_add(&left, bin_box + i - 1);
+		num_left += bin_count[i - 1];
+		if(!num_left || num_left == count) continue;
+
+		cost = node_cost;
+		if(area > 0.0f) {
+			cost += (aabox_area(&left) * num_left + right_area[i] * (count - num_left)) *
+				item_cost / area;
+		}
+		if(cost < best_cost) {
+			best_cost = cost;
+			best_split = i;
+		}
+	}
+	if(!best_split) return 0;
+
+	split->axis = axis;
+	split->bin = best_split;
+	split->cmin = cmin;
+	split->scale = scale;
+	return 1;
+}
+
+int aabox_split_left(const struct aabox_split *split, const struct aabox *box)
+{
+	int bin = (int)((box_center(box, split->axis) - split->cmin) * split->scale);
+	return bin < split->bin;
+}
+
+static inline float box_center(const struct aabox *box, int axis)
+{
+	return ((&box->vmin.x)[axis] + (&box->vmax.x)[axis]) * 0.5f;
+}
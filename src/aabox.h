@@ -3,12 +3,66 @@
 
 #include <cgmath/cgmath.h>
 
+/* number of bins along the split axis for the surface area heuristic */
+#define AABOX_SAH_BINS	16
+
 struct aabox {
 	cgm_vec3 vmin, vmax;
 };
 
+/* split found by aabox_sah_split: items whose box centers fall in bins before
+ * bin, along axis, go to the left child
+ */
+struct aabox_split {
+	int axis, bin;
+	float cmin, scale;
+};
+
+/* returns the bounds of item idx of an array passed to aabox_sah_split */
+typedef const struct aabox *(*aabox_item_func)(const void *items, int idx);
+
 struct surf_hit;
 
 int ray_aabox(const struct aabox *box, const cgm_ray *ray, struct surf_hit *hit);
 
+/* empty box, which grows to fit anything added to it */
+void aabox_init(struct aabox *box);
+void aabox_add(struct aabox *box, const struct aabox *b);
+void aabox_add_point(struct aabox *box, const cgm_vec3 *p);
+float aabox_area(const struct aabox *box);
+
+/* bins count items by the centers of their boxes, along the axis where the
+ * centers spread the most, and finds the bin boundary with the lowest surface
+ * area heuristic cost, for a node with bounds bbox. Returns 0 if no split costs
+ * less than leaf_cost, or the centers can't be split.
+ */
+int aabox_sah_split(struct aabox_split *split, const void *items, int count,
+		aabox_item_func get_box, const struct aabox *bbox, float node_cost,
+		float item_cost, float leaf_cost);
+/* does a box go to the left child of a split? */
+int aabox_split_left(const struct aabox_split *split, const struct aabox *box);
+
+/* does the ray from org, with the reciprocals of its direction, enter the box
+ * before distance tmax?
+ */
+static inline int ray_aabox_enter(const struct aabox *box, const cgm_vec3 *org,
+		const cgm_vec3 *inv_dir, float tmax)
+{
+	int i;
+	float t0, t1, tnear = 0.0f, tfar = tmax;
+
+	for(i=0; i<3; i++) {
+		t0 = ((&box->vmin.x)[i] - (&org->x)[i]) * (&inv_dir->x)[i];
+		t1 = ((&box->vmax.x)[i] - (&org->x)[i]) * (&inv_dir->x)[i];
+		if(t0 > t1) {
+			float tmp = t0;
+			t0 = t1;
+			t1 = tmp;
+		}
+		if(t0 > tnear) tnear = t0;
+		if(t1 < tfar) tfar = t1;
+	}
+	return tnear <= tfar && tfar >= 1e-5f;
+}
+
 #endif	/* AABOX_H_ */
@@ -0,0 +1,375 @@
+/* big allocations for scene data and the framebuffer
+ *
+ * Everything is mapped directly, so that it can be given huge pages and a NUMA
+ * memory policy before any of it is touched. The mappings are recorded in a
+ * list on the side, which keeps the memory returned page aligned. There are
+ * only a few big allocations per mesh, so looking them up is cheap. Nodes and
+ * their CPUs are read from sysfs, and the memory policy is set with the raw
+ * mbind system call, to avoid depending on libnuma.
+ *
+ * Transparent huge pages are aligned to the huge page size, otherwise the
+ * kernel can't back the start of the mapping with them.
+ */
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "bigmem.h"
+#include "tpool.h"
+
+#define MAX_NODES	64
+#define MAX_CPUS	1024
+#define DEF_HUGE_PAGE	(2 << 20)
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/* from linux/mempolicy.h */
+#define MPOL_BIND		2
+#define MPOL_INTERLEAVE	3
+
+struct bigmem_map {
+	void *base;
+	size_t len;		/* of the whole mapping */
+	size_t size;	/* requested */
+	int node;
+	struct bigmem_map *next;
+};
+
+static struct bigmem_map *find_map(void *ptr, int unlink);
+static void init_nodes(void);
+static int read_list(const char *fname, int *res, int max_items);
+static void *map_mem(size_t len, size_t align, int flags);
+static void bind_mem(void *ptr, size_t len, int node);
+
+static int pages = BIGMEM_SMALL_PAGES;
+static int policy = BIGMEM_LOCAL;
+static int pinning;
+
+static int num_nodes = -1;
+static int nodes[MAX_NODES];	/* numbers of the online nodes */
+static size_t huge_page_size;
+
+static struct thread_pool *pinned_pool;
+static int *thread_nodes;
+static __thread int cur_node = -1;
+
+static struct bigmem_map *allocs;
+static pthread_mutex_t allocs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void set_bigmem_pages(int p)
+{
+	pages = p;
+}
+
+int get_bigmem_pages(void)
+{
+	return pages;
+}
+
+void set_bigmem_policy(int p)
+{
+	policy = p;
+}
+
+int get_bigmem_policy(void)
+{
+	return policy;
+}
+
+void set_bigmem_pinning(int enable)
+{
+	pinning = enable;
+}
+
+int bigmem_num_nodes(void)
+{
+	if(num_nodes < 0) {
+		init_nodes();
+	}
+	return num_nodes;
+}
+
+void *bigmem_alloc(size_t size, int node)
+{
+	size_t len, align = 0;
+	char *base;
+	struct bigmem_map *map;
+
+	if(num_nodes < 0) {
+		init_nodes();
+	}
+	if(!(map = malloc(sizeof *map))) {
+		return 0;
+	}
+	len = size > 0 ? size : 1;
+
+	base = 0;
+#ifdef MAP_HUGETLB
+	if(pages == BIGMEM_HUGETLB) {
+		len = (len + huge_page_size - 1) & ~(huge_page_size - 1);
+		if(!(base = map_mem(len, 0, MAP_HUGETLB))) {
+			static int warned;
+			if(!warned) {
+				fprintf(stderr, "bigmem: no free huge pages, using transparent huge pages\n");
+				warned = 1;
+			}
+			len = size > 0 ? size : 1;
+		}
+	}
+#endif
+	if(!base) {
+		if(pages != BIGMEM_SMALL_PAGES && len >= huge_page_size) {
+			align = huge_page_size;
+		}
+		if(!(base = map_mem(len, align, 0))) {
+			perror("bigmem_alloc: failed to map memory");
+			free(map);
+			return 0;
+		}
+#ifdef MADV_HUGEPAGE
+		if(pages != BIGMEM_SMALL_PAGES) {
+			madvise(base, len, MADV_HUGEPAGE);
+		}
+#endif
+	}
+
+	/* the policy only applies to pages faulted in after it's set */
+	if(num_nodes > 1 && node != BIGMEM_ANY_NODE) {
+		bind_mem(base, len, node);
+	}
+
+	map->base = base;
+	map->len = len;
+	map->size = size;
+	map->node = node;
+
+	pthread_mutex_lock(&allocs_lock);
+	map->next = allocs;
+	allocs = map;
+	pthread_mutex_unlock(&allocs_lock);
+	return base;
+}
+
+void *bigmem_dup(const void *src, size_t size, int node)
+{
+	void *ptr;
+
+	if(!(ptr = bigmem_alloc(size, node))) {
+		return 0;
+	}
+	if(size) {
+		memcpy(ptr, src, size);
+	}
+	return ptr;
+}
+
+void bigmem_free(void *ptr)
+{
+	struct bigmem_map *map;
+
+	if(!ptr) return;
+
+	if(!(map = find_map(ptr, 1))) {
+		fprintf(stderr, "bigmem_free: %p wasn't allocated with bigmem_alloc\n", ptr);
+		return;
+	}
+	munmap(map->base, map->len);
+	free(map);
+}
+
+void bigmem_zero(void *ptr)
+{
+	struct bigmem_map *map;
+
+	if(!(map = find_map(ptr, 0))) {
+		return;
+	}
+#ifdef MADV_DONTNEED
+	/* discarded pages read back as zero, and are placed again on first touch */
+	if(num_nodes > 1 && map->node == BIGMEM_ANY_NODE &&
+			madvise(map->base, map->len, MADV_DONTNEED) != -1) {
+		return;
+	}
+#endif
+	memset(ptr, 0, map->size);
+}
+
+int bigmem_pin_workers(struct thread_pool *tpool)
+{
+	int i, num_threads, node, num_cpus;
+	int cpus[MAX_CPUS];
+	char fname[64];
+
+	if(!pinning && policy != BIGMEM_REPLICATE) {
+		return 0;
+	}
+	if(bigmem_num_nodes() <= 1) {
+		return 0;
+	}
+
+	num_threads = tpool_num_threads(tpool);
+	free(thread_nodes);
+	if(!(thread_nodes = malloc(num_threads * sizeof *thread_nodes))) {
+		return -1;
+	}
+
+	for(i=0; i<num_threads; i++) {
+		node = i * num_nodes / num_threads;
+		thread_nodes[i] = node;
+
+		sprintf(fname, "/sys/devices/system/node/node%d/cpulist", nodes[node]);
+		if((num_cpus = read_list(fname, cpus, MAX_CPUS)) <= 0 ||
+				tpool_set_thread_cpus(tpool, i, cpus, num_cpus) == -1) {
+			fprintf(stderr, "bigmem: failed to pin thread %d to node %d\n", i, nodes[node]);
+		}
+	}
+	pinned_pool = tpool;
+
+	printf("pinned %d threads to %d NUMA nodes\n", num_threads, num_nodes);
+	return 0;
+}
+
+int bigmem_thread_node(void)
+{
+	int id;
+
+	if(cur_node < 0) {
+		if(!pinned_pool || (id = tpool_thread_id(pinned_pool)) < 0) {
+			return 0;
+		}
+		cur_node = thread_nodes[id];
+	}
+	return cur_node;
+}
+
+/* finds the record of the mapping at ptr, and removes it from the list if
+ * unlink is set
+ */
+static struct bigmem_map *find_map(void *ptr, int unlink)
+{
+	struct bigmem_map dummy, *iter, *res = 0;
+
+	pthread_mutex_lock(&allocs_lock);
+	dummy.next = allocs;
+	iter = &dummy;
+	while(iter->next) {
+		if(iter->next->base == ptr) {
+			res = iter->next;
+			if(unlink) {
+				iter->next = res->next;
+			}
+			break;
+		}
+		iter = iter->next;
+	}
+	allocs = dummy.next;
+	pthread_mutex_unlock(&allocs_lock);
+	return res;
+}
+
+static void init_nodes(void)
+{
+	FILE *fp;
+	char buf[128];
+	long kb;
+
+	/* the node masks passed to mbind only cover the first MAX_NODES nodes */
+	if((num_nodes = read_list("/sys/devices/system/node/online", nodes, MAX_NODES)) <= 0 ||
+			nodes[num_nodes - 1] >= MAX_NODES) {
+		num_nodes = 1;
+		nodes[0] = 0;
+	}
+
+	huge_page_size = DEF_HUGE_PAGE;
+	if((fp = fopen("/proc/meminfo", "r"))) {
+		while(fgets(buf, sizeof buf, fp)) {
+			if(sscanf(buf, "Hugepagesize: %ld", &kb) == 1 && kb > 0) {
+				huge_page_size = (size_t)kb << 10;
+				break;
+			}
+		}
+		fclose(fp);
+	}
+}
+
+/* parses a sysfs list of ranges, like 0-7,16-23 */
+static int read_list(const char *fname, int *res, int max_items)
+{
+	FILE *fp;
+	int a, b, c, num = 0;
+
+	if(!(fp = fopen(fname, "r"))) {
+		return -1;
+	}
+	while(fscanf(fp, "%d", &a) == 1) {
+		b = a;
+		if((c = fgetc(fp)) == '-') {
+			if(fscanf(fp, "%d", &b) != 1) break;
+			c = fgetc(fp);
+		}
+		while(a <= b && num < max_items) {
+			res[num++] = a++;
+		}
+		if(c != ',') break;
+	}
+	fclose(fp);
+	return num;
+}
+
+/* maps len bytes, starting at a multiple of align if it's not 0 */
+static void *map_mem(size_t len, size_t align, int flags)
+{
+	char *ptr, *start;
+	size_t maplen = len + align;
+
+	ptr = mmap(0, maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	if(ptr == MAP_FAILED) {
+		return 0;
+	}
+	if(!align) {
+		return ptr;
+	}
+
+	start = (char*)(((size_t)ptr + align - 1) & ~(align - 1));
+	if(start > ptr) {
+		munmap(ptr, start - ptr);
+	}
+	if(start + len < ptr + maplen) {
+		munmap(start + len, ptr + maplen - (start + len));
+	}
+	return start;
+}
+
+static void bind_mem(void *ptr, size_t len, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	int i, mode;
+	unsigned long mask = 0;
+
+	if(node == BIGMEM_ALL_NODES) {
+		for(i=0; i<num_nodes; i++) {
+			mask |= 1UL << nodes[i];
+		}
+		mode = MPOL_INTERLEAVE;
+	} else {
+		mask = 1UL << nodes[node];
+		mode = MPOL_BIND;
+	}
+
+	/* maxnode counts one more than the bits the kernel reads */
+	if(syscall(SYS_mbind, ptr, len, mode, &mask, sizeof mask * 8 + 1, 0) == -1) {
+		static int warned;
+		if(!warned) {
+			perror("bigmem: mbind failed");
+			warned = 1;
+		}
+	}
+#endif
+}
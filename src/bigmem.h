@@ -0,0 +1,55 @@
+#ifndef BIGMEM_H_
+#define BIGMEM_H_
+
+#include <stddef.h>
+
+struct thread_pool;
+
+/* page size used for big allocations */
+enum {
+	BIGMEM_SMALL_PAGES,	/* regular pages */
+	BIGMEM_THP,			/* transparent huge pages, requested with madvise */
+	BIGMEM_HUGETLB		/* reserved huge pages, falls back to THP if none are free */
+};
+
+/* placement of read-only scene data on NUMA nodes, see place_mesh */
+enum {
+	BIGMEM_LOCAL,		/* first touch, wherever it was loaded */
+	BIGMEM_INTERLEAVE,	/* pages spread round-robin over all nodes */
+	BIGMEM_REPLICATE	/* a copy on every node, used by the threads of that node */
+};
+
+/* node arguments of bigmem_alloc besides node numbers */
+#define BIGMEM_ANY_NODE		-1	/* first touch */
+#define BIGMEM_ALL_NODES	-2	/* interleaved */
+
+/* settings, before anything is allocated */
+void set_bigmem_pages(int pages);
+int get_bigmem_pages(void);
+void set_bigmem_policy(int policy);
+int get_bigmem_policy(void);
+/* pin the worker threads to NUMA nodes, implied by BIGMEM_REPLICATE */
+void set_bigmem_pinning(int enable);
+
+int bigmem_num_nodes(void);
+
+/* page aligned, zeroed memory with the configured page size, placed on node,
+ * BIGMEM_ANY_NODE, or BIGMEM_ALL_NODES. Huge pages and placement are Linux
+ * specific, and placement is also ignored on single node systems.
+ */
+void *bigmem_alloc(size_t size, int node);
+void *bigmem_dup(const void *src, size_t size, int node);
+void bigmem_free(void *ptr);
+/* zeroes the whole allocation. BIGMEM_ANY_NODE memory is returned to the
+ * system, so that the threads writing to it next place it again.
+ */
+void bigmem_zero(void *ptr);
+
+/* pins the threads of the pool to nodes, in contiguous ranges, if pinning is
+ * enabled. Call before the pool starts working.
+ */
+int bigmem_pin_workers(struct thread_pool *tpool);
+/* node of the calling thread, 0 for threads outside the pinned pool */
+int bigmem_thread_node(void);
+
+#endif	/* BIGMEM_H_ */
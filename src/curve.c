@@ -0,0 +1,613 @@
+/* Bézier curves for hair and grass
+ *
+ * Segments are kept in a binary bounding volume hierarchy, built by binning
+ * their centers with the surface area heuristic, and stored in leaf order.
+ * Leaf nodes are tested against their axis aligned box first, and then against
+ * an oriented box along their segments, which is a much tighter fit for thin
+ * strands at an angle to the axes.
+ *
+ * Segments are intersected in ray space, where the ray runs from the origin
+ * along +z, like in pbrt: each segment is split in halves recursively, skipping
+ * halves whose bounds, widened by their width, don't contain the z axis, until
+ * it's flat enough to be treated as a line. Along the line the curve is a
+ * ribbon facing the ray, and the hit is moved from the ribbon to the front of
+ * the tube of the same width, so that rays leaving the surface don't hit the
+ * same ribbon again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <float.h>
+#include "curve.h"
+#include "dynarr.h"
+
+#define EPSILON		1e-5f
+
+/* relative costs of testing a ray against a node and against a segment */
+#define NODE_COST	1.0f
+#define SEG_COST	4.0f
+
+/* maximum number of times a segment is split in half while testing it */
+#define MAX_SPLITS	10
+
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+
+/* ray data shared by all the tests of a ray */
+struct curve_ray {
+	cgm_vec3 org, dir, inv_dir;
+	cgm_vec3 axis[3];	/* ray space, axis[2] points along the ray */
+	float len;			/* length of dir */
+};
+
+/* nearest hit found so far. Distances in ray space are in world units, and
+ * divided by the ray length for the ray parameter.
+ */
+struct curve_hit {
+	float z;
+	int seg;
+	float u, v;
+	cgm_vec3 pc;	/* point on the curve at the hit, in ray space */
+};
+
+/* segment bounds while building the hierarchy */
+struct build_seg {
+	struct aabox bbox;
+	int idx;
+};
+
+static void build_node(struct curve_set *cs, struct build_seg *bs, int nidx, int first,
+		int count, int depth);
+static const struct aabox *seg_box(const void *items, int idx);
+static void calc_obb(struct curve_obb *obb, const struct curve_set *cs,
+		const struct build_seg *bs, int count);
+static int ray_obb(const struct curve_obb *obb, const struct curve_ray *cr, float tmax);
+static void ray_curve_seg(const struct curve_seg *seg, int idx, const struct curve_ray *cr,
+		struct curve_hit *ch);
+static void ray_bezier(const struct curve_seg *seg, int idx, const cgm_vec3 *cp, float u0,
+		float u1, int depth, struct curve_hit *ch, float zmin);
+static void eval_bezier(cgm_vec3 *res, const cgm_vec3 *cp, float u);
+static void bezier_tangent(cgm_vec3 *res, const cgm_vec3 *cp, float u);
+
+int init_curves(struct curve_set *cs)
+{
+	memset(cs, 0, sizeof *cs);
+	aabox_init(&cs->bbox);
+
+	if(!(cs->new_segs = dynarr_alloc(0, sizeof *cs->new_segs))) {
+		return -1;
+	}
+	return 0;
+}
+
+void clear_curves(struct curve_set *cs)
+{
+	free(cs->segs);
+	free(cs->nodes);
+	free(cs->obbs);
+	if(cs->new_segs) dynarr_free(cs->new_segs);
+	memset(cs, 0, sizeof *cs);
+}
+
+int add_curve_seg(struct curve_set *cs, const cgm_vec3 *cp, float w0, float w1)
+{
+	struct curve_seg seg;
+	void *tmp;
+
+	memcpy(seg.cp, cp, sizeof seg.cp);
+	seg.width[0] = w0;
+	seg.width[1] = w1;
+	if(!(tmp = dynarr_push(cs->new_segs, &seg))) {
+		return -1;
+	}
+	cs->new_segs = tmp;
+	return 0;
+}
+
+int load_curves(struct curve_set *cs, const char *fname)
+{
+	FILE *fp;
+	int i, n, line_num = 0, num_strands = 0, res = -1;
+	char *line = 0, *ptr, *end;
+	size_t bufsz = 0;
+	float w[2], val[3];
+	cgm_vec3 *pts, *tmp;
+
+	if(!(fp = fopen(fname, "rb"))) {
+		fprintf(stderr, "load_curves: failed to open: %s\n", fname);
+		return -1;
+	}
+	if(!(pts = dynarr_alloc(0, sizeof *pts))) {
+		fprintf(stderr, "load_curves: failed to allocate control points\n");
+		fclose(fp);
+		return -1;
+	}
+
+	while(getline(&line, &bufsz, fp) != -1) {
+		line_num++;
+		if((ptr = strchr(line, '#'))) *ptr = 0;
+
+		ptr = line;
+		for(i=0; i<2; i++) {
+			w[i] = strtod(ptr, &end);
+			if(end == ptr) break;
+			ptr = end;
+		}
+		if(i == 0) {
+			while(*ptr && isspace(*ptr)) ptr++;
+			if(!*ptr) continue;		/* empty line */
+		}
+		if(i < 2) goto inval;
+
+		DYNARR_CLEAR(pts);
+		for(;;) {
+			for(i=0; i<3; i++) {
+				val[i] = strtod(ptr, &end);
+				if(end == ptr) break;
+				ptr = end;
+			}
+			if(i == 0) break;
+			if(i < 3) goto inval;
+
+			if(!(tmp = dynarr_push(pts, val))) {
+				fprintf(stderr, "load_curves: failed to allocate control points\n");
+				goto end;
+			}
+			pts = tmp;
+		}
+		while(*ptr && isspace(*ptr)) ptr++;
+		n = (dynarr_size(pts) - 1) / 3;
+		if(*ptr || n < 1 || n * 3 + 1 != dynarr_size(pts)) goto inval;
+
+		for(i=0; i<n; i++) {
+			if(add_curve_seg(cs, pts + i * 3, cgm_lerp(w[0], w[1], (float)i / n),
+						cgm_lerp(w[0], w[1], (float)(i + 1) / n)) == -1) {
+				fprintf(stderr, "load_curves: failed to allocate segments\n");
+				goto end;
+			}
+		}
+		num_strands++;
+	}
+
+	printf("loaded curves: %s: %d strands, %d segments\n", fname, num_strands,
+			dynarr_size(cs->new_segs));
+	res = 0;
+	goto end;
+
+inval:
+	fprintf(stderr, "load_curves: %s:%d: expected two widths and 3n + 1 control points\n",
+			fname, line_num);
+end:
+	free(line);
+	dynarr_free(pts);
+	fclose(fp);
+	return res;
+}
+
+static void pad_bounds(struct aabox *box, float pad)
+{
+	box->vmin.x -= pad;
+	box->vmin.y -= pad;
+	box->vmin.z -= pad;
+	box->vmax.x += pad;
+	box->vmax.y += pad;
+	box->vmax.z += pad;
+}
+
+/* curves are within the convex hull of their control points */
+static void seg_bounds(struct aabox *res, const struct curve_seg *seg)
+{
+	int i;
+
+	aabox_init(res);
+	for(i=0; i<4; i++) {
+		aabox_add_point(res, seg->cp + i);
+	}
+	pad_bounds(res, 0.5f * MAX(seg->width[0], seg->width[1]));
+}
+
+int build_curves(struct curve_set *cs)
+{
+	int i, num;
+	struct build_seg *bs;
+
+	if((num = dynarr_size(cs->new_segs)) <= 0) {
+		return 0;
+	}
+
+	bs = malloc(num * sizeof *bs);
+	cs->segs = malloc(num * sizeof *cs->segs);
+	cs->nodes = malloc((2 * num - 1) * sizeof *cs->nodes);
+	cs->obbs = malloc(num * sizeof *cs->obbs);
+	if(!bs || !cs->segs || !cs->nodes || !cs->obbs) {
+		fprintf(stderr, "build_curves: failed to allocate %d segments\n", num);
+		free(bs);
+		free(cs->segs);
+		free(cs->nodes);
+		free(cs->obbs);
+		cs->segs = 0;
+		cs->nodes = 0;
+		cs->obbs = 0;
+		return -1;
+	}
+
+	for(i=0; i<num; i++) {
+		seg_bounds(&bs[i].bbox, cs->new_segs + i);
+		bs[i].idx = i;
+		aabox_add(&cs->bbox, &bs[i].bbox);
+	}
+
+	cs->num_nodes = 1;
+	cs->num_obbs = 0;
+	build_node(cs, bs, 0, 0, num, 0);
+
+	for(i=0; i<num; i++) {
+		cs->segs[i] = cs->new_segs[bs[i].idx];
+	}
+	cs->num_segs = num;
+	free(bs);
+
+	printf("built curves: %d segments, %d nodes\n", cs->num_segs, cs->num_nodes);
+
+	DYNARR_CLEAR(cs->new_segs);
+	return 0;
+}
+
+static void build_node(struct curve_set *cs, struct build_seg *bs, int nidx, int first,
+		int count, int depth)
+{
+	int i, j;
+	struct aabox_split split;
+	struct curve_node *node = cs->nodes + nidx;
+	struct build_seg *segs = bs + first, tmp;
+
+	node->child = 0;
+	node->first = first;
+	node->count = count;
+
+	aabox_init(&node->bbox);
+	for(i=0; i<count; i++) {
+		aabox_add(&node->bbox, &segs[i].bbox);
+	}
+	if(count <= CURVE_LEAF_SEGS || depth >= CURVE_MAX_DEPTH) {
+		goto leaf;
+	}
+	/* leaves are always split if they're too large */
+	if(!aabox_sah_split(&split, segs, count, seg_box, &node->bbox, NODE_COST, SEG_COST,
+				FLT_MAX)) {
+		goto leaf;
+	}
+
+	i = 0;
+	j = count - 1;
+	while(i <= j) {
+		if(aabox_split_left(&split, &segs[i].bbox)) {
+			i++;
+		} else {
+			tmp = segs[i];
+			segs[i] = segs[j];
+			segs[j--] = tmp;
+		}
+	}
+
+	node->child = cs->num_nodes;
+	node->count = 0;
+	cs->num_nodes += 2;
+	build_node(cs, bs, node->child, first, i, depth + 1);
+	build_node(cs, bs, node->child + 1, first + i, count - i, depth + 1);
+	return;
+
+leaf:
+	node->obb = cs->num_obbs++;
+	calc_obb(cs->obbs + node->obb, cs, segs, count);
+}
+
+static const struct aabox *seg_box(const void *items, int idx)
+{
+	return &((const struct build_seg*)items)[idx].bbox;
+}
+
+/* the main axis follows the chords of the segments, flipped to agree */
+static void calc_obb(struct curve_obb *obb, const struct curve_set *cs,
+		const struct build_seg *bs, int count)
+{
+	int i, j;
+	float r = 0.0f;
+	cgm_vec3 dir, chord, p, *axis = obb->axis;
+	const struct curve_seg *seg;
+
+	cgm_vcons(&dir, 0, 0, 0);
+	for(i=0; i<count; i++) {
+		seg = cs->new_segs + bs[i].idx;
+		chord = seg->cp[3];
+		cgm_vsub(&chord, seg->cp);
+		if(cgm_vdot(&chord, &dir) < 0.0f) {
+			cgm_vscale(&chord, -1.0f);
+		}
+		cgm_vadd(&dir, &chord);
+	}
+	if(cgm_vlength_sq(&dir) <= 0.0f) {
+		cgm_vcons(&dir, 0, 0, 1);
+	}
+	cgm_vnormalize(&dir);
+
+	axis[2] = dir;
+	if(fabs(dir.x) < 0.9f) {
+		cgm_vcons(&p, 1, 0, 0);
+	} else {
+		cgm_vcons(&p, 0, 1, 0);
+	}
+	cgm_vcross(axis, &p, &dir);
+	cgm_vnormalize(axis);
+	cgm_vcross(axis + 1, &dir, axis);
+
+	aabox_init(&obb->box);
+	for(i=0; i<count; i++) {
+		seg = cs->new_segs + bs[i].idx;
+		for(j=0; j<4; j++) {
+			p.x = cgm_vdot(seg->cp + j, axis);
+			p.y = cgm_vdot(seg->cp + j, axis + 1);
+			p.z = cgm_vdot(seg->cp + j, axis + 2);
+			aabox_add_point(&obb->box, &p);
+		}
+		r = MAX(r, 0.5f * MAX(seg->width[0], seg->width[1]));
+	}
+	pad_bounds(&obb->box, r);
+}
+
+int find_curve_isect(const struct curve_set *cs, const cgm_ray *ray, float *t,
+		cgm_vec3 *normal, cgm_vec3 *tex)
+{
+	int i, sp, stack[CURVE_MAX_DEPTH + 2];
+	float d0, d1;
+	struct curve_ray cr;
+	struct curve_hit ch;
+	const struct curve_node *node, *c;
+	const struct curve_seg *seg;
+	cgm_vec3 n, tang, p;
+
+	if(!cs->num_nodes || (cr.len = cgm_vlength(&ray->dir)) <= 0.0f) {
+		return 0;
+	}
+	cr.org = ray->origin;
+	cr.dir = ray->dir;
+	cgm_vcons(&cr.inv_dir, 1.0f / ray->dir.x, 1.0f / ray->dir.y, 1.0f / ray->dir.z);
+
+	cr.axis[2] = ray->dir;
+	cgm_vscale(cr.axis + 2, 1.0f / cr.len);
+	if(fabs(cr.axis[2].x) < 0.9f) {
+		cgm_vcons(&p, 1, 0, 0);
+	} else {
+		cgm_vcons(&p, 0, 1, 0);
+	}
+	cgm_vcross(cr.axis, &p, cr.axis + 2);
+	cgm_vnormalize(cr.axis);
+	cgm_vcross(cr.axis + 1, cr.axis + 2, cr.axis);
+
+	ch.z = FLT_MAX;
+	ch.seg = -1;
+
+	/* nearest child first, by the distance of its center along the ray */
+	stack[0] = 0;
+	sp = 1;
+	while(sp > 0) {
+		node = cs->nodes + stack[--sp];
+		if(!ray_aabox_enter(&node->bbox, &cr.org, &cr.inv_dir, ch.z / cr.len)) {
+			continue;
+		}
+		if(node->child) {
+			c = cs->nodes + node->child;
+			d0 = (c[0].bbox.vmin.x + c[0].bbox.vmax.x) * cr.dir.x +
+				(c[0].bbox.vmin.y + c[0].bbox.vmax.y) * cr.dir.y +
+				(c[0].bbox.vmin.z + c[0].bbox.vmax.z) * cr.dir.z;
+			d1 = (c[1].bbox.vmin.x + c[1].bbox.vmax.x) * cr.dir.x +
+				(c[1].bbox.vmin.y + c[1].bbox.vmax.y) * cr.dir.y +
+				(c[1].bbox.vmin.z + c[1].bbox.vmax.z) * cr.dir.z;
+			stack[sp++] = d0 < d1 ? node->child + 1 : node->child;
+			stack[sp++] = d0 < d1 ? node->child : node->child + 1;
+			continue;
+		}
+
+		if(!ray_obb(cs->obbs + node->obb, &cr, ch.z / cr.len)) {
+			continue;
+		}
+		for(i=0; i<node->count; i++) {
+			ray_curve_seg(cs->segs + node->first + i, node->first + i, &cr, &ch);
+		}
+	}
+
+	if(ch.seg < 0) {
+		return 0;
+	}
+
+	*t = ch.z / cr.len;
+
+	/* the tube normal points from the curve to the hit point, perpendicular to
+	 * the tangent of the curve
+	 */
+	seg = cs->segs + ch.seg;
+	cgm_vcons(&n, 0, 0, 0);
+	for(i=0; i<3; i++) {
+		p = cr.axis[i];
+		cgm_vscale(&p, i < 2 ? -(&ch.pc.x)[i] : ch.z - ch.pc.z);
+		cgm_vadd(&n, &p);
+	}
+	bezier_tangent(&tang, seg->cp, ch.u);
+	if(cgm_vlength_sq(&tang) > 0.0f) {
+		cgm_vnormalize(&tang);
+		cgm_vscale(&tang, cgm_vdot(&n, &tang));
+		cgm_vsub(&n, &tang);
+	}
+	if(cgm_vlength_sq(&n) <= 0.0f) {
+		n = cr.axis[2];
+		cgm_vscale(&n, -1.0f);
+	}
+	cgm_vnormalize(&n);
+	*normal = n;
+
+	cgm_vcons(tex, ch.u, ch.v, 0);
+	return 1;
+}
+
+/* same as ray_aabox_enter, in the space of the box axes */
+static int ray_obb(const struct curve_obb *obb, const struct curve_ray *cr, float tmax)
+{
+	int i;
+	float o, inv_d, t0, t1, tnear = 0.0f, tfar = tmax;
+
+	for(i=0; i<3; i++) {
+		o = cgm_vdot(&cr->org, obb->axis + i);
+		inv_d = 1.0f / cgm_vdot(&cr->dir, obb->axis + i);
+		t0 = ((&obb->box.vmin.x)[i] - o) * inv_d;
+		t1 = ((&obb->box.vmax.x)[i] - o) * inv_d;
+		tnear = MAX(tnear, MIN(t0, t1));
+		tfar = MIN(tfar, MAX(t0, t1));
+	}
+	return tnear <= tfar && tfar >= EPSILON;
+}
+
+static void ray_curve_seg(const struct curve_seg *seg, int idx, const struct curve_ray *cr,
+		struct curve_hit *ch)
+{
+	int i, depth = 0;
+	float l0 = 0.0f, eps, fdepth;
+	cgm_vec3 cp[4], d;
+
+	for(i=0; i<4; i++) {
+		d = seg->cp[i];
+		cgm_vsub(&d, &cr->org);
+		cp[i].x = cgm_vdot(&d, cr->axis);
+		cp[i].y = cgm_vdot(&d, cr->axis + 1);
+		cp[i].z = cgm_vdot(&d, cr->axis + 2);
+	}
+
+	/* enough splits for the pieces to stay within a 20th of the width from
+	 * straight lines, from the second differences of the control points
+	 */
+	for(i=0; i<2; i++) {
+		l0 = MAX(l0, fabs(cp[i].x - 2.0f * cp[i + 1].x + cp[i + 2].x));
+		l0 = MAX(l0, fabs(cp[i].y - 2.0f * cp[i + 1].y + cp[i + 2].y));
+		l0 = MAX(l0, fabs(cp[i].z - 2.0f * cp[i + 1].z + cp[i + 2].z));
+	}
+	eps = 0.05f * MAX(seg->width[0], seg->width[1]);
+	if(l0 > 0.0f && eps > 0.0f) {
+		fdepth = log2(1.41421356f * 6.0f * l0 / (8.0f * eps)) * 0.5f;
+		depth = fdepth > 0.0f ? (int)(fdepth + 0.5f) : 0;
+		if(depth > MAX_SPLITS) depth = MAX_SPLITS;
+	}
+
+	ray_bezier(seg, idx, cp, 0.0f, 1.0f, depth, ch, EPSILON * cr->len);
+}
+
+static void ray_bezier(const struct curve_seg *seg, int idx, const cgm_vec3 *cp, float u0,
+		float u1, int depth, struct curve_hit *ch, float zmin)
+{
+	int i;
+	float r, ua, ub, w, u, width, dist_sq, z, cross;
+	cgm_vec3 sub[7], a, b, pc, dir;
+	const cgm_vec3 *c;
+	struct aabox box;
+
+	if(depth > 0) {
+		/* de Casteljau at the middle, the halves share sub[3] */
+		cgm_vlerp(sub + 1, cp, cp + 1, 0.5f);
+		cgm_vlerp(&a, cp + 1, cp + 2, 0.5f);
+		cgm_vlerp(sub + 5, cp + 2, cp + 3, 0.5f);
+		cgm_vlerp(sub + 2, sub + 1, &a, 0.5f);
+		cgm_vlerp(sub + 4, &a, sub + 5, 0.5f);
+		cgm_vlerp(sub + 3, sub + 2, sub + 4, 0.5f);
+		sub[0] = cp[0];
+		sub[6] = cp[3];
+
+		for(i=0; i<2; i++) {
+			c = sub + i * 3;
+			ua = i ? (u0 + u1) * 0.5f : u0;
+			ub = i ? u1 : (u0 + u1) * 0.5f;
+			r = 0.5f * MAX(cgm_lerp(seg->width[0], seg->width[1], ua),
+					cgm_lerp(seg->width[0], seg->width[1], ub));
+
+			aabox_init(&box);
+			aabox_add_point(&box, c);
+			aabox_add_point(&box, c + 1);
+			aabox_add_point(&box, c + 2);
+			aabox_add_point(&box, c + 3);
+			pad_bounds(&box, r);
+			if(box.vmin.x > 0.0f || box.vmax.x < 0.0f || box.vmin.y > 0.0f ||
+					box.vmax.y < 0.0f || box.vmax.z < zmin || box.vmin.z > ch->z) {
+				continue;
+			}
+			ray_bezier(seg, idx, c, ua, ub, depth - 1, ch, zmin);
+		}
+		return;
+	}
+
+	/* the ray must pass between the perpendiculars at both ends of the piece */
+	a = cp[1];
+	cgm_vsub(&a, cp);
+	b = cp[2];
+	cgm_vsub(&b, cp + 3);
+	if(a.x * -cp[0].x + a.y * -cp[0].y < 0.0f || b.x * -cp[3].x + b.y * -cp[3].y < 0.0f) {
+		return;
+	}
+
+	/* closest point to the ray along the line through the ends of the piece */
+	dir = cp[3];
+	cgm_vsub(&dir, cp);
+	if((w = dir.x * dir.x + dir.y * dir.y) <= 0.0f) {
+		return;
+	}
+	w = (-cp[0].x * dir.x - cp[0].y * dir.y) / w;
+	if(w < 0.0f) w = 0.0f;
+	if(w > 1.0f) w = 1.0f;
+	u = cgm_lerp(u0, u1, w);
+	width = cgm_lerp(seg->width[0], seg->width[1], u);
+	r = 0.5f * width;
+
+	eval_bezier(&pc, cp, w);
+	if((dist_sq = pc.x * pc.x + pc.y * pc.y) > r * r) {
+		return;
+	}
+
+	/* front of the tube, in front of the ribbon */
+	z = pc.z - sqrt(r * r - dist_sq);
+	if(z < zmin || z >= ch->z) {
+		return;
+	}
+
+	ch->z = z;
+	ch->seg = idx;
+	ch->u = u;
+	ch->pc = pc;
+	cross = dir.x * -pc.y - dir.y * -pc.x;
+	ch->v = 0.5f + (cross < 0.0f ? -0.5f : 0.5f) * sqrt(dist_sq) / r;
+}
+
+static void eval_bezier(cgm_vec3 *res, const cgm_vec3 *cp, float u)
+{
+	cgm_vec3 a, b, c;
+
+	cgm_vlerp(&a, cp, cp + 1, u);
+	cgm_vlerp(&b, cp + 1, cp + 2, u);
+	cgm_vlerp(&c, cp + 2, cp + 3, u);
+	cgm_vlerp(&a, &a, &b, u);
+	cgm_vlerp(&b, &b, &c, u);
+	cgm_vlerp(res, &a, &b, u);
+}
+
+/* the derivative is a quadratic Bézier over the differences, scaled by 3 */
+static void bezier_tangent(cgm_vec3 *res, const cgm_vec3 *cp, float u)
+{
+	int i;
+	cgm_vec3 d[3];
+
+	for(i=0; i<3; i++) {
+		d[i] = cp[i + 1];
+		cgm_vsub(d + i, cp + i);
+	}
+	cgm_vlerp(d, d, d + 1, u);
+	cgm_vlerp(d + 1, d + 1, d + 2, u);
+	cgm_vlerp(res, d, d + 1, u);
+	cgm_vscale(res, 3.0f);
+}
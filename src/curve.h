@@ -0,0 +1,76 @@
+#ifndef CURVE_H_
+#define CURVE_H_
+
+#include <cgmath/cgmath.h>
+#include "aabox.h"
+
+/* maximum number of segments in each leaf of the bounds hierarchy */
+#define CURVE_LEAF_SEGS		4
+#define CURVE_MAX_DEPTH		48
+
+/* cubic Bézier segment, with its width at both ends, varying linearly in
+ * between. Segments are intersected as ribbons facing the ray, and shaded as
+ * tubes of the same width.
+ */
+struct curve_seg {
+	cgm_vec3 cp[4];
+	float width[2];
+};
+
+/* strands are long and thin, and rarely aligned to the axes, so the leaves of
+ * the hierarchy are bounded by boxes aligned to the general direction of their
+ * segments instead
+ */
+struct curve_obb {
+	cgm_vec3 axis[3];	/* orthonormal */
+	struct aabox box;	/* in the space of the axes */
+};
+
+/* nodes are stored in a flat array, with the root first, and the two children
+ * of each internal node in consecutive slots after it. Leaves reference a
+ * range of the segment array, and their oriented box in the obbs array.
+ */
+struct curve_node {
+	struct aabox bbox;
+	int child;		/* index of the first child, 0 for leaves */
+	int first, count;
+	int obb;
+};
+
+struct curve_set {
+	struct curve_seg *segs;	/* in leaf order after build_curves */
+	int num_segs;
+	struct curve_node *nodes;
+	int num_nodes;
+	struct curve_obb *obbs;
+	int num_obbs;
+	struct aabox bbox;		/* bounds of all segments, after build_curves */
+
+	struct curve_seg *new_segs;	/* dynarr */
+};
+
+int init_curves(struct curve_set *cs);
+void clear_curves(struct curve_set *cs);
+
+/* adds a segment with control points cp[0] to cp[3] */
+int add_curve_seg(struct curve_set *cs, const cgm_vec3 *cp, float w0, float w1);
+
+/* loads strands from a text file, one per line: the width at the root and at
+ * the tip, followed by the 3n + 1 control points of n consecutive segments,
+ * as x y z triplets. The width varies linearly along the strand.
+ */
+int load_curves(struct curve_set *cs, const char *fname);
+
+/* moves the segments added so far into the intersection array, and builds the
+ * bounds hierarchy. Called once, after adding all the segments.
+ */
+int build_curves(struct curve_set *cs);
+
+/* returns the distance along the ray to the nearest hit, the normal of the
+ * tube at the hit point, and the position along the segment and across it in
+ * tex
+ */
+int find_curve_isect(const struct curve_set *cs, const cgm_ray *ray, float *t,
+		cgm_vec3 *normal, cgm_vec3 *tex);
+
+#endif	/* CURVE_H_ */
@@ -0,0 +1,235 @@
+/* lazily loaded meshes
+ *
+ * Lazy meshes start out with just their bounds, and map their mesh cache the
+ * first time a ray needs the geometry, or rebuild it if it's no longer valid.
+ * Each one counts the rays currently using it, and the count is -1 while the
+ * geometry isn't resident. Rays only take the lock when the geometry has to be
+ * loaded, and only for the bookkeeping: the mesh is marked as loading, the
+ * least recently used meshes not in use are evicted until the new one fits in
+ * the budget, and the lock is dropped while the mesh is read. Rays needing a
+ * mesh which is still loading wait for it on a condition variable. If
+ * everything is in use, the budget is exceeded temporarily.
+ *
+ * Meshes are quantized after every load, if quantization is enabled, since only
+ * the mesh cache is kept on disk.
+ *
+ * Recency is tracked with a clock which ticks on every load, instead of on
+ * every use, so rays only write to the mesh when its last use is out of date.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mesh.h"
+
+static int load_geom(struct lazy_mesh *lm);
+static int rebuild_geom(struct lazy_mesh *lm, struct mesh *m);
+static void evict_geom(long size);
+
+static long budget;
+static long resident;
+static unsigned int geom_clock;
+static struct lazy_mesh *meshes;
+static pthread_mutex_t geom_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t geom_loaded = PTHREAD_COND_INITIALIZER;
+
+void set_geom_budget(int mbytes)
+{
+	budget = (long)mbytes * 1048576;
+}
+
+int get_geom_budget(void)
+{
+	return budget / 1048576;
+}
+
+struct lazy_mesh *create_lazy_mesh(const char *path, const struct aabox *bbox, long size,
+		int max_node_items, int max_depth)
+{
+	struct lazy_mesh *lm;
+
+	if(!(lm = calloc(1, sizeof *lm)) || !(lm->path = strdup(path))) {
+		free(lm);
+		return 0;
+	}
+	init_mesh(&lm->m);
+	lm->bbox = *bbox;
+	lm->size = size;
+	lm->max_node_items = max_node_items;
+	lm->max_depth = max_depth;
+	lm->users = -1;
+
+	pthread_mutex_lock(&geom_lock);
+	lm->next = meshes;
+	meshes = lm;
+	pthread_mutex_unlock(&geom_lock);
+	return lm;
+}
+
+void free_lazy_mesh(struct lazy_mesh *lm)
+{
+	struct lazy_mesh dummy, *iter;
+
+	if(!lm) return;
+
+	pthread_mutex_lock(&geom_lock);
+	dummy.next = meshes;
+	iter = &dummy;
+	while(iter->next) {
+		if(iter->next == lm) {
+			iter->next = lm->next;
+			break;
+		}
+		iter = iter->next;
+	}
+	meshes = dummy.next;
+
+	if(lm->users >= 0) {
+		resident -= lm->size;
+	}
+	pthread_mutex_unlock(&geom_lock);
+
+	clear_mesh(&lm->m);
+	free(lm->path);
+	free(lm);
+}
+
+const struct mesh *acquire_lazy_mesh(struct lazy_mesh *lm)
+{
+	int n;
+	unsigned int now;
+
+	n = __atomic_load_n(&lm->users, __ATOMIC_ACQUIRE);
+	for(;;) {
+		if(n < 0) {
+			if(load_geom(lm) == -1) {
+				return 0;
+			}
+			break;
+		}
+		if(__atomic_compare_exchange_n(&lm->users, &n, n + 1, 1, __ATOMIC_ACQUIRE,
+					__ATOMIC_ACQUIRE)) {
+			break;
+		}
+	}
+
+	now = __atomic_load_n(&geom_clock, __ATOMIC_RELAXED);
+	if(__atomic_load_n(&lm->last_use, __ATOMIC_RELAXED) != now) {
+		__atomic_store_n(&lm->last_use, now, __ATOMIC_RELAXED);
+	}
+	return &lm->m;
+}
+
+void release_lazy_mesh(struct lazy_mesh *lm)
+{
+	__atomic_sub_fetch(&lm->users, 1, __ATOMIC_RELEASE);
+}
+
+/* loads the geometry, or just acquires it if another thread got there first */
+static int load_geom(struct lazy_mesh *lm)
+{
+	int res = 0;
+	struct mesh m;
+
+	pthread_mutex_lock(&geom_lock);
+	while(lm->loading) {
+		pthread_cond_wait(&geom_loaded, &geom_lock);
+	}
+	if(lm->users >= 0) {
+		__atomic_add_fetch(&lm->users, 1, __ATOMIC_ACQUIRE);
+		pthread_mutex_unlock(&geom_lock);
+		return 0;
+	}
+	if(lm->failed) {
+		pthread_mutex_unlock(&geom_lock);
+		return -1;
+	}
+
+	/* the space is reserved while loading, so that concurrent loads of other
+	 * meshes don't all fit themselves into the same part of the budget
+	 */
+	lm->loading = 1;
+	evict_geom(lm->size);
+	resident += lm->size;
+	pthread_mutex_unlock(&geom_lock);
+
+	init_mesh(&m);
+	if(map_mesh_cache(&m, lm->path, lm->max_node_items, lm->max_depth) == -1 &&
+			rebuild_geom(lm, &m) == -1) {
+		fprintf(stderr, "failed to load lazy mesh: %s\n", lm->path);
+		res = -1;
+	} else if(get_mesh_quantize()) {
+		quantize_mesh(&m);
+	}
+
+	pthread_mutex_lock(&geom_lock);
+	resident -= lm->size;
+	if(res == -1) {
+		lm->failed = 1;
+	} else {
+		/* the quantized mesh replaces the mapping, and its size is what counts
+		 * from now on
+		 */
+		if(m.quant) {
+			lm->size = m.quant->size;
+		}
+		lm->m = m;
+		resident += lm->size;
+		lm->last_use = ++geom_clock;
+		__atomic_store_n(&lm->users, 1, __ATOMIC_RELEASE);
+	}
+	lm->loading = 0;
+	pthread_cond_broadcast(&geom_loaded);
+	pthread_mutex_unlock(&geom_lock);
+	return res;
+}
+
+/* the cache was replaced or corrupted since the mesh was registered, so it's
+ * loaded from the source and the cache rewritten
+ */
+static int rebuild_geom(struct lazy_mesh *lm, struct mesh *m)
+{
+	clear_mesh(m);
+	if(load_mesh(m, lm->path) == -1 ||
+			build_mesh_octree(m, lm->max_node_items, lm->max_depth) == -1) {
+		clear_mesh(m);
+		return -1;
+	}
+	save_mesh_cache(m, lm->path, lm->max_node_items, lm->max_depth);
+	return 0;
+}
+
+/* called with the lock held. A mesh can only be evicted while nobody uses it,
+ * and the transition from 0 users to not resident happens atomically, so any
+ * ray trying to acquire it at the same time ends up in load_geom, waiting for
+ * the lock. Meshes being loaded aren't resident yet, and are skipped too.
+ */
+static void evict_geom(long size)
+{
+	int zero;
+	unsigned int use, lru_use = 0;
+	struct lazy_mesh *lm, *lru;
+
+	while(resident > 0 && resident + size > budget) {
+		lru = 0;
+		for(lm=meshes; lm; lm=lm->next) {
+			if(__atomic_load_n(&lm->users, __ATOMIC_RELAXED) != 0) {
+				continue;
+			}
+			use = __atomic_load_n(&lm->last_use, __ATOMIC_RELAXED);
+			if(!lru || (int)(use - lru_use) < 0) {
+				lru = lm;
+				lru_use = use;
+			}
+		}
+		if(!lru) break;
+
+		zero = 0;
+		if(!__atomic_compare_exchange_n(&lru->users, &zero, -1, 0, __ATOMIC_ACQUIRE,
+					__ATOMIC_RELAXED)) {
+			continue;	/* acquired while we were looking, try again */
+		}
+		clear_mesh(&lru->m);
+		resident -= lru->size;
+	}
+}
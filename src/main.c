@@ -12,32 +12,96 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/select.h>
+#include <sys/time.h>
 #include "rt.h"
+#include "rend.h"
+#include "texture.h"
+#include "mesh.h"
+#include "subdiv.h"
+#include "bigmem.h"
+#include "util.h"
+
+/* minimum interval between framebuffer updates in the interactive viewer */
+#define UPD_INTERVAL_MSEC	33
+/* dirty blocks are coalesced into at most this many rectangles per update */
+#define MAX_DIRTY_RECTS		8
+
+struct rect {
+	int x, y, w, h;
+};
 
 static void disp(void);
 static void reshape(int x, int y);
 static void keyb(unsigned char key, int x, int y);
+static void skeyb(int key, int x, int y);
+static void mouse(int bn, int st, int x, int y);
+static void motion(int x, int y);
+static void passive_motion(int x, int y);
+static void restart(void);
 static int save_image(const char *fname);
+static int benchmark(int xsz, int ysz);
+static int render_frames(int xsz, int ysz, int blksz, int jobsamp);
+static int init_pbo(void);
+static void add_dirty_rect(int x, int y, int w, int h);
 
 static const char *sdrsrc =
-	"uniform sampler2D tex;\n"
-	"uniform float scale, inv_gamma;\n"
+	"uniform sampler2D tex, prvtex1, prvtex2;\n"
+	"uniform vec2 prvscale1, prvscale2;\n"
+	"uniform float inv_gamma;\n"
 	"void main()\n"
 	"{\n"
-	"\tvec3 texel = texture2D(tex, gl_TexCoord[0].st).rgb * vec3(scale, scale, scale);\n"
-	"\tgl_FragColor.rgb = pow(texel, vec3(inv_gamma, inv_gamma, inv_gamma));\n"
+	"\tvec4 texel = texture2D(tex, gl_TexCoord[0].st);\n"
+	"\tif(texel.a <= 0.0) {\n"
+	"\t\ttexel = texture2D(prvtex1, gl_TexCoord[0].st * prvscale1);\n"
+	"\t}\n"
+	"\tif(texel.a <= 0.0) {\n"
+	"\t\ttexel = texture2D(prvtex2, gl_TexCoord[0].st * prvscale2);\n"
+	"\t}\n"
+	"\tvec3 color = texel.a > 0.0 ? texel.rgb / texel.a : vec3(0.0, 0.0, 0.0);\n"
+	"\tgl_FragColor.rgb = pow(color, vec3(inv_gamma, inv_gamma, inv_gamma));\n"
 	"\tgl_FragColor.a = 1.0;\n"
 	"}\n";
 
 static unsigned int sdr;
-static int uloc_scale, uloc_inv_gamma;
+static int uloc_inv_gamma;
 
 static int pfd[2];
 
+#define DEF_SAMPLES	5
+
+static const char *scnfile = "sponza.scn";
+static int nsamples;	/* 0: use the scene setting, or DEF_SAMPLES */
+static int bench;
+static int num_frames;	/* render a sequence of frames to files instead */
+
+/* preview levels are drawn from their own textures, on texture units 1 and up.
+ * the display shader expects RT_PREVIEW_LEVELS to be 2.
+ */
+static unsigned int prvtex[RT_PREVIEW_LEVELS + 1];
+static int preview_dirty[RT_PREVIEW_LEVELS + 1];
+static int clear_pending;
+
+static int win_width, win_height;
+
+/* orbit camera state, the camera position is derived from these */
+static float cam_theta, cam_phi, cam_dist;
+static cgm_vec3 cam_targ;
+static int bnstate[8];
+static int prev_mx, prev_my;
+
+/* persistently mapped pixel unpack buffer, mirroring the layout of fbpixels */
+static unsigned int pbo;
+static float *pbo_pixels;
+static GLsync pbo_fence;
+
+static struct rect dirty_rects[MAX_DIRTY_RECTS];
+static int num_dirty_rects;
+
 int main(int argc, char **argv)
 {
-	int i, xsz = 800, ysz = 600, nsamples = 5;
-	int ps, status, info_len, xfd, maxfd;
+	int i, xsz = 800, ysz = 600, blksz = 0, jobsamp = 0;
+	int ps, status, info_len, xfd, maxfd, upd_pending = 0;
+	long last_upd = 0;
 	char *info;
 	Display *dpy;
 
@@ -57,12 +121,104 @@ int main(int argc, char **argv)
 				return -1;
 			}
 
+		} else if(strcmp(argv[i], "-b") == 0) {
+			if(!argv[i + 1] || (blksz = atoi(argv[++i])) <= 0) {
+				fprintf(stderr, "-b must be followed by the block size\n");
+				return -1;
+			}
+
+		} else if(strcmp(argv[i], "-j") == 0) {
+			if(!argv[i + 1] || (jobsamp = atoi(argv[++i])) <= 0) {
+				fprintf(stderr, "-j must be followed by the number of samples per job\n");
+				return -1;
+			}
+
+		} else if(strcmp(argv[i], "-tc") == 0) {
+			int mbytes;
+			if(!argv[i + 1] || (mbytes = atoi(argv[++i])) <= 0) {
+				fprintf(stderr, "-tc must be followed by the texture cache size in MB\n");
+				return -1;
+			}
+			set_texture_cache_size(mbytes);
+
+		} else if(strcmp(argv[i], "-gm") == 0) {
+			int mbytes;
+			if(!argv[i + 1] || (mbytes = atoi(argv[++i])) <= 0) {
+				fprintf(stderr, "-gm must be followed by the geometry memory budget in MB\n");
+				return -1;
+			}
+			set_geom_budget(mbytes);
+
+		} else if(strcmp(argv[i], "-tm") == 0) {
+			int mbytes;
+			if(!argv[i + 1] || (mbytes = atoi(argv[++i])) <= 0) {
+				fprintf(stderr, "-tm must be followed by the tessellation cache size in MB\n");
+				return -1;
+			}
+			set_tess_cache_size(mbytes);
+
+		} else if(strcmp(argv[i], "-qm") == 0) {
+			set_mesh_quantize(1);
+
+		} else if(strcmp(argv[i], "-hp") == 0) {
+			if(!argv[i + 1]) {
+				fprintf(stderr, "-hp must be followed by thp or tlb\n");
+				return -1;
+			}
+			i++;
+			if(strcmp(argv[i], "thp") == 0) {
+				set_bigmem_pages(BIGMEM_THP);
+			} else if(strcmp(argv[i], "tlb") == 0) {
+				set_bigmem_pages(BIGMEM_HUGETLB);
+			} else {
+				fprintf(stderr, "invalid huge page mode: %s\n", argv[i]);
+				return -1;
+			}
+
+		} else if(strcmp(argv[i], "-numa") == 0) {
+			if(!argv[i + 1]) {
+				fprintf(stderr, "-numa must be followed by local, interleave or replicate\n");
+				return -1;
+			}
+			i++;
+			if(strcmp(argv[i], "local") == 0) {
+				set_bigmem_policy(BIGMEM_LOCAL);
+			} else if(strcmp(argv[i], "interleave") == 0) {
+				set_bigmem_policy(BIGMEM_INTERLEAVE);
+			} else if(strcmp(argv[i], "replicate") == 0) {
+				set_bigmem_policy(BIGMEM_REPLICATE);
+			} else {
+				fprintf(stderr, "invalid NUMA policy: %s\n", argv[i]);
+				return -1;
+			}
+
+		} else if(strcmp(argv[i], "-pin") == 0) {
+			set_bigmem_pinning(1);
+
+		} else if(strcmp(argv[i], "-bench") == 0) {
+			bench = 1;
+
+		} else if(strcmp(argv[i], "-frames") == 0) {
+			if(!argv[i + 1] || (num_frames = atoi(argv[++i])) <= 0) {
+				fprintf(stderr, "-frames must be followed by the number of frames\n");
+				return -1;
+			}
+
+		} else if(argv[i][0] != '-') {
+			scnfile = argv[i];
+
 		} else {
 			fprintf(stderr, "invalid argument: %s\n", argv[i]);
 			return -1;
 		}
 	}
 
+	if(bench) {
+		return benchmark(xsz, ysz);
+	}
+	if(num_frames) {
+		return render_frames(xsz, ysz, blksz, jobsamp);
+	}
 
 	glutInitWindowSize(xsz, ysz);
 	glutInitDisplayMode(GLUT_RGB | GLUT_SINGLE);
@@ -71,24 +227,65 @@ int main(int argc, char **argv)
 	glutDisplayFunc(disp);
 	glutReshapeFunc(reshape);
 	glutKeyboardFunc(keyb);
+	glutSpecialFunc(skeyb);
+	glutMouseFunc(mouse);
+	glutMotionFunc(motion);
+	glutPassiveMotionFunc(passive_motion);
 
 	pipe(pfd);
 	fcntl(pfd[0], F_SETFL, fcntl(pfd[0], F_GETFL) | O_NONBLOCK);
 
-	if(rt_init(xsz, ysz) == -1) {
+	if(rt_init(xsz, ysz, scnfile) == -1) {
 		return 1;
 	}
+	if(!nsamples && !(nsamples = get_scene_samples())) {
+		nsamples = DEF_SAMPLES;
+	}
 	atexit(rt_cleanup);
 
+	if(blksz) rt_set_block_size(blksz);
+	if(jobsamp) rt_set_job_samples(jobsamp);
+	printf("rendering in %dx%d blocks, %d samples per job\n", rt_get_block_size(),
+			rt_get_block_size(), rt_get_job_samples());
+
+	get_camera_targ(&cam_targ);
+	{
+		cgm_vec3 dir;
+		get_camera_pos(&dir);
+		cgm_vsub(&dir, &cam_targ);
+		if((cam_dist = cgm_vlength(&dir)) <= 0.0f) {
+			cam_dist = 1.0f;
+		}
+		cam_theta = atan2(dir.x, dir.z);
+		cam_phi = asin(dir.y / cam_dist);
+	}
+
+	glGenTextures(RT_PREVIEW_LEVELS, prvtex + 1);
+	for(i=1; i<=RT_PREVIEW_LEVELS; i++) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, prvtex[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, fbpreview[i].width, fbpreview[i].height,
+				0, GL_RGBA, GL_FLOAT, fbpreview[i].pixels);
+	}
+	glActiveTexture(GL_TEXTURE0);
+
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, fbwidth, fbheight, 0, GL_RGB, GL_FLOAT, fbpixels);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, fbwidth, fbheight, 0, GL_RGBA, GL_FLOAT, fbpixels);
 	glEnable(GL_TEXTURE_2D);
 
 	glPixelStorei(GL_UNPACK_ROW_LENGTH, fbwidth);
 
+	if(init_pbo() == -1) {
+		fprintf(stderr, "persistent mapped buffers not available, uploading from client memory\n");
+	}
+
 	if(!(ps = glCreateShader(GL_FRAGMENT_SHADER))) {
 		fprintf(stderr, "failed to create shader\n");
 		return 1;
@@ -122,10 +319,19 @@ int main(int argc, char **argv)
 	if(!status) return 1;
 
 	glUseProgram(sdr);
-	uloc_scale = glGetUniformLocation(sdr, "scale");
 	uloc_inv_gamma = glGetUniformLocation(sdr, "inv_gamma");
 
-	glUniform1f(uloc_scale, 1.0f);
+	glUniform1i(glGetUniformLocation(sdr, "tex"), 0);
+	for(i=1; i<=RT_PREVIEW_LEVELS; i++) {
+		char name[16];
+		sprintf(name, "prvtex%d", i);
+		glUniform1i(glGetUniformLocation(sdr, name), i);
+		/* preview images may overhang the framebuffer by a few pixels */
+		sprintf(name, "prvscale%d", i);
+		glUniform2f(glGetUniformLocation(sdr, name),
+				(float)fbwidth / (float)(fbpreview[i].width << i),
+				(float)fbheight / (float)(fbpreview[i].height << i));
+	}
 	glUniform1f(uloc_inv_gamma, 1.0f / 2.2f);
 
 	glClear(GL_COLOR_BUFFER_BIT);
@@ -138,27 +344,45 @@ int main(int argc, char **argv)
 	xfd = ConnectionNumber(dpy);
 	maxfd = xfd > pfd[0] ? xfd : pfd[0];
 
+	/* completed blocks only mark an update as pending. Updates are performed
+	 * at most once every UPD_INTERVAL_MSEC, regardless of how many blocks
+	 * completed in the meantime.
+	 */
 	for(;;) {
 		fd_set rdset;
 		int res, redraw_pending = 0;
+		long msec, dt;
+		struct timeval tv, *tvptr = 0;
 
 		FD_ZERO(&rdset);
 		FD_SET(xfd, &rdset);
 		FD_SET(pfd[0], &rdset);
 
-		while((res = select(maxfd + 1, &rdset, 0, 0, 0)) == -1 && errno == EINTR);
+		if(upd_pending) {
+			dt = UPD_INTERVAL_MSEC - (get_msec() - last_upd);
+			if(dt < 0) dt = 0;
+			tv.tv_sec = dt / 1000;
+			tv.tv_usec = (dt % 1000) * 1000;
+			tvptr = &tv;
+		}
 
-		if(res > 0) {
-			if(FD_ISSET(pfd[0], &rdset)) {
-				char tmp[64];
-				while(read(pfd[0], tmp, sizeof tmp) > 0);
-				glutPostRedisplay();
-				redraw_pending = 1;
-			}
-			if(FD_ISSET(xfd, &rdset) || redraw_pending) {
-				redraw_pending = 0;
-				glutMainLoopEvent();
-			}
+		while((res = select(maxfd + 1, &rdset, 0, 0, tvptr)) == -1 && errno == EINTR);
+
+		if(res > 0 && FD_ISSET(pfd[0], &rdset)) {
+			char tmp[64];
+			while(read(pfd[0], tmp, sizeof tmp) > 0);
+			upd_pending = 1;
+		}
+
+		if(upd_pending && (msec = get_msec()) - last_upd >= UPD_INTERVAL_MSEC) {
+			glutPostRedisplay();
+			redraw_pending = 1;
+			upd_pending = 0;
+			last_upd = msec;
+		}
+
+		if((res > 0 && FD_ISSET(xfd, &rdset)) || redraw_pending) {
+			glutMainLoopEvent();
 		}
 	}
 
@@ -167,43 +391,184 @@ int main(int argc, char **argv)
 
 void redraw(void)
 {
-	write(pfd[1], pfd, 1);
+	if(!bench && !num_frames) {
+		write(pfd[1], pfd, 1);
+	}
+}
+
+static int init_pbo(void)
+{
+	unsigned int flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	long size = (long)fbwidth * fbheight * 4 * sizeof *fbpixels;
+
+	if(!glutExtensionSupported("GL_ARB_buffer_storage")) {
+		return -1;
+	}
+
+	glGenBuffers(1, &pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+	glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, 0, flags);
+	if(!(pbo_pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags))) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &pbo);
+		pbo = 0;
+		return -1;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	return 0;
 }
 
 static void update_viewport(int x, int y, int w, int h)
 {
-	glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGB, GL_FLOAT, fbpixels + (y * fbwidth + x) * 3);
+	int i;
+	long offs = (long)(y * fbwidth + x) * 4;
+
+	if(!pbo) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGBA, GL_FLOAT, fbpixels + offs);
+		return;
+	}
+
+	for(i=0; i<h; i++) {
+		memcpy(pbo_pixels + offs + i * fbwidth * 4, fbpixels + offs + i * fbwidth * 4,
+				w * 4 * sizeof *fbpixels);
+	}
+	glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGBA, GL_FLOAT,
+			(void*)(offs * sizeof *fbpixels));
 }
 
-#define QUAD_VERTEX(x, y)	\
-	glTexCoord2f((x) / (float)fbwidth, (y) / (float)fbheight); \
-	glVertex2f(x, y)
+#define AREA(r)	((long)(r).w * (r).h)
 
-static void disp(void)
+static void rect_union(struct rect *res, const struct rect *a, const struct rect *b)
 {
-	struct rt_block *dirty = rt_begin_update();
-	while(dirty) {
-		update_viewport(dirty->x, dirty->y, dirty->w, dirty->h);
+	int x1 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+	int y1 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+	res->x = a->x < b->x ? a->x : b->x;
+	res->y = a->y < b->y ? a->y : b->y;
+	res->w = x1 - res->x;
+	res->h = y1 - res->y;
+}
+
+/* merge a block into the dirty rectangle list. Blocks which extend an existing
+ * rectangle without growing it beyond the area they cover are merged into it.
+ * When the list is full, the block is merged into the rectangle which grows
+ * the least.
+ */
+static void add_dirty_rect(int x, int y, int w, int h)
+{
+	int i, best = -1;
+	long cost, best_cost = 0;
+	struct rect r, u;
+
+	r.x = x;
+	r.y = y;
+	r.w = w;
+	r.h = h;
 
-		glUniform1f(uloc_scale, 1.0f / dirty->sample);
+	for(;;) {
+		best = -1;
+		for(i=0; i<num_dirty_rects; i++) {
+			rect_union(&u, &r, dirty_rects + i);
+			cost = AREA(u) - AREA(r) - AREA(dirty_rects[i]);
+			if(best == -1 || cost < best_cost) {
+				best = i;
+				best_cost = cost;
+			}
+		}
+		if(best == -1 || (best_cost > 0 && num_dirty_rects < MAX_DIRTY_RECTS)) {
+			break;
+		}
+		/* absorb the best candidate, and try again with the merged rectangle */
+		rect_union(&r, &r, dirty_rects + best);
+		dirty_rects[best] = dirty_rects[--num_dirty_rects];
+	}
 
-		glBegin(GL_QUADS);
-		QUAD_VERTEX(dirty->x, dirty->y);
-		QUAD_VERTEX(dirty->x + dirty->w, dirty->y);
-		QUAD_VERTEX(dirty->x + dirty->w, dirty->y + dirty->h);
-		QUAD_VERTEX(dirty->x, dirty->y + dirty->h);
-		glEnd();
+	dirty_rects[num_dirty_rects++] = r;
+}
 
+static void disp(void)
+{
+	int i;
+	struct rt_block *dirty;
+
+	dirty = rt_begin_update();
+	while(dirty) {
+		/* skip stale blocks left over from before the last rt_clear */
+		if(dirty->frm == cur_frame) {
+			if(dirty->level) {
+				preview_dirty[dirty->level] = 1;
+			} else {
+				add_dirty_rect(dirty->x, dirty->y, dirty->w, dirty->h);
+			}
+		}
 		dirty = dirty->next;
 	}
 	rt_end_update();
 
+	/* after a restart, keep showing the previous image until the new preview
+	 * starts coming in, then drop it all at once.
+	 */
+	if(clear_pending) {
+		for(i=1; i<=RT_PREVIEW_LEVELS; i++) {
+			if(preview_dirty[i]) {
+				add_dirty_rect(0, 0, fbwidth, fbheight);
+				clear_pending = 0;
+				break;
+			}
+		}
+	}
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	for(i=1; i<=RT_PREVIEW_LEVELS; i++) {
+		if(preview_dirty[i]) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, fbpreview[i].width, fbpreview[i].height,
+					GL_RGBA, GL_FLOAT, fbpreview[i].pixels);
+			preview_dirty[i] = 0;
+		}
+	}
+	glActiveTexture(GL_TEXTURE0);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, fbwidth);
+
+	if(pbo) {
+		/* make sure the previous transfer out of the buffer is done */
+		if(pbo_fence) {
+			glClientWaitSync(pbo_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+			glDeleteSync(pbo_fence);
+			pbo_fence = 0;
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+	}
+
+	for(i=0; i<num_dirty_rects; i++) {
+		update_viewport(dirty_rects[i].x, dirty_rects[i].y, dirty_rects[i].w, dirty_rects[i].h);
+	}
+	num_dirty_rects = 0;
+
+	if(pbo) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		pbo_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	glBegin(GL_QUADS);
+	glTexCoord2f(0, 0);
+	glVertex2f(0, 0);
+	glTexCoord2f(1, 0);
+	glVertex2f(fbwidth, 0);
+	glTexCoord2f(1, 1);
+	glVertex2f(fbwidth, fbheight);
+	glTexCoord2f(0, 1);
+	glVertex2f(0, fbheight);
+	glEnd();
+
 	glFlush();
 	assert(glGetError() == GL_NO_ERROR);
 }
 
 static void reshape(int x, int y)
 {
+	win_width = x;
+	win_height = y;
+
 	glViewport(0, 0, x, y);
 
 	glMatrixMode(GL_PROJECTION);
@@ -219,12 +584,11 @@ static void keyb(unsigned char key, int x, int y)
 
 	case '\n':
 	case '\r':
-		rt_clear();
-		rt_render(5);
+		restart();
 		break;
 
 	case ' ':
-		rt_render(5);
+		rt_render(nsamples);
 		break;
 
 	case 's':
@@ -233,13 +597,123 @@ static void keyb(unsigned char key, int x, int y)
 	}
 }
 
+/* arrow keys move the camera forward/back and sideways, page up/down move it
+ * vertically. The orbit target moves along with it.
+ */
+static void skeyb(int key, int x, int y)
+{
+	cgm_vec3 pos, fwd, right, up = {0, 1, 0}, dir = {0, 0, 0};
+	float step = cam_dist * 0.05f;
+
+	get_camera_pos(&pos);
+	fwd = cam_targ;
+	cgm_vsub(&fwd, &pos);
+	cgm_vnormalize(&fwd);
+	cgm_vcross(&right, &fwd, &up);
+	cgm_vnormalize(&right);
+
+	switch(key) {
+	case GLUT_KEY_UP:
+		cgm_vadd_scaled(&dir, &fwd, step);
+		break;
+	case GLUT_KEY_DOWN:
+		cgm_vadd_scaled(&dir, &fwd, -step);
+		break;
+	case GLUT_KEY_RIGHT:
+		cgm_vadd_scaled(&dir, &right, step);
+		break;
+	case GLUT_KEY_LEFT:
+		cgm_vadd_scaled(&dir, &right, -step);
+		break;
+	case GLUT_KEY_PAGE_UP:
+		cgm_vadd_scaled(&dir, &up, step);
+		break;
+	case GLUT_KEY_PAGE_DOWN:
+		cgm_vadd_scaled(&dir, &up, -step);
+		break;
+	default:
+		return;
+	}
+
+	cgm_vadd(&cam_targ, &dir);
+	restart();
+}
+
+static void mouse(int bn, int st, int x, int y)
+{
+	int idx = bn - GLUT_LEFT_BUTTON;
+
+	if(idx >= 0 && idx < 8) {
+		bnstate[idx] = st == GLUT_DOWN;
+	}
+	prev_mx = x;
+	prev_my = y;
+
+	/* mouse wheel zoom */
+	if(st == GLUT_DOWN && (bn == 3 || bn == 4)) {
+		cam_dist *= bn == 3 ? 0.9f : 1.1f;
+		restart();
+	}
+}
+
+/* left button drag orbits around the target, right button drag zooms */
+static void motion(int x, int y)
+{
+	int dx = x - prev_mx;
+	int dy = y - prev_my;
+
+	prev_mx = x;
+	prev_my = y;
+
+	if(!dx && !dy) return;
+
+	passive_motion(x, y);
+
+	if(bnstate[0]) {
+		cam_theta -= dx * 0.01f;
+		cam_phi += dy * 0.01f;
+		if(cam_phi < -1.5f) cam_phi = -1.5f;
+		if(cam_phi > 1.5f) cam_phi = 1.5f;
+		restart();
+	}
+	if(bnstate[2]) {
+		cam_dist *= 1.0f + dy * 0.01f;
+		if(cam_dist < 1e-3f) cam_dist = 1e-3f;
+		restart();
+	}
+}
+
+/* rendering progresses outwards from the mouse cursor */
+static void passive_motion(int x, int y)
+{
+	if(win_width > 0 && win_height > 0) {
+		rt_set_focus(x * fbwidth / win_width, y * fbheight / win_height);
+	}
+}
+
+/* cancel everything in flight and start rendering again from the current
+ * camera, beginning with the low resolution previews.
+ */
+static void restart(void)
+{
+	rt_clear();
+
+	set_camera_targ(cam_targ.x, cam_targ.y, cam_targ.z);
+	set_camera_pos(cam_targ.x + cam_dist * sin(cam_theta) * cos(cam_phi),
+			cam_targ.y + cam_dist * sin(cam_phi),
+			cam_targ.z + cam_dist * cos(cam_theta) * cos(cam_phi));
+
+	rt_render(nsamples);
+	clear_pending = 1;
+}
+
 #define INV_GAMMA	(1.0 / 2.2)
 static int save_image(const char *fname)
 {
 	FILE *fp;
 	int i;
 	float *fbptr = fbpixels;
-	float pixscale = 1.0f / (float)cur_sample;
+	float pixscale;
 
 	printf("saving framebuffer (%d samples) to %s ... ", cur_sample, fname);
 	fflush(stdout);
@@ -251,9 +725,13 @@ static int save_image(const char *fname)
 	fprintf(fp, "P6\n%d %d\n255\n", fbwidth, fbheight);
 
 	for(i=0; i<fbwidth * fbheight; i++) {
-		int r = pow(*fbptr++ * pixscale, INV_GAMMA) * 255.99;
-		int g = pow(*fbptr++ * pixscale, INV_GAMMA) * 255.99;
-		int b = pow(*fbptr++ * pixscale, INV_GAMMA) * 255.99;
+		int r, g, b;
+
+		pixscale = fbptr[3] > 0.0f ? 1.0f / fbptr[3] : 0.0f;
+		r = pow(fbptr[0] * pixscale, INV_GAMMA) * 255.99;
+		g = pow(fbptr[1] * pixscale, INV_GAMMA) * 255.99;
+		b = pow(fbptr[2] * pixscale, INV_GAMMA) * 255.99;
+		fbptr += 4;
 
 		fputc(r > 255 ? 255 : r, fp);
 		fputc(g > 255 ? 255 : g, fp);
@@ -264,3 +742,101 @@ static int save_image(const char *fname)
 	printf("done\n");
 	return 0;
 }
+
+/* render the scene with every combination of block size and samples per job,
+ * and report the fastest.
+ */
+static int benchmark(int xsz, int ysz)
+{
+	static const int blksizes[] = {8, 16, 32, 64, 128};
+	static const int jobsamples[] = {1, 2, 4, 8};
+	int i, j, best_blksz = 0, best_jobsamp = 0;
+	long msec, best_msec = -1;
+
+	if(rt_init(xsz, ysz, scnfile) == -1) {
+		return 1;
+	}
+	if(!nsamples && !(nsamples = get_scene_samples())) {
+		nsamples = DEF_SAMPLES;
+	}
+
+	printf("benchmarking %dx%d, %d samples per pixel\n", xsz, ysz, nsamples);
+	for(i=0; i<sizeof blksizes / sizeof *blksizes; i++) {
+		for(j=0; j<sizeof jobsamples / sizeof *jobsamples; j++) {
+			rt_clear();
+			rt_set_block_size(blksizes[i]);
+			rt_set_job_samples(jobsamples[j]);
+
+			msec = get_msec();
+			rt_render(nsamples);
+			rt_wait();
+			msec = get_msec() - msec;
+
+			/* recycle the completed blocks */
+			rt_begin_update();
+			rt_end_update();
+
+			printf("  block size %3d, %d samples/job: %ld ms\n", blksizes[i], jobsamples[j], msec);
+			if(best_msec < 0 || msec < best_msec) {
+				best_msec = msec;
+				best_blksz = blksizes[i];
+				best_jobsamp = jobsamples[j];
+			}
+		}
+	}
+	printf("best: -b %d -j %d (%ld ms)\n", best_blksz, best_jobsamp, best_msec);
+
+	rt_cleanup();
+	return 0;
+}
+
+/* renders the scene motion as a sequence of frames, each over its own part of
+ * the shutter interval, to frameNNNN.ppm files. Everything is loaded once, and
+ * only the bounds of moving surfaces are refitted between frames.
+ */
+static int render_frames(int xsz, int ysz, int blksz, int jobsamp)
+{
+	int i, res = 0;
+	long msec, upd_msec;
+	char fname[64];
+
+	if(rt_init(xsz, ysz, scnfile) == -1) {
+		return 1;
+	}
+	if(!nsamples && !(nsamples = get_scene_samples())) {
+		nsamples = DEF_SAMPLES;
+	}
+	if(blksz) rt_set_block_size(blksz);
+	if(jobsamp) rt_set_job_samples(jobsamp);
+
+	printf("rendering %d frames, %dx%d, %d samples per pixel\n", num_frames, xsz, ysz,
+			nsamples);
+	for(i=0; i<num_frames; i++) {
+		rt_clear();
+
+		msec = get_msec();
+		if(set_shutter((float)i / num_frames, (float)(i + 1) / num_frames) == -1) {
+			res = 1;
+			break;
+		}
+		upd_msec = get_msec() - msec;
+
+		rt_render(nsamples);
+		rt_wait();
+		msec = get_msec() - msec;
+
+		/* recycle the completed blocks */
+		rt_begin_update();
+		rt_end_update();
+
+		printf("frame %d: scene update %ld ms, total %ld ms\n", i, upd_msec, msec);
+		sprintf(fname, "frame%04d.ppm", i);
+		if(save_image(fname) == -1) {
+			res = 1;
+			break;
+		}
+	}
+
+	rt_cleanup();
+	return res;
+}
@@ -3,13 +3,18 @@
 
 #include <cgmath/cgmath.h>
 
+/* materials live in the scene material table, and are referenced by index */
 struct material {
+	char *name;
 	cgm_vec3 color;
 	cgm_vec3 emission;
 	float roughness;
 	int metallic;
 
-	struct material *next;
+	/* scene texture indices, -1 for none. Texture values replace the color
+	 * and roughness above.
+	 */
+	int color_tex, rough_tex;
 };
 
 #endif	/* MATERIAL_H_ */
@@ -1,28 +1,162 @@
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
-#include <errno.h>
 #include <float.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "mesh.h"
 #include "surf.h"
 #include "dynarr.h"
+#include "tpool.h"
+#include "bigmem.h"
+#include "util.h"
+
+#define TASKS_PER_THREAD	4
+#define MIN_TASK_ITEMS		16384
+#define MAX_TASKS			256
+
+static int ray_mesh_noacc(const struct mesh *m, const cgm_ray *ray, float time,
+		struct surf_hit *hit);
+static int ray_mesh_octree(const struct mesh *m, int nidx, const cgm_ray *ray, float time,
+		struct surf_hit *hit);
+static const struct face *face_at(const struct mesh *m, int idx, float time,
+		struct face *buf);
+static int octree_height(const struct mesh *m, int nidx);
+static int octree_max_faces(const struct mesh *m, int nidx);
+static void refit_octnode(struct mesh *m, int nidx, int levels);
+
+static struct thread_pool *mesh_tpool;
+
+void set_mesh_thread_pool(struct thread_pool *tpool)
+{
+	mesh_tpool = tpool;
+}
+
+struct thread_pool *get_mesh_thread_pool(void)
+{
+	return mesh_tpool;
+}
+
+/* tasks run by run_tasks must start with a pointer to the group, which counts
+ * the tasks still pending, like the chunks of the OBJ loader
+ */
+struct task_group {
+	int pending;
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+};
+
+static void task_done(void *cls)
+{
+	struct task_group *grp = *(struct task_group**)cls;
+
+	pthread_mutex_lock(&grp->lock);
+	if(--grp->pending <= 0) {
+		pthread_cond_signal(&grp->done_cond);
+	}
+	pthread_mutex_unlock(&grp->lock);
+}
+
+/* runs func on each of the tasks in the thread pool, and waits for all of them.
+ * Without a thread pool, or when called from one of its threads, the tasks run
+ * in order on the calling thread, since blocking a worker on other queued jobs
+ * could deadlock.
+ */
+static void run_tasks(void *tasks, int num_tasks, int task_size, tpool_callback func)
+{
+	int i;
+	char *task = tasks;
+	struct task_group grp;
 
-static int ray_mesh_noacc(const struct mesh *m, const cgm_ray *ray, struct surf_hit *hit);
-static int ray_mesh_octree(const struct mesh *m, struct octnode *on, const cgm_ray *ray, struct surf_hit *hit);
-static int octree_height(struct octnode *n);
-static int octree_max_faces(struct octnode *n);
+	if(!mesh_tpool || num_tasks <= 1 || tpool_thread_id(mesh_tpool) >= 0) {
+		for(i=0; i<num_tasks; i++) {
+			func(task + i * task_size);
+		}
+		return;
+	}
+
+	grp.pending = num_tasks;
+	pthread_mutex_init(&grp.lock, 0);
+	pthread_cond_init(&grp.done_cond, 0);
+
+	for(i=0; i<num_tasks; i++) {
+		*(struct task_group**)task = &grp;
+		if(tpool_enqueue(mesh_tpool, task, func, task_done) == -1) {
+			func(task);
+			task_done(task);
+		}
+		task += task_size;
+	}
+
+	pthread_mutex_lock(&grp.lock);
+	while(grp.pending > 0) {
+		pthread_cond_wait(&grp.done_cond, &grp.lock);
+	}
+	pthread_mutex_unlock(&grp.lock);
+
+	pthread_mutex_destroy(&grp.lock);
+	pthread_cond_destroy(&grp.done_cond);
+}
+
+/* number of tasks to split num items into, none smaller than MIN_TASK_ITEMS */
+static int num_par_tasks(int num)
+{
+	int num_tasks;
+
+	if(!mesh_tpool || tpool_thread_id(mesh_tpool) >= 0) {
+		return 1;
+	}
+	num_tasks = tpool_num_processors() * TASKS_PER_THREAD;
+	if(num_tasks > num / MIN_TASK_ITEMS) num_tasks = num / MIN_TASK_ITEMS;
+	if(num_tasks > MAX_TASKS) num_tasks = MAX_TASKS;
+	return num_tasks < 1 ? 1 : num_tasks;
+}
 
 void init_mesh(struct mesh *m)
 {
 	m->faces = 0;
 	m->num_faces = 0;
+	m->end_faces = 0;
+	m->span[0] = 0.0f;
+	m->span[1] = 1.0f;
+	m->octree = 0;
+	m->num_octnodes = 0;
+	m->octitems = 0;
+	m->num_octitems = 0;
+	m->mtlnames = m->mtllibs = 0;
+	m->num_mtls = m->num_mtllibs = 0;
+	m->cache_map = 0;
+	m->cache_size = 0;
+	m->quant = 0;
+	m->placed = 0;
+	m->replicas = 0;
 }
 
 void clear_mesh(struct mesh *m)
 {
-	free(m->faces);
-	m->faces = 0;
-	m->num_faces = 0;
+	int i;
+
+	for(i=0; i<m->num_mtls; i++) {
+		free(m->mtlnames[i]);
+	}
+	free(m->mtlnames);
+	for(i=0; i<m->num_mtllibs; i++) {
+		free(m->mtllibs[i]);
+	}
+	free(m->mtllibs);
+	free(m->end_faces);
+
+	if(m->placed) {
+		free_placed_mesh(m);
+	} else if(m->cache_map) {
+		munmap(m->cache_map, m->cache_size);
+	} else {
+		free(m->faces);
+		free(m->octree);
+		free(m->octitems);
+	}
+	free_mesh_quant(m->quant);
+	init_mesh(m);
 }
 
 void calc_face_normal(struct face *f)
@@ -36,50 +170,140 @@ void calc_face_normal(struct face *f)
 	cgm_vnormalize(&f->normal);
 }
 
-void calc_mesh_bounds(const struct mesh *m, struct aabox *aabb)
+/* bounds of a range of faces, computed by each task of calc_mesh_bounds */
+struct bounds_task {
+	struct task_group *grp;
+	const struct mesh *mesh;
+	int start, end;
+	struct aabox bbox;
+};
+
+static void add_face_bounds(struct aabox *aabb, const struct face *face)
 {
-	int i, j;
+	int i;
+
+	for(i=0; i<3; i++) {
+		const cgm_vec3 *v = face->v + i;
+		if(v->x < aabb->vmin.x) aabb->vmin.x = v->x;
+		if(v->x > aabb->vmax.x) aabb->vmax.x = v->x;
+		if(v->y < aabb->vmin.y) aabb->vmin.y = v->y;
+		if(v->y > aabb->vmax.y) aabb->vmax.y = v->y;
+		if(v->z < aabb->vmin.z) aabb->vmin.z = v->z;
+		if(v->z > aabb->vmax.z) aabb->vmax.z = v->z;
+	}
+}
+
+static void calc_range_bounds(void *cls)
+{
+	int i;
+	struct bounds_task *task = cls;
+	struct aabox *aabb = &task->bbox;
+	const struct mesh *m = task->mesh;
 
 	cgm_vcons(&aabb->vmin, FLT_MAX, FLT_MAX, FLT_MAX);
 	cgm_vcons(&aabb->vmax, -FLT_MAX, -FLT_MAX, -FLT_MAX);
 
-	for(i=0; i<m->num_faces; i++) {
-		for(j=0; j<3; j++) {
-			cgm_vec3 *v = m->faces[i].v + j;
-			if(v->x < aabb->vmin.x) aabb->vmin.x = v->x;
-			if(v->x > aabb->vmax.x) aabb->vmax.x = v->x;
-			if(v->y < aabb->vmin.y) aabb->vmin.y = v->y;
-			if(v->y > aabb->vmax.y) aabb->vmax.y = v->y;
-			if(v->z < aabb->vmin.z) aabb->vmin.z = v->z;
-			if(v->z > aabb->vmax.z) aabb->vmax.z = v->z;
+	/* deforming meshes include the faces at both ends of the interval */
+	for(i=task->start; i<task->end; i++) {
+		add_face_bounds(aabb, m->faces + i);
+		if(m->end_faces) {
+			add_face_bounds(aabb, m->end_faces + i);
 		}
 	}
 }
 
-static float ray_face(const struct face *face, const cgm_ray *ray, cgm_vec3 *bary)
+void calc_mesh_bounds(const struct mesh *m, struct aabox *aabb)
 {
-	float t, ndotdir, ndotvdir;
-	cgm_vec3 vdir, p;
+	int i, num_tasks;
+	struct bounds_task tasks[MAX_TASKS];
 
-	if(fabs(ndotdir = cgm_vdot(&face->normal, &ray->dir)) < 1e-6) {
-		return -1.0f;
+	if(m->quant) {
+		*aabb = m->quant->bbox;
+		return;
+	}
+
+	num_tasks = num_par_tasks(m->num_faces);
+	for(i=0; i<num_tasks; i++) {
+		tasks[i].mesh = m;
+		tasks[i].start = (long)m->num_faces * i / num_tasks;
+		tasks[i].end = (long)m->num_faces * (i + 1) / num_tasks;
 	}
+	run_tasks(tasks, num_tasks, sizeof *tasks, calc_range_bounds);
+
+	*aabb = tasks[0].bbox;
+	for(i=1; i<num_tasks; i++) {
+		struct aabox *b = &tasks[i].bbox;
+		if(b->vmin.x < aabb->vmin.x) aabb->vmin.x = b->vmin.x;
+		if(b->vmax.x > aabb->vmax.x) aabb->vmax.x = b->vmax.x;
+		if(b->vmin.y < aabb->vmin.y) aabb->vmin.y = b->vmin.y;
+		if(b->vmax.y > aabb->vmax.y) aabb->vmax.y = b->vmax.y;
+		if(b->vmin.z < aabb->vmin.z) aabb->vmin.z = b->vmin.z;
+		if(b->vmax.z > aabb->vmax.z) aabb->vmax.z = b->vmax.z;
+	}
+}
 
-	vdir = face->v[0];
-	cgm_vsub(&vdir, &ray->origin);
-	ndotvdir = cgm_vdot(&face->normal, &vdir);
+/* face idx at a shutter time, interpolated into buf for deforming meshes */
+static inline const struct face *face_at(const struct mesh *m, int idx, float time,
+		struct face *buf)
+{
+	int i;
+	const struct face *a, *b;
 
-	if((t = ndotvdir / ndotdir) < 1e-5) {
-		return -1.0f;
+	if(!m->end_faces) {
+		return m->faces + idx;
+	}
+	a = m->faces + idx;
+	b = m->end_faces + idx;
+	for(i=0; i<3; i++) {
+		cgm_vlerp(buf->v + i, a->v + i, b->v + i, time);
+		cgm_vlerp(buf->n + i, a->n + i, b->n + i, time);
+		buf->tc[i] = a->tc[i];
 	}
+	buf->mtl = a->mtl;
+	calc_face_normal(buf);
+	return buf;
+}
+
+int set_mesh_deform(struct mesh *m, struct mesh *end)
+{
+	if(end->num_faces != m->num_faces || m->cache_map || end->cache_map) {
+		return -1;
+	}
+	free(m->end_faces);
+	m->end_faces = end->faces;
+	end->faces = 0;
+	end->num_faces = 0;
+	return 0;
+}
 
-	cgm_raypos(&p, ray, t);
-	cgm_bary(bary, face->v, face->v + 1, face->v + 2, &p);
+float ray_triangle(const cgm_ray *ray, const cgm_vec3 *v, cgm_vec3 *bary)
+{
+	float det, inv_det, t;
+	cgm_vec3 e1, e2, pv, tv, qv;
+
+	e1 = v[1];
+	cgm_vsub(&e1, v);
+	e2 = v[2];
+	cgm_vsub(&e2, v);
+	cgm_vcross(&pv, &ray->dir, &e2);
+	if((det = cgm_vdot(&e1, &pv)) == 0.0f) {
+		return -1.0f;
+	}
+	inv_det = 1.0f / det;
 
-	if(bary->x < 0.0f || bary->x > 1.0f) return -1.0f;
+	tv = ray->origin;
+	cgm_vsub(&tv, v);
+	bary->y = cgm_vdot(&tv, &pv) * inv_det;
 	if(bary->y < 0.0f || bary->y > 1.0f) return -1.0f;
-	if(bary->z < 0.0f || bary->z > 1.0f) return -1.0f;
 
+	cgm_vcross(&qv, &tv, &e1);
+	bary->z = cgm_vdot(&ray->dir, &qv) * inv_det;
+	if(bary->z < 0.0f || bary->y + bary->z > 1.0f) return -1.0f;
+
+	if((t = cgm_vdot(&e2, &qv) * inv_det) < 1e-5) {
+		return -1.0f;
+	}
+	bary->x = 1.0f - bary->y - bary->z;
 	return t;
 }
 
@@ -91,27 +315,34 @@ static inline void bary_interp(cgm_vec3 *p, const cgm_vec3 *a,
 	p->z = a->z * bc->x + b->z * bc->y + c->z * bc->z;
 }
 
-int find_mesh_isect(const struct mesh *m, const float *inv_xform,
-		const cgm_ray *ray, struct surf_hit *hit)
+int find_mesh_isect(const struct mesh *m, const cgm_ray *lray, const cgm_ray *ray,
+		float time, struct surf_hit *hit)
 {
 	cgm_vec3 bc;
 	struct surf_hit tmphit;
-	struct face *face;
-	cgm_ray lray = *ray;
+	struct face buf;
+	const struct face *face;
+	int node;
+
+	if(m->replicas && (node = bigmem_thread_node()) > 0) {
+		m = m->replicas[node];
+	}
 
-	cgm_rmul_mr(&lray, inv_xform);
+	if(m->quant) {
+		return find_qmesh_isect(m->quant, lray, ray, hit);
+	}
 
 	if(m->octree) {
 		/*
-		if(!ray_aabox(&m->octree->bbox, &lray, &tmphit)) {
+		if(!ray_aabox(&m->octree->bbox, lray, &tmphit)) {
 			return 0;
 		}
 		*/
-		if(!ray_mesh_octree(m, m->octree, &lray, &tmphit)) {
+		if(!ray_mesh_octree(m, 0, lray, time, &tmphit)) {
 			return 0;
 		}
 	} else {
-		if(!ray_mesh_noacc(m, &lray, &tmphit)) {
+		if(!ray_mesh_noacc(m, lray, time, &tmphit)) {
 			return 0;
 		}
 	}
@@ -120,28 +351,57 @@ int find_mesh_isect(const struct mesh *m, const float *inv_xform,
 		hit->t = tmphit.t;
 
 		face = (struct face*)tmphit.surf;
+		face = face_at(m, face - m->faces, time, &buf);
 		bc = tmphit.pos;
 
+		hit->mtl = face->mtl;
 		cgm_raypos(&hit->pos, ray, hit->t);
 
 		bary_interp(&hit->normal, face->n, face->n + 1, face->n + 2, &bc);
 		bary_interp(&hit->tex, face->tc, face->tc + 1, face->tc + 2, &bc);
+		hit->uvscale = tri_uvscale(face->v, face->tc);
 	}
 	return 1;
 }
 
-static int ray_mesh_noacc(const struct mesh *m, const cgm_ray *ray, struct surf_hit *hit)
+float tri_uvscale(const cgm_vec3 *v, const cgm_vec3 *tc)
+{
+	float du1, dv1, du2, dv2, uvarea, area;
+	cgm_vec3 e1, e2, n;
+
+	du1 = tc[1].x - tc[0].x;
+	dv1 = tc[1].y - tc[0].y;
+	du2 = tc[2].x - tc[0].x;
+	dv2 = tc[2].y - tc[0].y;
+	if((uvarea = fabs(du1 * dv2 - du2 * dv1)) <= 0.0f) {
+		return 0.0f;
+	}
+
+	e1 = v[1];
+	cgm_vsub(&e1, v);
+	e2 = v[2];
+	cgm_vsub(&e2, v);
+	cgm_vcross(&n, &e1, &e2);
+	if((area = cgm_vlength(&n)) <= 0.0f) {
+		return 0.0f;
+	}
+	return sqrt(uvarea / area);
+}
+
+static int ray_mesh_noacc(const struct mesh *m, const cgm_ray *ray, float time,
+		struct surf_hit *hit)
 {
 	int i;
 	float t, nearest_t = FLT_MAX;
-	struct face *face, *nearest_face = 0;
+	struct face buf, *nearest_face = 0;
+	const struct face *face;
 	cgm_vec3 bc, nearest_bc;
 
 	for(i=0; i<m->num_faces; i++) {
-		face = m->faces + i;
-		if((t = ray_face(face, ray, &bc)) >= 0.0f && t < nearest_t) {
+		face = face_at(m, i, time, &buf);
+		if((t = ray_triangle(ray, face->v, &bc)) >= 0.0f && t < nearest_t) {
 			nearest_t = t;
-			nearest_face = face;
+			nearest_face = m->faces + i;
 			nearest_bc = bc;
 		}
 	}
@@ -155,30 +415,33 @@ static int ray_mesh_noacc(const struct mesh *m, const cgm_ray *ray, struct surf_
 	return 1;
 }
 
-static int ray_mesh_octree(const struct mesh *m, struct octnode *on, const cgm_ray *ray, struct surf_hit *hit)
+/* hits record the face in the faces array, also for deforming meshes */
+static int ray_mesh_octree(const struct mesh *m, int nidx, const cgm_ray *ray, float time,
+		struct surf_hit *hit)
 {
 	int i;
 	struct surf_hit nearest_hit, chit;
+	const struct octnode *on = m->octree + nidx;
 
 	if(!ray_aabox(&on->bbox, ray, 0)) {
 		return 0;
 	}
 
-	if(on->items) {
+	if(on->num_items) {
 		/* leaf node: check all faces for intersections, return the nearest */
 		float t, nearest_t = FLT_MAX;
-		struct face *face, *nearest_face = 0;
+		struct face buf, *nearest_face = 0;
+		const struct face *face;
 		cgm_vec3 bc, nearest_bc;
-		struct octitem *it = on->items;
+		const int *items = m->octitems + on->items;
 
-		while(it) {
-			face = m->faces + it->idx;
-			if((t = ray_face(face, ray, &bc)) >= 0.0f && t < nearest_t) {
+		for(i=0; i<on->num_items; i++) {
+			face = face_at(m, items[i], time, &buf);
+			if((t = ray_triangle(ray, face->v, &bc)) >= 0.0f && t < nearest_t) {
 				nearest_t = t;
-				nearest_face = face;
+				nearest_face = m->faces + items[i];
 				nearest_bc = bc;
 			}
-			it = it->next;
 		}
 
 		if(!nearest_face) return 0;
@@ -190,14 +453,14 @@ static int ray_mesh_octree(const struct mesh *m, struct octnode *on, const cgm_r
 		return 1;
 	}
 
+	if(!on->child) return 0;
+
 	/* internal node: recurse and check children */
 	nearest_hit.t = FLT_MAX;
 	nearest_hit.surf = 0;
 	for(i=0; i<8; i++) {
-		if(on->child[i]) {
-			if(ray_mesh_octree(m, on->child[i], ray, &chit) && chit.t < nearest_hit.t) {
-				nearest_hit = chit;
-			}
+		if(ray_mesh_octree(m, on->child + i, ray, time, &chit) && chit.t < nearest_hit.t) {
+			nearest_hit = chit;
 		}
 	}
 
@@ -220,6 +483,7 @@ int begin_mesh(struct mesh *m)
 		return -1;
 	}
 	cur_vidx = 0;
+	cur_face.mtl = -1;
 	return 0;
 }
 
@@ -255,6 +519,41 @@ void mesh_texcoord(struct mesh *m, float u, float v)
 	cgm_vcons(&cur_tc, u, v, 0);
 }
 
+/* the octree is built with linked nodes holding arrays of face indices, and
+ * then flattened into the mesh octree arrays.
+ *
+ * Splitting a node classifies each of its faces against the 8 child boxes, and
+ * scatters the indices into the child arrays. Large nodes do both steps in
+ * parallel over ranges of the face array: classification counts the faces of
+ * each range going to each child, and prefix sums of the counts give every
+ * range its own place in the child arrays. The top levels are split like that,
+ * largest node first, until there are enough subtrees to keep the thread pool
+ * busy, and the subtrees are then built as separate tasks.
+ */
+struct octbuild {
+	struct aabox bbox;
+	int *items;
+	int num_items;
+	struct octbuild *child[8];
+};
+
+struct split_task {
+	struct task_group *grp;
+	struct mesh *mesh;
+	struct octbuild *node;
+	unsigned char *masks;	/* children overlapped by each face of the node */
+	int start, end;
+	int count[8];		/* faces per child, then offsets in the child arrays */
+};
+
+struct subtree_task {
+	struct task_group *grp;
+	struct mesh *mesh;
+	struct octbuild *node;
+	int max_node_items, max_depth;
+	int failed;
+};
+
 static void child_bounds(struct aabox *res, struct aabox *par, int idx)
 {
 	static const cgm_vec3 tmin[8] = {
@@ -274,14 +573,20 @@ static void child_bounds(struct aabox *res, struct aabox *par, int idx)
 #define MAX(a, b)	((a) > (b) ? (a) : (b))
 #define ELEM(v, i)	(((float*)(&(v).x))[i])
 
-static int face_in_box(struct face *f, struct aabox *b)
+/* deforming faces go to every node overlapping the space they sweep */
+static int face_in_box(const struct mesh *m, int idx, struct aabox *b)
 {
 	int i;
 	float fmin, fmax, bmin, bmax;
+	const struct face *f = m->faces + idx, *e = m->end_faces ? m->end_faces + idx : 0;
 
 	for(i=0; i<3; i++) {
 		fmin = MIN(ELEM(f->v[0], i), MIN(ELEM(f->v[1], i), ELEM(f->v[2], i)));
 		fmax = MAX(ELEM(f->v[0], i), MAX(ELEM(f->v[1], i), ELEM(f->v[2], i)));
+		if(e) {
+			fmin = MIN(fmin, MIN(ELEM(e->v[0], i), MIN(ELEM(e->v[1], i), ELEM(e->v[2], i))));
+			fmax = MAX(fmax, MAX(ELEM(e->v[0], i), MAX(ELEM(e->v[1], i), ELEM(e->v[2], i))));
+		}
 		bmin = ELEM(b->vmin, i);
 		bmax = ELEM(b->vmax, i);
 
@@ -294,32 +599,65 @@ static int face_in_box(struct face *f, struct aabox *b)
 	return 1;
 }
 
-static void free_octree(struct octnode *node)
+static void free_octree(struct octbuild *node)
 {
 	int i;
+
+	if(!node) return;
+
 	for(i=0; i<8; i++) {
 		free_octree(node->child[i]);
 	}
-
-	while(node->items) {
-		struct octitem *it = node->items;
-		node->items = node->items->next;
-		free(it);
-	}
+	free(node->items);
 	free(node);
 }
 
-static int build_octree(struct mesh *mesh, struct octnode *node, int max_node_items, int max_depth)
+static void classify_faces(void *cls)
 {
-	int i;
-	struct octnode *cn;
-	struct octitem *item, *newit;
+	int i, j, *items;
+	unsigned char mask;
+	struct split_task *task = cls;
+	struct octbuild *node = task->node;
+
+	memset(task->count, 0, sizeof task->count);
+
+	items = node->items;
+	for(i=task->start; i<task->end; i++) {
+		mask = 0;
+		for(j=0; j<8; j++) {
+			if(face_in_box(task->mesh, items[i], &node->child[j]->bbox)) {
+				mask |= 1 << j;
+				task->count[j]++;
+			}
+		}
+		task->masks[i] = mask;
+	}
+}
 
-	if(node->num_items < max_node_items || max_depth <= 0) {
-		return 0;
+static void scatter_faces(void *cls)
+{
+	int i, j;
+	unsigned char mask;
+	struct split_task *task = cls;
+	struct octbuild *node = task->node;
+
+	for(i=task->start; i<task->end; i++) {
+		if(!(mask = task->masks[i])) continue;
+		for(j=0; j<8; j++) {
+			if(mask & (1 << j)) {
+				node->child[j]->items[task->count[j]++] = node->items[i];
+			}
+		}
 	}
+}
 
-	memset(node->child, 0, sizeof node->child);
+/* moves the faces of the node to 8 new children */
+static int split_octnode(struct mesh *mesh, struct octbuild *node)
+{
+	int i, j, num_tasks, total, num;
+	struct octbuild *cn;
+	struct split_task tasks[MAX_TASKS];
+	unsigned char *masks;
 
 	for(i=0; i<8; i++) {
 		if(!(cn = calloc(1, sizeof *cn))) {
@@ -328,37 +666,45 @@ static int build_octree(struct mesh *mesh, struct octnode *node, int max_node_it
 		}
 		node->child[i] = cn;
 		child_bounds(&cn->bbox, &node->bbox, i);
+	}
 
-		item = node->items;
-		while(item) {
-			if(face_in_box(mesh->faces + item->idx, &cn->bbox)) {
-				if(!(newit = malloc(sizeof *newit))) {
-					perror("build_octree: failed to allocate item");
-					goto fail;
-				}
-				newit->idx = item->idx;
-				newit->next = cn->items;
-				cn->items = newit;
-				cn->num_items++;
-			}
-			item = item->next;
-		}
+	if(!(masks = malloc(node->num_items))) {
+		perror("build_octree: failed to allocate face masks");
+		goto fail;
 	}
 
-	/* remove items from parent node */
-	while(node->items) {
-		item = node->items;
-		node->items = node->items->next;
-		free(item);
+	num_tasks = num_par_tasks(node->num_items);
+	for(i=0; i<num_tasks; i++) {
+		tasks[i].mesh = mesh;
+		tasks[i].node = node;
+		tasks[i].masks = masks;
+		tasks[i].start = (long)node->num_items * i / num_tasks;
+		tasks[i].end = (long)node->num_items * (i + 1) / num_tasks;
 	}
-	node->num_items = 0;
+	run_tasks(tasks, num_tasks, sizeof *tasks, classify_faces);
 
-	/* recurse into all children */
 	for(i=0; i<8; i++) {
-		if(build_octree(mesh, node->child[i], max_node_items, max_depth - 1) == -1) {
+		total = 0;
+		for(j=0; j<num_tasks; j++) {
+			num = tasks[j].count[i];
+			tasks[j].count[i] = total;
+			total += num;
+		}
+		cn = node->child[i];
+		if(!(cn->items = malloc(total * sizeof *cn->items + 1))) {
+			perror("build_octree: failed to allocate items");
+			free(masks);
 			goto fail;
 		}
+		cn->num_items = total;
 	}
+	run_tasks(tasks, num_tasks, sizeof *tasks, scatter_faces);
+	free(masks);
+
+	/* remove items from parent node */
+	free(node->items);
+	node->items = 0;
+	node->num_items = 0;
 	return 0;
 
 fail:
@@ -369,113 +715,344 @@ fail:
 	return -1;
 }
 
-int build_mesh_octree(struct mesh *m, int max_node_items, int max_depth)
+static int build_octree(struct mesh *mesh, struct octbuild *node, int max_node_items, int max_depth)
 {
 	int i;
 
-	if(m->num_faces <= 0) return -1;
-
-	printf("building octree for mesh with %d faces\n", m->num_faces);
+	if(node->num_items < max_node_items || max_depth <= 0) {
+		return 0;
+	}
 
-	if(!(m->octree = calloc(1, sizeof *m->octree))) {
-		perror("build_octree: failed to allocate root node");
+	if(split_octnode(mesh, node) == -1) {
 		return -1;
 	}
-	calc_mesh_bounds(m, &m->octree->bbox);
 
-	for(i=0; i<m->num_faces; i++) {
-		struct octitem *item;
-
-		if(!(item = malloc(sizeof *item))) {
-			perror("failed to construct face index m->octree->items");
-			while(m->octree->items) {
-				item = m->octree->items;
-				m->octree->items = m->octree->items->next;
-				free(item);
+	/* recurse into all children */
+	for(i=0; i<8; i++) {
+		if(build_octree(mesh, node->child[i], max_node_items, max_depth - 1) == -1) {
+			for(i=0; i<8; i++) {
+				free_octree(node->child[i]);
+				node->child[i] = 0;
 			}
 			return -1;
 		}
-		item->idx = i;
-		item->next = m->octree->items;
-		m->octree->items = item;
 	}
-	m->octree->num_items = m->num_faces;
-
-	build_octree(m, m->octree, max_node_items, max_depth);
+	return 0;
+}
 
-	printf("  height: %d\n", octree_height(m->octree));
-	printf("  max faces/node: %d\n", octree_max_faces(m->octree));
+static void build_subtree(void *cls)
+{
+	struct subtree_task *task = cls;
 
-	return 0;
+	task->failed = build_octree(task->mesh, task->node, task->max_node_items,
+			task->max_depth) == -1;
 }
 
-static int octree_height(struct octnode *n)
+static void count_octree(struct octbuild *node, int *num_nodes, int *num_items)
 {
-	int i, h, maxh = 0;
-	if(!n) return 0;
+	int i;
 
-	for(i=0; i<8; i++) {
-		if((h = octree_height(n->child[i])) > maxh) {
-			maxh = h;
+	*num_items += node->num_items;
+	if(node->child[0]) {
+		*num_nodes += 8;
+		for(i=0; i<8; i++) {
+			count_octree(node->child[i], num_nodes, num_items);
 		}
 	}
-	return maxh + 1;
 }
 
-static int octree_max_faces(struct octnode *n)
+/* writes node to m->octree[nidx], allocating consecutive slots for its children */
+static void flatten_octree(struct mesh *m, struct octbuild *node, int nidx, int *next_node)
 {
-	int i, maxf, num;
+	int i;
+	struct octnode *on = m->octree + nidx;
 
-	if(!n) return 0;
+	on->bbox = node->bbox;
+	on->items = m->num_octitems;
+	on->num_items = node->num_items;
+	on->child = 0;
 
-	maxf = n->num_items;
-	for(i=0; i<8; i++) {
-		if((num = octree_max_faces(n->child[i])) > maxf) {
-			maxf = num;
+	if(node->num_items) {
+		memcpy(m->octitems + m->num_octitems, node->items,
+				node->num_items * sizeof *m->octitems);
+		m->num_octitems += node->num_items;
+	}
+
+	if(node->child[0]) {
+		on->child = *next_node;
+		*next_node += 8;
+		for(i=0; i<8; i++) {
+			flatten_octree(m, node->child[i], on->child + i, next_node);
 		}
 	}
-	return maxf;
 }
 
-
-int dump_mesh(struct mesh *m, const char *fname)
+int build_mesh_octree(struct mesh *m, int max_node_items, int max_depth)
 {
-	int i, j;
-	FILE *fp;
+	int i, j, big, depth, num_nodes, num_items, num_sub = 0, max_sub = 1, res = -1;
+	long t0, build_time;
+	struct octbuild *root, *node;
+	struct subtree_task *sub = 0, *st;
 
+	if(m->num_faces <= 0) return -1;
 
-	if(!(fp = fopen(fname, "wb"))) {
-		fprintf(stderr, "failed to open file: %s: %s\n", fname, strerror(errno));
+	printf("building octree for mesh with %d faces\n", m->num_faces);
+	t0 = get_msec();
+
+	if(!(root = calloc(1, sizeof *root))) {
+		perror("build_octree: failed to allocate root node");
 		return -1;
 	}
-	fprintf(fp, "# OBJ mesh dumped from erebus\n");
+	calc_mesh_bounds(m, &root->bbox);
 
-	for(i=0; i<m->num_faces; i++) {
-		for(j=0; j<3; j++) {
-			fprintf(fp, "v %f %f %f\n", m->faces[i].v[j].x, m->faces[i].v[j].y, m->faces[i].v[j].z);
-		}
+	if(!(root->items = malloc(m->num_faces * sizeof *root->items))) {
+		perror("failed to construct face index root->items");
+		goto end;
 	}
 	for(i=0; i<m->num_faces; i++) {
-		for(j=0; j<3; j++) {
-			fprintf(fp, "vn %f %f %f\n", m->faces[i].n[j].x, m->faces[i].n[j].y, m->faces[i].n[j].z);
+		root->items[i] = i;
+	}
+	root->num_items = m->num_faces;
+
+	if(mesh_tpool && tpool_thread_id(mesh_tpool) < 0) {
+		max_sub = tpool_num_processors() * TASKS_PER_THREAD;
+	}
+	if(!(sub = malloc((max_sub + 7) * sizeof *sub))) {
+		perror("build_octree: failed to allocate subtree tasks");
+		goto end;
+	}
+	sub[0].node = root;
+	sub[0].max_depth = max_depth;
+	num_sub = 1;
+
+	/* keep splitting the largest subtree until there are enough of them */
+	while(num_sub < max_sub) {
+		big = 0;
+		for(i=1; i<num_sub; i++) {
+			if(sub[i].node->num_items > sub[big].node->num_items) {
+				big = i;
+			}
+		}
+		node = sub[big].node;
+		depth = sub[big].max_depth;
+		if(node->num_items < max_node_items || depth <= 0) {
+			break;
+		}
+		if(split_octnode(m, node) == -1) {
+			goto end;
+		}
+		for(j=0; j<8; j++) {
+			st = j ? sub + num_sub++ : sub + big;
+			st->node = node->child[j];
+			st->max_depth = depth - 1;
 		}
 	}
-	for(i=0; i<m->num_faces; i++) {
-		for(j=0; j<3; j++) {
-			fprintf(fp, "vt %f %f\n", m->faces[i].tc[j].x, m->faces[i].tc[j].y);
+
+	for(i=0; i<num_sub; i++) {
+		sub[i].mesh = m;
+		sub[i].max_node_items = max_node_items;
+		sub[i].failed = 0;
+	}
+	run_tasks(sub, num_sub, sizeof *sub, build_subtree);
+	for(i=0; i<num_sub; i++) {
+		if(sub[i].failed) goto end;
+	}
+	build_time = get_msec() - t0;
+
+	num_nodes = 1;
+	num_items = 0;
+	count_octree(root, &num_nodes, &num_items);
+
+	free(m->octree);
+	free(m->octitems);
+	if(!(m->octree = malloc(num_nodes * sizeof *m->octree)) ||
+			!(m->octitems = malloc(num_items * sizeof *m->octitems + 1))) {
+		perror("build_octree: failed to allocate octree arrays");
+		free(m->octree);
+		m->octree = 0;
+		m->octitems = 0;
+		goto end;
+	}
+	m->num_octnodes = 1;
+	m->num_octitems = 0;
+	flatten_octree(m, root, 0, &m->num_octnodes);
+	m->span[0] = 0.0f;
+	m->span[1] = 1.0f;
+
+	printf("  built in %ld ms (%d subtree tasks)\n", build_time, num_sub);
+	printf("  height: %d\n", octree_height(m, 0));
+	printf("  max faces/node: %d\n", octree_max_faces(m, 0));
+	res = 0;
+
+end:
+	free(sub);
+	free_octree(root);
+	return res;
+}
+
+/* ---- octree refitting ----
+ * The node bounds are replaced by the bounds of the faces under them, which
+ * may extend past the cell each node was built for. That's fine, since the
+ * traversal looks for the nearest hit in all children of a node, not just the
+ * first one hit. Empty leaves get empty (inverted) bounds, which rays miss.
+ * Subtrees a few levels below the root are refitted as separate tasks, and
+ * the levels above them afterwards.
+ */
+struct refit_task {
+	struct task_group *grp;
+	struct mesh *mesh;
+	int nidx, start, end;
+};
+
+static void refit_subtree(void *cls)
+{
+	struct refit_task *task = cls;
+	refit_octnode(task->mesh, task->nidx, INT_MAX);
+}
+
+static void calc_range_normals(void *cls)
+{
+	int i;
+	struct refit_task *task = cls;
+
+	for(i=task->start; i<task->end; i++) {
+		calc_face_normal(task->mesh->faces + i);
+	}
+}
+
+/* appends the nodes depth levels below nidx to the nodes array */
+static int collect_octnodes(const struct mesh *m, int nidx, int depth, int *nodes, int num)
+{
+	int i;
+	const struct octnode *on = m->octree + nidx;
+
+	if(depth <= 0) {
+		nodes[num++] = nidx;
+		return num;
+	}
+	if(on->child) {
+		for(i=0; i<8; i++) {
+			num = collect_octnodes(m, on->child + i, depth - 1, nodes, num);
 		}
 	}
+	return num;
+}
 
-	for(i=0; i<m->num_faces; i++) {
-		int idx[3];
+int refit_mesh_octree(struct mesh *m, float t0, float t1)
+{
+	int i, depth, num_tasks;
+	int nodes[MAX_TASKS];
+	struct refit_task tasks[MAX_TASKS];
+
+	if(!m->octree) return -1;
+
+	m->span[0] = t0;
+	m->span[1] = t1;
+
+	/* deforming meshes compute their face normals at the time of each ray */
+	if(!m->end_faces) {
+		num_tasks = num_par_tasks(m->num_faces);
+		for(i=0; i<num_tasks; i++) {
+			tasks[i].mesh = m;
+			tasks[i].start = (long)m->num_faces * i / num_tasks;
+			tasks[i].end = (long)m->num_faces * (i + 1) / num_tasks;
+		}
+		run_tasks(tasks, num_tasks, sizeof *tasks, calc_range_normals);
+	}
 
-		idx[0] = i * 3 + 1;
-		idx[1] = i * 3 + 2;
-		idx[2] = i * 3 + 3;
+	/* deep enough for at least as many subtrees as tasks, up to MAX_TASKS */
+	num_tasks = num_par_tasks(m->num_octitems);
+	depth = 0;
+	while((1 << 3 * depth) < num_tasks && (8 << 3 * depth) <= MAX_TASKS) {
+		depth++;
+	}
+	if(!depth) {
+		refit_octnode(m, 0, INT_MAX);
+		return 0;
+	}
 
-		fprintf(fp, "f %d/%d/%d %d/%d/%d %d/%d/%d\n", idx[0], idx[0], idx[0],
-				idx[1], idx[1], idx[1], idx[2], idx[2], idx[2]);
+	num_tasks = collect_octnodes(m, 0, depth, nodes, 0);
+	for(i=0; i<num_tasks; i++) {
+		tasks[i].mesh = m;
+		tasks[i].nidx = nodes[i];
 	}
-	fclose(fp);
+	run_tasks(tasks, num_tasks, sizeof *tasks, refit_subtree);
+	refit_octnode(m, 0, depth);
 	return 0;
 }
+
+/* recomputes the bounds of a node from its faces, or its children after
+ * refitting them. Nodes more than levels - 1 below it are already refitted.
+ */
+static void refit_octnode(struct mesh *m, int nidx, int levels)
+{
+	int i;
+	struct face buf;
+	struct octnode *on = m->octree + nidx;
+	struct aabox *box = &on->bbox;
+	const struct aabox *cbox;
+	const int *items;
+
+	cgm_vcons(&box->vmin, FLT_MAX, FLT_MAX, FLT_MAX);
+	cgm_vcons(&box->vmax, -FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	if(on->num_items) {
+		/* deforming faces sweep along straight lines, between their positions
+		 * at both ends of the span
+		 */
+		items = m->octitems + on->items;
+		for(i=0; i<on->num_items; i++) {
+			add_face_bounds(box, face_at(m, items[i], m->span[0], &buf));
+			if(m->end_faces) {
+				add_face_bounds(box, face_at(m, items[i], m->span[1], &buf));
+			}
+		}
+		return;
+	}
+
+	if(on->child) {
+		for(i=0; i<8; i++) {
+			if(levels > 1) {
+				refit_octnode(m, on->child + i, levels - 1);
+			}
+			cbox = &m->octree[on->child + i].bbox;
+			box->vmin.x = MIN(box->vmin.x, cbox->vmin.x);
+			box->vmin.y = MIN(box->vmin.y, cbox->vmin.y);
+			box->vmin.z = MIN(box->vmin.z, cbox->vmin.z);
+			box->vmax.x = MAX(box->vmax.x, cbox->vmax.x);
+			box->vmax.y = MAX(box->vmax.y, cbox->vmax.y);
+			box->vmax.z = MAX(box->vmax.z, cbox->vmax.z);
+		}
+	}
+}
+
+static int octree_height(const struct mesh *m, int nidx)
+{
+	int i, h, maxh = 0;
+	const struct octnode *n = m->octree + nidx;
+
+	if(n->child) {
+		for(i=0; i<8; i++) {
+			if((h = octree_height(m, n->child + i)) > maxh) {
+				maxh = h;
+			}
+		}
+	}
+	return maxh + 1;
+}
+
+static int octree_max_faces(const struct mesh *m, int nidx)
+{
+	int i, maxf, num;
+	const struct octnode *n = m->octree + nidx;
+
+	maxf = n->num_items;
+	if(n->child) {
+		for(i=0; i<8; i++) {
+			if((num = octree_max_faces(m, n->child + i)) > maxf) {
+				maxf = num;
+			}
+		}
+	}
+	return maxf;
+}
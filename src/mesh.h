@@ -5,44 +5,174 @@
 #include "aabox.h"
 
 struct surf_hit;
+struct thread_pool;
 
 struct face {
 	cgm_vec3 v[3], n[3], tc[3];
 	cgm_vec3 normal;
+	int mtl;		/* index in the mesh mtlnames array, -1 for none */
 };
 
-struct octitem {
-	int idx;
-	struct octitem *next;
-};
-
+/* octree nodes are stored in a flat array, with the root node first, and
+ * the 8 children of each internal node in consecutive slots. Everything is
+ * referenced by index, so the whole structure can be written to and mapped
+ * from a file as is.
+ */
 struct octnode {
 	struct aabox bbox;
-	struct octitem *items;
+	int child;		/* index of the first child, 0 for leaf nodes */
+	int items;		/* index of the first face index in octitems */
 	int num_items;
-	struct octnode *child[8];
+};
+
+/* compressed copy of the octree and faces of a static mesh, which replaces
+ * them to save memory (meshquant.c). Vertex positions are snapped to a grid
+ * over the mesh bounds, shared by all leaves, so a vertex decodes to the same
+ * position in every face using it, and the surface stays watertight.
+ */
+struct qoctnode {
+	/* bounds in 255ths of the bounds of the parent, rounded outwards, so they
+	 * still contain the whole of every face under the node
+	 */
+	unsigned char bmin[3], bmax[3];
+	unsigned short num_items;	/* faces in leaf nodes */
+	int first;		/* index of the first child, or of the leaf in qleaves */
+};
+
+struct qleaf {
+	int origin[3];	/* grid cell the vertex coordinates of the leaf start from */
+	int first;		/* index of the first triangle in qtris */
+	int verts;		/* index of the first vertex in qverts */
+};
+
+/* leaf vertex position in grid steps from the leaf origin, shared by all the
+ * triangles of the leaf which use it
+ */
+struct qvert {
+	unsigned short v[3];
+};
+
+/* a face as referenced by a leaf, with indices into the leaf vertices */
+struct qtri {
+	int face;		/* index in qfaces */
+	unsigned char v[3];
+};
+
+struct qface {
+	unsigned int n[3];	/* octahedral normals, 16 bits per coordinate */
+	float tc[3][2];
+	int mtl;
+};
+
+struct mesh_quant {
+	struct aabox bbox;		/* bounds of the root node, which aren't quantized */
+	cgm_vec3 grid_org;
+	float grid_step;
+
+	struct qoctnode *nodes;
+	int num_nodes;
+	struct qleaf *leaves;
+	int num_leaves;
+	struct qvert *verts;
+	int num_verts;
+	struct qtri *tris;
+	int num_tris;
+	struct qface *faces;
+	long size;			/* memory used by all of the above */
 };
 
 struct mesh {
 	struct face *faces;
 	int num_faces;
+	/* the same faces at shutter close for deforming meshes, or null. Vertex
+	 * positions and normals are interpolated with the ray time, and the octree
+	 * is built over the space swept by each face. Never part of a mesh cache.
+	 */
+	struct face *end_faces;
+	/* part of the deformation covered by the octree node bounds, from 0 at
+	 * shutter open to 1 at close, see refit_mesh_octree
+	 */
+	float span[2];
 
 	struct octnode *octree;
+	int num_octnodes;
+	int *octitems;	/* face indices of all leaf nodes */
+	int num_octitems;
+
+	/* material names used by the faces, and the material libraries which
+	 * should define them, relative to the mesh file. Not part of the cache
+	 * mapping, these are always allocated separately.
+	 */
+	char **mtlnames;
+	int num_mtls;
+	char **mtllibs;
+	int num_mtllibs;
+
+	void *cache_map;	/* if loaded from a mesh cache, owns the arrays above */
+	long cache_size;
+
+	/* if compressed by quantize_mesh, replaces faces and the octree, which are
+	 * freed. num_faces and the material names are kept.
+	 */
+	struct mesh_quant *quant;
+
+	/* set by place_mesh, if the arrays above are allocated with bigmem_alloc.
+	 * With the replicate policy, replicas holds copies of the mesh on every
+	 * other NUMA node, indexed by node, and rays use the copy on their node.
+	 */
+	int placed;
+	struct mesh **replicas;
 
 	cgm_vec3 im_norm, im_tc;	/* immedate mode construction state */
 };
 
+/* mesh geometry loaded on demand from its mesh cache, and evicted again when
+ * the geometry memory budget is exceeded (lazymesh.c)
+ */
+struct lazy_mesh {
+	char *path;
+	struct mesh m;		/* valid while resident */
+	struct aabox bbox;	/* bounds of the geometry, always valid */
+	long size;			/* memory used while resident */
+	int max_node_items, max_depth;
+
+	int users;		/* number of rays using the geometry, -1 while not resident */
+	int loading;	/* being loaded by a thread, with the lock released */
+	int failed;		/* don't keep retrying meshes which failed to load */
+	unsigned int last_use;
+
+	struct lazy_mesh *next;
+};
+
 void init_mesh(struct mesh *m);
 void clear_mesh(struct mesh *m);
 
+/* optional thread pool used by load_mesh to parse large files in parallel */
+void set_mesh_thread_pool(struct thread_pool *tpool);
+struct thread_pool *get_mesh_thread_pool(void);
+
 int load_mesh(struct mesh *m, const char *fname);
 int dump_mesh(struct mesh *m, const char *fname);
 
 void calc_face_normal(struct face *f);
 void calc_mesh_bounds(const struct mesh *m, struct aabox *aabb);
 
-int find_mesh_isect(const struct mesh *m, const float *inv_xform,
-		const cgm_ray *ray, struct surf_hit *hit);
+/* returns the distance to the triangle v[0] v[1] v[2], and the barycentric
+ * coordinates of the hit in bary, or -1 if the ray misses it
+ */
+float ray_triangle(const cgm_ray *ray, const cgm_vec3 *v, cgm_vec3 *bary);
+
+/* lray is the ray in mesh space, and ray the same ray in world space, which is
+ * used for the hit position. time is only used by deforming meshes.
+ */
+int find_mesh_isect(const struct mesh *m, const cgm_ray *lray, const cgm_ray *ray,
+		float time, struct surf_hit *hit);
+
+/* makes the mesh deform from its current faces to those of end, which must
+ * have the same number of faces, in the same order. Takes the faces of end.
+ * Call before building the octree.
+ */
+int set_mesh_deform(struct mesh *m, struct mesh *end);
 
 int begin_mesh(struct mesh *m);
 void end_mesh(struct mesh *m);
@@ -52,5 +182,75 @@ void mesh_texcoord(struct mesh *m, float u, float v);
 
 /* max_depth takes precedence over max_node_items */
 int build_mesh_octree(struct mesh *m, int max_node_items, int max_depth);
+/* updates the octree node bounds in place after the face vertices moved,
+ * keeping the structure of the tree, and recomputes the face normals. The
+ * node bounds of deforming meshes are fitted to the part of the deformation
+ * between times t0 and t1 instead, which is ignored otherwise. Nodes overlap
+ * more as the faces move further from where the octree was built, so rebuild
+ * it after large changes.
+ */
+int refit_mesh_octree(struct mesh *m, float t0, float t1);
+
+/* quantize_mesh compresses a static mesh with an octree, for meshes loaded
+ * while set_mesh_quantize is enabled. Returns -1 and leaves the mesh as it was
+ * if the mesh can't be compressed.
+ */
+void set_mesh_quantize(int enable);
+int get_mesh_quantize(void);
+int quantize_mesh(struct mesh *m);
+void free_mesh_quant(struct mesh_quant *q);
+int find_qmesh_isect(const struct mesh_quant *q, const cgm_ray *lray, const cgm_ray *ray,
+		struct surf_hit *hit);
+
+/* moves the faces and octree, or their quantized copy, of a static mesh to
+ * memory allocated according to the bigmem page size and placement policy
+ * (meshplace.c). Does nothing with the default settings.
+ */
+int place_mesh(struct mesh *m);
+void free_placed_mesh(struct mesh *m);
+
+/* square root of the ratio of the texture space and object space areas of a
+ * triangle, used to scale ray footprints to texture space
+ */
+float tri_uvscale(const cgm_vec3 *v, const cgm_vec3 *tc);
+
+/* val * 10^exp, the way the OBJ loader converts decimal numbers, which
+ * dump_mesh relies on to write numbers that read back the same (meshload.c)
+ */
+double pow10_scale(double val, int exp);
+
+/* binary cache of a loaded mesh and its octree, stored next to the source
+ * file, and keyed by the source file contents and octree build parameters.
+ * load_mesh_cache returns -1 if the cache is missing or stale.
+ */
+int load_mesh_cache(struct mesh *m, const char *fname, int max_node_items, int max_depth);
+int save_mesh_cache(const struct mesh *m, const char *fname, int max_node_items, int max_depth);
+/* like load_mesh_cache, but only checks the size and modification time of the
+ * source, instead of hashing it
+ */
+int map_mesh_cache(struct mesh *m, const char *fname, int max_node_items, int max_depth);
+/* loads just the material names into m, and returns the mesh bounds and the
+ * size of the cache, if the cache is up to date. Checks the source like
+ * map_mesh_cache.
+ */
+int load_mesh_cache_info(struct mesh *m, const char *fname, int max_node_items, int max_depth,
+		struct aabox *bbox, long *size);
+
+/* geometry memory budget for lazy meshes, 0 disables lazy loading */
+void set_geom_budget(int mbytes);
+int get_geom_budget(void);
+
+/* registers a mesh with an up to date mesh cache, see load_mesh_cache_info.
+ * The geometry isn't loaded until the first call to acquire_lazy_mesh.
+ */
+struct lazy_mesh *create_lazy_mesh(const char *path, const struct aabox *bbox, long size,
+		int max_node_items, int max_depth);
+void free_lazy_mesh(struct lazy_mesh *lm);
+
+/* returns the geometry, loading it if necessary, or null on failure. The
+ * geometry stays resident until the matching release_lazy_mesh call.
+ */
+const struct mesh *acquire_lazy_mesh(struct lazy_mesh *lm);
+void release_lazy_mesh(struct lazy_mesh *lm);
 
 #endif	/* MESH_H_ */
@@ -0,0 +1,519 @@
+/* binary mesh cache
+ *
+ * The cache file holds the processed face array and the flattened octree,
+ * each aligned to CACHE_ALIGN bytes. Nothing in there is a pointer, so the
+ * file is mapped in one go, and the mesh arrays point straight into the
+ * mapping. The mapping is private and writable, so the mesh can still be
+ * modified in memory without affecting the file.
+ *
+ * The material library and material names follow, as consecutive
+ * null-terminated strings. These are copied out of the mapping.
+ *
+ * Lazily loaded meshes read just the header, the octree root bounds and the
+ * material names up front, with load_mesh_cache_info, and map the rest when
+ * first needed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "mesh.h"
+
+#define CACHE_MAGIC		"EREBUSMC"
+#define CACHE_VERSION	3
+#define CACHE_ALIGN		64
+
+struct cache_header {
+	char magic[8];
+	uint32_t version, hdr_size;
+	uint32_t face_size, node_size;	/* catch layout changes */
+	uint64_t src_hash, src_size, src_mtime;
+	int32_t max_node_items, max_depth;
+	int32_t num_faces, num_octnodes, num_octitems, padding;
+	int32_t num_mtls, num_mtllibs;
+	uint64_t faces_offs, nodes_offs, items_offs;
+	uint64_t strs_offs, strs_size;
+	uint64_t file_size;
+};
+
+static int map_cache(struct mesh *m, const char *fname, int max_node_items, int max_depth,
+		int verify_hash);
+static int check_header(const struct cache_header *hdr, uint64_t file_size, int max_node_items,
+		int max_depth, const char *cfname);
+static int check_source(const struct cache_header *hdr, const char *fname, int verify_hash,
+		const char *cfname);
+static int check_data(const struct cache_header *hdr, const unsigned char *data,
+		const char *cfname);
+static char *cache_filename(const char *fname);
+static int hash_file(const char *fname, uint64_t *hash, uint64_t *size);
+static void init_header(struct cache_header *hdr, const struct mesh *m, int max_node_items,
+		int max_depth);
+static int pad_file(FILE *fp, uint64_t offs);
+static int read_strings(char ***res, int num, const char **ptr, const char *end);
+static int write_strings(FILE *fp, char **strs, int num);
+static void free_strings(char **strs, int num);
+
+int load_mesh_cache(struct mesh *m, const char *fname, int max_node_items, int max_depth)
+{
+	return map_cache(m, fname, max_node_items, max_depth, 1);
+}
+
+int map_mesh_cache(struct mesh *m, const char *fname, int max_node_items, int max_depth)
+{
+	return map_cache(m, fname, max_node_items, max_depth, 0);
+}
+
+int load_mesh_cache_info(struct mesh *m, const char *fname, int max_node_items, int max_depth,
+		struct aabox *bbox, long *size)
+{
+	int fd;
+	char *cfname, *strs = 0, **mtlnames = 0, **mtllibs = 0;
+	const char *sptr;
+	struct stat st;
+	struct cache_header hdr;
+	struct octnode root;
+
+	if(!(cfname = cache_filename(fname))) {
+		return -1;
+	}
+	if((fd = open(cfname, O_RDONLY)) == -1) {
+		free(cfname);
+		return -1;
+	}
+	if(fstat(fd, &st) == -1 || read(fd, &hdr, sizeof hdr) != sizeof hdr ||
+			check_header(&hdr, st.st_size, max_node_items, max_depth, cfname) == -1 ||
+			check_source(&hdr, fname, 0, cfname) == -1) {
+		goto err;
+	}
+
+	if(pread(fd, &root, sizeof root, hdr.nodes_offs) != sizeof root ||
+			!(strs = malloc(hdr.strs_size + 1)) ||
+			pread(fd, strs, hdr.strs_size, hdr.strs_offs) != hdr.strs_size) {
+		fprintf(stderr, "load_mesh_cache_info: failed to read %s\n", cfname);
+		goto err;
+	}
+	sptr = strs;
+	if(read_strings(&mtllibs, hdr.num_mtllibs, &sptr, strs + hdr.strs_size) == -1 ||
+			read_strings(&mtlnames, hdr.num_mtls, &sptr, strs + hdr.strs_size) == -1) {
+		fprintf(stderr, "load_mesh_cache_info: failed to read material names: %s\n", cfname);
+		free_strings(mtllibs, mtllibs ? hdr.num_mtllibs : 0);
+		goto err;
+	}
+
+	clear_mesh(m);
+	m->mtlnames = mtlnames;
+	m->num_mtls = hdr.num_mtls;
+	m->mtllibs = mtllibs;
+	m->num_mtllibs = hdr.num_mtllibs;
+
+	*bbox = root.bbox;
+	*size = st.st_size;
+
+	free(strs);
+	close(fd);
+	free(cfname);
+	return 0;
+
+err:
+	free(strs);
+	close(fd);
+	free(cfname);
+	return -1;
+}
+
+static int map_cache(struct mesh *m, const char *fname, int max_node_items, int max_depth,
+		int verify_hash)
+{
+	int fd;
+	char *cfname, **mtlnames = 0, **mtllibs = 0;
+	const char *sptr, *send;
+	struct stat st;
+	struct cache_header *hdr;
+	unsigned char *data;
+
+	if(!(cfname = cache_filename(fname))) {
+		return -1;
+	}
+	if((fd = open(cfname, O_RDONLY)) == -1) {
+		free(cfname);
+		return -1;
+	}
+	if(fstat(fd, &st) == -1 || st.st_size < sizeof *hdr) {
+		close(fd);
+		free(cfname);
+		return -1;
+	}
+	data = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == (void*)-1) {
+		free(cfname);
+		return -1;
+	}
+	hdr = (struct cache_header*)data;
+
+	if(check_header(hdr, st.st_size, max_node_items, max_depth, cfname) == -1 ||
+			check_source(hdr, fname, verify_hash, cfname) == -1 ||
+			check_data(hdr, data, cfname) == -1) {
+		goto stale;
+	}
+
+	sptr = (char*)data + hdr->strs_offs;
+	send = sptr + hdr->strs_size;
+	if(read_strings(&mtllibs, hdr->num_mtllibs, &sptr, send) == -1 ||
+			read_strings(&mtlnames, hdr->num_mtls, &sptr, send) == -1) {
+		fprintf(stderr, "load_mesh_cache: failed to read material names: %s\n", cfname);
+		free_strings(mtllibs, mtllibs ? hdr->num_mtllibs : 0);
+		goto stale;
+	}
+
+	clear_mesh(m);
+	m->mtlnames = mtlnames;
+	m->num_mtls = hdr->num_mtls;
+	m->mtllibs = mtllibs;
+	m->num_mtllibs = hdr->num_mtllibs;
+	m->faces = (struct face*)(data + hdr->faces_offs);
+	m->num_faces = hdr->num_faces;
+	m->octree = (struct octnode*)(data + hdr->nodes_offs);
+	m->num_octnodes = hdr->num_octnodes;
+	m->octitems = (int*)(data + hdr->items_offs);
+	m->num_octitems = hdr->num_octitems;
+	m->cache_map = data;
+	m->cache_size = st.st_size;
+
+	if(verify_hash) {
+		printf("loaded mesh cache: %s: %d faces, %d octree nodes\n", cfname, m->num_faces,
+				m->num_octnodes);
+	}
+	free(cfname);
+	return 0;
+
+stale:
+	munmap(data, st.st_size);
+	free(cfname);
+	return -1;
+}
+
+static int check_header(const struct cache_header *hdr, uint64_t file_size, int max_node_items,
+		int max_depth, const char *cfname)
+{
+	uint64_t faces_size, nodes_size, items_size;
+
+	if(file_size < sizeof *hdr || memcmp(hdr->magic, CACHE_MAGIC, sizeof hdr->magic) != 0 ||
+			hdr->version != CACHE_VERSION || hdr->hdr_size != sizeof *hdr ||
+			hdr->face_size != sizeof(struct face) || hdr->node_size != sizeof(struct octnode) ||
+			hdr->file_size != file_size) {
+		fprintf(stderr, "load_mesh_cache: ignoring invalid cache file: %s\n", cfname);
+		return -1;
+	}
+	if(hdr->max_node_items != max_node_items || hdr->max_depth != max_depth) {
+		return -1;
+	}
+
+	faces_size = (uint64_t)hdr->num_faces * sizeof(struct face);
+	nodes_size = (uint64_t)hdr->num_octnodes * sizeof(struct octnode);
+	items_size = (uint64_t)hdr->num_octitems * sizeof(int);
+	if(hdr->num_faces <= 0 || hdr->num_octnodes <= 0 || hdr->num_octitems < 0 ||
+			hdr->faces_offs + faces_size > hdr->file_size ||
+			hdr->nodes_offs + nodes_size > hdr->file_size ||
+			hdr->items_offs + items_size > hdr->file_size ||
+			hdr->num_mtls < 0 || hdr->num_mtllibs < 0 ||
+			hdr->strs_offs + hdr->strs_size > hdr->file_size) {
+		fprintf(stderr, "load_mesh_cache: ignoring corrupted cache file: %s\n", cfname);
+		return -1;
+	}
+	return 0;
+}
+
+/* everything indexed during traversal has to be in range, because the mesh
+ * arrays are used straight from the file. Children are stored after their
+ * parents, so a corrupted octree can't loop either.
+ */
+static int check_data(const struct cache_header *hdr, const unsigned char *data,
+		const char *cfname)
+{
+	int i;
+	const struct face *faces = (const struct face*)(data + hdr->faces_offs);
+	const struct octnode *nodes = (const struct octnode*)(data + hdr->nodes_offs);
+	const int *items = (const int*)(data + hdr->items_offs);
+
+	for(i=0; i<hdr->num_octnodes; i++) {
+		if(nodes[i].child && (nodes[i].child <= i ||
+					nodes[i].child > hdr->num_octnodes - 8)) {
+			goto inval;
+		}
+		if(nodes[i].items < 0 || nodes[i].num_items < 0 ||
+				nodes[i].num_items > hdr->num_octitems - nodes[i].items) {
+			goto inval;
+		}
+	}
+	for(i=0; i<hdr->num_octitems; i++) {
+		if(items[i] < 0 || items[i] >= hdr->num_faces) {
+			goto inval;
+		}
+	}
+	for(i=0; i<hdr->num_faces; i++) {
+		if(faces[i].mtl < -1 || faces[i].mtl >= hdr->num_mtls) {
+			goto inval;
+		}
+	}
+	return 0;
+
+inval:
+	fprintf(stderr, "load_mesh_cache: ignoring corrupted cache file: %s\n", cfname);
+	return -1;
+}
+
+/* hashing the source is the safe way to detect changes, but for huge meshes
+ * loaded lazily it defeats the purpose, so these only check the source size
+ * and modification time
+ */
+static int check_source(const struct cache_header *hdr, const char *fname, int verify_hash,
+		const char *cfname)
+{
+	struct stat st;
+	uint64_t hash, size;
+
+	if(verify_hash) {
+		if(hash_file(fname, &hash, &size) == -1 || hash != hdr->src_hash ||
+				size != hdr->src_size) {
+			printf("mesh cache %s is out of date\n", cfname);
+			return -1;
+		}
+	} else {
+		if(stat(fname, &st) == -1 || st.st_size != hdr->src_size ||
+				st.st_mtime != hdr->src_mtime) {
+			printf("mesh cache %s is out of date\n", cfname);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int save_mesh_cache(const struct mesh *m, const char *fname, int max_node_items, int max_depth)
+{
+	FILE *fp;
+	char *cfname, *tmpname;
+	struct cache_header hdr;
+	struct stat st;
+
+	if(!m->octree || m->num_faces <= 0) {
+		return -1;
+	}
+
+	init_header(&hdr, m, max_node_items, max_depth);
+	if(hash_file(fname, &hdr.src_hash, &hdr.src_size) == -1 || stat(fname, &st) == -1) {
+		return -1;
+	}
+	hdr.src_mtime = st.st_mtime;
+
+	if(!(cfname = cache_filename(fname))) {
+		return -1;
+	}
+	if(!(tmpname = malloc(strlen(cfname) + 5))) {
+		free(cfname);
+		return -1;
+	}
+	sprintf(tmpname, "%s.tmp", cfname);
+
+	/* write to a temporary file first, and rename it when complete, to avoid
+	 * leaving a partially written cache behind, or overwriting one which is
+	 * currently mapped by another process.
+	 */
+	if(!(fp = fopen(tmpname, "wb"))) {
+		fprintf(stderr, "save_mesh_cache: failed to open %s for writing\n", tmpname);
+		goto err;
+	}
+
+	if(fwrite(&hdr, sizeof hdr, 1, fp) != 1 ||
+			pad_file(fp, hdr.faces_offs) == -1 ||
+			fwrite(m->faces, sizeof *m->faces, m->num_faces, fp) != m->num_faces ||
+			pad_file(fp, hdr.nodes_offs) == -1 ||
+			fwrite(m->octree, sizeof *m->octree, m->num_octnodes, fp) != m->num_octnodes ||
+			pad_file(fp, hdr.items_offs) == -1 ||
+			fwrite(m->octitems, sizeof *m->octitems, m->num_octitems, fp) != m->num_octitems ||
+			pad_file(fp, hdr.strs_offs) == -1 ||
+			write_strings(fp, m->mtllibs, m->num_mtllibs) == -1 ||
+			write_strings(fp, m->mtlnames, m->num_mtls) == -1) {
+		fprintf(stderr, "save_mesh_cache: failed to write %s\n", tmpname);
+		fclose(fp);
+		remove(tmpname);
+		goto err;
+	}
+	if(fclose(fp) != 0 || rename(tmpname, cfname) == -1) {
+		fprintf(stderr, "save_mesh_cache: failed to write %s\n", cfname);
+		remove(tmpname);
+		goto err;
+	}
+
+	printf("saved mesh cache: %s\n", cfname);
+	free(tmpname);
+	free(cfname);
+	return 0;
+
+err:
+	free(tmpname);
+	free(cfname);
+	return -1;
+}
+
+static char *cache_filename(const char *fname)
+{
+	char *cfname;
+
+	if(!(cfname = malloc(strlen(fname) + 7))) {
+		return 0;
+	}
+	sprintf(cfname, "%s.cache", fname);
+	return cfname;
+}
+
+#define ALIGN_OFFS(x)	(((x) + CACHE_ALIGN - 1) & ~(uint64_t)(CACHE_ALIGN - 1))
+
+static void init_header(struct cache_header *hdr, const struct mesh *m, int max_node_items,
+		int max_depth)
+{
+	int i;
+
+	memset(hdr, 0, sizeof *hdr);
+	memcpy(hdr->magic, CACHE_MAGIC, sizeof hdr->magic);
+	hdr->version = CACHE_VERSION;
+	hdr->hdr_size = sizeof *hdr;
+	hdr->face_size = sizeof *m->faces;
+	hdr->node_size = sizeof *m->octree;
+	hdr->max_node_items = max_node_items;
+	hdr->max_depth = max_depth;
+	hdr->num_faces = m->num_faces;
+	hdr->num_octnodes = m->num_octnodes;
+	hdr->num_octitems = m->num_octitems;
+	hdr->num_mtls = m->num_mtls;
+	hdr->num_mtllibs = m->num_mtllibs;
+
+	hdr->faces_offs = ALIGN_OFFS(sizeof *hdr);
+	hdr->nodes_offs = ALIGN_OFFS(hdr->faces_offs + m->num_faces * sizeof *m->faces);
+	hdr->items_offs = ALIGN_OFFS(hdr->nodes_offs + m->num_octnodes * sizeof *m->octree);
+	hdr->strs_offs = ALIGN_OFFS(hdr->items_offs + m->num_octitems * sizeof *m->octitems);
+	hdr->strs_size = 0;
+	for(i=0; i<m->num_mtllibs; i++) {
+		hdr->strs_size += strlen(m->mtllibs[i]) + 1;
+	}
+	for(i=0; i<m->num_mtls; i++) {
+		hdr->strs_size += strlen(m->mtlnames[i]) + 1;
+	}
+	hdr->file_size = hdr->strs_offs + hdr->strs_size;
+}
+
+/* write zeros up to the next section offset */
+static int pad_file(FILE *fp, uint64_t offs)
+{
+	static const char zeros[CACHE_ALIGN];
+	long cur = ftell(fp);
+
+	if(cur < 0 || cur > offs || offs - cur > CACHE_ALIGN) {
+		return -1;
+	}
+	if(fwrite(zeros, 1, offs - cur, fp) != offs - cur) {
+		return -1;
+	}
+	return 0;
+}
+
+/* copies num consecutive strings into a newly allocated array */
+static int read_strings(char ***res, int num, const char **ptr, const char *end)
+{
+	int i, len;
+	char **strs;
+
+	if(!(strs = malloc(num * sizeof *strs + 1))) {
+		return -1;
+	}
+	for(i=0; i<num; i++) {
+		len = strnlen(*ptr, end - *ptr);
+		if(*ptr + len >= end || !(strs[i] = malloc(len + 1))) {
+			free_strings(strs, i);
+			return -1;
+		}
+		memcpy(strs[i], *ptr, len + 1);
+		*ptr += len + 1;
+	}
+	*res = strs;
+	return 0;
+}
+
+static void free_strings(char **strs, int num)
+{
+	int i;
+
+	for(i=0; i<num; i++) {
+		free(strs[i]);
+	}
+	free(strs);
+}
+
+static int write_strings(FILE *fp, char **strs, int num)
+{
+	int i;
+
+	for(i=0; i<num; i++) {
+		if(fwrite(strs[i], 1, strlen(strs[i]) + 1, fp) != strlen(strs[i]) + 1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* 64bit FNV-1a variant over 8-byte words, with 4 independent lanes to avoid
+ * being limited by the multiply latency. This only needs to detect changes
+ * to the source file, not resist deliberate collisions.
+ */
+#define FNV_OFFS	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+static int hash_file(const char *fname, uint64_t *hash, uint64_t *size)
+{
+	int i, fd;
+	struct stat st;
+	unsigned char *data;
+	uint64_t h[4] = {FNV_OFFS, FNV_OFFS ^ 1, FNV_OFFS ^ 2, FNV_OFFS ^ 3};
+	uint64_t w[4], res, offs = 0;
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		return -1;
+	}
+	if(fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+	*size = st.st_size;
+
+	if(st.st_size > 0) {
+		if((data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == (void*)-1) {
+			close(fd);
+			return -1;
+		}
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+		while(offs + sizeof w <= st.st_size) {
+			memcpy(w, data + offs, sizeof w);
+			for(i=0; i<4; i++) {
+				h[i] = (h[i] ^ w[i]) * FNV_PRIME;
+			}
+			offs += sizeof w;
+		}
+		while(offs < st.st_size) {
+			h[0] = (h[0] ^ data[offs++]) * FNV_PRIME;
+		}
+		munmap(data, st.st_size);
+	}
+	close(fd);
+
+	res = FNV_OFFS;
+	for(i=0; i<4; i++) {
+		res = (res ^ h[i]) * FNV_PRIME;
+	}
+	*hash = res;
+	return 0;
+}
@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include "mesh.h"
+
+#define OUTBUF_SIZE		(1 << 20)
+
+/* buffered output, to keep the number of stdio calls down */
+struct outbuf {
+	FILE *fp;
+	char *buf;
+	int len;
+	int err;
+};
+
+/* hash table of unique vertex attributes. Each element is a fixed number of
+ * floats, compared bitwise. The table is sized for the worst case up front,
+ * so it never needs to grow.
+ */
+struct attr_table {
+	int elem_size;		/* floats per element */
+	float *elems;
+	int num_elems;
+	int *slots;			/* element index + 1, or 0 for empty slots */
+	unsigned int mask;
+};
+
+static int dump_obj(struct mesh *m, struct outbuf *ob);
+static int dump_ply(struct mesh *m, struct outbuf *ob);
+
+static int init_attr_table(struct attr_table *tab, int elem_size, int max_elems);
+static void destroy_attr_table(struct attr_table *tab);
+static int attr_index(struct attr_table *tab, const float *val, int *is_new);
+
+static void ob_write(struct outbuf *ob, const void *data, int size);
+static void ob_flush(struct outbuf *ob);
+static char *ob_reserve(struct outbuf *ob, int size);
+static int format_int(char *buf, int x);
+static int format_float(char *buf, float x);
+
+/* Writes the mesh as an OBJ file, or as a binary PLY file if the filename
+ * ends in .ply. Identical positions, normals and texcoords are written once.
+ */
+int dump_mesh(struct mesh *m, const char *fname)
+{
+	int res;
+	const char *suffix;
+	struct outbuf ob;
+
+	if(m->quant) {
+		fprintf(stderr, "dump_mesh: can't dump quantized mesh: %s\n", fname);
+		return -1;
+	}
+
+	if(!(ob.fp = fopen(fname, "wb"))) {
+		fprintf(stderr, "failed to open file: %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	if(!(ob.buf = malloc(OUTBUF_SIZE))) {
+		fprintf(stderr, "dump_mesh: failed to allocate output buffer\n");
+		fclose(ob.fp);
+		return -1;
+	}
+	ob.len = 0;
+	ob.err = 0;
+
+	if((suffix = strrchr(fname, '.')) && strcasecmp(suffix, ".ply") == 0) {
+		res = dump_ply(m, &ob);
+	} else {
+		res = dump_obj(m, &ob);
+	}
+	ob_flush(&ob);
+
+	if(fclose(ob.fp) != 0 || ob.err) {
+		fprintf(stderr, "dump_mesh: failed to write %s\n", fname);
+		res = -1;
+	}
+	free(ob.buf);
+	return res;
+}
+
+static void write_obj_attr(struct outbuf *ob, const char *prefix, const float *val, int count)
+{
+	int i;
+	char *ptr = ob_reserve(ob, 64);
+
+	while(*prefix) *ptr++ = *prefix++;
+	for(i=0; i<count; i++) {
+		if(i) *ptr++ = ' ';
+		ptr += format_float(ptr, val[i]);
+	}
+	*ptr++ = '\n';
+	ob->len = ptr - ob->buf;
+}
+
+static void write_obj_name(struct outbuf *ob, const char *prefix, const char *name)
+{
+	ob_write(ob, prefix, strlen(prefix));
+	ob_write(ob, name, strlen(name));
+	ob_write(ob, "\n", 1);
+}
+
+/* Elements are written as soon as they are first referenced, followed by the
+ * face using them, so the file is produced in a single pass over the faces.
+ */
+static int dump_obj(struct mesh *m, struct outbuf *ob)
+{
+	int i, j, is_new, idx[3][3], cur_mtl = -1;
+	char *ptr;
+	struct face *f;
+	struct attr_table vtab, ntab, ttab;
+	static const char hdr[] = "# OBJ mesh dumped from erebus\n";
+
+	memset(&vtab, 0, sizeof vtab);
+	memset(&ntab, 0, sizeof ntab);
+	if(init_attr_table(&vtab, 3, m->num_faces * 3) == -1 ||
+			init_attr_table(&ntab, 3, m->num_faces * 3) == -1 ||
+			init_attr_table(&ttab, 2, m->num_faces * 3) == -1) {
+		fprintf(stderr, "dump_mesh: failed to allocate vertex tables\n");
+		destroy_attr_table(&vtab);
+		destroy_attr_table(&ntab);
+		return -1;
+	}
+
+	ob_write(ob, hdr, sizeof hdr - 1);
+	for(i=0; i<m->num_mtllibs; i++) {
+		write_obj_name(ob, "mtllib ", m->mtllibs[i]);
+	}
+
+	f = m->faces;
+	for(i=0; i<m->num_faces; i++) {
+		if(f->mtl != cur_mtl && f->mtl >= 0 && f->mtl < m->num_mtls) {
+			write_obj_name(ob, "usemtl ", m->mtlnames[f->mtl]);
+			cur_mtl = f->mtl;
+		}
+		for(j=0; j<3; j++) {
+			idx[j][0] = attr_index(&vtab, &f->v[j].x, &is_new);
+			if(is_new) write_obj_attr(ob, "v ", &f->v[j].x, 3);
+
+			idx[j][1] = attr_index(&ttab, &f->tc[j].x, &is_new);
+			if(is_new) write_obj_attr(ob, "vt ", &f->tc[j].x, 2);
+
+			idx[j][2] = attr_index(&ntab, &f->n[j].x, &is_new);
+			if(is_new) write_obj_attr(ob, "vn ", &f->n[j].x, 3);
+		}
+
+		ptr = ob_reserve(ob, 128);
+		*ptr++ = 'f';
+		for(j=0; j<3; j++) {
+			*ptr++ = ' ';
+			ptr += format_int(ptr, idx[j][0] + 1);
+			*ptr++ = '/';
+			ptr += format_int(ptr, idx[j][1] + 1);
+			*ptr++ = '/';
+			ptr += format_int(ptr, idx[j][2] + 1);
+		}
+		*ptr++ = '\n';
+		ob->len = ptr - ob->buf;
+		f++;
+	}
+
+	destroy_attr_table(&vtab);
+	destroy_attr_table(&ntab);
+	destroy_attr_table(&ttab);
+	return 0;
+}
+
+/* binary PLY with one vertex element per unique position/normal/texcoord
+ * combination. The vertex count goes in the header, so vertices are
+ * de-duplicated in a first pass, and written out after it.
+ */
+static int dump_ply(struct mesh *m, struct outbuf *ob)
+{
+	int i, j, is_new, *fvidx;
+	char hdr[512];
+	unsigned char *fbuf;
+	struct attr_table tab;
+	static const int one = 1;
+
+	fvidx = 0;
+	if(init_attr_table(&tab, 8, m->num_faces * 3) == -1 ||
+			!(fvidx = malloc(m->num_faces * 3 * sizeof *fvidx + 1))) {
+		fprintf(stderr, "dump_mesh: failed to allocate vertex table\n");
+		destroy_attr_table(&tab);
+		return -1;
+	}
+
+	for(i=0; i<m->num_faces; i++) {
+		struct face *f = m->faces + i;
+		for(j=0; j<3; j++) {
+			float vert[8];
+			vert[0] = f->v[j].x;
+			vert[1] = f->v[j].y;
+			vert[2] = f->v[j].z;
+			vert[3] = f->n[j].x;
+			vert[4] = f->n[j].y;
+			vert[5] = f->n[j].z;
+			vert[6] = f->tc[j].x;
+			vert[7] = f->tc[j].y;
+			fvidx[i * 3 + j] = attr_index(&tab, vert, &is_new);
+		}
+	}
+
+	sprintf(hdr, "ply\nformat %s 1.0\ncomment PLY mesh dumped from erebus\n"
+			"element vertex %d\nproperty float x\nproperty float y\nproperty float z\n"
+			"property float nx\nproperty float ny\nproperty float nz\n"
+			"property float s\nproperty float t\n"
+			"element face %d\nproperty list uchar int vertex_indices\nend_header\n",
+			*(char*)&one ? "binary_little_endian" : "binary_big_endian",
+			tab.num_elems, m->num_faces);
+	ob_write(ob, hdr, strlen(hdr));
+
+	/* both elements are written in the native byte order */
+	ob_write(ob, tab.elems, tab.num_elems * 8 * sizeof *tab.elems);
+
+	for(i=0; i<m->num_faces; i++) {
+		fbuf = (unsigned char*)ob_reserve(ob, 1 + 3 * sizeof *fvidx);
+		*fbuf = 3;
+		memcpy(fbuf + 1, fvidx + i * 3, 3 * sizeof *fvidx);
+		ob->len += 1 + 3 * sizeof *fvidx;
+	}
+
+	free(fvidx);
+	destroy_attr_table(&tab);
+	return 0;
+}
+
+
+static int init_attr_table(struct attr_table *tab, int elem_size, int max_elems)
+{
+	unsigned int sz = 64;
+
+	while(sz < max_elems * 2) sz <<= 1;
+
+	tab->elem_size = elem_size;
+	tab->num_elems = 0;
+	tab->mask = sz - 1;
+	tab->slots = calloc(sz, sizeof *tab->slots);
+	tab->elems = malloc(max_elems * elem_size * sizeof *tab->elems + 1);
+
+	if(!tab->slots || !tab->elems) {
+		destroy_attr_table(tab);
+		return -1;
+	}
+	return 0;
+}
+
+static void destroy_attr_table(struct attr_table *tab)
+{
+	free(tab->slots);
+	free(tab->elems);
+	tab->slots = 0;
+	tab->elems = 0;
+}
+
+static int attr_index(struct attr_table *tab, const float *val, int *is_new)
+{
+	int i, idx;
+	unsigned int bits, h = 2166136261u, slot;
+	size_t size = tab->elem_size * sizeof *val;
+
+	for(i=0; i<tab->elem_size; i++) {
+		memcpy(&bits, val + i, sizeof bits);
+		h = (h ^ bits) * 16777619u;
+	}
+	h ^= h >> 15;
+
+	/* linear probing */
+	slot = h & tab->mask;
+	while((idx = tab->slots[slot])) {
+		if(memcmp(tab->elems + (idx - 1) * tab->elem_size, val, size) == 0) {
+			*is_new = 0;
+			return idx - 1;
+		}
+		slot = (slot + 1) & tab->mask;
+	}
+
+	idx = tab->num_elems++;
+	memcpy(tab->elems + idx * tab->elem_size, val, size);
+	tab->slots[slot] = idx + 1;
+	*is_new = 1;
+	return idx;
+}
+
+
+static void ob_write(struct outbuf *ob, const void *data, int size)
+{
+	if(ob->len + size > OUTBUF_SIZE) {
+		ob_flush(ob);
+		if(size > OUTBUF_SIZE) {
+			if(fwrite(data, 1, size, ob->fp) != size) {
+				ob->err = 1;
+			}
+			return;
+		}
+	}
+	memcpy(ob->buf + ob->len, data, size);
+	ob->len += size;
+}
+
+static void ob_flush(struct outbuf *ob)
+{
+	if(ob->len > 0 && fwrite(ob->buf, 1, ob->len, ob->fp) != ob->len) {
+		ob->err = 1;
+	}
+	ob->len = 0;
+}
+
+/* returns a pointer to at least size free bytes at the end of the buffer.
+ * The caller writes there, and advances ob->len itself.
+ */
+static char *ob_reserve(struct outbuf *ob, int size)
+{
+	if(ob->len + size > OUTBUF_SIZE) {
+		ob_flush(ob);
+	}
+	return ob->buf + ob->len;
+}
+
+
+/* positive integers only */
+static int format_int(char *buf, int x)
+{
+	int i, len = 0;
+	char tmp[12];
+
+	do {
+		tmp[len++] = '0' + x % 10;
+		x /= 10;
+	} while(x > 0);
+
+	for(i=0; i<len; i++) {
+		buf[i] = tmp[len - 1 - i];
+	}
+	return len;
+}
+
+/* Formats x with the fewest significant digits which read back as exactly the
+ * same float. 9 significant digits are always enough for a float, so this
+ * never needs more than 16 characters.
+ */
+static int format_float(char *buf, float x)
+{
+	int i, n, e10, exp, pos, len;
+	uint32_t bits;
+	long long digits = 0;
+	double d;
+	char dig[12], *ptr = buf;
+
+	/* zeros are checked on the bits, as -ffast-math ignores the sign of zero */
+	memcpy(&bits, &x, sizeof bits);
+	if(!(bits & 0x7fffffff)) {
+		if(bits) *ptr++ = '-';
+		*ptr++ = '0';
+		return ptr - buf;
+	}
+	/* so are infinities, NaNs and denormals, which -ffast-math doesn't handle */
+	if((bits & 0x7f800000) == 0x7f800000 || !(bits & 0x7f800000)) {
+		return sprintf(buf, "%g", x);
+	}
+	if(x < 0.0f) {
+		*ptr++ = '-';
+		x = -x;
+	}
+	d = x;
+	e10 = (int)floor(log10(d));
+
+	exp = 0;
+	for(n=1; n<=9; n++) {
+		exp = e10 - n + 1;	/* x ~= digits * 10^exp */
+		digits = llround(pow10_scale(d, -exp));
+		if(digits >= (long long)pow10_scale(1.0, n)) {
+			/* rounded up to an extra digit (9.96 -> 10) */
+			digits /= 10;
+			exp++;
+		}
+		if((float)pow10_scale(digits, exp) == x) {
+			break;
+		}
+	}
+
+	/* strip trailing zeros, which only show up after rounding */
+	while(digits >= 10 && digits % 10 == 0) {
+		digits /= 10;
+		exp++;
+	}
+
+	/* digits, most significant first */
+	len = 0;
+	while(digits > 0) {
+		dig[len++] = '0' + digits % 10;
+		digits /= 10;
+	}
+	for(i=0; i<len/2; i++) {
+		char tmp = dig[i];
+		dig[i] = dig[len - 1 - i];
+		dig[len - 1 - i] = tmp;
+	}
+
+	/* position of the decimal point relative to the first digit */
+	pos = exp + len;
+
+	if(pos > 0 && pos <= 9) {
+		for(i=0; i<pos; i++) {
+			*ptr++ = i < len ? dig[i] : '0';
+		}
+		if(len > pos) {
+			*ptr++ = '.';
+			for(i=pos; i<len; i++) {
+				*ptr++ = dig[i];
+			}
+		}
+	} else if(pos <= 0 && pos > -5) {
+		*ptr++ = '0';
+		*ptr++ = '.';
+		for(i=0; i<-pos; i++) {
+			*ptr++ = '0';
+		}
+		for(i=0; i<len; i++) {
+			*ptr++ = dig[i];
+		}
+	} else {
+		*ptr++ = dig[0];
+		if(len > 1) {
+			*ptr++ = '.';
+			for(i=1; i<len; i++) {
+				*ptr++ = dig[i];
+			}
+		}
+		ptr += sprintf(ptr, "e%d", pos - 1);
+	}
+	return ptr - buf;
+}
@@ -1,118 +1,689 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
-#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include <cgmath/cgmath.h>
 #include "mesh.h"
 #include "dynarr.h"
+#include "tpool.h"
+
+/* chunks smaller than this are not worth parsing on a separate thread */
+#define MIN_CHUNK_SIZE		(1 << 20)
+#define CHUNKS_PER_THREAD	4
+
+/* face vertex index flags: index is relative to the start of the chunk */
+#define FV_VREL		1
+#define FV_TREL		2
+#define FV_NREL		4
+/* the first vertex of each polygon also holds its vertex count in the flags */
+#define FV_COUNT_SHIFT	8
 
 struct facevertex {
 	int vidx, tidx, nidx;
+	unsigned int flags;
+};
+
+/* name in the mapped file, not null-terminated */
+struct obj_name {
+	const char *str;
+	int len;
+};
+
+/* usemtl: faces from fvarr index fv onwards use chunk material mtl */
+struct mtl_switch {
+	int fv;
+	int mtl;
+};
+
+struct obj_context;
+
+struct obj_chunk {
+	const char *start, *end;
+	struct obj_context *ctx;
+
+	cgm_vec3 *varr, *narr, *tarr;
+	struct facevertex *fvarr;
+	int num_lines;
+	int num_tris;		/* triangles after triangulating all polygons */
+	int num_polys;		/* faces with more than 3 vertices */
+	int max_poly_verts;
+
+	/* materials named by usemtl and libraries named by mtllib in this chunk */
+	struct obj_name *mtlnames, *mtllibs;
+	struct mtl_switch *mtlsw;
+	int *mtlmap;	/* chunk material index to mesh material index */
+	int mtl_in;		/* mesh material in effect at the start of the chunk */
+
+	/* number of elements defined in all previous chunks */
+	int vbase, tbase, nbase, fbase;
+
+	const char *errmsg;
+	const char *errline_ptr;
+	int errline;	/* line number of the error within the chunk, 0 if n/a */
 };
 
-static char *clean_line(char *s);
-static char *parse_face_vert(char *ptr, struct facevertex *fv, int numv, int numt, int numn);
+struct obj_context {
+	struct mesh *mesh;
+	/* merged arrays of all chunks */
+	cgm_vec3 *varr, *narr, *tarr;
+	int vsz, nsz, tsz;
+	/* merged material names and libraries, moved to the mesh on success */
+	char **mtlnames, **mtllibs;
+	int num_mtls, num_mtllibs;
+
+	int pending;
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+};
+
+static void init_obj_context(struct obj_context *ctx, struct mesh *mesh);
+static void destroy_obj_context(struct obj_context *ctx);
+static void run_chunks(struct obj_context *ctx, struct obj_chunk *chunks, int num_chunks,
+		tpool_callback func);
+static int merge_materials(struct obj_context *ctx, struct obj_chunk *chunks, int num_chunks);
+static void parse_chunk(void *cls);
+static void build_chunk_faces(void *cls);
+static const char *map_file(const char *fname, long *size);
+static void unmap_file(const char *data, long size);
+static const char *parse_name(const char *ptr, const char *end, struct obj_name *name);
+static const char *parse_face_vert(const char *ptr, const char *end, struct facevertex *fv,
+		int numv, int numt, int numn);
+
+#define IS_SPACE(c)	((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\v' || (c) == '\f')
+#define IS_DIGIT(c)	((c) >= '0' && (c) <= '9')
+
+static inline const char *skip_space(const char *ptr, const char *end)
+{
+	while(ptr < end && IS_SPACE(*ptr)) ptr++;
+	return ptr;
+}
+
+static inline const char *skip_line(const char *ptr, const char *end)
+{
+	const char *nl = memchr(ptr, '\n', end - ptr);
+	return nl ? nl + 1 : end;
+}
+
+/* length of the line starting at ptr, for error messages */
+static inline int line_len(const char *ptr, const char *end)
+{
+	const char *nl = memchr(ptr, '\n', end - ptr);
+	return (nl ? nl : end) - ptr;
+}
+
+static const double pow10tab[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* powers of ten up to 1e22 are exact in double precision, larger ones are
+ * applied in steps of 1e22
+ */
+double pow10_scale(double val, int exp)
+{
+	if(exp < 0) {
+		while(exp < -22) {
+			val /= 1e22;
+			exp += 22;
+		}
+		val /= pow10tab[-exp];
+	} else if(exp > 0) {
+		while(exp > 22) {
+			val *= 1e22;
+			exp -= 22;
+		}
+		val *= pow10tab[exp];
+	}
+	return val;
+}
+
+/* parses a floating point number in decimal notation, with an optional
+ * exponent. Returns a pointer just past the number, or null on failure.
+ */
+static const char *parse_float(const char *ptr, const char *end, float *res)
+{
+	int neg = 0, exp = 0, eneg = 0, edig = 0, ndig = 0;
+	unsigned long long mant = 0;
+	double val;
+
+	ptr = skip_space(ptr, end);
+
+	if(ptr < end && (*ptr == '-' || *ptr == '+')) {
+		neg = *ptr++ == '-';
+	}
+
+	/* only the first 19 significant digits fit in the mantissa, any further
+	 * digits just scale it.
+	 */
+	while(ptr < end && IS_DIGIT(*ptr)) {
+		if(mant < 1000000000000000000ull) {
+			mant = mant * 10 + (*ptr - '0');
+		} else {
+			exp++;
+		}
+		ptr++;
+		ndig++;
+	}
+	if(ptr < end && *ptr == '.') {
+		ptr++;
+		while(ptr < end && IS_DIGIT(*ptr)) {
+			if(mant < 1000000000000000000ull) {
+				mant = mant * 10 + (*ptr - '0');
+				exp--;
+			}
+			ptr++;
+			ndig++;
+		}
+	}
+	if(!ndig) return 0;
+
+	if(ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+		int e = 0;
+		const char *eptr = ptr + 1;
+
+		if(eptr < end && (*eptr == '-' || *eptr == '+')) {
+			eneg = *eptr++ == '-';
+		}
+		while(eptr < end && IS_DIGIT(*eptr)) {
+			if(e < 10000) e = e * 10 + (*eptr - '0');
+			eptr++;
+			edig++;
+		}
+		if(edig) {
+			exp += eneg ? -e : e;
+			ptr = eptr;
+		}
+	}
 
+	val = pow10_scale((double)mant, exp);
+
+	*res = neg ? -val : val;
+	return ptr;
+}
+
+static const char *parse_int(const char *ptr, const char *end, int *res)
+{
+	int neg = 0, val = 0;
+	const char *start;
+
+	if(ptr < end && (*ptr == '-' || *ptr == '+')) {
+		neg = *ptr++ == '-';
+	}
+	start = ptr;
+	while(ptr < end && IS_DIGIT(*ptr)) {
+		val = val * 10 + (*ptr++ - '0');
+	}
+	if(ptr == start) return 0;
+
+	*res = neg ? -val : val;
+	return ptr;
+}
+
+/* true if ptr is at the end of a token */
+static inline int token_end(const char *ptr, const char *end)
+{
+	return ptr >= end || IS_SPACE(*ptr) || *ptr == '\n' || *ptr == '#';
+}
+
+/* Files are split into chunks at line boundaries, and each chunk is parsed
+ * into its own arrays, in parallel when a thread pool is available. Indices
+ * in face definitions are either absolute, or relative to the end of the
+ * arrays at that point in the file (negative indices). Relative indices are
+ * kept relative to the start of the chunk until the number of elements in
+ * all previous chunks is known, and then converted to absolute.
+ */
 int load_mesh(struct mesh *mesh, const char *fname)
 {
-	int i, j, line_num = 0, result = -1;
-	int found_quad = 0;
-	FILE *fp = 0;
-	char buf[256];
-	cgm_vec3 *varr = 0;
-	cgm_vec3 *narr = 0;
-	cgm_vec3 *tarr = 0;
-	struct facevertex *fvarr = 0, *fvptr;
-	int num_fv;
-	struct face *fptr;
-
-	if(!(fp = fopen(fname, "rb"))) {
+	int i, num_chunks, line_num, result = -1;
+	int vsz = 0, tsz = 0, nsz = 0, num_faces = 0, num_polys = 0;
+	long size, chunk_size;
+	const char *data, *ptr, *end;
+	struct obj_chunk *chunks = 0, *ck;
+	struct obj_context ctx;
+	struct thread_pool *tpool = get_mesh_thread_pool();
+
+	if(!(data = map_file(fname, &size))) {
 		fprintf(stderr, "load_mesh: failed to open file: %s\n", fname);
+		return -1;
+	}
+	end = data + size;
+
+	num_chunks = 1;
+	if(tpool && size > MIN_CHUNK_SIZE) {
+		num_chunks = tpool_num_processors() * CHUNKS_PER_THREAD;
+		if(num_chunks > size / MIN_CHUNK_SIZE) {
+			num_chunks = size / MIN_CHUNK_SIZE;
+		}
+	}
+	if(!(chunks = calloc(num_chunks, sizeof *chunks))) {
+		fprintf(stderr, "load_mesh: failed to allocate chunk array\n");
 		goto err;
 	}
 
-	if(!(varr = dynarr_alloc(0, sizeof *varr)) ||
-			!(narr = dynarr_alloc(0, sizeof *narr)) ||
-			!(tarr = dynarr_alloc(0, sizeof *tarr)) ||
-			!(fvarr = dynarr_alloc(0, sizeof *fvarr))) {
-		fprintf(stderr, "load_mesh: failed to allocate resizable vertex array\n");
+	/* split at the first newline after each nominal chunk boundary. Chunks
+	 * may end up empty for files with very long lines, which is fine.
+	 */
+	chunk_size = size / num_chunks;
+	ptr = data;
+	for(i=0; i<num_chunks; i++) {
+		ck = chunks + i;
+		ck->start = ptr;
+		if(i == num_chunks - 1) {
+			ptr = end;
+		} else {
+			ptr = data + (i + 1) * chunk_size;
+			if(ptr < ck->start) {
+				ptr = ck->start;
+			} else if(ptr > ck->start) {
+				ptr = skip_line(ptr - 1, end);
+			}
+		}
+		ck->end = ptr;
+		ck->ctx = &ctx;
+	}
+
+	init_obj_context(&ctx, mesh);
+	run_chunks(&ctx, chunks, num_chunks, parse_chunk);
+
+	/* report the first error in the file. All chunks before it have been
+	 * fully parsed, so their line counts are correct.
+	 */
+	line_num = 0;
+	for(i=0; i<num_chunks; i++) {
+		ck = chunks + i;
+		if(ck->errmsg) {
+			if(ck->errline) {
+				fprintf(stderr, "%s:%d: %s: \"%.*s\"\n", fname, line_num + ck->errline,
+						ck->errmsg, line_len(ck->errline_ptr, end), ck->errline_ptr);
+			} else {
+				fprintf(stderr, "load_mesh: %s\n", ck->errmsg);
+			}
+			goto err;
+		}
+		line_num += ck->num_lines;
+
+		/* prefix sums of the element counts */
+		ck->vbase = vsz;
+		ck->tbase = tsz;
+		ck->nbase = nsz;
+		ck->fbase = num_faces;
+		vsz += dynarr_size(ck->varr);
+		tsz += dynarr_size(ck->tarr);
+		nsz += dynarr_size(ck->narr);
+		num_faces += ck->num_tris;
+		num_polys += ck->num_polys;
+	}
+
+	if(!(ctx.varr = malloc(vsz * sizeof *ctx.varr + 1)) ||
+			!(ctx.tarr = malloc(tsz * sizeof *ctx.tarr + 1)) ||
+			!(ctx.narr = malloc(nsz * sizeof *ctx.narr + 1))) {
+		fprintf(stderr, "load_mesh: failed to allocate vertex arrays\n");
 		goto err;
 	}
+	ctx.vsz = vsz;
+	ctx.tsz = tsz;
+	ctx.nsz = nsz;
 
-	while(fgets(buf, sizeof buf, fp)) {
-		char *line = clean_line(buf);
-		++line_num;
+	for(i=0; i<num_chunks; i++) {
+		ck = chunks + i;
+		memcpy(ctx.varr + ck->vbase, ck->varr, dynarr_size(ck->varr) * sizeof *ctx.varr);
+		memcpy(ctx.tarr + ck->tbase, ck->tarr, dynarr_size(ck->tarr) * sizeof *ctx.tarr);
+		memcpy(ctx.narr + ck->nbase, ck->narr, dynarr_size(ck->narr) * sizeof *ctx.narr);
+	}
 
-		if(!line || !*line) continue;
+	if(merge_materials(&ctx, chunks, num_chunks) == -1) {
+		fprintf(stderr, "load_mesh: failed to allocate material arrays\n");
+		goto err;
+	}
 
-		switch(line[0]) {
+	if(!(mesh->faces = malloc(num_faces * sizeof *mesh->faces + 1))) {
+		fprintf(stderr, "load_mesh: failed to create faces array\n");
+		goto err;
+	}
+	mesh->num_faces = num_faces;
+
+	run_chunks(&ctx, chunks, num_chunks, build_chunk_faces);
+
+	for(i=0; i<num_chunks; i++) {
+		if(chunks[i].errmsg) {
+			fprintf(stderr, "load_mesh: %s: %s\n", fname, chunks[i].errmsg);
+			free(mesh->faces);
+			mesh->faces = 0;
+			mesh->num_faces = 0;
+			goto err;
+		}
+	}
+
+	mesh->mtlnames = ctx.mtlnames;
+	mesh->num_mtls = ctx.num_mtls;
+	mesh->mtllibs = ctx.mtllibs;
+	mesh->num_mtllibs = ctx.num_mtllibs;
+	ctx.mtlnames = ctx.mtllibs = 0;
+	ctx.num_mtls = ctx.num_mtllibs = 0;
+
+	result = 0;	/* success */
+
+	printf("loaded mesh: %s: %d vertices, %d faces (%d polygons triangulated, %d materials, "
+			"%d chunks)\n", fname, vsz, mesh->num_faces, num_polys, mesh->num_mtls, num_chunks);
+
+err:
+	unmap_file(data, size);
+	if(chunks) {
+		for(i=0; i<num_chunks; i++) {
+			dynarr_free(chunks[i].varr);
+			dynarr_free(chunks[i].narr);
+			dynarr_free(chunks[i].tarr);
+			dynarr_free(chunks[i].fvarr);
+			dynarr_free(chunks[i].mtlnames);
+			dynarr_free(chunks[i].mtllibs);
+			dynarr_free(chunks[i].mtlsw);
+			free(chunks[i].mtlmap);
+		}
+		free(chunks);
+		destroy_obj_context(&ctx);
+	}
+	return result;
+}
+
+static void init_obj_context(struct obj_context *ctx, struct mesh *mesh)
+{
+	memset(ctx, 0, sizeof *ctx);
+	ctx->mesh = mesh;
+	pthread_mutex_init(&ctx->lock, 0);
+	pthread_cond_init(&ctx->done_cond, 0);
+}
+
+static void destroy_obj_context(struct obj_context *ctx)
+{
+	int i;
+
+	for(i=0; i<ctx->num_mtls; i++) {
+		free(ctx->mtlnames[i]);
+	}
+	free(ctx->mtlnames);
+	for(i=0; i<ctx->num_mtllibs; i++) {
+		free(ctx->mtllibs[i]);
+	}
+	free(ctx->mtllibs);
+
+	free(ctx->varr);
+	free(ctx->tarr);
+	free(ctx->narr);
+	pthread_mutex_destroy(&ctx->lock);
+	pthread_cond_destroy(&ctx->done_cond);
+}
+
+static int find_name(char **names, int num, const struct obj_name *name)
+{
+	int i;
+
+	for(i=0; i<num; i++) {
+		if(strncmp(names[i], name->str, name->len) == 0 && !names[i][name->len]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static char *dup_name(const struct obj_name *name)
+{
+	char *str;
+
+	if(!(str = malloc(name->len + 1))) {
+		return 0;
+	}
+	memcpy(str, name->str, name->len);
+	str[name->len] = 0;
+	return str;
+}
+
+/* Merges the material names and libraries of all chunks, and works out the
+ * mesh material in effect at the start of each chunk, which is the last one
+ * selected in any previous chunk.
+ */
+static int merge_materials(struct obj_context *ctx, struct obj_chunk *chunks, int num_chunks)
+{
+	int i, j, idx, nnames, nlibs, max_names = 0, max_libs = 0, cur_mtl = -1;
+	struct obj_chunk *ck;
+
+	for(i=0; i<num_chunks; i++) {
+		max_names += dynarr_size(chunks[i].mtlnames);
+		max_libs += dynarr_size(chunks[i].mtllibs);
+	}
+	if(!(ctx->mtlnames = malloc(max_names * sizeof *ctx->mtlnames + 1)) ||
+			!(ctx->mtllibs = malloc(max_libs * sizeof *ctx->mtllibs + 1))) {
+		return -1;
+	}
+
+	for(i=0; i<num_chunks; i++) {
+		ck = chunks + i;
+		nnames = dynarr_size(ck->mtlnames);
+		nlibs = dynarr_size(ck->mtllibs);
+
+		if(!(ck->mtlmap = malloc(nnames * sizeof *ck->mtlmap + 1))) {
+			return -1;
+		}
+		for(j=0; j<nnames; j++) {
+			if((idx = find_name(ctx->mtlnames, ctx->num_mtls, ck->mtlnames + j)) == -1) {
+				if(!(ctx->mtlnames[ctx->num_mtls] = dup_name(ck->mtlnames + j))) {
+					return -1;
+				}
+				idx = ctx->num_mtls++;
+			}
+			ck->mtlmap[j] = idx;
+		}
+
+		for(j=0; j<nlibs; j++) {
+			if(find_name(ctx->mtllibs, ctx->num_mtllibs, ck->mtllibs + j) == -1) {
+				if(!(ctx->mtllibs[ctx->num_mtllibs] = dup_name(ck->mtllibs + j))) {
+					return -1;
+				}
+				ctx->num_mtllibs++;
+			}
+		}
+
+		ck->mtl_in = cur_mtl;
+		if(!dynarr_empty(ck->mtlsw)) {
+			cur_mtl = ck->mtlmap[ck->mtlsw[dynarr_size(ck->mtlsw) - 1].mtl];
+		}
+	}
+	return 0;
+}
+
+static void chunk_done(void *cls)
+{
+	struct obj_context *ctx = ((struct obj_chunk*)cls)->ctx;
+
+	pthread_mutex_lock(&ctx->lock);
+	if(--ctx->pending <= 0) {
+		pthread_cond_signal(&ctx->done_cond);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/* runs func on every chunk, and waits for all of them to finish. Chunks are
+ * processed on the calling thread if there's no thread pool, or if we're
+ * already running on one of its threads.
+ */
+static void run_chunks(struct obj_context *ctx, struct obj_chunk *chunks, int num_chunks,
+		tpool_callback func)
+{
+	int i;
+	struct thread_pool *tpool = get_mesh_thread_pool();
+
+	if(!tpool || num_chunks <= 1 || tpool_thread_id(tpool) >= 0) {
+		for(i=0; i<num_chunks; i++) {
+			func(chunks + i);
+		}
+		return;
+	}
+
+	ctx->pending = num_chunks;
+	for(i=0; i<num_chunks; i++) {
+		if(tpool_enqueue(tpool, chunks + i, func, chunk_done) == -1) {
+			func(chunks + i);
+			chunk_done(chunks + i);
+		}
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	while(ctx->pending > 0) {
+		pthread_cond_wait(&ctx->done_cond, &ctx->lock);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+#define CHUNK_ERROR(msg) \
+	do { \
+		ck->errmsg = msg; \
+		ck->errline = ck->num_lines; \
+		ck->errline_ptr = line; \
+		return; \
+	} while(0)
+
+#define CHUNK_PUSH(arr, item) \
+	do { \
+		void *tmp = dynarr_push((arr), (item)); \
+		if(!tmp) { \
+			ck->errmsg = "failed to resize vertex arrays"; \
+			return; \
+		} \
+		(arr) = tmp; \
+	} while(0)
+
+static void parse_chunk(void *cls)
+{
+	struct obj_chunk *ck = cls;
+	const char *ptr, *line, *end = ck->end;
+
+	if(!(ck->varr = dynarr_alloc(0, sizeof *ck->varr)) ||
+			!(ck->narr = dynarr_alloc(0, sizeof *ck->narr)) ||
+			!(ck->tarr = dynarr_alloc(0, sizeof *ck->tarr)) ||
+			!(ck->fvarr = dynarr_alloc(0, sizeof *ck->fvarr)) ||
+			!(ck->mtlnames = dynarr_alloc(0, sizeof *ck->mtlnames)) ||
+			!(ck->mtllibs = dynarr_alloc(0, sizeof *ck->mtllibs)) ||
+			!(ck->mtlsw = dynarr_alloc(0, sizeof *ck->mtlsw))) {
+		ck->errmsg = "failed to allocate resizable vertex array";
+		return;
+	}
+
+	/* the file is parsed in place, one line at a time without copying it */
+	for(ptr = ck->start; ptr < end; ptr = skip_line(ptr, end)) {
+		++ck->num_lines;
+		line = ptr = skip_space(ptr, end);
+		if(ptr >= end) break;
+
+		switch(ptr[0]) {
 		case 'v':
-			if(isspace(line[1])) {
+			if(ptr + 1 < end && IS_SPACE(ptr[1])) {
 				/* vertex */
 				cgm_vec3 v;
-				int num;
 
-				num = sscanf(line + 2, "%f %f %f", &v.x, &v.y, &v.z);
-				if(num != 3) {
-					fprintf(stderr, "%s:%d: invalid vertex definition: \"%s\"\n", fname, line_num, line);
-					goto err;
-				}
-				if(!(varr = dynarr_push(varr, &v))) {
-					fprintf(stderr, "load_mesh: failed to resize vertex buffer\n");
-					goto err;
+				if(!(ptr = parse_float(ptr + 2, end, &v.x)) ||
+						!(ptr = parse_float(ptr, end, &v.y)) ||
+						!(ptr = parse_float(ptr, end, &v.z))) {
+					CHUNK_ERROR("invalid vertex definition");
 				}
+				CHUNK_PUSH(ck->varr, &v);
 
-			} else if(line[1] == 't' && isspace(line[2])) {
+			} else if(ptr + 2 < end && ptr[1] == 't' && IS_SPACE(ptr[2])) {
 				/* texcoord */
-				cgm_vec3 tc;
-				if(sscanf(line + 3, "%f %f", &tc.x, &tc.y) != 2) {
-					fprintf(stderr, "%s:%d: invalid texcoord definition: \"%s\"\n", fname, line_num, line);
-					goto err;
-				}
-				if(!(tarr = dynarr_push(tarr, &tc))) {
-					fprintf(stderr, "load_mesh: failed to resize texcoord buffer\n");
-					goto err;
+				cgm_vec3 tc = {0, 0, 0};
+
+				if(!(ptr = parse_float(ptr + 3, end, &tc.x)) ||
+						!(ptr = parse_float(ptr, end, &tc.y))) {
+					CHUNK_ERROR("invalid texcoord definition");
 				}
+				CHUNK_PUSH(ck->tarr, &tc);
 
-			} else if(line[1] == 'n' && isspace(line[2])) {
+			} else if(ptr + 2 < end && ptr[1] == 'n' && IS_SPACE(ptr[2])) {
 				/* normal */
 				cgm_vec3 norm;
-				if(sscanf(line + 3, "%f %f %f", &norm.x, &norm.y, &norm.z) != 3) {
-					fprintf(stderr, "%s:%d: invalid normal definition: \"%s\"\n", fname, line_num, line);
-					goto err;
-				}
-				if(!(narr = dynarr_push(narr, &norm))) {
-					fprintf(stderr, "load_mesh: failed to resize normal buffer\n");
-					goto err;
+
+				if(!(ptr = parse_float(ptr + 3, end, &norm.x)) ||
+						!(ptr = parse_float(ptr, end, &norm.y)) ||
+						!(ptr = parse_float(ptr, end, &norm.z))) {
+					CHUNK_ERROR("invalid normal definition");
 				}
+				CHUNK_PUSH(ck->narr, &norm);
 			}
 			break;
 
 		case 'f':
-			if(isspace(line[1])) {
-				/* face */
-				char *ptr = line + 2;
+			if(ptr + 1 < end && IS_SPACE(ptr[1])) {
+				/* face: any number of vertices, triangulated after merging */
 				struct facevertex fv;
-				int vsz = dynarr_size(varr);
-				int tsz = dynarr_size(tarr);
-				int nsz = dynarr_size(narr);
-
-				for(i=0; i<4; i++) {
-					if(!(ptr = parse_face_vert(ptr, &fv, vsz, tsz, nsz))) {
-						if(i < 3 || found_quad) {
-							fprintf(stderr, "%s:%d: invalid face definition: \"%s\"\n", fname, line_num, line);
-							goto err;
-						} else {
-							break;
-						}
+				int first = dynarr_size(ck->fvarr);
+				int vsz = dynarr_size(ck->varr);
+				int tsz = dynarr_size(ck->tarr);
+				int nsz = dynarr_size(ck->narr);
+				int nverts = 0;
+
+				ptr += 2;
+				for(;;) {
+					ptr = skip_space(ptr, end);
+					if(ptr >= end || *ptr == '\n' || *ptr == '#') break;
+
+					if(!(ptr = parse_face_vert(ptr, end, &fv, vsz, tsz, nsz))) {
+						CHUNK_ERROR("invalid face definition");
 					}
+					CHUNK_PUSH(ck->fvarr, &fv);
+					nverts++;
+				}
+				if(nverts < 3) {
+					CHUNK_ERROR("invalid face definition");
+				}
+				ck->fvarr[first].flags |= nverts << FV_COUNT_SHIFT;
 
-					if(!(fvarr = dynarr_push(fvarr, &fv))) {
-						fprintf(stderr, "load_mesh: failed to resize face vertex array\n");
-						goto err;
+				ck->num_tris += nverts - 2;
+				if(nverts > 3) {
+					ck->num_polys++;
+					if(nverts > ck->max_poly_verts) {
+						ck->max_poly_verts = nverts;
 					}
 				}
-				if(i > 3) found_quad = 1;
+			}
+			break;
+
+		case 'u':
+			if(ptr + 6 < end && memcmp(ptr, "usemtl", 6) == 0 && IS_SPACE(ptr[6])) {
+				struct obj_name name;
+				struct mtl_switch sw;
+				int i, num = dynarr_size(ck->mtlnames);
+
+				if(!parse_name(ptr + 7, end, &name)) {
+					CHUNK_ERROR("invalid usemtl");
+				}
+				for(i=0; i<num; i++) {
+					if(ck->mtlnames[i].len == name.len &&
+							memcmp(ck->mtlnames[i].str, name.str, name.len) == 0) {
+						break;
+					}
+				}
+				if(i >= num) {
+					CHUNK_PUSH(ck->mtlnames, &name);
+				}
+				sw.fv = dynarr_size(ck->fvarr);
+				sw.mtl = i;
+				CHUNK_PUSH(ck->mtlsw, &sw);
+			}
+			break;
+
+		case 'm':
+			if(ptr + 6 < end && memcmp(ptr, "mtllib", 6) == 0 && IS_SPACE(ptr[6])) {
+				/* mtllib can list any number of files */
+				struct obj_name name;
+				const char *next;
+
+				ptr += 7;
+				while((next = parse_name(ptr, end, &name))) {
+					CHUNK_PUSH(ck->mtllibs, &name);
+					ptr = next;
+				}
 			}
 			break;
 
@@ -120,71 +691,301 @@ int load_mesh(struct mesh *mesh, const char *fname)
 			break;
 		}
 	}
+}
 
-	num_fv = dynarr_size(fvarr);
-	mesh->num_faces = num_fv / 3;
-	if(!(mesh->faces = malloc(mesh->num_faces * sizeof *mesh->faces))) {
-		fprintf(stderr, "load_mesh: failed to create faces array\n");
-		goto err;
+static inline int resolve_idx(int idx, int rel, int base)
+{
+	return rel ? base + idx : idx;
+}
+
+/* resolved indices of a polygon vertex */
+struct polyvert {
+	int vidx, tidx, nidx;
+};
+
+/* triangulation scratch space, large enough for the largest polygon */
+struct polywork {
+	struct polyvert *pv;
+	float *px, *py;
+	int *idx, *tri;
+};
+
+static void make_face(struct face *f, const struct obj_context *ctx, int mtl,
+		const struct polyvert *a, const struct polyvert *b, const struct polyvert *c)
+{
+	int i;
+	const struct polyvert *pv[3];
+	static const cgm_vec3 zero;
+
+	pv[0] = a;
+	pv[1] = b;
+	pv[2] = c;
+
+	for(i=0; i<3; i++) {
+		f->v[i] = ctx->varr[pv[i]->vidx];
+		f->tc[i] = pv[i]->tidx >= 0 && pv[i]->tidx < ctx->tsz ? ctx->tarr[pv[i]->tidx] : zero;
+	}
+
+	calc_face_normal(f);
+	f->mtl = mtl;
+
+	/* faces without vertex normals use the face normal */
+	for(i=0; i<3; i++) {
+		f->n[i] = pv[i]->nidx >= 0 && pv[i]->nidx < ctx->nsz ? ctx->narr[pv[i]->nidx] : f->normal;
 	}
+}
+
+static inline float cross2(const float *px, const float *py, int a, int b, int c)
+{
+	return (px[b] - px[a]) * (py[c] - py[a]) - (py[b] - py[a]) * (px[c] - px[a]);
+}
+
+/* points on, or within eps of, the triangle edges count as inside */
+static int in_triangle(const float *px, const float *py, int a, int b, int c, int p,
+		float sign, float eps)
+{
+	return cross2(px, py, a, b, p) * sign >= -eps && cross2(px, py, b, c, p) * sign >= -eps &&
+		cross2(px, py, c, a, p) * sign >= -eps;
+}
+
+/* Triangulates a polygon of n > 3 vertices into (n - 2) * 3 indices in
+ * work->tri. The polygon is projected onto the axis plane most parallel to
+ * it. Convex polygons are split as a fan, others by ear clipping. If no ear
+ * can be found (self-intersecting or degenerate polygons), the current vertex
+ * is clipped anyway, so we always produce n - 2 triangles.
+ */
+static void triangulate(const struct obj_context *ctx, struct polywork *work, int n)
+{
+	int i, j, k, m, prev, next, xaxis, yaxis, ear;
+	float area, sign, eps;
+	cgm_vec3 norm = {0, 0, 0};
+	float *px = work->px, *py = work->py;
+	int *idx = work->idx, *tri = work->tri;
+
+	/* Newell's method for the polygon normal */
+	for(i=0; i<n; i++) {
+		const cgm_vec3 *v0 = ctx->varr + work->pv[i].vidx;
+		const cgm_vec3 *v1 = ctx->varr + work->pv[(i + 1) % n].vidx;
+		norm.x += (v0->y - v1->y) * (v0->z + v1->z);
+		norm.y += (v0->z - v1->z) * (v0->x + v1->x);
+		norm.z += (v0->x - v1->x) * (v0->y + v1->y);
+	}
+	if(fabs(norm.x) > fabs(norm.y) && fabs(norm.x) > fabs(norm.z)) {
+		xaxis = 1;
+		yaxis = 2;
+	} else if(fabs(norm.y) > fabs(norm.z)) {
+		xaxis = 2;
+		yaxis = 0;
+	} else {
+		xaxis = 0;
+		yaxis = 1;
+	}
+
+	for(i=0; i<n; i++) {
+		const float *v = &ctx->varr[work->pv[i].vidx].x;
+		px[i] = v[xaxis];
+		py[i] = v[yaxis];
+	}
+
+	area = 0.0f;
+	for(i=0; i<n; i++) {
+		j = (i + 1) % n;
+		area += px[i] * py[j] - px[j] * py[i];
+	}
+	sign = area < 0.0f ? -1.0f : 1.0f;
+	eps = fabs(area) * 1e-5f;
 
-	fptr = mesh->faces;
-	fvptr = fvarr;
-	for(i=0; i<mesh->num_faces; i++) {
-		for(j=0; j<3; j++) {
-			fptr->v[j] = varr[fvptr->vidx];
-			fptr->n[j] = narr[fvptr->nidx];
-			fptr->tc[j] = tarr[fvptr->tidx];
-			fvptr++;
+	for(i=0; i<n; i++) {
+		if(cross2(px, py, i, (i + 1) % n, (i + 2) % n) * sign < 0.0f) {
+			break;
+		}
+	}
+	if(i >= n) {
+		/* convex */
+		for(i=1; i<n-1; i++) {
+			*tri++ = 0;
+			*tri++ = i;
+			*tri++ = i + 1;
 		}
+		return;
+	}
 
-		calc_face_normal(fptr);
-		fptr++;
+	for(i=0; i<n; i++) {
+		idx[i] = i;
 	}
+	m = n;
+	i = 0;
+	k = 0;	/* vertices tried since the last ear was clipped */
+	while(m > 3) {
+		prev = idx[(i + m - 1) % m];
+		next = idx[(i + 1) % m];
 
-	result = 0;	/* success */
+		ear = 0;
+		if(cross2(px, py, prev, idx[i], next) * sign > 0.0f) {
+			ear = 1;
+			for(j=0; j<m; j++) {
+				int p = idx[j];
+				if(p == prev || p == idx[i] || p == next) continue;
+				if(in_triangle(px, py, prev, idx[i], next, p, sign, eps)) {
+					ear = 0;
+					break;
+				}
+			}
+		}
 
-	printf("loaded %s mesh: %s: %d vertices, %d faces\n", found_quad ? "quad" : "triangle",
-			fname, dynarr_size(varr), mesh->num_faces);
+		if(ear || k >= m) {
+			*tri++ = prev;
+			*tri++ = idx[i];
+			*tri++ = next;
+			memmove(idx + i, idx + i + 1, (m - i - 1) * sizeof *idx);
+			if(--m <= i) i = 0;
+			k = 0;
+		} else {
+			i = (i + 1) % m;
+			k++;
+		}
+	}
+	*tri++ = idx[0];
+	*tri++ = idx[1];
+	*tri++ = idx[2];
+}
 
-err:
-	if(fp) fclose(fp);
-	dynarr_free(varr);
-	dynarr_free(narr);
-	dynarr_free(tarr);
-	dynarr_free(fvarr);
-	return result;
+static void build_chunk_faces(void *cls)
+{
+	int i, j, n, num_fv, mtl;
+	struct obj_chunk *ck = cls;
+	struct obj_context *ctx = ck->ctx;
+	struct facevertex *fvptr = ck->fvarr;
+	struct face *fptr = ctx->mesh->faces + ck->fbase;
+	struct polyvert tripv[3];
+	struct polywork work;
+	struct mtl_switch *sw, *swend;
+
+	memset(&work, 0, sizeof work);
+	if(ck->max_poly_verts > 3) {
+		n = ck->max_poly_verts;
+		if(!(work.pv = malloc(n * sizeof *work.pv)) || !(work.px = malloc(n * sizeof *work.px)) ||
+				!(work.py = malloc(n * sizeof *work.py)) ||
+				!(work.idx = malloc(n * sizeof *work.idx)) ||
+				!(work.tri = malloc((n - 2) * 3 * sizeof *work.tri))) {
+			ck->errmsg = "failed to allocate triangulation buffers";
+			goto end;
+		}
+	}
+
+	mtl = ck->mtl_in;
+	sw = ck->mtlsw;
+	swend = sw + dynarr_size(ck->mtlsw);
+
+	num_fv = dynarr_size(ck->fvarr);
+	while(fvptr < ck->fvarr + num_fv) {
+		struct polyvert *pv;
+
+		while(sw < swend && sw->fv <= fvptr - ck->fvarr) {
+			mtl = ck->mtlmap[sw++->mtl];
+		}
+
+		n = fvptr->flags >> FV_COUNT_SHIFT;
+		pv = n > 3 ? work.pv : tripv;
+
+		for(i=0; i<n; i++) {
+			pv[i].vidx = resolve_idx(fvptr[i].vidx, fvptr[i].flags & FV_VREL, ck->vbase);
+			pv[i].tidx = resolve_idx(fvptr[i].tidx, fvptr[i].flags & FV_TREL, ck->tbase);
+			pv[i].nidx = resolve_idx(fvptr[i].nidx, fvptr[i].flags & FV_NREL, ck->nbase);
+
+			if(pv[i].vidx < 0 || pv[i].vidx >= ctx->vsz) {
+				ck->errmsg = "vertex index out of range";
+				goto end;
+			}
+		}
+
+		if(n == 3) {
+			make_face(fptr++, ctx, mtl, pv, pv + 1, pv + 2);
+		} else {
+			triangulate(ctx, &work, n);
+			for(j=0; j<n-2; j++) {
+				int *tri = work.tri + j * 3;
+				make_face(fptr++, ctx, mtl, pv + tri[0], pv + tri[1], pv + tri[2]);
+			}
+		}
+		fvptr += n;
+	}
+
+end:
+	free(work.pv);
+	free(work.px);
+	free(work.py);
+	free(work.idx);
+	free(work.tri);
 }
 
-static char *clean_line(char *s)
+static const char *map_file(const char *fname, long *size)
 {
-	char *end;
+	int fd;
+	struct stat st;
+	void *data;
 
-	while(*s && isspace(*s)) ++s;
-	if(!*s) return 0;
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		return 0;
+	}
+	if(fstat(fd, &st) == -1) {
+		close(fd);
+		return 0;
+	}
+	*size = st.st_size;
 
-	end = s;
-	while(*end && *end != '#') ++end;
-	*end = 0;
+	if(!st.st_size) {
+		close(fd);
+		return "";	/* nothing to map, but still a valid (empty) file */
+	}
 
-	while(end > s && isspace(*end)) --end;
-	*end = 0;
+	data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		return 0;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	madvise(data, st.st_size, MADV_WILLNEED);
+	return data;
+}
 
-	return s;
+static void unmap_file(const char *data, long size)
+{
+	if(size > 0) {
+		munmap((void*)data, size);
+	}
 }
 
-static char *parse_idx(char *ptr, int *idx, int arrsz)
+static const char *parse_idx(const char *ptr, const char *end, int *idx, int arrsz,
+		unsigned int *flags, unsigned int relbit)
 {
-	char *endp;
-	int val = strtol(ptr, &endp, 10);
-	if(endp == ptr) return 0;
+	int val;
 
-	if(val < 0) {	/* convert negative indices */
+	if(!(ptr = parse_int(ptr, end, &val))) {
+		return 0;
+	}
+
+	if(val < 0) {	/* convert negative indices, relative to the chunk start */
 		*idx = arrsz + val;
+		*flags |= relbit;
 	} else {
 		*idx = val - 1;	/* indices in obj are 1-based */
 	}
-	return endp;
+	return ptr;
+}
+
+/* reads a whitespace delimited name, returns null at the end of the line */
+static const char *parse_name(const char *ptr, const char *end, struct obj_name *name)
+{
+	ptr = skip_space(ptr, end);
+	if(token_end(ptr, end)) {
+		return 0;
+	}
+
+	name->str = ptr;
+	while(!token_end(ptr, end)) ptr++;
+	name->len = ptr - name->str;
+	return ptr;
 }
 
 /* possible face-vertex definitions:
@@ -193,23 +994,26 @@ static char *parse_idx(char *ptr, int *idx, int arrsz)
  * 3. vertex//normal
  * 4. vertex/texcoord/normal
  */
-static char *parse_face_vert(char *ptr, struct facevertex *fv, int numv, int numt, int numn)
+static const char *parse_face_vert(const char *ptr, const char *end, struct facevertex *fv,
+		int numv, int numt, int numn)
 {
-	if(!(ptr = parse_idx(ptr, &fv->vidx, numv)))
+	fv->tidx = fv->nidx = -1;
+	fv->flags = 0;
+
+	if(!(ptr = parse_idx(ptr, end, &fv->vidx, numv, &fv->flags, FV_VREL)))
 		return 0;
-	if(*ptr != '/') return (!*ptr || isspace(*ptr)) ? ptr : 0;
+	if(ptr >= end || *ptr != '/') return token_end(ptr, end) ? ptr : 0;
 
-	if(*++ptr == '/') {	/* no texcoord */
-		fv->tidx = -1;
+	if(++ptr < end && *ptr == '/') {	/* no texcoord */
 		++ptr;
 	} else {
-		if(!(ptr = parse_idx(ptr, &fv->tidx, numt)))
+		if(!(ptr = parse_idx(ptr, end, &fv->tidx, numt, &fv->flags, FV_TREL)))
 			return 0;
-		if(*ptr != '/') return (!*ptr || isspace(*ptr)) ? ptr : 0;
+		if(ptr >= end || *ptr != '/') return token_end(ptr, end) ? ptr : 0;
 		++ptr;
 	}
 
-	if(!(ptr = parse_idx(ptr, &fv->nidx, numn)))
+	if(!(ptr = parse_idx(ptr, end, &fv->nidx, numn, &fv->flags, FV_NREL)))
 		return 0;
-	return (!*ptr || isspace(*ptr)) ? ptr : 0;
+	return token_end(ptr, end) ? ptr : 0;
 }
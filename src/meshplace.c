@@ -0,0 +1,169 @@
+/* placement of mesh data in memory
+ *
+ * Static meshes are copied into big allocations after they're loaded, built
+ * and compressed, so that the arrays rays read from get huge pages, and on
+ * NUMA systems are either interleaved over all nodes, or replicated on every
+ * node. Replicas are shallow copies of the mesh, sharing the material names,
+ * with their own copies of the arrays read during traversal.
+ *
+ * Deforming meshes are refitted in place between frames, and are left alone.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "mesh.h"
+#include "bigmem.h"
+
+static int place_arrays(struct mesh *dst, const struct mesh *src, int node);
+static void free_arrays(struct mesh *m);
+
+int place_mesh(struct mesh *m)
+{
+	int i, node, num_nodes, policy = get_bigmem_policy();
+	struct mesh tmp;
+
+	if(m->placed || m->end_faces || (!m->faces && !m->quant)) {
+		return -1;
+	}
+	if(policy == BIGMEM_LOCAL && get_bigmem_pages() == BIGMEM_SMALL_PAGES) {
+		return 0;
+	}
+
+	if((num_nodes = bigmem_num_nodes()) <= 1) {
+		policy = BIGMEM_LOCAL;
+	}
+	switch(policy) {
+	case BIGMEM_INTERLEAVE:
+		node = BIGMEM_ALL_NODES;
+		break;
+	case BIGMEM_REPLICATE:
+		node = 0;
+		break;
+	default:
+		node = BIGMEM_ANY_NODE;
+	}
+
+	if(place_arrays(&tmp, m, node) == -1) {
+		fprintf(stderr, "place_mesh: failed to allocate mesh arrays\n");
+		return -1;
+	}
+
+	if(policy == BIGMEM_REPLICATE) {
+		if(!(tmp.replicas = calloc(num_nodes, sizeof *tmp.replicas))) {
+			free_arrays(&tmp);
+			return -1;
+		}
+		for(i=1; i<num_nodes; i++) {
+			if(!(tmp.replicas[i] = malloc(sizeof *tmp.replicas[i])) ||
+					place_arrays(tmp.replicas[i], m, i) == -1) {
+				fprintf(stderr, "place_mesh: failed to replicate mesh on node %d\n", i);
+				free(tmp.replicas[i]);
+				tmp.replicas[i] = 0;
+				free_placed_mesh(&tmp);
+				return -1;
+			}
+		}
+	}
+
+	/* the copies take over from the original arrays */
+	if(m->cache_map) {
+		munmap(m->cache_map, m->cache_size);
+	} else {
+		free(m->faces);
+		free(m->octree);
+		free(m->octitems);
+	}
+	free_mesh_quant(m->quant);
+
+	*m = tmp;
+	return 0;
+}
+
+void free_placed_mesh(struct mesh *m)
+{
+	int i, num_nodes;
+
+	if(m->replicas) {
+		num_nodes = bigmem_num_nodes();
+		for(i=1; i<num_nodes; i++) {
+			if(m->replicas[i]) {
+				free_arrays(m->replicas[i]);
+				free(m->replicas[i]);
+			}
+		}
+		free(m->replicas);
+		m->replicas = 0;
+	}
+	free_arrays(m);
+}
+
+/* copies the arrays read by the traversal to node, into dst, which gets the
+ * rest of src as is
+ */
+static int place_arrays(struct mesh *dst, const struct mesh *src, int node)
+{
+	struct mesh_quant *q;
+
+	*dst = *src;
+	dst->placed = 1;
+	dst->replicas = 0;
+	dst->faces = 0;
+	dst->octree = 0;
+	dst->octitems = 0;
+	dst->quant = 0;
+	dst->cache_map = 0;
+	dst->cache_size = 0;
+
+	if(src->quant) {
+		if(!(q = malloc(sizeof *q))) {
+			return -1;
+		}
+		*q = *src->quant;
+		dst->quant = q;
+
+		q->nodes = bigmem_dup(q->nodes, q->num_nodes * sizeof *q->nodes, node);
+		q->leaves = bigmem_dup(q->leaves, q->num_leaves * sizeof *q->leaves, node);
+		q->verts = bigmem_dup(q->verts, q->num_verts * sizeof *q->verts, node);
+		q->tris = bigmem_dup(q->tris, q->num_tris * sizeof *q->tris, node);
+		q->faces = bigmem_dup(q->faces, src->num_faces * sizeof *q->faces, node);
+		if(!q->nodes || !q->leaves || !q->verts || !q->tris || !q->faces) {
+			free_arrays(dst);
+			return -1;
+		}
+		return 0;
+	}
+
+	dst->faces = bigmem_dup(src->faces, src->num_faces * sizeof *src->faces, node);
+	if(src->octree) {
+		dst->octree = bigmem_dup(src->octree, src->num_octnodes * sizeof *src->octree, node);
+		dst->octitems = bigmem_dup(src->octitems,
+				src->num_octitems * sizeof *src->octitems, node);
+	}
+	if(!dst->faces || (src->octree && (!dst->octree || !dst->octitems))) {
+		free_arrays(dst);
+		return -1;
+	}
+	return 0;
+}
+
+static void free_arrays(struct mesh *m)
+{
+	struct mesh_quant *q;
+
+	bigmem_free(m->faces);
+	bigmem_free(m->octree);
+	bigmem_free(m->octitems);
+	m->faces = 0;
+	m->octree = 0;
+	m->octitems = 0;
+
+	if((q = m->quant)) {
+		bigmem_free(q->nodes);
+		bigmem_free(q->leaves);
+		bigmem_free(q->verts);
+		bigmem_free(q->tris);
+		bigmem_free(q->faces);
+		free(q);
+		m->quant = 0;
+	}
+}
@@ -0,0 +1,556 @@
+/* quantized meshes
+ *
+ * Compresses the octree and faces of a static mesh, after it's built or
+ * loaded from its mesh cache, and decodes them while rays traverse it.
+ *
+ * Node bounds are stored in 8 bits per side, as fractions of the bounds of
+ * the parent, which the traversal decodes on the way down from the root. They
+ * are rounded outwards, and fitted to the quantized faces under each node
+ * instead of the octree cells, so every face lies entirely within the bounds
+ * of every leaf referencing it.
+ *
+ * Vertex positions are snapped to a grid over the mesh bounds, 2^21 cells
+ * along the longest side, or coarser if the faces of a leaf span more than
+ * the 16 bit vertex coordinates can hold. Each leaf stores the grid cell its
+ * vertices start from, its distinct vertices as 16 bit offsets from it, and
+ * its triangles as 8 bit indices into those, so the vertices shared by the
+ * faces of a leaf are only stored once. Shading attributes are kept once per
+ * face, with octahedral normals.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include "mesh.h"
+#include "surf.h"
+
+#define GRID_RES	2097152.0f
+#define MAX_COORD	0xffff
+#define MAX_LEAF_VERTS	256
+
+#define ELEM(v, i)	(((float*)(&(v).x))[i])
+
+struct qhit {
+	float t;
+	int face;
+	cgm_vec3 bc, v[3];
+};
+
+static int leaf_span(const struct mesh *m, const struct mesh_quant *q);
+static void leaf_range(const struct mesh *m, const struct mesh_quant *q,
+		const struct octnode *on, int *gmin, int *gmax);
+static int leaf_verts(const struct mesh *m, const struct mesh_quant *q,
+		const struct octnode *on, const int *origin, struct qvert *verts, struct qtri *tris);
+static void grid_coord(int *res, const struct mesh_quant *q, const cgm_vec3 *p);
+static void fit_node(const struct mesh *m, struct aabox *tbox, int nidx);
+static void quant_node(const struct mesh *m, struct mesh_quant *q, const struct aabox *tbox,
+		int nidx, const struct aabox *box);
+static void quant_range(float lo, float hi, float pmin, float pmax,
+		unsigned char *qlo, unsigned char *qhi);
+static unsigned int encode_normal(const cgm_vec3 *n);
+static void decode_normal(cgm_vec3 *n, unsigned int q);
+static int ray_qnode(const struct mesh_quant *q, int nidx, const struct aabox *box,
+		const cgm_ray *ray, struct qhit *hit);
+
+static int quantize_enabled;
+
+void set_mesh_quantize(int enable)
+{
+	quantize_enabled = enable;
+}
+
+int get_mesh_quantize(void)
+{
+	return quantize_enabled;
+}
+
+/* the same vertex always decodes to the same position, in any leaf */
+static inline void grid_pos(cgm_vec3 *res, const struct mesh_quant *q, const int *origin,
+		const unsigned short *v)
+{
+	res->x = q->grid_org.x + (float)(origin[0] + v[0]) * q->grid_step;
+	res->y = q->grid_org.y + (float)(origin[1] + v[1]) * q->grid_step;
+	res->z = q->grid_org.z + (float)(origin[2] + v[2]) * q->grid_step;
+}
+
+/* 255 decodes to the parent bounds exactly, as does 0 */
+static inline float qdecode(float pmin, float pmax, int q)
+{
+	return q >= 255 ? pmax : pmin + (pmax - pmin) * (float)q * (1.0f / 255.0f);
+}
+
+static inline void child_box(struct aabox *res, const struct aabox *par,
+		const struct qoctnode *on)
+{
+	res->vmin.x = qdecode(par->vmin.x, par->vmax.x, on->bmin[0]);
+	res->vmin.y = qdecode(par->vmin.y, par->vmax.y, on->bmin[1]);
+	res->vmin.z = qdecode(par->vmin.z, par->vmax.z, on->bmin[2]);
+	res->vmax.x = qdecode(par->vmin.x, par->vmax.x, on->bmax[0]);
+	res->vmax.y = qdecode(par->vmin.y, par->vmax.y, on->bmax[1]);
+	res->vmax.z = qdecode(par->vmin.z, par->vmax.z, on->bmax[2]);
+}
+
+int quantize_mesh(struct mesh *m)
+{
+	int i, j, num, num_leaves = 0;
+	int span, gmax[3];
+	long orig_size;
+	float ext;
+	struct aabox bounds;
+	struct aabox *tbox = 0;
+	struct mesh_quant *q;
+	struct qleaf *leaf;
+	struct qvert *vert, vbuf[MAX_LEAF_VERTS];
+	struct qtri *tri;
+	const struct face *f;
+
+	if(!m->octree || m->end_faces || m->quant || m->num_faces <= 0) {
+		return -1;
+	}
+	for(i=0; i<m->num_octnodes; i++) {
+		if(m->octree[i].num_items > MAX_COORD) {
+			fprintf(stderr, "quantize_mesh: too many faces in an octree leaf\n");
+			return -1;
+		}
+		if(m->octree[i].num_items) num_leaves++;
+	}
+
+	if(!(q = calloc(1, sizeof *q))) {
+		perror("quantize_mesh: failed to allocate mesh");
+		return -1;
+	}
+	q->num_nodes = m->num_octnodes;
+	q->num_leaves = num_leaves;
+	q->num_tris = m->num_octitems;
+
+	if(!(q->nodes = malloc(q->num_nodes * sizeof *q->nodes)) ||
+			!(q->leaves = malloc(num_leaves * sizeof *q->leaves + 1)) ||
+			!(q->tris = malloc(q->num_tris * sizeof *q->tris + 1)) ||
+			!(q->faces = malloc(m->num_faces * sizeof *q->faces)) ||
+			!(tbox = malloc(q->num_nodes * sizeof *tbox))) {
+		perror("quantize_mesh: failed to allocate mesh arrays");
+		goto err;
+	}
+
+	/* the grid starts out as fine as float positions allow over the mesh,
+	 * and gets coarser until the widest leaf fits in the vertex coordinates
+	 */
+	calc_mesh_bounds(m, &bounds);
+	ext = bounds.vmax.x - bounds.vmin.x;
+	if(bounds.vmax.y - bounds.vmin.y > ext) ext = bounds.vmax.y - bounds.vmin.y;
+	if(bounds.vmax.z - bounds.vmin.z > ext) ext = bounds.vmax.z - bounds.vmin.z;
+	q->grid_org = bounds.vmin;
+	q->grid_step = ext > 0.0f ? ext / GRID_RES : 1.0f;
+	while((span = leaf_span(m, q)) > MAX_COORD) {
+		q->grid_step *= (float)span / MAX_COORD * 1.001f;
+	}
+
+	/* leaf origins, and the number of distinct vertices over all leaves */
+	leaf = q->leaves;
+	for(i=0; i<m->num_octnodes; i++) {
+		const struct octnode *on = m->octree + i;
+		if(!on->num_items) continue;
+
+		leaf_range(m, q, on, leaf->origin, gmax);
+		if((num = leaf_verts(m, q, on, leaf->origin, vbuf, 0)) == -1) {
+			fprintf(stderr, "quantize_mesh: too many vertices in an octree leaf\n");
+			goto err;
+		}
+		q->num_verts += num;
+		leaf++;
+	}
+
+	q->size = sizeof *q + q->num_nodes * sizeof *q->nodes + num_leaves * sizeof *q->leaves +
+		(long)q->num_verts * sizeof *q->verts + (long)q->num_tris * sizeof *q->tris +
+		(long)m->num_faces * sizeof *q->faces;
+	orig_size = (long)m->num_faces * sizeof *m->faces + m->num_octnodes * sizeof *m->octree +
+		(long)m->num_octitems * sizeof *m->octitems;
+	if(q->size >= orig_size) {
+		fprintf(stderr, "quantize_mesh: compressing wouldn't save any memory\n");
+		goto err;
+	}
+
+	if(!(q->verts = malloc(q->num_verts * sizeof *q->verts + 1))) {
+		perror("quantize_mesh: failed to allocate mesh vertices");
+		goto err;
+	}
+
+	/* leaves, their vertices and triangles, in node order */
+	leaf = q->leaves;
+	vert = q->verts;
+	tri = q->tris;
+	for(i=0; i<m->num_octnodes; i++) {
+		const struct octnode *on = m->octree + i;
+		struct qoctnode *qn = q->nodes + i;
+		struct aabox *tb = tbox + i;
+
+		qn->num_items = on->num_items;
+		qn->first = on->num_items ? leaf - q->leaves : on->child;
+
+		cgm_vcons(&tb->vmin, FLT_MAX, FLT_MAX, FLT_MAX);
+		cgm_vcons(&tb->vmax, -FLT_MAX, -FLT_MAX, -FLT_MAX);
+		if(!on->num_items) continue;
+
+		leaf->first = tri - q->tris;
+		leaf->verts = vert - q->verts;
+		num = leaf_verts(m, q, on, leaf->origin, vert, tri);
+
+		for(j=0; j<on->num_items; j++) {
+			tri[j].face = m->octitems[on->items + j];
+		}
+		for(j=0; j<num; j++) {
+			cgm_vec3 p;
+			grid_pos(&p, q, leaf->origin, vert[j].v);
+			if(p.x < tb->vmin.x) tb->vmin.x = p.x;
+			if(p.x > tb->vmax.x) tb->vmax.x = p.x;
+			if(p.y < tb->vmin.y) tb->vmin.y = p.y;
+			if(p.y > tb->vmax.y) tb->vmax.y = p.y;
+			if(p.z < tb->vmin.z) tb->vmin.z = p.z;
+			if(p.z > tb->vmax.z) tb->vmax.z = p.z;
+		}
+		tri += on->num_items;
+		vert += num;
+		leaf++;
+	}
+
+	fit_node(m, tbox, 0);
+	if(tbox->vmin.x > tbox->vmax.x) {
+		fprintf(stderr, "quantize_mesh: octree has no faces\n");
+		goto err;
+	}
+	q->bbox = tbox[0];
+	quant_node(m, q, tbox, 0, &q->bbox);
+
+	for(i=0; i<m->num_faces; i++) {
+		struct qface *qf = q->faces + i;
+		f = m->faces + i;
+		for(j=0; j<3; j++) {
+			qf->n[j] = encode_normal(f->n + j);
+			qf->tc[j][0] = f->tc[j].x;
+			qf->tc[j][1] = f->tc[j].y;
+		}
+		qf->mtl = f->mtl;
+	}
+	free(tbox);
+
+	printf("  quantized from %ld KB to %ld KB, grid step %g\n", orig_size >> 10,
+			q->size >> 10, q->grid_step);
+
+	if(m->cache_map) {
+		munmap(m->cache_map, m->cache_size);
+	} else {
+		free(m->faces);
+		free(m->octree);
+		free(m->octitems);
+	}
+	m->faces = 0;
+	m->octree = 0;
+	m->num_octnodes = 0;
+	m->octitems = 0;
+	m->num_octitems = 0;
+	m->cache_map = 0;
+	m->cache_size = 0;
+	m->quant = q;
+	return 0;
+
+err:
+	free(tbox);
+	free_mesh_quant(q);
+	return -1;
+}
+
+void free_mesh_quant(struct mesh_quant *q)
+{
+	if(!q) return;
+	free(q->nodes);
+	free(q->leaves);
+	free(q->verts);
+	free(q->tris);
+	free(q->faces);
+	free(q);
+}
+
+/* returns the largest extent of the faces of any leaf, in grid steps */
+static int leaf_span(const struct mesh *m, const struct mesh_quant *q)
+{
+	int i, j, max_span = 0;
+	int gmin[3], gmax[3];
+
+	for(i=0; i<m->num_octnodes; i++) {
+		if(!m->octree[i].num_items) continue;
+
+		leaf_range(m, q, m->octree + i, gmin, gmax);
+		for(j=0; j<3; j++) {
+			if(gmax[j] - gmin[j] > max_span) {
+				max_span = gmax[j] - gmin[j];
+			}
+		}
+	}
+	return max_span;
+}
+
+static void leaf_range(const struct mesh *m, const struct mesh_quant *q,
+		const struct octnode *on, int *gmin, int *gmax)
+{
+	int i, j, k, g[3];
+	const struct face *f;
+
+	for(i=0; i<3; i++) {
+		gmin[i] = INT_MAX;
+		gmax[i] = INT_MIN;
+	}
+	for(i=0; i<on->num_items; i++) {
+		f = m->faces + m->octitems[on->items + i];
+		for(j=0; j<3; j++) {
+			grid_coord(g, q, f->v + j);
+			for(k=0; k<3; k++) {
+				if(g[k] < gmin[k]) gmin[k] = g[k];
+				if(g[k] > gmax[k]) gmax[k] = g[k];
+			}
+		}
+	}
+}
+
+/* collects the distinct vertices of the faces of a leaf in verts, and sets the
+ * vertex indices of the triangles in tris, unless it's null. Returns the number
+ * of vertices, or -1 if there are too many for the triangle indices.
+ */
+static int leaf_verts(const struct mesh *m, const struct mesh_quant *q,
+		const struct octnode *on, const int *origin, struct qvert *verts, struct qtri *tris)
+{
+	int i, j, k, g[3], num = 0;
+	const struct face *f;
+
+	for(i=0; i<on->num_items; i++) {
+		f = m->faces + m->octitems[on->items + i];
+		for(j=0; j<3; j++) {
+			grid_coord(g, q, f->v + j);
+			g[0] -= origin[0];
+			g[1] -= origin[1];
+			g[2] -= origin[2];
+
+			for(k=0; k<num; k++) {
+				if(verts[k].v[0] == g[0] && verts[k].v[1] == g[1] && verts[k].v[2] == g[2]) {
+					break;
+				}
+			}
+			if(k >= num) {
+				if(num >= MAX_LEAF_VERTS) return -1;
+				verts[num].v[0] = g[0];
+				verts[num].v[1] = g[1];
+				verts[num].v[2] = g[2];
+				num++;
+			}
+			if(tris) tris[i].v[j] = k;
+		}
+	}
+	return num;
+}
+
+static void grid_coord(int *res, const struct mesh_quant *q, const cgm_vec3 *p)
+{
+	int i;
+	for(i=0; i<3; i++) {
+		res[i] = (int)((ELEM(*p, i) - ELEM(q->grid_org, i)) / q->grid_step + 0.5f);
+	}
+}
+
+/* internal node bounds are the union of their children, empty subtrees keep
+ * empty (inverted) bounds
+ */
+static void fit_node(const struct mesh *m, struct aabox *tbox, int nidx)
+{
+	int i, cidx = m->octree[nidx].child;
+	struct aabox *tb = tbox + nidx, *cb;
+
+	if(m->octree[nidx].num_items || !cidx) return;
+
+	for(i=0; i<8; i++) {
+		fit_node(m, tbox, cidx + i);
+		cb = tbox + cidx + i;
+		if(cb->vmin.x < tb->vmin.x) tb->vmin.x = cb->vmin.x;
+		if(cb->vmax.x > tb->vmax.x) tb->vmax.x = cb->vmax.x;
+		if(cb->vmin.y < tb->vmin.y) tb->vmin.y = cb->vmin.y;
+		if(cb->vmax.y > tb->vmax.y) tb->vmax.y = cb->vmax.y;
+		if(cb->vmin.z < tb->vmin.z) tb->vmin.z = cb->vmin.z;
+		if(cb->vmax.z > tb->vmax.z) tb->vmax.z = cb->vmax.z;
+	}
+}
+
+/* quantizes the children of a node against box, the node bounds as the
+ * traversal decodes them. Empty subtrees become empty leaves.
+ */
+static void quant_node(const struct mesh *m, struct mesh_quant *q, const struct aabox *tbox,
+		int nidx, const struct aabox *box)
+{
+	int i, j, cidx = q->nodes[nidx].first;
+	struct qoctnode *cn;
+	const struct aabox *cb;
+	struct aabox cbox;
+
+	if(q->nodes[nidx].num_items || !cidx) return;
+
+	for(i=0; i<8; i++) {
+		cn = q->nodes + cidx + i;
+		cb = tbox + cidx + i;
+		if(cb->vmin.x > cb->vmax.x) {
+			memset(cn, 0, sizeof *cn);
+			continue;
+		}
+		for(j=0; j<3; j++) {
+			quant_range(ELEM(cb->vmin, j), ELEM(cb->vmax, j), ELEM(box->vmin, j),
+					ELEM(box->vmax, j), cn->bmin + j, cn->bmax + j);
+		}
+		child_box(&cbox, box, cn);
+		quant_node(m, q, tbox, cidx + i, &cbox);
+	}
+}
+
+static void quant_range(float lo, float hi, float pmin, float pmax,
+		unsigned char *qlo, unsigned char *qhi)
+{
+	int a, b;
+	float scale = pmax > pmin ? 255.0f / (pmax - pmin) : 0.0f;
+
+	a = (int)floor((lo - pmin) * scale);
+	b = (int)ceil((hi - pmin) * scale);
+	if(a < 0) a = 0;
+	if(a > 255) a = 255;
+	if(b < 0) b = 0;
+	if(b > 255) b = 255;
+
+	/* step outwards past any rounding in the decoded bounds */
+	while(a > 0 && qdecode(pmin, pmax, a) > lo) a--;
+	while(b < 255 && qdecode(pmin, pmax, b) < hi) b++;
+	*qlo = a;
+	*qhi = b;
+}
+
+/* folds the octahedron the normal lies on onto the plane, with the lower half
+ * folded over the corners
+ */
+static unsigned int encode_normal(const cgm_vec3 *n)
+{
+	float x, y, len;
+	unsigned int qx, qy;
+
+	if((len = fabs(n->x) + fabs(n->y) + fabs(n->z)) <= 0.0f) {
+		return 0x80008000;
+	}
+	x = n->x / len;
+	y = n->y / len;
+	if(n->z < 0.0f) {
+		float fx = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = fx;
+	}
+	qx = (unsigned int)((x * 0.5f + 0.5f) * 65535.0f + 0.5f);
+	qy = (unsigned int)((y * 0.5f + 0.5f) * 65535.0f + 0.5f);
+	return qx | (qy << 16);
+}
+
+static void decode_normal(cgm_vec3 *n, unsigned int q)
+{
+	float x, y, z;
+
+	x = (float)(q & 0xffff) / 32767.5f - 1.0f;
+	y = (float)(q >> 16) / 32767.5f - 1.0f;
+	if((z = 1.0f - fabs(x) - fabs(y)) < 0.0f) {
+		float fx = (1.0f - fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = fx;
+	}
+	cgm_vcons(n, x, y, z);
+	cgm_vnormalize(n);
+}
+
+int find_qmesh_isect(const struct mesh_quant *q, const cgm_ray *lray, const cgm_ray *ray,
+		struct surf_hit *hit)
+{
+	int i;
+	struct qhit qh;
+	const struct qface *qf;
+	cgm_vec3 n[3], tc[3];
+
+	qh.t = FLT_MAX;
+	if(!ray_qnode(q, 0, &q->bbox, lray, &qh)) {
+		return 0;
+	}
+
+	if(hit) {
+		qf = q->faces + qh.face;
+		for(i=0; i<3; i++) {
+			decode_normal(n + i, qf->n[i]);
+			cgm_vcons(tc + i, qf->tc[i][0], qf->tc[i][1], 0.0f);
+		}
+
+		hit->t = qh.t;
+		hit->mtl = qf->mtl;
+		cgm_raypos(&hit->pos, ray, hit->t);
+
+		cgm_vcons(&hit->normal, 0, 0, 0);
+		cgm_vcons(&hit->tex, 0, 0, 0);
+		cgm_vadd_scaled(&hit->normal, n, qh.bc.x);
+		cgm_vadd_scaled(&hit->normal, n + 1, qh.bc.y);
+		cgm_vadd_scaled(&hit->normal, n + 2, qh.bc.z);
+		cgm_vadd_scaled(&hit->tex, tc, qh.bc.x);
+		cgm_vadd_scaled(&hit->tex, tc + 1, qh.bc.y);
+		cgm_vadd_scaled(&hit->tex, tc + 2, qh.bc.z);
+		hit->uvscale = tri_uvscale(qh.v, tc);
+	}
+	return 1;
+}
+
+/* box is the decoded bounds of the node. Only hits nearer than the one in hit
+ * so far are recorded.
+ */
+static int ray_qnode(const struct mesh_quant *q, int nidx, const struct aabox *box,
+		const cgm_ray *ray, struct qhit *hit)
+{
+	int i, k, found = 0;
+	float t;
+	cgm_vec3 v[3], bc;
+	struct aabox cbox;
+	const struct qoctnode *on = q->nodes + nidx, *cn;
+	const struct qleaf *leaf;
+	const struct qvert *verts;
+	const struct qtri *tri;
+
+	if(!ray_aabox(box, ray, 0)) {
+		return 0;
+	}
+
+	if(on->num_items) {
+		leaf = q->leaves + on->first;
+		tri = q->tris + leaf->first;
+		verts = q->verts + leaf->verts;
+		for(i=0; i<on->num_items; i++) {
+			for(k=0; k<3; k++) {
+				grid_pos(v + k, q, leaf->origin, verts[tri[i].v[k]].v);
+			}
+			if((t = ray_triangle(ray, v, &bc)) >= 0.0f && t < hit->t) {
+				hit->t = t;
+				hit->face = tri[i].face;
+				hit->bc = bc;
+				memcpy(hit->v, v, sizeof v);
+				found = 1;
+			}
+		}
+		return found;
+	}
+
+	if(!on->first) return 0;
+
+	for(i=0; i<8; i++) {
+		cn = q->nodes + on->first + i;
+		if(!cn->num_items && !cn->first) continue;
+
+		child_box(&cbox, box, cn);
+		if(ray_qnode(q, on->first + i, &cbox, ray, hit)) {
+			found = 1;
+		}
+	}
+	return found;
+}
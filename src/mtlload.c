@@ -0,0 +1,181 @@
+/* MTL material library loader
+ *
+ * Only the parts of the format which map to our material model are used:
+ *   Kd: diffuse color
+ *   Ke: emission
+ *   Ns: specular exponent, converted to roughness
+ *   Pr, Pm: roughness and metallic from the PBR extension, if present
+ *   map_Kd, map_Pr: color and roughness textures, relative to the library
+ * Everything else, including texture map options, is ignored.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "scene.h"
+
+static int add_mtl(struct scene *scn, struct material *mtl, int *num_added);
+static int parse_vec(char *args, cgm_vec3 *res);
+static int parse_float(char *args, float *res);
+static const char *map_filename(const char *args);
+
+int load_mtllib(struct scene *scn, const char *fname)
+{
+	FILE *fp;
+	int line_num = 0, have_pr = 0, num_added = 0, res = -1;
+	char buf[512], *line, *cmd, *args, *end;
+	struct material mtl;
+
+	if(!(fp = fopen(fname, "rb"))) {
+		fprintf(stderr, "load_mtllib: failed to open material library: %s\n", fname);
+		return -1;
+	}
+
+	mtl.name = 0;
+	while(fgets(buf, sizeof buf, fp)) {
+		line_num++;
+		if((line = strchr(buf, '#'))) *line = 0;
+
+		line = buf;
+		while(*line && isspace(*line)) line++;
+		if(!*line) continue;
+
+		cmd = line;
+		while(*line && !isspace(*line)) line++;
+		if(*line) *line++ = 0;
+		while(*line && isspace(*line)) line++;
+		args = line;
+
+		end = args + strlen(args);
+		while(end > args && isspace(end[-1])) end--;
+		*end = 0;
+
+		if(strcmp(cmd, "newmtl") == 0) {
+			if(add_mtl(scn, &mtl, &num_added) == -1) {
+				goto end;
+			}
+			if(!*args) {
+				fprintf(stderr, "%s:%d: newmtl: missing name\n", fname, line_num);
+				goto end;
+			}
+			init_material(&mtl);
+			if(!(mtl.name = strdup(args))) {
+				fprintf(stderr, "load_mtllib: failed to allocate material\n");
+				goto end;
+			}
+			have_pr = 0;
+			continue;
+		}
+
+		if(!mtl.name) {
+			continue;	/* ignore everything before the first newmtl */
+		}
+
+		if(strcmp(cmd, "Kd") == 0) {
+			if(parse_vec(args, &mtl.color) == -1) goto inval;
+
+		} else if(strcmp(cmd, "Ke") == 0) {
+			if(parse_vec(args, &mtl.emission) == -1) goto inval;
+
+		} else if(strcmp(cmd, "Ns") == 0) {
+			float ns;
+			if(parse_float(args, &ns) == -1) goto inval;
+			/* Beckmann roughness with the same highlight width as Phong */
+			if(!have_pr) {
+				mtl.roughness = sqrt(2.0f / (ns + 2.0f));
+			}
+
+		} else if(strcmp(cmd, "Pr") == 0) {
+			if(parse_float(args, &mtl.roughness) == -1) goto inval;
+			have_pr = 1;
+
+		} else if(strcmp(cmd, "Pm") == 0) {
+			float pm;
+			if(parse_float(args, &pm) == -1) goto inval;
+			mtl.metallic = pm >= 0.5f;
+
+		} else if(strcmp(cmd, "map_Kd") == 0 || strcmp(cmd, "map_Pr") == 0) {
+			int tex, *dest = cmd[5] == 'd' ? &mtl.color_tex : &mtl.rough_tex;
+			if(!*args) goto inval;
+			if((tex = add_texture(scn, fname, map_filename(args))) == -1) {
+				fprintf(stderr, "load_mtllib: failed to allocate texture\n");
+				goto end;
+			}
+			*dest = tex;
+		}
+		continue;
+
+inval:
+		fprintf(stderr, "%s:%d: invalid %s: %s\n", fname, line_num, cmd, args);
+		goto end;
+	}
+
+	if(add_mtl(scn, &mtl, &num_added) == -1) {
+		goto end;
+	}
+	printf("loaded material library: %s: %d materials\n", fname, num_added);
+	res = 0;
+
+end:
+	free(mtl.name);
+	fclose(fp);
+	return res;
+}
+
+/* adds the material if one with the same name doesn't exist already, and
+ * either way releases the name of mtl
+ */
+static int add_mtl(struct scene *scn, struct material *mtl, int *num_added)
+{
+	if(!mtl->name) return 0;
+
+	if(find_material(scn, mtl->name) == -1) {
+		if(add_material(scn, mtl) == -1) {
+			fprintf(stderr, "load_mtllib: failed to add material: %s\n", mtl->name);
+			return -1;
+		}
+		(*num_added)++;
+		mtl->name = 0;
+		return 0;
+	}
+
+	free(mtl->name);
+	mtl->name = 0;
+	return 0;
+}
+
+static int parse_vec(char *args, cgm_vec3 *res)
+{
+	char *endp;
+
+	res->x = strtod(args, &endp);
+	if(endp == args) return -1;
+	args = endp;
+	res->y = strtod(args, &endp);
+	if(endp == args) {
+		/* a single value applies to all channels */
+		res->y = res->z = res->x;
+		return 0;
+	}
+	args = endp;
+	res->z = strtod(args, &endp);
+	return endp == args ? -1 : 0;
+}
+
+static int parse_float(char *args, float *res)
+{
+	char *endp;
+
+	*res = strtod(args, &endp);
+	return endp == args ? -1 : 0;
+}
+
+/* texture map options come before the filename */
+static const char *map_filename(const char *args)
+{
+	const char *ptr = args + strlen(args);
+
+	while(ptr > args && !isspace(ptr[-1])) ptr--;
+	return ptr;
+}
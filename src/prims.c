@@ -0,0 +1,556 @@
+/* world space spheres and boxes
+ *
+ * Primitives are sorted along a Morton curve through their centers, so that
+ * consecutive primitives are close together, and stored as one array per
+ * attribute. Blocks of PRIM_BLOCK_SIZE consecutive primitives are intersected
+ * at once, in loops without branches, which the compiler turns into SIMD code.
+ * The blocks are the leaves of an implicit bounds tree, so sorting is all it
+ * takes to build it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include "prims.h"
+#include "surf.h"
+#include "dynarr.h"
+
+#define EPSILON		1e-5f
+
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+
+/* ray data shared by all the tests of a ray */
+struct prim_ray {
+	cgm_vec3 org, dir, inv_dir;
+	float dd, inv_dd;	/* squared length of dir, and its reciprocal */
+};
+
+struct sort_key {
+	unsigned int code;
+	int idx;
+};
+
+/* intersects count primitives starting at start, and returns the index of the
+ * nearest one closer than *t, updating *t, or -1 if there's none
+ */
+typedef int (*block_isect_func)(const void *arr, int start, int count,
+		const struct prim_ray *pr, float *t);
+
+static int build_spheres(struct prim_set *ps);
+static int build_boxes(struct prim_set *ps);
+static struct sort_key *morton_order(const cgm_vec3 *centers, int count, int stride,
+		const struct aabox *bbox);
+static int build_tree(struct prim_tree *tree, struct aabox *blocks, int num_blocks);
+static void free_tree(struct prim_tree *tree);
+static int ray_tree(const struct prim_tree *tree, int level, int idx, const void *arr,
+		int count, block_isect_func isect, const struct prim_ray *pr, float *t);
+static int ray_spheres(const void *arr, int start, int count, const struct prim_ray *pr,
+		float *t);
+static int ray_boxes(const void *arr, int start, int count, const struct prim_ray *pr,
+		float *t);
+static void box_normal(cgm_vec3 *n, const struct box_array *ba, int idx,
+		const struct prim_ray *pr);
+
+int init_prims(struct prim_set *ps)
+{
+	memset(ps, 0, sizeof *ps);
+	aabox_init(&ps->bbox);
+
+	ps->new_sph = dynarr_alloc(0, sizeof *ps->new_sph);
+	ps->new_box = dynarr_alloc(0, sizeof *ps->new_box);
+	if(!ps->new_sph || !ps->new_box) {
+		clear_prims(ps);
+		return -1;
+	}
+	return 0;
+}
+
+void clear_prims(struct prim_set *ps)
+{
+	/* all attributes of each kind are allocated together, see build_* */
+	free(ps->sph.x);
+	free(ps->sph.mtl);
+	free_tree(&ps->sph.tree);
+	free(ps->box.x0);
+	free(ps->box.mtl);
+	free_tree(&ps->box.tree);
+
+	if(ps->new_sph) dynarr_free(ps->new_sph);
+	if(ps->new_box) dynarr_free(ps->new_box);
+	memset(ps, 0, sizeof *ps);
+}
+
+int add_prim_sphere(struct prim_set *ps, float x, float y, float z, float rad, int mtl)
+{
+	struct prim_sphere sph;
+	void *tmp;
+
+	cgm_vcons(&sph.pos, x, y, z);
+	sph.rad = rad;
+	sph.mtl = mtl;
+	if(!(tmp = dynarr_push(ps->new_sph, &sph))) {
+		return -1;
+	}
+	ps->new_sph = tmp;
+	return 0;
+}
+
+int add_prim_box(struct prim_set *ps, const struct aabox *box, int mtl)
+{
+	struct prim_box pbox;
+	void *tmp;
+
+	pbox.box = *box;
+	pbox.mtl = mtl;
+	if(!(tmp = dynarr_push(ps->new_box, &pbox))) {
+		return -1;
+	}
+	ps->new_box = tmp;
+	return 0;
+}
+
+static void sphere_bounds(struct aabox *res, float x, float y, float z, float rad)
+{
+	cgm_vcons(&res->vmin, x - rad, y - rad, z - rad);
+	cgm_vcons(&res->vmax, x + rad, y + rad, z + rad);
+}
+
+int build_prims(struct prim_set *ps)
+{
+	int i;
+	struct aabox b;
+
+	for(i=0; i<dynarr_size(ps->new_sph); i++) {
+		struct prim_sphere *sph = ps->new_sph + i;
+		sphere_bounds(&b, sph->pos.x, sph->pos.y, sph->pos.z, sph->rad);
+		aabox_add(&ps->bbox, &b);
+	}
+	for(i=0; i<dynarr_size(ps->new_box); i++) {
+		aabox_add(&ps->bbox, &ps->new_box[i].box);
+	}
+
+	if(build_spheres(ps) == -1 || build_boxes(ps) == -1) {
+		fprintf(stderr, "build_prims: failed to allocate primitive arrays\n");
+		return -1;
+	}
+
+	printf("built primitive arrays: %d spheres, %d boxes\n", ps->sph.count, ps->box.count);
+
+	DYNARR_CLEAR(ps->new_sph);
+	DYNARR_CLEAR(ps->new_box);
+	return 0;
+}
+
+static int build_spheres(struct prim_set *ps)
+{
+	int i, j, num, num_blocks;
+	struct sphere_array *sa = &ps->sph;
+	struct prim_sphere *sph;
+	struct sort_key *keys;
+	struct aabox *blocks, b;
+
+	if((num = dynarr_size(ps->new_sph)) <= 0) {
+		return 0;
+	}
+	if(!(keys = morton_order(&ps->new_sph->pos, num, sizeof *ps->new_sph, &ps->bbox))) {
+		return -1;
+	}
+
+	num_blocks = (num + PRIM_BLOCK_SIZE - 1) / PRIM_BLOCK_SIZE;
+	sa->x = malloc(num * 4 * sizeof *sa->x);
+	sa->mtl = malloc(num * sizeof *sa->mtl);
+	blocks = malloc(num_blocks * sizeof *blocks);
+	if(!sa->x || !sa->mtl || !blocks) {
+		free(sa->x);
+		free(sa->mtl);
+		sa->x = 0;
+		sa->mtl = 0;
+		free(blocks);
+		free(keys);
+		return -1;
+	}
+	sa->y = sa->x + num;
+	sa->z = sa->y + num;
+	sa->rad = sa->z + num;
+
+	for(i=0; i<num; i++) {
+		sph = ps->new_sph + keys[i].idx;
+		sa->x[i] = sph->pos.x;
+		sa->y[i] = sph->pos.y;
+		sa->z[i] = sph->pos.z;
+		sa->rad[i] = sph->rad;
+		sa->mtl[i] = sph->mtl;
+
+		j = i / PRIM_BLOCK_SIZE;
+		sphere_bounds(&b, sph->pos.x, sph->pos.y, sph->pos.z, sph->rad);
+		if(i % PRIM_BLOCK_SIZE) {
+			aabox_add(blocks + j, &b);
+		} else {
+			blocks[j] = b;
+		}
+	}
+	free(keys);
+
+	sa->count = num;
+	return build_tree(&sa->tree, blocks, num_blocks);
+}
+
+static int build_boxes(struct prim_set *ps)
+{
+	int i, j, num, num_blocks;
+	struct box_array *ba = &ps->box;
+	struct prim_box *box;
+	struct sort_key *keys;
+	struct aabox *blocks;
+	cgm_vec3 *centers;
+
+	if((num = dynarr_size(ps->new_box)) <= 0) {
+		return 0;
+	}
+
+	if(!(centers = malloc(num * sizeof *centers))) {
+		return -1;
+	}
+	for(i=0; i<num; i++) {
+		box = ps->new_box + i;
+		cgm_vlerp(centers + i, &box->box.vmin, &box->box.vmax, 0.5f);
+	}
+	keys = morton_order(centers, num, sizeof *centers, &ps->bbox);
+	free(centers);
+	if(!keys) return -1;
+
+	num_blocks = (num + PRIM_BLOCK_SIZE - 1) / PRIM_BLOCK_SIZE;
+	ba->x0 = malloc(num * 6 * sizeof *ba->x0);
+	ba->mtl = malloc(num * sizeof *ba->mtl);
+	blocks = malloc(num_blocks * sizeof *blocks);
+	if(!ba->x0 || !ba->mtl || !blocks) {
+		free(ba->x0);
+		free(ba->mtl);
+		ba->x0 = 0;
+		ba->mtl = 0;
+		free(blocks);
+		free(keys);
+		return -1;
+	}
+	ba->y0 = ba->x0 + num;
+	ba->z0 = ba->y0 + num;
+	ba->x1 = ba->z0 + num;
+	ba->y1 = ba->x1 + num;
+	ba->z1 = ba->y1 + num;
+
+	for(i=0; i<num; i++) {
+		box = ps->new_box + keys[i].idx;
+		ba->x0[i] = box->box.vmin.x;
+		ba->y0[i] = box->box.vmin.y;
+		ba->z0[i] = box->box.vmin.z;
+		ba->x1[i] = box->box.vmax.x;
+		ba->y1[i] = box->box.vmax.y;
+		ba->z1[i] = box->box.vmax.z;
+		ba->mtl[i] = box->mtl;
+
+		j = i / PRIM_BLOCK_SIZE;
+		if(i % PRIM_BLOCK_SIZE) {
+			aabox_add(blocks + j, &box->box);
+		} else {
+			blocks[j] = box->box;
+		}
+	}
+	free(keys);
+
+	ba->count = num;
+	return build_tree(&ba->tree, blocks, num_blocks);
+}
+
+/* spreads the low 10 bits of x, two zero bits apart */
+static unsigned int spread_bits(unsigned int x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x30000ff;
+	x = (x | (x << 8)) & 0x300f00f;
+	x = (x | (x << 4)) & 0x30c30c3;
+	x = (x | (x << 2)) & 0x9249249;
+	return x;
+}
+
+static int cmp_keys(const void *a, const void *b)
+{
+	const struct sort_key *ka = a;
+	const struct sort_key *kb = b;
+
+	if(ka->code != kb->code) {
+		return ka->code < kb->code ? -1 : 1;
+	}
+	return ka->idx - kb->idx;
+}
+
+/* returns the indices of the centers (stride bytes apart) in Morton order */
+static struct sort_key *morton_order(const cgm_vec3 *centers, int count, int stride,
+		const struct aabox *bbox)
+{
+	int i;
+	float sx, sy, sz;
+	unsigned int x, y, z;
+	const cgm_vec3 *c;
+	struct sort_key *keys;
+
+	if(!(keys = malloc(count * sizeof *keys))) {
+		return 0;
+	}
+
+	sx = bbox->vmax.x > bbox->vmin.x ? 1023.0f / (bbox->vmax.x - bbox->vmin.x) : 0.0f;
+	sy = bbox->vmax.y > bbox->vmin.y ? 1023.0f / (bbox->vmax.y - bbox->vmin.y) : 0.0f;
+	sz = bbox->vmax.z > bbox->vmin.z ? 1023.0f / (bbox->vmax.z - bbox->vmin.z) : 0.0f;
+
+	for(i=0; i<count; i++) {
+		c = (const cgm_vec3*)((const char*)centers + i * stride);
+		x = (unsigned int)((c->x - bbox->vmin.x) * sx);
+		y = (unsigned int)((c->y - bbox->vmin.y) * sy);
+		z = (unsigned int)((c->z - bbox->vmin.z) * sz);
+		keys[i].code = spread_bits(x) | (spread_bits(y) << 1) | (spread_bits(z) << 2);
+		keys[i].idx = i;
+	}
+	qsort(keys, count, sizeof *keys, cmp_keys);
+	return keys;
+}
+
+/* takes ownership of the block bounds, which become level 0 */
+static int build_tree(struct prim_tree *tree, struct aabox *blocks, int num_blocks)
+{
+	int i, j, n, num_levels = 1;
+	struct aabox *lvl, *below;
+
+	for(n=num_blocks; n>1; n=(n + PRIM_BLOCK_SIZE - 1) / PRIM_BLOCK_SIZE) {
+		num_levels++;
+	}
+
+	tree->levels = malloc(num_levels * sizeof *tree->levels);
+	tree->level_size = malloc(num_levels * sizeof *tree->level_size);
+	if(!tree->levels || !tree->level_size) {
+		free(tree->levels);
+		free(tree->level_size);
+		tree->levels = 0;
+		tree->level_size = 0;
+		free(blocks);
+		return -1;
+	}
+	tree->levels[0] = blocks;
+	tree->level_size[0] = num_blocks;
+	tree->num_levels = 1;
+
+	for(i=1; i<num_levels; i++) {
+		n = (tree->level_size[i - 1] + PRIM_BLOCK_SIZE - 1) / PRIM_BLOCK_SIZE;
+		if(!(lvl = malloc(n * sizeof *lvl))) {
+			free_tree(tree);
+			return -1;
+		}
+		below = tree->levels[i - 1];
+		for(j=0; j<tree->level_size[i - 1]; j++) {
+			if(j % PRIM_BLOCK_SIZE) {
+				aabox_add(lvl + j / PRIM_BLOCK_SIZE, below + j);
+			} else {
+				lvl[j / PRIM_BLOCK_SIZE] = below[j];
+			}
+		}
+		tree->levels[i] = lvl;
+		tree->level_size[i] = n;
+		tree->num_levels++;
+	}
+	return 0;
+}
+
+static void free_tree(struct prim_tree *tree)
+{
+	int i;
+
+	for(i=0; i<tree->num_levels; i++) {
+		free(tree->levels[i]);
+	}
+	free(tree->levels);
+	free(tree->level_size);
+	memset(tree, 0, sizeof *tree);
+}
+
+int find_prims_isect(const struct prim_set *ps, const cgm_ray *ray, struct surf_hit *hit)
+{
+	int sidx = -1, bidx = -1;
+	float t = FLT_MAX, len;
+	struct prim_ray pr;
+
+	pr.org = ray->origin;
+	pr.dir = ray->dir;
+	cgm_vcons(&pr.inv_dir, 1.0f / ray->dir.x, 1.0f / ray->dir.y, 1.0f / ray->dir.z);
+	pr.dd = cgm_vdot(&ray->dir, &ray->dir);
+	pr.inv_dd = 1.0f / pr.dd;
+
+	if(ps->sph.count) {
+		sidx = ray_tree(&ps->sph.tree, ps->sph.tree.num_levels - 1, 0, &ps->sph,
+				ps->sph.count, ray_spheres, &pr, &t);
+	}
+	/* any box hit found now is closer than the nearest sphere */
+	if(ps->box.count) {
+		bidx = ray_tree(&ps->box.tree, ps->box.tree.num_levels - 1, 0, &ps->box,
+				ps->box.count, ray_boxes, &pr, &t);
+	}
+	if(sidx < 0 && bidx < 0) {
+		return 0;
+	}
+
+	if(hit) {
+		hit->t = t;
+		cgm_raypos(&hit->pos, ray, t);
+		cgm_vcons(&hit->tex, 0, 0, 0);
+		hit->uvscale = 0.0f;
+
+		if(bidx >= 0) {
+			box_normal(&hit->normal, &ps->box, bidx, &pr);
+			hit->mtl = ps->box.mtl[bidx];
+		} else {
+			const struct sphere_array *sa = &ps->sph;
+
+			cgm_vcons(&hit->normal, hit->pos.x - sa->x[sidx], hit->pos.y - sa->y[sidx],
+					hit->pos.z - sa->z[sidx]);
+			if((len = cgm_vlength(&hit->normal)) > 0.0f) {
+				cgm_vscale(&hit->normal, 1.0f / len);
+			}
+			hit->mtl = sa->mtl[sidx];
+		}
+	}
+	return 1;
+}
+
+/* nearest hit closer than *t, in the subtree of node idx of a level. Returns
+ * the index of the primitive hit, or -1
+ */
+static int ray_tree(const struct prim_tree *tree, int level, int idx, const void *arr,
+		int count, block_isect_func isect, const struct prim_ray *pr, float *t)
+{
+	int i, end, res = -1, child;
+
+	if(!ray_aabox_enter(tree->levels[level] + idx, &pr->org, &pr->inv_dir, *t)) {
+		return -1;
+	}
+
+	if(level == 0) {
+		i = idx * PRIM_BLOCK_SIZE;
+		return isect(arr, i, MIN(PRIM_BLOCK_SIZE, count - i), pr, t);
+	}
+
+	end = MIN((idx + 1) * PRIM_BLOCK_SIZE, tree->level_size[level - 1]);
+	for(i=idx * PRIM_BLOCK_SIZE; i<end; i++) {
+		if((child = ray_tree(tree, level - 1, i, arr, count, isect, pr, t)) >= 0) {
+			res = child;
+		}
+	}
+	return res;
+}
+
+/* the first loop of the block tests has no branches, so that it can be vectorized */
+static int ray_spheres(const void *arr, int start, int count, const struct prim_ray *pr,
+		float *t)
+{
+	int i, res = -1;
+	float ox, oy, oz, b, c, d, sq, t0, t1, tt, tsph[PRIM_BLOCK_SIZE];
+	const struct sphere_array *sa = arr;
+	const float *x = sa->x + start;
+	const float *y = sa->y + start;
+	const float *z = sa->z + start;
+	const float *rad = sa->rad + start;
+
+	for(i=0; i<count; i++) {
+		ox = pr->org.x - x[i];
+		oy = pr->org.y - y[i];
+		oz = pr->org.z - z[i];
+		b = pr->dir.x * ox + pr->dir.y * oy + pr->dir.z * oz;
+		c = ox * ox + oy * oy + oz * oz - rad[i] * rad[i];
+		d = b * b - pr->dd * c;
+		sq = sqrtf(d > 0.0f ? d : 0.0f);
+		t0 = (-b - sq) * pr->inv_dd;
+		t1 = (-b + sq) * pr->inv_dd;
+		tt = t0 > EPSILON ? t0 : t1;
+		tsph[i] = d >= 0.0f && tt > EPSILON ? tt : FLT_MAX;
+	}
+
+	for(i=0; i<count; i++) {
+		if(tsph[i] < *t) {
+			*t = tsph[i];
+			res = start + i;
+		}
+	}
+	return res;
+}
+
+static int ray_boxes(const void *arr, int start, int count, const struct prim_ray *pr,
+		float *t)
+{
+	int i, res = -1;
+	float t0, t1, tnear, tfar, tt, tbox[PRIM_BLOCK_SIZE];
+	const struct box_array *ba = arr;
+	const float *x0 = ba->x0 + start, *x1 = ba->x1 + start;
+	const float *y0 = ba->y0 + start, *y1 = ba->y1 + start;
+	const float *z0 = ba->z0 + start, *z1 = ba->z1 + start;
+
+	for(i=0; i<count; i++) {
+		t0 = (x0[i] - pr->org.x) * pr->inv_dir.x;
+		t1 = (x1[i] - pr->org.x) * pr->inv_dir.x;
+		tnear = MIN(t0, t1);
+		tfar = MAX(t0, t1);
+
+		t0 = (y0[i] - pr->org.y) * pr->inv_dir.y;
+		t1 = (y1[i] - pr->org.y) * pr->inv_dir.y;
+		tnear = MAX(tnear, MIN(t0, t1));
+		tfar = MIN(tfar, MAX(t0, t1));
+
+		t0 = (z0[i] - pr->org.z) * pr->inv_dir.z;
+		t1 = (z1[i] - pr->org.z) * pr->inv_dir.z;
+		tnear = MAX(tnear, MIN(t0, t1));
+		tfar = MIN(tfar, MAX(t0, t1));
+
+		tt = tnear > EPSILON ? tnear : tfar;
+		tbox[i] = tnear <= tfar && tt > EPSILON ? tt : FLT_MAX;
+	}
+
+	for(i=0; i<count; i++) {
+		if(tbox[i] < *t) {
+			*t = tbox[i];
+			res = start + i;
+		}
+	}
+	return res;
+}
+
+/* normal of the slab face the ray went through, which ray_boxes found as the
+ * last slab entered, or the first one left for rays starting inside. Unlike
+ * the nearest face to the hit point, this works for boxes with no thickness.
+ */
+static void box_normal(cgm_vec3 *n, const struct box_array *ba, int idx,
+		const struct prim_ray *pr)
+{
+	int i, enter, exit;
+	float t0, t1, tmin[3], tmax[3];
+	float bmin[3], bmax[3];
+
+	bmin[0] = ba->x0[idx];
+	bmin[1] = ba->y0[idx];
+	bmin[2] = ba->z0[idx];
+	bmax[0] = ba->x1[idx];
+	bmax[1] = ba->y1[idx];
+	bmax[2] = ba->z1[idx];
+
+	enter = exit = 0;
+	for(i=0; i<3; i++) {
+		t0 = (bmin[i] - (&pr->org.x)[i]) * (&pr->inv_dir.x)[i];
+		t1 = (bmax[i] - (&pr->org.x)[i]) * (&pr->inv_dir.x)[i];
+		tmin[i] = MIN(t0, t1);
+		tmax[i] = MAX(t0, t1);
+		if(tmin[i] > tmin[enter]) enter = i;
+		if(tmax[i] < tmax[exit]) exit = i;
+	}
+
+	cgm_vcons(n, 0, 0, 0);
+	if(tmin[enter] > EPSILON) {
+		(&n->x)[enter] = (&pr->dir.x)[enter] > 0.0f ? -1.0f : 1.0f;
+	} else {
+		(&n->x)[exit] = (&pr->dir.x)[exit] > 0.0f ? 1.0f : -1.0f;
+	}
+}
@@ -0,0 +1,76 @@
+#ifndef PRIMS_H_
+#define PRIMS_H_
+
+#include <cgmath/cgmath.h>
+#include "aabox.h"
+
+struct surf_hit;
+
+/* number of primitives intersected at once, and number of children of each
+ * node of the bounds tree
+ */
+#define PRIM_BLOCK_SIZE	16
+
+/* implicit tree of bounding boxes over blocks of consecutive primitives. Node i
+ * of a level bounds nodes i * PRIM_BLOCK_SIZE to (i + 1) * PRIM_BLOCK_SIZE - 1
+ * of the level below it, and the nodes of level 0 bound blocks of primitives.
+ * The last level has a single node.
+ */
+struct prim_tree {
+	struct aabox **levels;
+	int *level_size;
+	int num_levels;
+};
+
+/* primitives are stored as one array per attribute */
+struct sphere_array {
+	float *x, *y, *z, *rad;
+	int *mtl;
+	int count;
+	struct prim_tree tree;
+};
+
+struct box_array {
+	float *x0, *y0, *z0, *x1, *y1, *z1;
+	int *mtl;
+	int count;
+	struct prim_tree tree;
+};
+
+/* input primitives, until build_prims */
+struct prim_sphere {
+	cgm_vec3 pos;
+	float rad;
+	int mtl;
+};
+
+struct prim_box {
+	struct aabox box;
+	int mtl;
+};
+
+/* world space spheres and boxes, each with its own scene material index */
+struct prim_set {
+	struct sphere_array sph;
+	struct box_array box;
+	struct aabox bbox;		/* bounds of all primitives, after build_prims */
+
+	struct prim_sphere *new_sph;	/* dynarr */
+	struct prim_box *new_box;		/* dynarr */
+};
+
+int init_prims(struct prim_set *ps);
+void clear_prims(struct prim_set *ps);
+
+int add_prim_sphere(struct prim_set *ps, float x, float y, float z, float rad, int mtl);
+int add_prim_box(struct prim_set *ps, const struct aabox *box, int mtl);
+
+/* sorts the primitives added so far into the intersection arrays, and builds
+ * their bounds trees. Called once, after adding all the primitives.
+ */
+int build_prims(struct prim_set *ps);
+
+/* fills in everything but the surface of the hit */
+int find_prims_isect(const struct prim_set *ps, const cgm_ray *ray, struct surf_hit *hit);
+
+#endif	/* PRIMS_H_ */
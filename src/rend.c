@@ -10,70 +10,46 @@ struct camera {
 	float xform[16];
 };
 
+static void trace_cone(cgm_vec3 *color, const cgm_ray *ray, float time,
+		const struct ray_cone *cone, int depth);
+static void eval_material(const struct material *mtl, const cgm_ray *ray, float width,
+		const struct surf_hit *hit, cgm_vec3 *color, float *roughness);
+static float texture_lod(const struct texture *tex, float footprint);
+
 static struct scene scn;
-static int max_ray_depth = 5;
+static int max_ray_depth;
 static struct material defmtl;
 static struct camera cam;
 
-int init_rend(void)
+int init_rend(const char *scnfile)
 {
-	union surface *surf;
-	struct mesh *m;
-	struct aabox bbox;
-
 	init_scene(&scn);
-	cgm_vcons(&scn.sky_horiz, 5, 4, 4);
-	cgm_vcons(&scn.sky_zenith, 5, 4, 4);
-
-	set_camera_pos(1.4, 0.1, 0);
-	set_camera_targ(0, 0.5, 0);
-	set_camera_up(0, 1, 0);
-	set_camera_fov(50);
-
-	/*
-	set_camera_pos(0, 1, 5);
-	set_camera_targ(0, 0, 0);
-	set_camera_up(0, 1, 0);
-	set_camera_fov(50);
-
-	surf = create_sphere(0, 1, 0, 1);
-	add_surface(&scn, surf);
-
-	surf = create_aabox(0, -1, 0, 10, 2, 10);
-	add_surface(&scn, surf);
-
-	surf = create_aabox(2, 1, 0, 1, 2, 1);
-	add_surface(&scn, surf);
-
-	surf = create_mesh();
-	m = &surf->mesh.m;
-	begin_mesh(m);
-	mesh_normal(m, 0, 0, 1);
-	mesh_vertex(m, -2, 0, 0);
-	mesh_vertex(m, -2.5, 1, 0);
-	mesh_vertex(m, -1.5, 1, 0);
-	end_mesh(m);
-	add_surface(&scn, surf);
-	*/
-
-	surf = create_mesh();
-	m = &surf->mesh.m;
-	if(load_mesh(m, "sponza_tri.obj") == -1) {
+	if(load_scene(&scn, scnfile) == -1) {
+		clear_scene(&scn);
 		return -1;
 	}
-	calc_mesh_bounds(m, &bbox);
-	printf("mesh bounds: (%f %f %f) - (%f %f %f)\n", bbox.vmin.x, bbox.vmin.y,
-			bbox.vmin.z, bbox.vmax.x, bbox.vmax.y, bbox.vmax.z);
-	add_surface(&scn, surf);
 
-	build_mesh_octree(m, 32, 20);
+	cam.pos = scn.cam_pos;
+	cam.targ = scn.cam_targ;
+	set_camera_up(scn.cam_up.x, scn.cam_up.y, scn.cam_up.z);
+	set_camera_fov(scn.cam_fov);
+	max_ray_depth = scn.max_ray_depth;
 
-	cgm_vcons(&defmtl.color, 0.7, 0.7, 0.7);
-	defmtl.roughness = 1.0f;
+	init_material(&defmtl);
 
 	return 0;
 }
 
+int get_scene_samples(void)
+{
+	return scn.samples;
+}
+
+int set_shutter(float open, float close)
+{
+	return set_scene_shutter(&scn, open, close);
+}
+
 void destroy_rend(void)
 {
 	clear_scene(&scn);
@@ -102,7 +78,17 @@ void set_camera_fov(float vfov_deg)
 	cam.half_fov = cgm_deg_to_rad(vfov_deg) * 0.5f;
 }
 
-void primary_ray(cgm_ray *ray, int x, int y, int sample)
+void get_camera_pos(cgm_vec3 *res)
+{
+	*res = cam.pos;
+}
+
+void get_camera_targ(cgm_vec3 *res)
+{
+	*res = cam.targ;
+}
+
+void primary_ray(cgm_ray *ray, float *time, int x, int y, int sample)
 {
 	struct tinymt32 mt;
 	float xoffs, yoffs;
@@ -119,6 +105,7 @@ void primary_ray(cgm_ray *ray, int x, int y, int sample)
 	yoffs = (2.0f * tinymt32_generate_float(&mt) - 1.0f) / (float)fbheight;
 	ray->dir.x += xoffs;
 	ray->dir.y += yoffs;
+	*time = cgm_lerp(scn.shutter[0], scn.shutter[1], tinymt32_generate_float(&mt));
 
 	cgm_rmul_mr(ray, cam.xform);
 	/*
@@ -128,14 +115,27 @@ void primary_ray(cgm_ray *ray, int x, int y, int sample)
 	*/
 }
 
-void trace_ray(cgm_vec3 *color, const cgm_ray *ray, int depth)
+void trace_ray(cgm_vec3 *color, const cgm_ray *ray, float time, int depth)
+{
+	struct ray_cone cone;
+
+	/* primary ray directions are on a plane at distance 1/tan(half_fov), with
+	 * pixels 2/fbheight apart
+	 */
+	cone.width = 0.0f;
+	cone.spread = 2.0f * tan(cam.half_fov) / (float)fbheight;
+	trace_cone(color, ray, time, &cone, depth);
+}
+
+static void trace_cone(cgm_vec3 *color, const cgm_ray *ray, float time,
+		const struct ray_cone *cone, int depth)
 {
 	struct surf_hit hit;
 
-	if(!ray_scene(&scn, ray, &hit)) {
+	if(!ray_scene(&scn, ray, time, &hit)) {
 		backdrop(color, ray);
 	} else {
-		shade(color, ray, &hit, depth);
+		shade(color, ray, time, cone, &hit, depth);
 	}
 }
 
@@ -155,22 +155,28 @@ void backdrop(cgm_vec3 *color, const cgm_ray *ray)
 	}
 }
 
-void shade(cgm_vec3 *color, const cgm_ray *ray, const struct surf_hit *hit, int depth)
+void shade(cgm_vec3 *color, const cgm_ray *ray, float time, const struct ray_cone *cone,
+		const struct surf_hit *hit, int depth)
 {
 	cgm_ray sray;
-	struct material *mtl;
-	union surface *surf;
+	cgm_vec3 mtlcolor, refl;
+	float rough, ndotd;
+	struct ray_cone scone;
+	const struct material *mtl;
 
 	if(depth >= max_ray_depth) {
 		backdrop(color, ray);
 		return;
 	}
 
-	surf = hit->surf;
-	mtl = surf->any.mtl;
-	if(!mtl) {
-		mtl = &defmtl;
-	}
+	/* secondary rays keep spreading at the same rate from the current width,
+	 * which keeps texture lookups after diffuse bounces at coarse mip levels
+	 */
+	scone.width = cone->width + cone->spread * hit->t * cgm_vlength(&ray->dir);
+	scone.spread = cone->spread;
+
+	mtl = hit->mtl >= 0 ? scn.mtltab + hit->mtl : &defmtl;
+	eval_material(mtl, ray, scone.width, hit, &mtlcolor, &rough);
 
 	/* generate random direction with cosine distribution by generating a point
 	 * on a unit sphere tangent to the surface, with center hit->pos + hit->normal
@@ -181,6 +187,69 @@ void shade(cgm_vec3 *color, const cgm_ray *ray, const struct surf_hit *hit, int
 	cgm_vnormalize(&sray.dir);
 	sray.origin = hit->pos;
 
-	trace_ray(color, &sray, depth + 1);
-	cgm_vmul(color, &mtl->color);
+	/* smoother surfaces pull the bounce towards the mirror direction, down to a
+	 * perfect mirror at roughness 0. Roughness 1 is the plain diffuse lobe.
+	 */
+	if(rough < 1.0f) {
+		if(rough < 0.0f) rough = 0.0f;
+		refl = ray->dir;
+		ndotd = cgm_vdot(&refl, &hit->normal);
+		cgm_vadd_scaled(&refl, &hit->normal, -2.0f * ndotd);
+		cgm_vnormalize(&refl);
+
+		cgm_vlerp(&refl, &refl, &sray.dir, rough);
+		if(cgm_vdot(&refl, &hit->normal) > 0.0f) {
+			cgm_vnormalize(&refl);
+			sray.dir = refl;
+		}
+	}
+
+	trace_cone(color, &sray, time, &scone, depth + 1);
+	cgm_vmul(color, &mtlcolor);
+}
+
+/* evaluates the material at the hit point, looking up its textures at the mip
+ * level matching the ray footprint width. Pass a null roughness if it's not
+ * needed, to skip the lookup.
+ */
+static void eval_material(const struct material *mtl, const cgm_ray *ray, float width,
+		const struct surf_hit *hit, cgm_vec3 *color, float *roughness)
+{
+	float cos_theta, footprint, nlen;
+	struct texture *tex;
+	cgm_vec3 texel;
+
+	*color = mtl->color;
+	if(roughness) *roughness = mtl->roughness;
+
+	if(hit->uvscale <= 0.0f || (mtl->color_tex < 0 && (!roughness || mtl->rough_tex < 0))) {
+		return;
+	}
+
+	/* the footprint stretches along the surface at grazing angles */
+	nlen = cgm_vlength(&ray->dir) * cgm_vlength(&hit->normal);
+	cos_theta = nlen > 0.0f ? fabs(cgm_vdot(&ray->dir, &hit->normal)) / nlen : 1.0f;
+	if(cos_theta < 0.05f) cos_theta = 0.05f;
+	footprint = width * hit->uvscale / cos_theta;
+
+	if(mtl->color_tex >= 0) {
+		tex = scn.textab + mtl->color_tex;
+		if(sample_texture(tex, hit->tex.x, hit->tex.y, texture_lod(tex, footprint), 1,
+					&texel) != -1) {
+			*color = texel;
+		}
+	}
+	if(roughness && mtl->rough_tex >= 0) {
+		tex = scn.textab + mtl->rough_tex;
+		if(sample_texture(tex, hit->tex.x, hit->tex.y, texture_lod(tex, footprint), 0,
+					&texel) != -1) {
+			*roughness = texel.x;
+		}
+	}
+}
+
+static float texture_lod(const struct texture *tex, float footprint)
+{
+	float texels = footprint * sqrt((float)tex->width * (float)tex->height);
+	return texels > 1.0f ? log2(texels) : 0.0f;
 }
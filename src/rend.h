@@ -4,17 +4,39 @@
 #include <cgmath/cgmath.h>
 #include "surf.h"
 
-int init_rend(void);
+int init_rend(const char *scnfile);
 void destroy_rend(void);
 
+/* samples per pixel requested by the scene file, 0 if unspecified */
+int get_scene_samples(void);
+/* renders the part of the scene motion between open and close, from 0 to 1,
+ * refitting the scene to it. Only call while nothing is rendering.
+ */
+int set_shutter(float open, float close);
+
 void set_camera_pos(float x, float y, float z);
 void set_camera_targ(float x, float y, float z);
 void set_camera_up(float x, float y, float z);
 void set_camera_fov(float vfov_deg);
+void get_camera_pos(cgm_vec3 *res);
+void get_camera_targ(cgm_vec3 *res);
+
+/* ray cone, approximating the ray differentials for texture filtering */
+struct ray_cone {
+	float width;	/* footprint width at the ray origin */
+	float spread;	/* spread angle */
+};
 
-void primary_ray(cgm_ray *ray, int x, int y, int sample);
-void trace_ray(cgm_vec3 *color, const cgm_ray *ray, int depth);
+/* returns the primary ray and its shutter time, both jittered by the sample.
+ * The time is within the interval set by set_shutter.
+ */
+void primary_ray(cgm_ray *ray, float *time, int x, int y, int sample);
+/* traces a primary ray, with a cone covering a single pixel. All rays of the
+ * path share the time of the primary ray.
+ */
+void trace_ray(cgm_vec3 *color, const cgm_ray *ray, float time, int depth);
 void backdrop(cgm_vec3 *color, const cgm_ray *ray);
-void shade(cgm_vec3 *color, const cgm_ray *ray, const struct surf_hit *hit, int depth);
+void shade(cgm_vec3 *color, const cgm_ray *ray, float time, const struct ray_cone *cone,
+		const struct surf_hit *hit, int depth);
 
 #endif	/* REND_H_ */
@@ -1,26 +1,86 @@
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
 #include "rt.h"
 #include "rend.h"
 #include "tpool.h"
-
-#define BLOCK_SIZE	32
-
-static void render_block(void *bp);
-static void done_block(void *bp);
-static struct rt_block *alloc_block(void);
-static void free_block(struct rt_block *blk);
+#include "bigmem.h"
+
+/* limits for the automatic block size selection */
+#define MIN_BLOCK_SIZE		8
+#define MAX_BLOCK_SIZE		128
+/* automatic block size aims for at least this many blocks per thread */
+#define BLOCKS_PER_THREAD	16
+/* samples rendered by each job after the first full resolution pass */
+#define DEF_JOB_SAMPLES		4
+/* max number of passes in flight, must be a power of two */
+#define PASS_RING_SIZE		64
+
+/* A pass is one job per block, all of them at the same level and samples.
+ * Passes are published into a ring by rt_render, and jobs are identified by
+ * a sequence number: job / num_blk is the pass, job % num_blk the index into
+ * its block order. Workers claim jobs by bumping job_head, no allocations or
+ * locks are involved in submitting or completing jobs. The worker completing
+ * the last job of a pass wakes up rt_render, if it's waiting for a free slot.
+ *
+ * The sequence restarts from 0 whenever rt_render finds everything published
+ * so far done, and rt_render waits for that to happen before it would exceed
+ * the range of an int.
+ */
+struct rt_pass {
+	int frm, level;
+	int sample, nsamples;
+	const int *order;
+	int remaining;	/* jobs not yet completed, the slot is free when 0 */
+};
+
+static int auto_block_size(void);
+static void calc_block_order(void);
+static void reset_jobs(void);
+static void restart_jobs(int wait);
+static int free_pass_slots(void);
+static void publish_pass(const int *order, int level, int sample, int nsamples);
+static void start_workers(void);
+static void run_jobs(void *cls);
+static int claim_job(void);
+static void render_block(struct rt_block *blk);
+static void atomic_addf(float *ptr, float val);
+static void render_preview_block(struct rt_block *blk);
 
 static struct thread_pool *tpool;
 
-static struct rt_block *donelist, *donelist_tail;
-static pthread_mutex_t donelist_lock = PTHREAD_MUTEX_INITIALIZER;
+static int num_threads;
+static int blksize, num_xblk, num_yblk;
+static int job_samples = DEF_JOB_SAMPLES;
+
+/* block indices in scheduling order. Preview passes go outwards from the
+ * focus point, full resolution passes follow a Hilbert curve to keep
+ * consecutive blocks, and the workers rendering them, spatially coherent.
+ */
+static int *blkorder, *prvorder;
+static int focus_x, focus_y;
+static int order_valid;
+
+static struct rt_pass passes[PASS_RING_SIZE];
+static int num_passes, retired_passes;	/* only touched by the main thread */
+static int job_head, job_tail;
+static int num_workers;	/* run_jobs instances queued or running */
+static pthread_mutex_t pass_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pass_done = PTHREAD_COND_INITIALIZER;
+
+/* completion is reported by setting bit <level> in the block's dirty mask.
+ * rt_begin_update collects them into the preallocated update records.
+ */
+static unsigned int *blkdirty;
+static struct rt_block *updblocks;
+static int upd_pending;
 
 static int debug;
 
-int rt_init(int width, int height)
+int rt_init(int width, int height, const char *scnfile)
 {
+	int i;
 	char *env;
 
 	if((env = getenv("RTW_DEBUG")) && atoi(env)) {
@@ -29,172 +89,576 @@ int rt_init(int width, int height)
 
 	fbwidth = width;
 	fbheight = height;
-	if(!(fbpixels = calloc(width * height * 3, sizeof *fbpixels))) {
+	/* pages are placed by the first worker rendering into them */
+	if(!(fbpixels = bigmem_alloc((size_t)width * height * 4 * sizeof *fbpixels,
+					BIGMEM_ANY_NODE))) {
 		return -1;
 	}
 
-	if(init_rend() == -1) {
-		free(fbpixels);
-		fbpixels = 0;
-		return -1;
+	for(i=1; i<=RT_PREVIEW_LEVELS; i++) {
+		struct rt_preview *prv = fbpreview + i;
+		prv->width = (width + (1 << i) - 1) >> i;
+		prv->height = (height + (1 << i) - 1) >> i;
+		if(!(prv->pixels = calloc(prv->width * prv->height * 4, sizeof *prv->pixels))) {
+			goto err;
+		}
 	}
 
-	if(!(tpool = tpool_create(debug ? 1 : 0))) {
-		destroy_rend();
-		free(fbpixels);
-		fbpixels = 0;
-		return -1;
+	num_threads = debug ? 1 : tpool_num_processors();
+	if(rt_set_block_size(0) == -1) {
+		goto err;
+	}
+	rt_set_focus(width / 2, height / 2);
+
+	if(!(tpool = tpool_create(num_threads))) {
+		goto err;
+	}
+	bigmem_pin_workers(tpool);
+	/* let the scene loader use the same threads for parsing meshes */
+	set_mesh_thread_pool(tpool);
+
+	if(init_rend(scnfile) == -1) {
+		set_mesh_thread_pool(0);
+		tpool_destroy(tpool);
+		tpool = 0;
+		goto err;
 	}
 
 	return 0;
+
+err:
+	bigmem_free(fbpixels);
+	fbpixels = 0;
+	for(i=1; i<=RT_PREVIEW_LEVELS; i++) {
+		free(fbpreview[i].pixels);
+		fbpreview[i].pixels = 0;
+	}
+	free(blkorder);
+	free(prvorder);
+	free(blkdirty);
+	free(updblocks);
+	blkorder = prvorder = 0;
+	blkdirty = 0;
+	updblocks = 0;
+	return -1;
 }
 
 void rt_cleanup(void)
 {
-	tpool_destroy(tpool);
+	int i;
+
 	destroy_rend();
-	free(fbpixels);
+	set_mesh_thread_pool(0);
+	tpool_destroy(tpool);
+	bigmem_free(fbpixels);
+	for(i=1; i<=RT_PREVIEW_LEVELS; i++) {
+		free(fbpreview[i].pixels);
+	}
+	free(blkorder);
+	free(prvorder);
+	free(blkdirty);
+	free(updblocks);
 }
 
 void rt_clear(void)
 {
-	cur_frame++;
+	int i;
+	struct rt_preview *prv;
+
+	/* bumping the frame number makes any block already in progress bail out
+	 * at the next pixel, and the workers skip any remaining jobs of the old
+	 * frame without rendering them. Wait for them to run out, so that nothing
+	 * stale gets accumulated into the cleared framebuffer.
+	 */
+	__atomic_add_fetch(&cur_frame, 1, __ATOMIC_SEQ_CST);
+	tpool_wait(tpool);
+
+	reset_jobs();
 	cur_sample = 0;
 
-	memset(fbpixels, 0, fbwidth * fbheight * 3 * sizeof *fbpixels);
+	bigmem_zero(fbpixels);
+	for(i=1; i<=RT_PREVIEW_LEVELS; i++) {
+		prv = fbpreview + i;
+		memset(prv->pixels, 0, prv->width * prv->height * 4 * sizeof *prv->pixels);
+	}
+}
+
+int rt_set_block_size(int sz)
+{
+	int *neworder, *newprv;
+	unsigned int *newdirty;
+	struct rt_block *newupd;
+	int num_blk;
+
+	if(sz <= 0) {
+		sz = auto_block_size();
+	}
+	/* preview cells must not straddle block boundaries */
+	sz = (sz + (1 << RT_PREVIEW_LEVELS) - 1) & ~((1 << RT_PREVIEW_LEVELS) - 1);
+
+	num_blk = ((fbwidth + sz - 1) / sz) * ((fbheight + sz - 1) / sz);
+	if(!(neworder = malloc(num_blk * sizeof *neworder))) {
+		return -1;
+	}
+	if(!(newprv = malloc(num_blk * sizeof *newprv))) {
+		free(neworder);
+		return -1;
+	}
+	if(!(newdirty = calloc(num_blk, sizeof *newdirty))) {
+		free(neworder);
+		free(newprv);
+		return -1;
+	}
+	if(!(newupd = malloc(num_blk * (RT_PREVIEW_LEVELS + 1) * sizeof *newupd))) {
+		free(neworder);
+		free(newprv);
+		free(newdirty);
+		return -1;
+	}
+	free(blkorder);
+	free(prvorder);
+	free(blkdirty);
+	free(updblocks);
+	blkorder = neworder;
+	prvorder = newprv;
+	blkdirty = newdirty;
+	updblocks = newupd;
+
+	blksize = sz;
+	num_xblk = (fbwidth + sz - 1) / sz;
+	num_yblk = (fbheight + sz - 1) / sz;
+	order_valid = 0;
+
+	/* job sequence numbers depend on the number of blocks */
+	reset_jobs();
+	return 0;
+}
+
+int rt_get_block_size(void)
+{
+	return blksize;
+}
+
+void rt_set_job_samples(int n)
+{
+	job_samples = n > 0 ? n : 1;
+}
+
+int rt_get_job_samples(void)
+{
+	return job_samples;
+}
+
+/* largest power of two block size which still gives every thread enough
+ * blocks per pass to balance the load.
+ */
+static int auto_block_size(void)
+{
+	int sz = MAX_BLOCK_SIZE;
+
+	while(sz > MIN_BLOCK_SIZE) {
+		int num_blk = ((fbwidth + sz - 1) / sz) * ((fbheight + sz - 1) / sz);
+		if(num_blk >= BLOCKS_PER_THREAD * num_threads) {
+			break;
+		}
+		sz >>= 1;
+	}
+	return sz;
+}
+
+void rt_set_focus(int x, int y)
+{
+	if(x != focus_x || y != focus_y) {
+		focus_x = x;
+		focus_y = y;
+		order_valid = 0;
+	}
+}
+
+static int blkdist_cmp(const void *a, const void *b)
+{
+	int ia = *(int*)a;
+	int ib = *(int*)b;
+	int dxa = (ia % num_xblk) * blksize + blksize / 2 - focus_x;
+	int dya = (ia / num_xblk) * blksize + blksize / 2 - focus_y;
+	int dxb = (ib % num_xblk) * blksize + blksize / 2 - focus_x;
+	int dyb = (ib / num_xblk) * blksize + blksize / 2 - focus_y;
+	int da = dxa * dxa + dya * dya;
+	int db = dxb * dxb + dyb * dyb;
+
+	return da == db ? ia - ib : da - db;
+}
+
+/* position of the d-th cell along a Hilbert curve covering an n x n grid */
+static void hilbert_pos(int n, int d, int *xp, int *yp)
+{
+	int s, rx, ry, tmp, x = 0, y = 0;
+
+	for(s=1; s<n; s*=2) {
+		rx = 1 & (d / 2);
+		ry = 1 & (d ^ rx);
+		if(!ry) {
+			if(rx) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			tmp = x;
+			x = y;
+			y = tmp;
+		}
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+	*xp = x;
+	*yp = y;
+}
+
+static void calc_block_order(void)
+{
+	int i, n, x, y, num_blk = num_xblk * num_yblk;
+
+	for(i=0; i<num_blk; i++) {
+		prvorder[i] = i;
+	}
+	qsort(prvorder, num_blk, sizeof *prvorder, blkdist_cmp);
+
+	/* walk a Hilbert curve over the enclosing power of two grid, and keep
+	 * only the cells which fall on actual blocks.
+	 */
+	n = 1;
+	while(n < num_xblk || n < num_yblk) n <<= 1;
+
+	num_blk = 0;
+	for(i=0; i<n * n; i++) {
+		hilbert_pos(n, i, &x, &y);
+		if(x < num_xblk && y < num_yblk) {
+			blkorder[num_blk++] = y * num_xblk + x;
+		}
+	}
+	order_valid = 1;
 }
 
 void rt_render(int nsamples)
 {
-	int i, j, k, x, y, num_xblk, num_yblk;
-
-	num_xblk = (fbwidth + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	num_yblk = (fbheight + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-	tpool_begin_batch(tpool);
-	for(k=0; k<nsamples; k++) {
-		cur_sample++;
-		y = 0;
-		for(i=0; i<num_yblk; i++) {
-			int bh = fbheight - y > BLOCK_SIZE ? BLOCK_SIZE : fbheight - y;
-			x = 0;
-			for(j=0; j<num_xblk; j++) {
-				struct rt_block *blk = alloc_block();
-				if(!blk) abort();
-				blk->frm = cur_frame;
-				blk->sample = cur_sample;
-				blk->x = x;
-				blk->y = y;
-				blk->w = fbwidth - x > BLOCK_SIZE ? BLOCK_SIZE : fbwidth - x;
-				blk->h = bh;
-
-				tpool_enqueue(tpool, blk, render_block, done_block);
-				x += BLOCK_SIZE;
+	int i, n, nfree;
+
+	if(!order_valid) {
+		calc_block_order();
+	}
+	restart_jobs(0);
+
+	/* start a new frame with quick low resolution passes, coarsest first,
+	 * followed by a single sample full resolution pass. The ring is empty
+	 * after rt_clear, so there's always room for these.
+	 */
+	if(cur_sample == 0) {
+		for(i=RT_PREVIEW_LEVELS; i>0; i--) {
+			publish_pass(prvorder, i, 0, 1);
+		}
+		if(nsamples > 0) {
+			publish_pass(prvorder, 0, ++cur_sample, 1);
+			nsamples--;
+		}
+	}
+
+	/* after that, each job renders multiple samples for its block while it's
+	 * still hot in the cache. If the ring is getting full, larger passes are
+	 * published instead of waiting for slots to free up.
+	 */
+	while(nsamples > 0) {
+		if(num_passes >= INT_MAX / (num_xblk * num_yblk) - 1) {
+			restart_jobs(1);
+		}
+		if(!(nfree = free_pass_slots())) {
+			start_workers();
+			pthread_mutex_lock(&pass_lock);
+			while(!(nfree = free_pass_slots())) {
+				pthread_cond_wait(&pass_done, &pass_lock);
 			}
-			y += BLOCK_SIZE;
+			pthread_mutex_unlock(&pass_lock);
 		}
+		n = nsamples > job_samples ? job_samples : nsamples;
+		if(nsamples > n * nfree) {
+			n = (nsamples + nfree - 1) / nfree;
+		}
+		publish_pass(blkorder, 0, cur_sample + 1, n);
+		cur_sample += n;
+		nsamples -= n;
 	}
-	tpool_end_batch(tpool);
+
+	start_workers();
 }
 
-static void render_block(void *bp)
+void rt_wait(void)
 {
-	int i, j, px, py;
-	cgm_ray ray;
-	cgm_vec3 color;
-	struct rt_block *blk = bp;
-	float *fbptr = fbpixels + (blk->y * fbwidth + blk->x) * 3;
+	tpool_wait(tpool);
+}
+
+/* must only be called while no workers are running */
+static void reset_jobs(void)
+{
+	num_passes = retired_passes = 0;
+	job_head = job_tail = 0;
+	if(blkdirty) {
+		memset(blkdirty, 0, num_xblk * num_yblk * sizeof *blkdirty);
+	}
+	upd_pending = 0;
+}
+
+/* restarts the job sequence if all published passes are done, or waits for
+ * them to be done first if wait is set. Pending block updates are kept.
+ */
+static void restart_jobs(int wait)
+{
+	if(!num_passes) return;
+
+	if(free_pass_slots() < PASS_RING_SIZE) {
+		if(!wait) return;
+
+		start_workers();
+		pthread_mutex_lock(&pass_lock);
+		while(free_pass_slots() < PASS_RING_SIZE) {
+			pthread_cond_wait(&pass_done, &pass_lock);
+		}
+		pthread_mutex_unlock(&pass_lock);
+	}
+
+	/* workers may still be on their way out, comparing job_head and job_tail */
+	tpool_wait(tpool);
+	num_passes = retired_passes = 0;
+	job_head = job_tail = 0;
+}
+
+static int free_pass_slots(void)
+{
+	struct rt_pass *pass;
+
+	while(retired_passes < num_passes) {
+		pass = passes + (retired_passes & (PASS_RING_SIZE - 1));
+		if(__atomic_load_n(&pass->remaining, __ATOMIC_ACQUIRE) > 0) {
+			break;
+		}
+		retired_passes++;
+	}
+	return PASS_RING_SIZE - (num_passes - retired_passes);
+}
+
+static void publish_pass(const int *order, int level, int sample, int nsamples)
+{
+	int num_blk = num_xblk * num_yblk;
+	struct rt_pass *pass = passes + (num_passes & (PASS_RING_SIZE - 1));
+
+	pass->frm = cur_frame;
+	pass->level = level;
+	pass->sample = sample;
+	pass->nsamples = nsamples;
+	pass->order = order;
+	pass->remaining = num_blk;
+
+	num_passes++;
+	__atomic_store_n(&job_tail, num_passes * num_blk, __ATOMIC_SEQ_CST);
+}
+
+/* make sure there's a worker running on every thread of the pool */
+static void start_workers(void)
+{
+	int n = __atomic_load_n(&num_workers, __ATOMIC_SEQ_CST);
 
-	if(blk->frm < cur_frame) {
-		return;
+	while(n < num_threads) {
+		if(__atomic_compare_exchange_n(&num_workers, &n, n + 1, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			tpool_enqueue(tpool, 0, run_jobs, 0);
+			n++;
+		}
 	}
+}
+
+static int claim_job(void)
+{
+	int job = __atomic_load_n(&job_head, __ATOMIC_SEQ_CST);
+
+	do {
+		if(job >= __atomic_load_n(&job_tail, __ATOMIC_SEQ_CST)) {
+			return -1;
+		}
+	} while(!__atomic_compare_exchange_n(&job_head, &job, job + 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	return job;
+}
+
+/* worker loop, keeps claiming and rendering jobs until there are none left */
+static void run_jobs(void *cls)
+{
+	int job, idx, n, num_blk = num_xblk * num_yblk;
+	struct rt_pass *pass;
+	struct rt_block blk;
+
+	for(;;) {
+		while((job = claim_job()) >= 0) {
+			pass = passes + ((job / num_blk) & (PASS_RING_SIZE - 1));
+			idx = pass->order[job % num_blk];
+
+			if(pass->frm == __atomic_load_n(&cur_frame, __ATOMIC_SEQ_CST)) {
+				blk.frm = pass->frm;
+				blk.sample = pass->sample;
+				blk.nsamples = pass->nsamples;
+				blk.level = pass->level;
+				blk.x = (idx % num_xblk) * blksize;
+				blk.y = (idx / num_xblk) * blksize;
+				blk.w = fbwidth - blk.x > blksize ? blksize : fbwidth - blk.x;
+				blk.h = fbheight - blk.y > blksize ? blksize : fbheight - blk.y;
+
+				if(blk.level) {
+					render_preview_block(&blk);
+				} else {
+					render_block(&blk);
+				}
+
+				__atomic_fetch_or(blkdirty + idx, 1 << blk.level, __ATOMIC_RELEASE);
+				/* only the first completion since the last update wakes up the
+				 * main thread
+				 */
+				if(!__atomic_exchange_n(&upd_pending, 1, __ATOMIC_ACQ_REL)) {
+					redraw();
+				}
+			}
+			if(!__atomic_sub_fetch(&pass->remaining, 1, __ATOMIC_RELEASE)) {
+				pthread_mutex_lock(&pass_lock);
+				pthread_cond_signal(&pass_done);
+				pthread_mutex_unlock(&pass_lock);
+			}
+		}
+
+		/* out of jobs. Retire, but check again afterwards, in case rt_render
+		 * published more work while seeing this worker as still running.
+		 */
+		__atomic_sub_fetch(&num_workers, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&job_head, __ATOMIC_SEQ_CST) >= __atomic_load_n(&job_tail, __ATOMIC_SEQ_CST)) {
+			break;
+		}
+		n = __atomic_load_n(&num_workers, __ATOMIC_SEQ_CST);
+		do {
+			if(n >= num_threads) return;
+		} while(!__atomic_compare_exchange_n(&num_workers, &n, n + 1, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	}
+}
+
+static void render_block(struct rt_block *blk)
+{
+	int i, j, k, px, py;
+	float time;
+	cgm_ray ray;
+	cgm_vec3 color, sum;
+	float *fbptr = fbpixels + (blk->y * fbwidth + blk->x) * 4;
 
 	for(i=0; i<blk->h; i++) {
 		py = blk->y + i;
 		for(j=0; j<blk->w; j++) {
 			px = blk->x + j;
 
+			if(blk->frm != cur_frame) {
+				return;
+			}
+
 			if(debug && px == fbwidth / 2 && py == fbheight / 2) {
 				asm("int $3");
 			}
-			primary_ray(&ray, px, py, blk->sample);
-			trace_ray(&color, &ray, 0);
+			cgm_vcons(&sum, 0, 0, 0);
+			for(k=0; k<blk->nsamples; k++) {
+				primary_ray(&ray, &time, px, py, blk->sample + k);
+				trace_ray(&color, &ray, time, 0);
+				cgm_vadd(&sum, &color);
+			}
 
-			*fbptr++ += color.x;
-			*fbptr++ += color.y;
-			*fbptr++ += color.z;
+			/* successive passes over the same block may overlap in time */
+			atomic_addf(fbptr++, sum.x);
+			atomic_addf(fbptr++, sum.y);
+			atomic_addf(fbptr++, sum.z);
+			atomic_addf(fbptr++, (float)blk->nsamples);
 		}
-		fbptr += (fbwidth - blk->w) * 3;
+		fbptr += (fbwidth - blk->w) * 4;
 	}
 }
 
-static void done_block(void *bp)
+static void atomic_addf(float *ptr, float val)
 {
-	struct rt_block *blk = bp;
-	pthread_mutex_lock(&donelist_lock);
+	float prev, sum;
 
-	blk->next = 0;
-	if(donelist) {
-		donelist_tail->next = blk;
-		donelist_tail = blk;
-	} else {
-		donelist = donelist_tail = blk;
-	}
-	pthread_mutex_unlock(&donelist_lock);
-	redraw();
+	__atomic_load(ptr, &prev, __ATOMIC_RELAXED);
+	do {
+		sum = prev + val;
+	} while(!__atomic_compare_exchange(ptr, &prev, &sum, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
 
-struct rt_block *rt_begin_update(void)
+static void render_preview_block(struct rt_block *blk)
 {
-	pthread_mutex_lock(&donelist_lock);
-	return donelist;
-}
+	int i, j, px, py, step = 1 << blk->level;
+	float time;
+	cgm_ray ray;
+	cgm_vec3 color;
+	float *fbptr;
+	struct rt_preview *prv = fbpreview + blk->level;
 
-void rt_end_update(void)
-{
-	while(donelist) {
-		struct rt_block *tmp = donelist;
-		donelist = donelist->next;
-		free_block(tmp);
+	for(i=0; i<blk->h; i+=step) {
+		py = blk->y + i;
+		fbptr = prv->pixels + ((py >> blk->level) * prv->width + (blk->x >> blk->level)) * 4;
+		for(j=0; j<blk->w; j+=step) {
+			px = blk->x + j;
+
+			if(blk->frm != cur_frame) {
+				return;
+			}
+
+			/* trace through the center of each preview cell */
+			primary_ray(&ray, &time, px + step / 2, py + step / 2, 0);
+			trace_ray(&color, &ray, time, 0);
+
+			*fbptr++ = color.x;
+			*fbptr++ = color.y;
+			*fbptr++ = color.z;
+			*fbptr++ = 1.0f;
+		}
 	}
-	donelist_tail = 0;
-	pthread_mutex_unlock(&donelist_lock);
 }
 
-#define MAX_JOB_POOL_SIZE	4096
-static struct rt_block *freeblocks;
-static int freeblocks_size;
-static pthread_mutex_t blockslock = PTHREAD_MUTEX_INITIALIZER;
-
-static struct rt_block *alloc_block(void)
+/* returns a list of blocks completed since the last update, at most one per
+ * block and level. The list is valid until rt_end_update.
+ */
+struct rt_block *rt_begin_update(void)
 {
-	struct rt_block *res = 0;
+	int i, j, num_blk = num_xblk * num_yblk;
+	unsigned int bits;
+	struct rt_block *list = 0, *blk;
 
-	pthread_mutex_lock(&blockslock);
-	if(freeblocks) {
-		res = freeblocks;
-		freeblocks = freeblocks->next;
-		freeblocks_size--;
-	}
-	pthread_mutex_unlock(&blockslock);
+	__atomic_store_n(&upd_pending, 0, __ATOMIC_SEQ_CST);
 
-	if(!res && !(res = malloc(sizeof *res))) {
-		return 0;
+	for(i=num_blk-1; i>=0; i--) {
+		if(!__atomic_load_n(blkdirty + i, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		bits = __atomic_exchange_n(blkdirty + i, 0, __ATOMIC_ACQUIRE);
+
+		for(j=0; j<=RT_PREVIEW_LEVELS; j++) {
+			if(!(bits & (1 << j))) continue;
+
+			blk = updblocks + i * (RT_PREVIEW_LEVELS + 1) + j;
+			blk->frm = cur_frame;
+			blk->sample = cur_sample;
+			blk->nsamples = 0;
+			blk->level = j;
+			blk->x = (i % num_xblk) * blksize;
+			blk->y = (i / num_xblk) * blksize;
+			blk->w = fbwidth - blk->x > blksize ? blksize : fbwidth - blk->x;
+			blk->h = fbheight - blk->y > blksize ? blksize : fbheight - blk->y;
+			blk->next = list;
+			list = blk;
+		}
 	}
-	res->next = 0;
-	return res;
+	return list;
 }
 
-static void free_block(struct rt_block *blk)
+void rt_end_update(void)
 {
-	pthread_mutex_lock(&blockslock);
-	if(freeblocks_size >= MAX_JOB_POOL_SIZE) {
-		pthread_mutex_unlock(&blockslock);
-		free(blk);
-	} else {
-		blk->next = freeblocks;
-		freeblocks = blk;
-		freeblocks_size++;
-		pthread_mutex_unlock(&blockslock);
-	}
 }
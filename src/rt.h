@@ -1,21 +1,51 @@
 #ifndef RTW_H_
 #define RTW_H_
 
+/* number of reduced resolution preview passes at the start of every frame.
+ * Level N traces one ray per 2^N x 2^N pixels, and they run coarsest first.
+ */
+#define RT_PREVIEW_LEVELS	2
+
 struct rt_block {
-	int frm, sample;
+	int frm;
+	int sample, nsamples;	/* renders samples [sample, sample + nsamples) */
+	int level;	/* 0 for full resolution, otherwise the preview level */
 	int x, y, w, h;
 	struct rt_block *next;
 };
 
+/* RGBA preview image for a single level, shown until finer data arrives */
+struct rt_preview {
+	int width, height;
+	float *pixels;
+};
+
 int fbwidth, fbheight;
+/* RGBA: the alpha channel counts the samples accumulated in each pixel */
 float *fbpixels;
+struct rt_preview fbpreview[RT_PREVIEW_LEVELS + 1];	/* indexed by level, [0] unused */
 int cur_frame, cur_sample;
 
-int rt_init(int width, int height);
+int rt_init(int width, int height, const char *scnfile);
 void rt_cleanup(void);
 
+/* cancels all pending work for the current frame and clears the framebuffer */
 void rt_clear(void);
 void rt_render(int nsamples);
+/* wait for all queued blocks to be rendered */
+void rt_wait(void);
+
+/* block size and samples per job may only change while no rendering is in
+ * progress, i.e. right after rt_clear or rt_wait. A size of 0 selects one
+ * automatically, based on the framebuffer size and number of threads.
+ */
+int rt_set_block_size(int sz);
+int rt_get_block_size(void);
+void rt_set_job_samples(int n);
+int rt_get_job_samples(void);
+
+/* blocks are scheduled in order of increasing distance from the focus point */
+void rt_set_focus(int x, int y);
 struct rt_block *rt_begin_update(void);
 void rt_end_update(void);
 
@@ -1,64 +1,428 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <float.h>
 #include "scene.h"
 
+/* relative costs of testing a ray against a node and against a surface */
+#define NODE_COST	1.0f
+#define SURF_COST	4.0f
+
+static int is_emitter(const struct scene *scn, const union surface *surf);
+static int build_bvh(struct scene *scn);
+static void build_bvh_node(struct scene_bvh *bvh, int nidx, int first, int count, int depth);
+static void refit_bvh(struct scene_bvh *bvh);
+static float bvh_cost(const struct scene_bvh *bvh);
+static void free_bvh(struct scene_bvh *bvh);
+static const struct aabox *surf_box(const void *items, int idx);
+
 void init_scene(struct scene *scn)
 {
 	memset(scn, 0, sizeof *scn);
+
+	cgm_vcons(&scn->cam_pos, 0, 0, 5);
+	cgm_vcons(&scn->cam_up, 0, 1, 0);
+	scn->cam_fov = 50.0f;
+	scn->max_ray_depth = 5;
+	scn->shutter[1] = 1.0f;
 }
 
 void clear_scene(struct scene *scn)
 {
+	int i;
+
 	while(scn->surfaces) {
 		union surface *s = scn->surfaces;
 		scn->surfaces = scn->surfaces->any.next;
 		free_surface(s);
 	}
 
-	while(scn->materials) {
-		struct material *m = scn->materials;
-		scn->materials = scn->materials->next;
-		free(m);
+	for(i=0; i<scn->num_mtls; i++) {
+		free(scn->mtltab[i].name);
 	}
+	free(scn->mtltab);
+
+	for(i=0; i<scn->num_tex; i++) {
+		destroy_texture(scn->textab + i);
+	}
+	free(scn->textab);
+
+	free_bvh(&scn->bvh);
 
 	scn->surfaces = 0;
 	scn->emitters = 0;
-	scn->materials = 0;
+	scn->num_surfaces = 0;
+	scn->mtltab = 0;
+	scn->num_mtls = scn->max_mtls = 0;
+	scn->textab = 0;
+	scn->num_tex = scn->max_tex = 0;
 }
 
 void add_surface(struct scene *scn, union surface *surf)
 {
 	surf->any.next = scn->surfaces;
 	scn->surfaces = surf;
+	scn->num_surfaces++;
 
-	if(surf->any.mtl && cgm_vlength_sq(&surf->any.mtl->emission) > 1e-4) {
+	if(is_emitter(scn, surf)) {
 		surf->any.emnext = scn->emitters;
 		scn->emitters = surf;
 	}
 }
 
-void add_material(struct scene *scn, struct material *mtl)
+/* a surface emits light if its own material, or any of its face, primitive or
+ * voxel materials are emissive
+ */
+static int is_emitter(const struct scene *scn, const union surface *surf)
+{
+	int i, num_mtls = 0;
+	const int *mtlmap = 0;
+	const struct prim_set *ps;
+
+	if(surf->any.mtl >= 0 && cgm_vlength_sq(&scn->mtltab[surf->any.mtl].emission) > 1e-4) {
+		return 1;
+	}
+	if(surf->any.type == SURF_MESH) {
+		mtlmap = surf->mesh.mtlmap;
+		num_mtls = surf->mesh.m.num_mtls;
+	} else if(surf->any.type == SURF_INSTANCE) {
+		mtlmap = surf->inst.mtlmap;
+		num_mtls = surf->inst.geom->m.num_mtls;
+	} else if(surf->any.type == SURF_VOXELS) {
+		mtlmap = surf->vox.vg->mtl;
+		num_mtls = surf->vox.vg->num_mtls;
+	} else if(surf->any.type == SURF_PRIMS) {
+		ps = &surf->prims.ps;
+		for(i=0; i<ps->sph.count; i++) {
+			if(ps->sph.mtl[i] >= 0 &&
+					cgm_vlength_sq(&scn->mtltab[ps->sph.mtl[i]].emission) > 1e-4) {
+				return 1;
+			}
+		}
+		for(i=0; i<ps->box.count; i++) {
+			if(ps->box.mtl[i] >= 0 &&
+					cgm_vlength_sq(&scn->mtltab[ps->box.mtl[i]].emission) > 1e-4) {
+				return 1;
+			}
+		}
+	}
+	if(mtlmap) {
+		for(i=0; i<num_mtls; i++) {
+			if(mtlmap[i] >= 0 && cgm_vlength_sq(&scn->mtltab[mtlmap[i]].emission) > 1e-4) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+void init_material(struct material *mtl)
+{
+	memset(mtl, 0, sizeof *mtl);
+	cgm_vcons(&mtl->color, 0.7, 0.7, 0.7);
+	mtl->roughness = 1.0f;
+	mtl->color_tex = mtl->rough_tex = -1;
+}
+
+int add_material(struct scene *scn, const struct material *mtl)
+{
+	if(scn->num_mtls >= scn->max_mtls) {
+		int newsz = scn->max_mtls ? scn->max_mtls * 2 : 16;
+		void *tmp = realloc(scn->mtltab, newsz * sizeof *scn->mtltab);
+		if(!tmp) return -1;
+		scn->mtltab = tmp;
+		scn->max_mtls = newsz;
+	}
+	scn->mtltab[scn->num_mtls] = *mtl;
+	return scn->num_mtls++;
+}
+
+int find_material(const struct scene *scn, const char *name)
+{
+	int i;
+
+	for(i=0; i<scn->num_mtls; i++) {
+		if(scn->mtltab[i].name && strcmp(scn->mtltab[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+char *rel_path(const char *base, const char *fname)
+{
+	int dirlen = 0;
+	char *path, *slash;
+
+	if(fname[0] != '/' && (slash = strrchr(base, '/'))) {
+		dirlen = slash - base + 1;
+	}
+
+	if(!(path = malloc(dirlen + strlen(fname) + 1))) {
+		return 0;
+	}
+	memcpy(path, base, dirlen);
+	strcpy(path + dirlen, fname);
+	return path;
+}
+
+int add_texture(struct scene *scn, const char *base, const char *fname)
 {
-	mtl->next = scn->materials;
-	scn->materials = mtl;
+	int i;
+	char *path;
+
+	if(!(path = rel_path(base, fname))) {
+		return -1;
+	}
+	for(i=0; i<scn->num_tex; i++) {
+		if(strcmp(scn->textab[i].name, path) == 0) {
+			free(path);
+			return i;
+		}
+	}
+
+	if(scn->num_tex >= scn->max_tex) {
+		int newsz = scn->max_tex ? scn->max_tex * 2 : 16;
+		void *tmp = realloc(scn->textab, newsz * sizeof *scn->textab);
+		if(!tmp) {
+			free(path);
+			return -1;
+		}
+		scn->textab = tmp;
+		scn->max_tex = newsz;
+	}
+	init_texture(scn->textab + scn->num_tex);
+	scn->textab[scn->num_tex].name = path;
+	return scn->num_tex++;
 }
 
-int ray_scene(const struct scene *scn, const cgm_ray *ray, struct surf_hit *hit)
+void open_scene_textures(struct scene *scn)
+{
+	int i;
+
+	for(i=0; i<scn->num_tex; i++) {
+		if(scn->textab[i].fd == -1 && open_texture(scn->textab + i) == -1) {
+			fprintf(stderr, "failed to open texture: %s\n", scn->textab[i].name);
+		}
+	}
+}
+
+int update_scene(struct scene *scn)
+{
+	struct scene_bvh *bvh = &scn->bvh;
+
+	if(!bvh->nodes || bvh->num_surfs != scn->num_surfaces) {
+		return build_bvh(scn);
+	}
+	refit_bvh(bvh);
+	if(bvh_cost(bvh) > bvh->build_cost * SCENE_REBUILD_COST) {
+		return build_bvh(scn);
+	}
+	return 0;
+}
+
+int set_scene_shutter(struct scene *scn, float open, float close)
 {
 	union surface *surf;
-	struct surf_hit nearest;
 
-	nearest.t = FLT_MAX;
-	nearest.surf = 0;
+	scn->shutter[0] = open;
+	scn->shutter[1] = close;
 
 	surf = scn->surfaces;
 	while(surf) {
-		struct surf_hit tmphit;
-		if(ray_surface(surf, ray, &tmphit) && tmphit.t < nearest.t) {
-			nearest = tmphit;
+		if(set_surface_shutter(surf, open, close)) {
+			calc_bounds(surf);
 		}
 		surf = surf->any.next;
 	}
+	return update_scene(scn);
+}
+
+static int build_bvh(struct scene *scn)
+{
+	int i, num = scn->num_surfaces;
+	struct scene_bvh *bvh = &scn->bvh;
+	union surface *surf;
+
+	free_bvh(bvh);
+	if(!num) return 0;
+
+	if(!(bvh->surfs = malloc(num * sizeof *bvh->surfs)) ||
+			!(bvh->nodes = malloc((2 * num - 1) * sizeof *bvh->nodes))) {
+		fprintf(stderr, "update_scene: failed to allocate the surface hierarchy\n");
+		free_bvh(bvh);
+		return -1;
+	}
+
+	surf = scn->surfaces;
+	for(i=0; i<num; i++) {
+		bvh->surfs[i] = surf;
+		surf = surf->any.next;
+	}
+	bvh->num_surfs = num;
+
+	bvh->num_nodes = 1;
+	build_bvh_node(bvh, 0, 0, num, 0);
+	bvh->build_cost = bvh_cost(bvh);
+	return 0;
+}
+
+/* splits the surfaces along the axis where their centers spread the most, at
+ * the bin boundary with the lowest surface area heuristic cost, unless testing
+ * all of them is cheaper
+ */
+static void build_bvh_node(struct scene_bvh *bvh, int nidx, int first, int count, int depth)
+{
+	int i, j;
+	struct aabox_split split;
+	struct scene_node *node = bvh->nodes + nidx;
+	union surface **surfs = bvh->surfs + first, *tmp;
+
+	node->child = 0;
+	node->first = first;
+	node->count = count;
+
+	aabox_init(&node->bbox);
+	for(i=0; i<count; i++) {
+		aabox_add(&node->bbox, &surfs[i]->any.world_aabb);
+	}
+	if(count <= SCENE_LEAF_SURFS || depth >= SCENE_MAX_DEPTH) {
+		return;
+	}
+	if(!aabox_sah_split(&split, surfs, count, surf_box, &node->bbox, NODE_COST,
+				SURF_COST, count * SURF_COST)) {
+		return;
+	}
+
+	/* partition the surfaces of the node around the split */
+	i = 0;
+	j = count - 1;
+	while(i <= j) {
+		if(aabox_split_left(&split, &surfs[i]->any.world_aabb)) {
+			i++;
+		} else {
+			tmp = surfs[i];
+			surfs[i] = surfs[j];
+			surfs[j--] = tmp;
+		}
+	}
+
+	node->child = bvh->num_nodes;
+	node->count = 0;
+	bvh->num_nodes += 2;
+	build_bvh_node(bvh, node->child, first, i, depth + 1);
+	build_bvh_node(bvh, node->child + 1, first + i, count - i, depth + 1);
+}
+
+/* children are always stored after their parents */
+static void refit_bvh(struct scene_bvh *bvh)
+{
+	int i, j;
+	struct scene_node *node;
+
+	for(i=bvh->num_nodes-1; i>=0; i--) {
+		node = bvh->nodes + i;
+		aabox_init(&node->bbox);
+		if(node->child) {
+			aabox_add(&node->bbox, &bvh->nodes[node->child].bbox);
+			aabox_add(&node->bbox, &bvh->nodes[node->child + 1].bbox);
+		} else {
+			for(j=0; j<node->count; j++) {
+				aabox_add(&node->bbox, &bvh->surfs[node->first + j]->any.world_aabb);
+			}
+		}
+	}
+}
+
+/* expected cost of tracing a ray through the hierarchy, relative to hitting
+ * the root, by the surface area heuristic
+ */
+static float bvh_cost(const struct scene_bvh *bvh)
+{
+	int i;
+	float area, root_area, cost = 0.0f;
+	const struct scene_node *node;
+
+	if(!bvh->num_nodes || (root_area = aabox_area(&bvh->nodes->bbox)) <= 0.0f) {
+		return 0.0f;
+	}
+	for(i=0; i<bvh->num_nodes; i++) {
+		node = bvh->nodes + i;
+		area = aabox_area(&node->bbox);
+		cost += node->child ? area * NODE_COST : area * node->count * SURF_COST;
+	}
+	return cost / root_area;
+}
+
+static void free_bvh(struct scene_bvh *bvh)
+{
+	free(bvh->nodes);
+	free(bvh->surfs);
+	memset(bvh, 0, sizeof *bvh);
+}
+
+static const struct aabox *surf_box(const void *items, int idx)
+{
+	return &((union surface *const*)items)[idx]->any.world_aabb;
+}
+
+static inline void ray_scene_surf(const union surface *surf, const cgm_ray *ray,
+		float time, struct surf_hit *nearest)
+{
+	struct surf_hit tmphit;
+	struct aabox box;
+	const struct aabox *bounds;
+
+	/* world space bounds first, before bringing the ray to local space. Moving
+	 * surfaces use their bounds at the time of the ray.
+	 */
+	if(surf->any.motion) {
+		motion_bounds(&box, surf->any.motion, time);
+		bounds = &box;
+	} else {
+		bounds = &surf->any.world_aabb;
+	}
+	if(ray_aabox(bounds, ray, 0) && ray_surface(surf, ray, time, &tmphit) &&
+			tmphit.t < nearest->t) {
+		*nearest = tmphit;
+	}
+}
+
+int ray_scene(const struct scene *scn, const cgm_ray *ray, float time, struct surf_hit *hit)
+{
+	int i, sp, stack[SCENE_MAX_DEPTH + 2];
+	union surface *surf;
+	struct surf_hit nearest;
+	const struct scene_bvh *bvh = &scn->bvh;
+	const struct scene_node *node;
+
+	nearest.t = FLT_MAX;
+	nearest.surf = 0;
+
+	if(bvh->nodes && bvh->num_surfs == scn->num_surfaces) {
+		stack[0] = 0;
+		sp = 1;
+		while(sp > 0) {
+			node = bvh->nodes + stack[--sp];
+			if(!ray_aabox(&node->bbox, ray, 0)) {
+				continue;
+			}
+			if(node->child) {
+				stack[sp++] = node->child + 1;
+				stack[sp++] = node->child;
+			} else {
+				for(i=0; i<node->count; i++) {
+					ray_scene_surf(bvh->surfs[node->first + i], ray, time, &nearest);
+				}
+			}
+		}
+	} else {
+		surf = scn->surfaces;
+		while(surf) {
+			ray_scene_surf(surf, ray, time, &nearest);
+			surf = surf->any.next;
+		}
+	}
 
 	if(nearest.surf) {
 		if(hit) *hit = nearest;
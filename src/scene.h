@@ -2,22 +2,114 @@
 #define SCENE_H_
 
 #include "surf.h"
+#include "texture.h"
+
+/* the bounding volume hierarchy over the surfaces is rebuilt once refitting
+ * has made it this many times more expensive to traverse than after the last
+ * rebuild, by the surface area heuristic
+ */
+#define SCENE_REBUILD_COST	1.3f
+#define SCENE_LEAF_SURFS	2
+#define SCENE_MAX_DEPTH		48
+
+/* nodes are stored in a flat array, with the root first and every internal
+ * node followed by the subtrees of its two children, which are in
+ * consecutive slots. Leaves reference a range of the surface array.
+ */
+struct scene_node {
+	struct aabox bbox;
+	int child;		/* index of the first child, 0 for leaves */
+	int first, count;
+};
+
+struct scene_bvh {
+	struct scene_node *nodes;
+	int num_nodes;
+	union surface **surfs;
+	int num_surfs;
+	float build_cost;	/* surface area heuristic cost after the last rebuild */
+};
 
 struct scene {
 	cgm_vec3 sky_nadir, sky_horiz, sky_zenith;
 
+	/* initial camera and render settings */
+	cgm_vec3 cam_pos, cam_targ, cam_up;
+	float cam_fov;
+	int max_ray_depth;
+	int samples;	/* samples per pixel, 0 if not specified */
+
 	union surface *surfaces;
 	union surface *emitters;
-	struct material *materials;
+	int num_surfaces;
+	struct scene_bvh bvh;	/* see update_scene */
+
+	/* part of the scene motion rendered, see set_scene_shutter */
+	float shutter[2];
+
+	/* material table, indexed by surface and face material indices */
+	struct material *mtltab;
+	int num_mtls, max_mtls;
+
+	/* texture table, indexed by material texture indices */
+	struct texture *textab;
+	int num_tex, max_tex;
 };
 
 void init_scene(struct scene *scn);
 void clear_scene(struct scene *scn);
 
+/* appends the contents of a scene description file to the scene */
+int load_scene(struct scene *scn, const char *fname);
+
 void add_surface(struct scene *scn, union surface *surf);
-void add_material(struct scene *scn, struct material *mtl);
 
-int ray_scene(const struct scene *scn, const cgm_ray *ray, struct surf_hit *hit);
+/* call after adding, moving, or changing the geometry of surfaces, followed by
+ * calc_bounds on the surfaces changed, while nothing is rendering. Refits the
+ * hierarchy over the surfaces to their current bounds, or rebuilds it if
+ * surfaces were added, or if refitting degraded it past SCENE_REBUILD_COST.
+ * Until it succeeds, rays test every surface in turn.
+ */
+int update_scene(struct scene *scn);
+
+/* restricts rendering to the part of the scene motion between open and close,
+ * for rendering it as a sequence of frames. The surfaces keep their motion
+ * from 0 to 1, but their bounds are refitted to the interval, and followed by
+ * update_scene.
+ */
+int set_scene_shutter(struct scene *scn, float open, float close);
+
+/* sets the default material properties, without a name */
+void init_material(struct material *mtl);
+/* copies the material into the material table, and returns its index, or -1
+ * on failure. The table takes ownership of the name.
+ */
+int add_material(struct scene *scn, const struct material *mtl);
+/* returns the index of the named material, or -1 if it doesn't exist */
+int find_material(const struct scene *scn, const char *name);
+
+/* returns the index of the texture for image fname, relative to the directory
+ * of the file base, adding it to the texture table if it's not there already.
+ * Returns -1 on failure.
+ */
+int add_texture(struct scene *scn, const char *base, const char *fname);
+/* opens all textures not opened yet. Textures which fail to open are left in
+ * the table, and lookups in them fail.
+ */
+void open_scene_textures(struct scene *scn);
+
+/* adds all materials from an MTL library, which aren't already defined */
+int load_mtllib(struct scene *scn, const char *fname);
+
+/* returns fname relative to the directory of the file base, in a newly
+ * allocated string, or null on failure
+ */
+char *rel_path(const char *base, const char *fname);
+
+/* time is the shutter time of the ray, from 0 at shutter open to 1 at close,
+ * and within the scene shutter interval
+ */
+int ray_scene(const struct scene *scn, const cgm_ray *ray, float time, struct surf_hit *hit);
 
 
 #endif	/* SCENE_H_ */
@@ -0,0 +1,929 @@
+/* scene description file loader
+ *
+ * Scene files are line based. Each line starts with a keyword, followed by
+ * attribute/value pairs, and anything after a # is a comment:
+ *
+ *   camera pos 1.4 0.1 0 target 0 0.5 0 up 0 1 0 fov 50
+ *   sky horizon 5 4 4 zenith 5 4 4 nadir 0 0 0
+ *   render samples 5 maxdepth 5
+ *   material <name> color 0.7 0.7 0.7 emission 0 0 0 roughness 1 metallic 0
+ *   sphere pos 0 1 0 radius 1 material <name>
+ *   box pos 0 -1 0 size 10 2 10 material <name>
+ *   mesh <file> pos 0 0 0 rotate <deg> 0 1 0 scale 1 1 1 material <name>
+ *   voxels <file> dim 256 256 256 threshold 128 scale 0.1 0.1 0.1
+ *   curves <file> pos 0 0 0 rotate <deg> 0 1 0 scale 1 1 1 material <name>
+ *   subdiv <file> level 4 dispmap <image> dispscale 0.1 material <name>
+ *
+ * Materials also take a colormap and a roughmap image. Voxels and subdivision
+ * surfaces take the same pos, rotate, scale and material attributes as meshes
+ * and curves.
+ *
+ * Meshes, voxels, curves and subdivision surfaces move during the shutter
+ * interval if any of endpos, endrotate or endscale are given, going from pos,
+ * rotate and scale at shutter open to the end values at shutter close. End
+ * values not given stay the same as the start ones. Meshes also deform with
+ * "deform <file>", naming a second mesh file with the same faces in the same
+ * order, at shutter close. Deforming meshes don't use the mesh cache, and
+ * aren't loaded lazily. When rendering a sequence of frames, the shutter
+ * interval spans the whole sequence.
+ *
+ * Mesh and image filenames are relative to the directory of the scene file. Each
+ * mesh line places an instance of its mesh file. Files referenced more than once
+ * are loaded once, and all their instances share the same faces and octree.
+ * All distinct meshes are loaded in parallel on the mesh thread pool.
+ * With a geometry memory budget set, meshes with an up to date mesh cache are
+ * only registered with their bounds, and loaded when first hit by a ray.
+ *
+ * Voxel files are raw volumes of dim bytes, x varying fastest, and voxels with
+ * values of at least threshold (default 1) are solid. Each voxel is a unit cube
+ * before scaling, and pos is the corner of the first voxel.
+ *
+ * Curve files hold hair or grass strands of cubic Bézier segments, see
+ * load_curves.
+ *
+ * Subdivision surfaces take their control mesh from an OBJ file, and are
+ * tessellated into 2^level quads along each side of each patch, up to
+ * SUBDIV_MAX_LEVEL, when rays first reach it. The red channel of the optional
+ * displacement map, times dispscale, displaces the surface along its normal.
+ *
+ * Spheres and boxes are gathered into a single primitive array surface, which
+ * intersects them in world space without any transformations.
+ *
+ * Materials selected by usemtl in a mesh are looked up by name, after loading
+ * the MTL libraries the mesh refers to. Materials defined in the scene file
+ * take precedence over library materials with the same name. The material
+ * attribute of a mesh applies to faces without a material.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "scene.h"
+#include "dynarr.h"
+#include "tpool.h"
+
+#define MESH_OCTREE_ITEMS	32
+#define MESH_OCTREE_DEPTH	20
+
+enum {
+	ATTR_POS,
+	ATTR_TARGET,
+	ATTR_UP,
+	ATTR_FOV,
+	ATTR_HORIZON,
+	ATTR_ZENITH,
+	ATTR_NADIR,
+	ATTR_SAMPLES,
+	ATTR_MAXDEPTH,
+	ATTR_COLOR,
+	ATTR_EMISSION,
+	ATTR_ROUGHNESS,
+	ATTR_METALLIC,
+	ATTR_RADIUS,
+	ATTR_SIZE,
+	ATTR_ROTATE,
+	ATTR_SCALE,
+	ATTR_MATERIAL,
+	ATTR_COLORMAP,
+	ATTR_ROUGHMAP,
+	ATTR_DIM,
+	ATTR_THRESHOLD,
+	ATTR_ENDPOS,
+	ATTR_ENDROTATE,
+	ATTR_ENDSCALE,
+	ATTR_DEFORM,
+	ATTR_LEVEL,
+	ATTR_DISPMAP,
+	ATTR_DISPSCALE,
+
+	NUM_ATTRS
+};
+
+#define ATTR_BIT(x)	(1 << (x))
+
+static struct {
+	const char *name;
+	int nval;	/* number of values, 0 for a single string */
+} attrdef[NUM_ATTRS] = {
+	{"pos", 3}, {"target", 3}, {"up", 3}, {"fov", 1},
+	{"horizon", 3}, {"zenith", 3}, {"nadir", 3},
+	{"samples", 1}, {"maxdepth", 1},
+	{"color", 3}, {"emission", 3}, {"roughness", 1}, {"metallic", 1},
+	{"radius", 1}, {"size", 3}, {"rotate", 4}, {"scale", 3},
+	{"material", 0}, {"colormap", 0}, {"roughmap", 0},
+	{"dim", 3}, {"threshold", 1},
+	{"endpos", 3}, {"endrotate", 4}, {"endscale", 3}, {"deform", 0},
+	{"level", 1}, {"dispmap", 0}, {"dispscale", 1}
+};
+
+#define MOTION_ATTRS	(ATTR_BIT(ATTR_ENDPOS) | ATTR_BIT(ATTR_ENDROTATE) | ATTR_BIT(ATTR_ENDSCALE))
+
+struct attr {
+	int set;
+	float val[4];
+	char *str;
+};
+
+/* mesh instance waiting for its mesh data to be loaded */
+struct mesh_ref {
+	char *path;
+	char *deform;	/* mesh file at shutter close, or null */
+	int mtl;
+	float xform[16], inv_xform[16];
+	struct xform_key key[2];
+	int moving;
+	struct mesh_geom *geom;	/* loaded by the first reference to each file */
+	struct mesh_ref *orig;	/* first reference to the same file, or null */
+	int result;
+};
+
+static int parse_attrs(char *args, struct attr *attr, unsigned int allowed, const char **errmsg);
+static int load_mesh_mtllibs(struct scene *scn, struct mesh_ref *ref, char ***loaded);
+static int build_mtlmap(struct scene *scn, struct surf_instance *inst, int warn);
+static void load_mesh_job(void *cls);
+static int load_lazy_mesh(struct mesh_ref *ref);
+static int load_voxel_surface(struct scene *scn, const char *fname, const char *name,
+		struct attr *attr, int mtl);
+static int load_curve_surface(struct scene *scn, const char *fname, const char *name,
+		struct attr *attr, int mtl);
+static int load_subdiv_surface(struct scene *scn, const char *fname, const char *name,
+		struct attr *attr, int mtl);
+static void calc_xform(float *xform, float *inv_xform, struct attr *attr);
+static int calc_motion_keys(struct xform_key *key, struct attr *attr);
+static void set_key(struct xform_key *key, struct attr *pos, struct attr *rot,
+		struct attr *scale);
+
+int load_scene(struct scene *scn, const char *fname)
+{
+	FILE *fp;
+	int i, j, num_refs, mtl, line_num = 0, res = -1;
+	char buf[1024], *line, *cmd, *args, *name, **libs;
+	const char *errmsg;
+	struct attr attr[NUM_ATTRS];
+	struct mesh_ref *refs, mref;
+	struct material newmtl;
+	union surface *surf, *prims = 0;
+	struct mesh_geom *geom;
+	struct aabox box;
+	struct thread_pool *tpool;
+	void *tmp;
+
+	if(!(fp = fopen(fname, "rb"))) {
+		fprintf(stderr, "load_scene: failed to open scene file: %s\n", fname);
+		return -1;
+	}
+	refs = dynarr_alloc(0, sizeof *refs);
+	libs = dynarr_alloc(0, sizeof *libs);
+	if(!refs || !libs) {
+		fprintf(stderr, "load_scene: failed to allocate memory\n");
+		goto end;
+	}
+
+	while(fgets(buf, sizeof buf, fp)) {
+		line_num++;
+		if((line = strchr(buf, '#'))) *line = 0;
+
+		line = buf;
+		while(*line && isspace(*line)) line++;
+		if(!*line) continue;
+
+		cmd = line;
+		while(*line && !isspace(*line)) line++;
+		if(*line) *line++ = 0;
+		args = line;
+
+		/* materials and geometry files are followed by a name before the attributes */
+		name = 0;
+		if(strcmp(cmd, "material") == 0 || strcmp(cmd, "mesh") == 0 ||
+				strcmp(cmd, "voxels") == 0 || strcmp(cmd, "curves") == 0 ||
+				strcmp(cmd, "subdiv") == 0) {
+			while(*args && isspace(*args)) args++;
+			if(!*args) {
+				fprintf(stderr, "%s:%d: %s: missing name\n", fname, line_num, cmd);
+				goto end;
+			}
+			name = args;
+			while(*args && !isspace(*args)) args++;
+			if(*args) *args++ = 0;
+		}
+
+		errmsg = 0;
+		if(strcmp(cmd, "camera") == 0) {
+			if(parse_attrs(args, attr, ATTR_BIT(ATTR_POS) | ATTR_BIT(ATTR_TARGET) |
+						ATTR_BIT(ATTR_UP) | ATTR_BIT(ATTR_FOV), &errmsg) == -1) {
+				goto inval;
+			}
+			if(attr[ATTR_POS].set) cgm_vcons(&scn->cam_pos, attr[ATTR_POS].val[0],
+					attr[ATTR_POS].val[1], attr[ATTR_POS].val[2]);
+			if(attr[ATTR_TARGET].set) cgm_vcons(&scn->cam_targ, attr[ATTR_TARGET].val[0],
+					attr[ATTR_TARGET].val[1], attr[ATTR_TARGET].val[2]);
+			if(attr[ATTR_UP].set) cgm_vcons(&scn->cam_up, attr[ATTR_UP].val[0],
+					attr[ATTR_UP].val[1], attr[ATTR_UP].val[2]);
+			if(attr[ATTR_FOV].set) scn->cam_fov = attr[ATTR_FOV].val[0];
+
+		} else if(strcmp(cmd, "sky") == 0) {
+			if(parse_attrs(args, attr, ATTR_BIT(ATTR_HORIZON) | ATTR_BIT(ATTR_ZENITH) |
+						ATTR_BIT(ATTR_NADIR), &errmsg) == -1) {
+				goto inval;
+			}
+			if(attr[ATTR_HORIZON].set) cgm_vcons(&scn->sky_horiz, attr[ATTR_HORIZON].val[0],
+					attr[ATTR_HORIZON].val[1], attr[ATTR_HORIZON].val[2]);
+			if(attr[ATTR_ZENITH].set) cgm_vcons(&scn->sky_zenith, attr[ATTR_ZENITH].val[0],
+					attr[ATTR_ZENITH].val[1], attr[ATTR_ZENITH].val[2]);
+			if(attr[ATTR_NADIR].set) cgm_vcons(&scn->sky_nadir, attr[ATTR_NADIR].val[0],
+					attr[ATTR_NADIR].val[1], attr[ATTR_NADIR].val[2]);
+
+		} else if(strcmp(cmd, "render") == 0) {
+			if(parse_attrs(args, attr, ATTR_BIT(ATTR_SAMPLES) | ATTR_BIT(ATTR_MAXDEPTH),
+						&errmsg) == -1) {
+				goto inval;
+			}
+			if(attr[ATTR_SAMPLES].set) scn->samples = attr[ATTR_SAMPLES].val[0];
+			if(attr[ATTR_MAXDEPTH].set) scn->max_ray_depth = attr[ATTR_MAXDEPTH].val[0];
+
+		} else if(strcmp(cmd, "material") == 0) {
+			if(parse_attrs(args, attr, ATTR_BIT(ATTR_COLOR) | ATTR_BIT(ATTR_EMISSION) |
+						ATTR_BIT(ATTR_ROUGHNESS) | ATTR_BIT(ATTR_METALLIC) |
+						ATTR_BIT(ATTR_COLORMAP) | ATTR_BIT(ATTR_ROUGHMAP), &errmsg) == -1) {
+				goto inval;
+			}
+			if(find_material(scn, name) != -1) {
+				fprintf(stderr, "%s:%d: duplicate material: %s\n", fname, line_num, name);
+				goto end;
+			}
+			init_material(&newmtl);
+			if(attr[ATTR_COLOR].set) cgm_vcons(&newmtl.color, attr[ATTR_COLOR].val[0],
+					attr[ATTR_COLOR].val[1], attr[ATTR_COLOR].val[2]);
+			if(attr[ATTR_EMISSION].set) cgm_vcons(&newmtl.emission, attr[ATTR_EMISSION].val[0],
+					attr[ATTR_EMISSION].val[1], attr[ATTR_EMISSION].val[2]);
+			if(attr[ATTR_ROUGHNESS].set) newmtl.roughness = attr[ATTR_ROUGHNESS].val[0];
+			if(attr[ATTR_METALLIC].set) newmtl.metallic = attr[ATTR_METALLIC].val[0] != 0.0f;
+			if((attr[ATTR_COLORMAP].set && (newmtl.color_tex =
+							add_texture(scn, fname, attr[ATTR_COLORMAP].str)) == -1) ||
+					(attr[ATTR_ROUGHMAP].set && (newmtl.rough_tex =
+							add_texture(scn, fname, attr[ATTR_ROUGHMAP].str)) == -1)) {
+				fprintf(stderr, "load_scene: failed to allocate texture\n");
+				goto end;
+			}
+
+			if(!(newmtl.name = strdup(name)) || add_material(scn, &newmtl) == -1) {
+				fprintf(stderr, "load_scene: failed to allocate material\n");
+				free(newmtl.name);
+				goto end;
+			}
+
+		} else if(strcmp(cmd, "sphere") == 0 || strcmp(cmd, "box") == 0) {
+			int sph = cmd[0] == 's';
+			unsigned int req = ATTR_BIT(ATTR_POS) | ATTR_BIT(sph ? ATTR_RADIUS : ATTR_SIZE);
+
+			if(parse_attrs(args, attr, req | ATTR_BIT(ATTR_MATERIAL), &errmsg) == -1) {
+				goto inval;
+			}
+			if(!attr[ATTR_POS].set || !attr[sph ? ATTR_RADIUS : ATTR_SIZE].set) {
+				errmsg = sph ? "pos and radius are required" : "pos and size are required";
+				goto inval;
+			}
+			mtl = -1;
+			if(attr[ATTR_MATERIAL].set &&
+					(mtl = find_material(scn, attr[ATTR_MATERIAL].str)) == -1) {
+				errmsg = "undefined material";
+				goto inval;
+			}
+
+			if(!prims && !(prims = create_prims())) {
+				errmsg = "failed to create surface";
+				goto inval;
+			}
+			if(sph) {
+				if(attr[ATTR_RADIUS].val[0] == 0.0f) {
+					errmsg = "zero radius";
+					goto inval;
+				}
+				if(add_prim_sphere(&prims->prims.ps, attr[ATTR_POS].val[0],
+							attr[ATTR_POS].val[1], attr[ATTR_POS].val[2],
+							fabs(attr[ATTR_RADIUS].val[0]), mtl) == -1) {
+					errmsg = "failed to create surface";
+					goto inval;
+				}
+			} else {
+				float *pos = attr[ATTR_POS].val;
+				float *size = attr[ATTR_SIZE].val;
+
+				cgm_vcons(&box.vmin, pos[0] - fabs(size[0]) * 0.5f,
+						pos[1] - fabs(size[1]) * 0.5f, pos[2] - fabs(size[2]) * 0.5f);
+				cgm_vcons(&box.vmax, pos[0] + fabs(size[0]) * 0.5f,
+						pos[1] + fabs(size[1]) * 0.5f, pos[2] + fabs(size[2]) * 0.5f);
+				if(add_prim_box(&prims->prims.ps, &box, mtl) == -1) {
+					errmsg = "failed to create surface";
+					goto inval;
+				}
+			}
+
+		} else if(strcmp(cmd, "mesh") == 0) {
+			if(parse_attrs(args, attr, ATTR_BIT(ATTR_POS) | ATTR_BIT(ATTR_ROTATE) |
+						ATTR_BIT(ATTR_SCALE) | ATTR_BIT(ATTR_MATERIAL) | MOTION_ATTRS |
+						ATTR_BIT(ATTR_DEFORM), &errmsg) == -1) {
+				goto inval;
+			}
+			mtl = -1;
+			if(attr[ATTR_MATERIAL].set &&
+					(mtl = find_material(scn, attr[ATTR_MATERIAL].str)) == -1) {
+				errmsg = "undefined material";
+				goto inval;
+			}
+
+			mref.deform = 0;
+			if(!(mref.path = rel_path(fname, name)) || (attr[ATTR_DEFORM].set &&
+						!(mref.deform = rel_path(fname, attr[ATTR_DEFORM].str)))) {
+				fprintf(stderr, "load_scene: failed to allocate mesh\n");
+				free(mref.path);
+				goto end;
+			}
+			mref.mtl = mtl;
+			calc_xform(mref.xform, mref.inv_xform, attr);
+			mref.moving = calc_motion_keys(mref.key, attr);
+			mref.geom = 0;
+			mref.orig = 0;
+			mref.result = -1;
+			if(!(tmp = dynarr_push(refs, &mref))) {
+				fprintf(stderr, "load_scene: failed to allocate mesh\n");
+				free(mref.path);
+				free(mref.deform);
+				goto end;
+			}
+			refs = tmp;
+
+		} else if(strcmp(cmd, "voxels") == 0) {
+			if(parse_attrs(args, attr, ATTR_BIT(ATTR_DIM) | ATTR_BIT(ATTR_THRESHOLD) |
+						ATTR_BIT(ATTR_POS) | ATTR_BIT(ATTR_ROTATE) | ATTR_BIT(ATTR_SCALE) |
+						ATTR_BIT(ATTR_MATERIAL) | MOTION_ATTRS, &errmsg) == -1) {
+				goto inval;
+			}
+			if(!attr[ATTR_DIM].set) {
+				errmsg = "dim is required";
+				goto inval;
+			}
+			mtl = -1;
+			if(attr[ATTR_MATERIAL].set &&
+					(mtl = find_material(scn, attr[ATTR_MATERIAL].str)) == -1) {
+				errmsg = "undefined material";
+				goto inval;
+			}
+			if(load_voxel_surface(scn, fname, name, attr, mtl) == -1) {
+				goto end;
+			}
+
+		} else if(strcmp(cmd, "curves") == 0) {
+			if(parse_attrs(args, attr, ATTR_BIT(ATTR_POS) | ATTR_BIT(ATTR_ROTATE) |
+						ATTR_BIT(ATTR_SCALE) | ATTR_BIT(ATTR_MATERIAL) | MOTION_ATTRS,
+						&errmsg) == -1) {
+				goto inval;
+			}
+			mtl = -1;
+			if(attr[ATTR_MATERIAL].set &&
+					(mtl = find_material(scn, attr[ATTR_MATERIAL].str)) == -1) {
+				errmsg = "undefined material";
+				goto inval;
+			}
+			if(load_curve_surface(scn, fname, name, attr, mtl) == -1) {
+				goto end;
+			}
+
+		} else if(strcmp(cmd, "subdiv") == 0) {
+			if(parse_attrs(args, attr, ATTR_BIT(ATTR_LEVEL) | ATTR_BIT(ATTR_DISPMAP) |
+						ATTR_BIT(ATTR_DISPSCALE) | ATTR_BIT(ATTR_POS) | ATTR_BIT(ATTR_ROTATE) |
+						ATTR_BIT(ATTR_SCALE) | ATTR_BIT(ATTR_MATERIAL) | MOTION_ATTRS,
+						&errmsg) == -1) {
+				goto inval;
+			}
+			if(attr[ATTR_LEVEL].set && (attr[ATTR_LEVEL].val[0] < 0 ||
+						attr[ATTR_LEVEL].val[0] > SUBDIV_MAX_LEVEL)) {
+				errmsg = "subdivision level out of range";
+				goto inval;
+			}
+			mtl = -1;
+			if(attr[ATTR_MATERIAL].set &&
+					(mtl = find_material(scn, attr[ATTR_MATERIAL].str)) == -1) {
+				errmsg = "undefined material";
+				goto inval;
+			}
+			if(load_subdiv_surface(scn, fname, name, attr, mtl) == -1) {
+				goto end;
+			}
+
+		} else {
+			fprintf(stderr, "%s:%d: unknown keyword: %s\n", fname, line_num, cmd);
+			goto end;
+		}
+		continue;
+
+inval:
+		fprintf(stderr, "%s:%d: invalid %s: %s\n", fname, line_num, cmd, errmsg);
+		goto end;
+	}
+
+	/* the first reference to each mesh file loads it, the rest share its data.
+	 * Deforming meshes are only shared with the same end mesh.
+	 */
+	num_refs = dynarr_size(refs);
+	for(i=0; i<num_refs; i++) {
+		for(j=0; j<i; j++) {
+			if(!refs[j].orig && strcmp(refs[i].path, refs[j].path) == 0 &&
+					(refs[i].deform ? refs[j].deform && strcmp(refs[i].deform,
+						refs[j].deform) == 0 : !refs[j].deform)) {
+				refs[i].orig = refs + j;
+				break;
+			}
+		}
+		if(!refs[i].orig && !(refs[i].geom = create_mesh_geom())) {
+			fprintf(stderr, "load_scene: failed to allocate mesh\n");
+			goto end;
+		}
+	}
+
+	/* with a single mesh it's better to use the pool for parsing its chunks */
+	tpool = get_mesh_thread_pool();
+	if(tpool && num_refs > 1) {
+		for(i=0; i<num_refs; i++) {
+			if(!refs[i].orig) {
+				tpool_enqueue(tpool, refs + i, load_mesh_job, 0);
+			}
+		}
+		tpool_wait(tpool);
+	} else {
+		for(i=0; i<num_refs; i++) {
+			if(!refs[i].orig) {
+				load_mesh_job(refs + i);
+			}
+		}
+	}
+
+	for(i=0; i<num_refs; i++) {
+		struct mesh_ref *orig = refs[i].orig ? refs[i].orig : refs + i;
+		if(orig->result == -1) {
+			fprintf(stderr, "load_scene: failed to load mesh: %s\n", orig->path);
+			goto end;
+		}
+		if(!refs[i].orig) {
+			calc_geom_bounds(refs[i].geom);
+		}
+	}
+
+	/* libraries are loaded in mesh order, so the first definition of each
+	 * material wins, regardless of the loading order of the meshes
+	 */
+	for(i=0; i<num_refs; i++) {
+		if(!refs[i].orig && load_mesh_mtllibs(scn, refs + i, &libs) == -1) {
+			goto end;
+		}
+	}
+
+	for(i=0; i<num_refs; i++) {
+		geom = refs[i].orig ? refs[i].orig->geom : refs[i].geom;
+		if(!(surf = create_instance(geom))) {
+			fprintf(stderr, "load_scene: failed to allocate mesh instance\n");
+			goto end;
+		}
+		surf->any.mtl = refs[i].mtl;
+		set_surface_xform(surf, refs[i].xform, refs[i].inv_xform);
+		if(refs[i].moving && set_surface_motion(surf, refs[i].key, refs[i].key + 1) == -1) {
+			fprintf(stderr, "load_scene: failed to allocate mesh motion\n");
+			free_surface(surf);
+			goto end;
+		}
+		/* only complain about missing materials once per mesh file */
+		if(build_mtlmap(scn, &surf->inst, !refs[i].orig) == -1) {
+			fprintf(stderr, "load_scene: failed to allocate material map\n");
+			free_surface(surf);
+			goto end;
+		}
+		calc_bounds(surf);
+		add_surface(scn, surf);
+	}
+
+	if(prims) {
+		if(build_prims(&prims->prims.ps) == -1) {
+			goto end;
+		}
+		calc_bounds(prims);
+		add_surface(scn, prims);
+		prims = 0;
+	}
+
+	if(update_scene(scn) == -1) {
+		goto end;
+	}
+	open_scene_textures(scn);
+	res = 0;
+
+end:
+	fclose(fp);
+	if(prims) {
+		free_surface(prims);
+	}
+	if(refs) {
+		/* the instances added to the scene hold their own references */
+		for(i=0; i<dynarr_size(refs); i++) {
+			release_mesh_geom(refs[i].geom);
+			free(refs[i].path);
+			free(refs[i].deform);
+		}
+		dynarr_free(refs);
+	}
+	if(libs) {
+		for(i=0; i<dynarr_size(libs); i++) {
+			free(libs[i]);
+		}
+		dynarr_free(libs);
+	}
+	return res;
+}
+
+static int parse_attrs(char *args, struct attr *attr, unsigned int allowed, const char **errmsg)
+{
+	int i, j;
+	char *tok, *endp;
+
+	memset(attr, 0, NUM_ATTRS * sizeof *attr);
+
+	tok = strtok(args, " \t\r\n");
+	while(tok) {
+		for(i=0; i<NUM_ATTRS; i++) {
+			if(strcmp(tok, attrdef[i].name) == 0) break;
+		}
+		if(i >= NUM_ATTRS || !(allowed & ATTR_BIT(i))) {
+			*errmsg = "unknown attribute";
+			return -1;
+		}
+
+		if(attrdef[i].nval == 0) {
+			if(!(attr[i].str = strtok(0, " \t\r\n"))) {
+				*errmsg = "missing attribute value";
+				return -1;
+			}
+		}
+		for(j=0; j<attrdef[i].nval; j++) {
+			if(!(tok = strtok(0, " \t\r\n"))) {
+				*errmsg = "missing attribute value";
+				return -1;
+			}
+			attr[i].val[j] = strtod(tok, &endp);
+			if(endp == tok || *endp) {
+				*errmsg = "invalid attribute value";
+				return -1;
+			}
+		}
+		attr[i].set = 1;
+		tok = strtok(0, " \t\r\n");
+	}
+	return 0;
+}
+
+/* loads the MTL libraries of a mesh, skipping any already loaded. Missing
+ * libraries are not fatal, faces just fall back to the surface material.
+ */
+static int load_mesh_mtllibs(struct scene *scn, struct mesh_ref *ref, char ***loaded)
+{
+	int i, j, num_loaded;
+	char *path;
+	void *tmp;
+	struct mesh *m = &ref->geom->m;
+
+	for(i=0; i<m->num_mtllibs; i++) {
+		if(!(path = rel_path(ref->path, m->mtllibs[i]))) {
+			fprintf(stderr, "load_scene: failed to allocate memory\n");
+			return -1;
+		}
+
+		num_loaded = dynarr_size(*loaded);
+		for(j=0; j<num_loaded; j++) {
+			if(strcmp((*loaded)[j], path) == 0) break;
+		}
+		if(j < num_loaded) {
+			free(path);
+			continue;
+		}
+
+		if(!(tmp = dynarr_push(*loaded, &path))) {
+			fprintf(stderr, "load_scene: failed to allocate memory\n");
+			free(path);
+			return -1;
+		}
+		*loaded = tmp;
+
+		load_mtllib(scn, path);
+	}
+	return 0;
+}
+
+static int build_mtlmap(struct scene *scn, struct surf_instance *inst, int warn)
+{
+	int i;
+	struct mesh *m = &inst->geom->m;
+
+	if(m->num_mtls <= 0) {
+		return 0;
+	}
+	if(!(inst->mtlmap = malloc(m->num_mtls * sizeof *inst->mtlmap))) {
+		return -1;
+	}
+	for(i=0; i<m->num_mtls; i++) {
+		if((inst->mtlmap[i] = find_material(scn, m->mtlnames[i])) == -1) {
+			if(warn) {
+				fprintf(stderr, "load_scene: undefined material: %s\n", m->mtlnames[i]);
+			}
+			inst->mtlmap[i] = inst->mtl;
+		}
+	}
+	return 0;
+}
+static void load_mesh_job(void *cls)
+{
+	struct mesh_ref *ref = cls;
+	struct mesh *m = &ref->geom->m;
+	struct mesh end;
+
+	/* the mesh cache only holds static meshes, and their octrees */
+	if(ref->deform) {
+		init_mesh(&end);
+		if(load_mesh(m, ref->path) == -1 || load_mesh(&end, ref->deform) == -1) {
+			clear_mesh(&end);
+			return;
+		}
+		if(set_mesh_deform(m, &end) == -1) {
+			fprintf(stderr, "load_scene: %s: faces don't match %s\n", ref->deform, ref->path);
+			clear_mesh(&end);
+			return;
+		}
+		clear_mesh(&end);
+		if(build_mesh_octree(m, MESH_OCTREE_ITEMS, MESH_OCTREE_DEPTH) != -1) {
+			ref->result = 0;
+		}
+		return;
+	}
+
+	if(get_geom_budget() > 0) {
+		if(load_lazy_mesh(ref) != -1) {
+			ref->result = 0;
+			return;
+		}
+		/* no usable mesh cache, fall back to loading it normally */
+	}
+
+	if(load_mesh_cache(m, ref->path, MESH_OCTREE_ITEMS, MESH_OCTREE_DEPTH) == -1) {
+		if(load_mesh(m, ref->path) == -1) {
+			return;
+		}
+		if(build_mesh_octree(m, MESH_OCTREE_ITEMS, MESH_OCTREE_DEPTH) != -1) {
+			save_mesh_cache(m, ref->path, MESH_OCTREE_ITEMS, MESH_OCTREE_DEPTH);
+		}
+	}
+	/* the cache keeps the uncompressed mesh, which stays in use on failure */
+	if(get_mesh_quantize()) {
+		quantize_mesh(m);
+	}
+	place_mesh(m);
+	ref->result = 0;
+}
+
+/* registers the mesh with just its bounds, building the mesh cache first if
+ * it's missing or out of date
+ */
+static int load_lazy_mesh(struct mesh_ref *ref)
+{
+	long size;
+	struct aabox bbox;
+	struct mesh *m = &ref->geom->m;
+
+	if(load_mesh_cache_info(m, ref->path, MESH_OCTREE_ITEMS, MESH_OCTREE_DEPTH, &bbox,
+				&size) == -1) {
+		if(load_mesh(m, ref->path) == -1 ||
+				build_mesh_octree(m, MESH_OCTREE_ITEMS, MESH_OCTREE_DEPTH) == -1 ||
+				save_mesh_cache(m, ref->path, MESH_OCTREE_ITEMS, MESH_OCTREE_DEPTH) == -1) {
+			clear_mesh(m);
+			return -1;
+		}
+		if(load_mesh_cache_info(m, ref->path, MESH_OCTREE_ITEMS, MESH_OCTREE_DEPTH, &bbox,
+					&size) == -1) {
+			clear_mesh(m);
+			return -1;
+		}
+	}
+
+	if(!(ref->geom->lazy = create_lazy_mesh(ref->path, &bbox, size, MESH_OCTREE_ITEMS,
+					MESH_OCTREE_DEPTH))) {
+		clear_mesh(m);
+		return -1;
+	}
+	return 0;
+}
+
+static int load_voxel_surface(struct scene *scn, const char *fname, const char *name,
+		struct attr *attr, int mtl)
+{
+	int threshold = 1;
+	char *path;
+	float xform[16], inv_xform[16];
+	struct xform_key key[2];
+	struct voxel_grid *vg;
+	union surface *surf;
+
+	if(attr[ATTR_THRESHOLD].set) {
+		threshold = attr[ATTR_THRESHOLD].val[0];
+	}
+	if(!(path = rel_path(fname, name)) || !(vg = malloc(sizeof *vg))) {
+		fprintf(stderr, "load_scene: failed to allocate voxel grid\n");
+		free(path);
+		return -1;
+	}
+	if(load_voxels_raw(vg, path, attr[ATTR_DIM].val[0], attr[ATTR_DIM].val[1],
+				attr[ATTR_DIM].val[2], threshold, -1) == -1) {
+		free(vg);
+		free(path);
+		return -1;
+	}
+	free(path);
+
+	if(!(surf = create_voxels(vg))) {
+		fprintf(stderr, "load_scene: failed to allocate voxel surface\n");
+		clear_voxels(vg);
+		free(vg);
+		return -1;
+	}
+	surf->any.mtl = mtl;
+	calc_xform(xform, inv_xform, attr);
+	set_surface_xform(surf, xform, inv_xform);
+	if(calc_motion_keys(key, attr) && set_surface_motion(surf, key, key + 1) == -1) {
+		fprintf(stderr, "load_scene: failed to allocate voxel motion\n");
+		free_surface(surf);
+		return -1;
+	}
+	calc_bounds(surf);
+	add_surface(scn, surf);
+	return 0;
+}
+
+static int load_curve_surface(struct scene *scn, const char *fname, const char *name,
+		struct attr *attr, int mtl)
+{
+	char *path;
+	float xform[16], inv_xform[16];
+	struct xform_key key[2];
+	struct curve_set *cs = 0;
+	union surface *surf;
+
+	if(!(path = rel_path(fname, name)) || !(cs = malloc(sizeof *cs)) ||
+			init_curves(cs) == -1) {
+		fprintf(stderr, "load_scene: failed to allocate curves\n");
+		free(path);
+		free(cs);
+		return -1;
+	}
+	if(load_curves(cs, path) == -1 || build_curves(cs) == -1) {
+		clear_curves(cs);
+		free(cs);
+		free(path);
+		return -1;
+	}
+	free(path);
+
+	if(!(surf = create_curves(cs))) {
+		fprintf(stderr, "load_scene: failed to allocate curve surface\n");
+		clear_curves(cs);
+		free(cs);
+		return -1;
+	}
+	surf->any.mtl = mtl;
+	calc_xform(xform, inv_xform, attr);
+	set_surface_xform(surf, xform, inv_xform);
+	if(calc_motion_keys(key, attr) && set_surface_motion(surf, key, key + 1) == -1) {
+		fprintf(stderr, "load_scene: failed to allocate curve motion\n");
+		free_surface(surf);
+		return -1;
+	}
+	calc_bounds(surf);
+	add_surface(scn, surf);
+	return 0;
+}
+
+static int load_subdiv_surface(struct scene *scn, const char *fname, const char *name,
+		struct attr *attr, int mtl)
+{
+	char *path, *disp_path;
+	float xform[16], inv_xform[16];
+	struct xform_key key[2];
+	struct subdiv_mesh *sd;
+	union surface *surf;
+
+	if(!(path = rel_path(fname, name)) || !(sd = malloc(sizeof *sd))) {
+		fprintf(stderr, "load_scene: failed to allocate subdivision surface\n");
+		free(path);
+		return -1;
+	}
+	init_subdiv(sd);
+	if(attr[ATTR_LEVEL].set) {
+		sd->level = attr[ATTR_LEVEL].val[0];
+	}
+	if(attr[ATTR_DISPMAP].set) {
+		if(!(disp_path = rel_path(fname, attr[ATTR_DISPMAP].str))) {
+			fprintf(stderr, "load_scene: failed to allocate memory\n");
+			goto err;
+		}
+		if(set_subdiv_disp(sd, disp_path, attr[ATTR_DISPSCALE].set ?
+					attr[ATTR_DISPSCALE].val[0] : 1.0f) == -1) {
+			free(disp_path);
+			goto err;
+		}
+		free(disp_path);
+	}
+	if(load_subdiv(sd, path) == -1) {
+		goto err;
+	}
+	free(path);
+
+	if(!(surf = create_subdiv(sd))) {
+		fprintf(stderr, "load_scene: failed to allocate subdivision surface\n");
+		clear_subdiv(sd);
+		free(sd);
+		return -1;
+	}
+	surf->any.mtl = mtl;
+	calc_xform(xform, inv_xform, attr);
+	set_surface_xform(surf, xform, inv_xform);
+	if(calc_motion_keys(key, attr) && set_surface_motion(surf, key, key + 1) == -1) {
+		fprintf(stderr, "load_scene: failed to allocate subdivision surface motion\n");
+		free_surface(surf);
+		return -1;
+	}
+	calc_bounds(surf);
+	add_surface(scn, surf);
+	return 0;
+
+err:
+	clear_subdiv(sd);
+	free(sd);
+	free(path);
+	return -1;
+}
+
+/* scale, then rotate, then translate */
+static void calc_xform(float *xform, float *inv_xform, struct attr *attr)
+{
+	float *v;
+
+	cgm_midentity(xform);
+	if(attr[ATTR_SCALE].set) {
+		v = attr[ATTR_SCALE].val;
+		cgm_mscale(xform, v[0], v[1], v[2]);
+	}
+	if(attr[ATTR_ROTATE].set) {
+		cgm_vec3 axis;
+		v = attr[ATTR_ROTATE].val;
+		cgm_vcons(&axis, v[1], v[2], v[3]);
+		cgm_vnormalize(&axis);
+		cgm_mrotate(xform, cgm_deg_to_rad(v[0]), axis.x, axis.y, axis.z);
+	}
+	if(attr[ATTR_POS].set) {
+		v = attr[ATTR_POS].val;
+		cgm_mtranslate(xform, v[0], v[1], v[2]);
+	}
+
+	cgm_mcopy(inv_xform, xform);
+	cgm_minverse(inv_xform);
+}
+
+/* shutter open and close keys of moving surfaces, from the same attributes as
+ * calc_xform and their end counterparts. Returns 0 for static surfaces.
+ */
+static int calc_motion_keys(struct xform_key *key, struct attr *attr)
+{
+	int i;
+
+	for(i=0; i<2; i++) {
+		cgm_vcons(&key[i].pos, 0, 0, 0);
+		cgm_vcons(&key[i].scale, 1, 1, 1);
+		cgm_qcons(&key[i].rot, 0, 0, 0, 1);
+		set_key(key + i, attr + ATTR_POS, attr + ATTR_ROTATE, attr + ATTR_SCALE);
+	}
+	set_key(key + 1, attr + ATTR_ENDPOS, attr + ATTR_ENDROTATE, attr + ATTR_ENDSCALE);
+
+	return attr[ATTR_ENDPOS].set || attr[ATTR_ENDROTATE].set || attr[ATTR_ENDSCALE].set;
+}
+
+static void set_key(struct xform_key *key, struct attr *pos, struct attr *rot,
+		struct attr *scale)
+{
+	cgm_vec3 axis;
+
+	if(pos->set) {
+		cgm_vcons(&key->pos, pos->val[0], pos->val[1], pos->val[2]);
+	}
+	if(rot->set) {
+		cgm_vcons(&axis, rot->val[1], rot->val[2], rot->val[3]);
+		cgm_vnormalize(&axis);
+		cgm_qrotation(&key->rot, cgm_deg_to_rad(rot->val[0]), axis.x, axis.y, axis.z);
+	}
+	if(scale->set) {
+		cgm_vcons(&key->scale, scale->val[0], scale->val[1], scale->val[2]);
+	}
+}
@@ -0,0 +1,1356 @@
+/* Catmull-Clark subdivision surfaces
+ *
+ * Control meshes with faces other than quads are subdivided once, after which
+ * every quad becomes a bicubic Bézier patch, with the approximation of Loop and
+ * Schaefer: interior points are weighted by the valence of their vertex, edge
+ * points are the midpoints of the interior points on either side of the edge,
+ * and corners are the average of the interior points around them. Regular
+ * patches come out as the exact limit surface, and patches next to
+ * extraordinary vertices are continuous with their neighbours. Boundaries
+ * follow the cubic B-spline through the boundary vertices, and vertices with a
+ * single face are kept as corners.
+ *
+ * Patches are only tessellated when a ray reaches their bounds, and displaced
+ * along the normal at the grid vertices. The tessellations of all surfaces
+ * share a cache of bounded size, and use the same reference counting as lazy
+ * meshes: each patch counts the rays using its tessellation, and the count is
+ * -1 while it isn't resident. Patches are tessellated without holding the cache
+ * lock, which is only taken to insert the result. Patches not in use are
+ * evicted with the clock algorithm, like texture tiles, since there are far
+ * too many of them to search for the least recently used one on every miss.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <float.h>
+#include <pthread.h>
+#include "subdiv.h"
+#include "mesh.h"
+#include "dynarr.h"
+
+#define EPSILON		1e-5f
+
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+
+/* polygon mesh, with the texture coordinates of each face corner. Each corner
+ * also stands for the edge from its vertex to the vertex of the next corner.
+ */
+struct cage {
+	cgm_vec3 *verts;
+	int num_verts;
+	int *fstart;	/* first corner of each face, followed by the number of corners */
+	int num_faces;
+	int *cvert;		/* vertex of each corner */
+	cgm_vec3 *ctc;	/* texture coordinates of each corner */
+	int *cface;		/* face of each corner */
+	int *twin;		/* corner of the same edge in the other direction, -1 on boundaries */
+	int num_corners;
+};
+
+struct edge_key {
+	int v0, v1;		/* v0 < v1 */
+	int c;
+};
+
+/* patch bounds and centers while building the hierarchy */
+struct build_patch {
+	struct aabox bbox;
+	cgm_vec3 center;
+	int idx;
+};
+
+/* nearest hit found so far */
+struct subdiv_hit {
+	float t;
+	cgm_vec3 normal;
+	float u, v;		/* patch parameters */
+	const struct subdiv_patch *patch;
+	float uvscale;
+};
+
+static int load_cage(struct cage *cg, const char *fname);
+static void free_cage(struct cage *cg);
+static int link_cage(struct cage *cg);
+static int refine_cage(struct cage *res, const struct cage *cg);
+static int build_patches(struct subdiv_mesh *sd, const struct cage *cg);
+static void build_node(struct subdiv_mesh *sd, struct build_patch *bp, int nidx, int first,
+		int count, int depth);
+static struct subdiv_tess *tessellate(const struct subdiv_mesh *sd,
+		const struct subdiv_patch *p);
+static const struct subdiv_tess *acquire_tess(const struct subdiv_mesh *sd,
+		struct subdiv_patch *p);
+static void release_tess(struct subdiv_patch *p);
+static int insert_tess(struct subdiv_patch *p, struct subdiv_tess *tess);
+static void evict_tess(long size);
+static void ray_tess(const struct subdiv_tess *tess, const struct subdiv_patch *p,
+		const cgm_ray *ray, const cgm_vec3 *inv_dir, struct subdiv_hit *sh);
+
+/* control points of the boundary row and the row next to it along each edge of
+ * a patch, from the corner of the edge to the next corner
+ */
+static const int edge_row[4][2][4] = {
+	{{0, 1, 2, 3}, {4, 5, 6, 7}},
+	{{3, 7, 11, 15}, {2, 6, 10, 14}},
+	{{15, 14, 13, 12}, {11, 10, 9, 8}},
+	{{12, 8, 4, 0}, {13, 9, 5, 1}}
+};
+
+static long cache_size = (long)DEF_TESS_CACHE_MB * 1048576;
+static long resident;
+static struct subdiv_patch **resident_patches;
+static int num_resident, max_resident, clock_hand;
+static pthread_mutex_t tess_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void set_tess_cache_size(int mbytes)
+{
+	cache_size = (long)mbytes * 1048576;
+}
+
+int get_tess_cache_size(void)
+{
+	return cache_size / 1048576;
+}
+
+void init_subdiv(struct subdiv_mesh *sd)
+{
+	memset(sd, 0, sizeof *sd);
+	cgm_vcons(&sd->bbox.vmin, FLT_MAX, FLT_MAX, FLT_MAX);
+	cgm_vcons(&sd->bbox.vmax, -FLT_MAX, -FLT_MAX, -FLT_MAX);
+	sd->level = DEF_SUBDIV_LEVEL;
+	init_texture(&sd->disp);
+}
+
+void clear_subdiv(struct subdiv_mesh *sd)
+{
+	int i;
+	struct subdiv_patch *p, *last;
+
+	pthread_mutex_lock(&tess_lock);
+	for(i=0; i<sd->num_patches; i++) {
+		p = sd->patches + i;
+		if(p->users < 0) continue;
+
+		last = resident_patches[--num_resident];
+		resident_patches[p->slot] = last;
+		last->slot = p->slot;
+		if(clock_hand >= num_resident) clock_hand = 0;
+
+		resident -= p->tess->size;
+		free(p->tess);
+	}
+	pthread_mutex_unlock(&tess_lock);
+
+	free(sd->patches);
+	free(sd->nodes);
+	destroy_texture(&sd->disp);
+	init_subdiv(sd);
+}
+
+int set_subdiv_disp(struct subdiv_mesh *sd, const char *fname, float scale)
+{
+	destroy_texture(&sd->disp);
+	if(!(sd->disp.name = strdup(fname))) {
+		fprintf(stderr, "set_subdiv_disp: failed to allocate memory\n");
+		return -1;
+	}
+	if(open_texture(&sd->disp) == -1) {
+		fprintf(stderr, "set_subdiv_disp: failed to open displacement map: %s\n", fname);
+		destroy_texture(&sd->disp);
+		return -1;
+	}
+	sd->disp_scale = scale;
+	return 0;
+}
+
+int load_subdiv(struct subdiv_mesh *sd, const char *fname)
+{
+	int i, res;
+	struct cage cg, quads;
+
+	if(load_cage(&cg, fname) == -1) {
+		return -1;
+	}
+	if(link_cage(&cg) == -1) {
+		free_cage(&cg);
+		return -1;
+	}
+
+	for(i=0; i<cg.num_faces; i++) {
+		if(cg.fstart[i + 1] - cg.fstart[i] != 4) break;
+	}
+	if(i < cg.num_faces) {
+		res = refine_cage(&quads, &cg);
+		free_cage(&cg);
+		if(res == -1 || link_cage(&quads) == -1) {
+			free_cage(&quads);
+			return -1;
+		}
+		cg = quads;
+	}
+
+	res = build_patches(sd, &cg);
+	printf("loaded subdivision surface: %s: %d vertices, %d patches\n", fname,
+			cg.num_verts, sd->num_patches);
+	free_cage(&cg);
+	return res;
+}
+
+/* OBJ indices start from 1, and negative ones count back from the end */
+static int obj_index(long idx, int count)
+{
+	if(idx < 0) {
+		idx += count;
+	} else {
+		idx--;
+	}
+	return idx >= 0 && idx < count ? idx : -1;
+}
+
+static int load_cage(struct cage *cg, const char *fname)
+{
+	FILE *fp;
+	int i, vidx, tidx, line_num = 0, num, res = -1;
+	long idx;
+	char *line = 0, *ptr, *end;
+	size_t bufsz = 0;
+	cgm_vec3 v, zero = {0, 0, 0}, *verts, *tcs, *ctc;
+	int *fstart, *cvert;
+	void *tmp;
+
+	memset(cg, 0, sizeof *cg);
+	if(!(fp = fopen(fname, "rb"))) {
+		fprintf(stderr, "load_subdiv: failed to open: %s\n", fname);
+		return -1;
+	}
+	verts = dynarr_alloc(0, sizeof *verts);
+	tcs = dynarr_alloc(0, sizeof *tcs);
+	ctc = dynarr_alloc(0, sizeof *ctc);
+	fstart = dynarr_alloc(0, sizeof *fstart);
+	cvert = dynarr_alloc(0, sizeof *cvert);
+	if(!verts || !tcs || !ctc || !fstart || !cvert) {
+		goto nomem;
+	}
+
+	while(getline(&line, &bufsz, fp) != -1) {
+		line_num++;
+		if((ptr = strchr(line, '#'))) *ptr = 0;
+		ptr = line;
+		while(*ptr && isspace(*ptr)) ptr++;
+
+		if(ptr[0] == 'v' && (isspace(ptr[1]) || (ptr[1] == 't' && isspace(ptr[2])))) {
+			num = ptr[1] == 't' ? 2 : 3;
+			ptr += num == 2 ? 2 : 1;
+			v = zero;
+			for(i=0; i<num; i++) {
+				(&v.x)[i] = strtod(ptr, &end);
+				if(end == ptr) goto inval;
+				ptr = end;
+			}
+			if(!(tmp = dynarr_push(num == 2 ? tcs : verts, &v))) {
+				goto nomem;
+			}
+			if(num == 2) {
+				tcs = tmp;
+			} else {
+				verts = tmp;
+			}
+
+		} else if(ptr[0] == 'f' && isspace(ptr[1])) {
+			ptr++;
+			num = dynarr_size(cvert);
+			if(!(tmp = dynarr_push(fstart, &num))) {
+				goto nomem;
+			}
+			fstart = tmp;
+
+			/* v, v/vt, v//vn or v/vt/vn */
+			for(;;) {
+				idx = strtol(ptr, &end, 10);
+				if(end == ptr) break;
+				ptr = end;
+				if((vidx = obj_index(idx, dynarr_size(verts))) == -1) {
+					goto inval;
+				}
+				tidx = -1;
+				if(*ptr == '/') {
+					idx = strtol(++ptr, &end, 10);
+					if(end != ptr && (tidx = obj_index(idx, dynarr_size(tcs))) == -1) {
+						goto inval;
+					}
+					ptr = end;
+					if(*ptr == '/') {
+						strtol(++ptr, &end, 10);
+						ptr = end;
+					}
+				}
+				if(!(tmp = dynarr_push(cvert, &vidx))) {
+					goto nomem;
+				}
+				cvert = tmp;
+				if(!(tmp = dynarr_push(ctc, tidx >= 0 ? tcs + tidx : &zero))) {
+					goto nomem;
+				}
+				ctc = tmp;
+			}
+			while(*ptr && isspace(*ptr)) ptr++;
+			if(*ptr || dynarr_size(cvert) - num < 3) {
+				goto inval;
+			}
+		}
+	}
+
+	if(!(cg->num_faces = dynarr_size(fstart))) {
+		fprintf(stderr, "load_subdiv: %s: no faces\n", fname);
+		goto end;
+	}
+	num = dynarr_size(cvert);
+	if(!(tmp = dynarr_push(fstart, &num))) {
+		goto nomem;
+	}
+	fstart = tmp;
+
+	cg->num_verts = dynarr_size(verts);
+	cg->num_corners = num;
+	cg->verts = dynarr_finalize(verts);
+	cg->fstart = dynarr_finalize(fstart);
+	cg->cvert = dynarr_finalize(cvert);
+	cg->ctc = dynarr_finalize(ctc);
+	verts = 0;
+	fstart = cvert = 0;
+	ctc = 0;
+	res = 0;
+	goto end;
+
+nomem:
+	fprintf(stderr, "load_subdiv: %s: failed to allocate memory\n", fname);
+	goto end;
+inval:
+	fprintf(stderr, "load_subdiv: %s:%d: invalid vertex or face\n", fname, line_num);
+end:
+	if(verts) dynarr_free(verts);
+	if(tcs) dynarr_free(tcs);
+	if(ctc) dynarr_free(ctc);
+	if(fstart) dynarr_free(fstart);
+	if(cvert) dynarr_free(cvert);
+	free(line);
+	fclose(fp);
+	return res;
+}
+
+static void free_cage(struct cage *cg)
+{
+	free(cg->verts);
+	free(cg->fstart);
+	free(cg->cvert);
+	free(cg->ctc);
+	free(cg->cface);
+	free(cg->twin);
+	memset(cg, 0, sizeof *cg);
+}
+
+static inline int next_corner(const struct cage *cg, int c)
+{
+	int f = cg->cface[c];
+	return c + 1 < cg->fstart[f + 1] ? c + 1 : cg->fstart[f];
+}
+
+static inline int prev_corner(const struct cage *cg, int c)
+{
+	int f = cg->cface[c];
+	return c > cg->fstart[f] ? c - 1 : cg->fstart[f + 1] - 1;
+}
+
+static int cmp_edge(const void *a, const void *b)
+{
+	const struct edge_key *ea = a, *eb = b;
+
+	if(ea->v0 != eb->v0) return ea->v0 - eb->v0;
+	if(ea->v1 != eb->v1) return ea->v1 - eb->v1;
+	return ea->c - eb->c;
+}
+
+/* pairs up the corners of each edge by sorting them. Edges shared by more than
+ * two faces, or by two faces of opposite orientation, are treated as boundaries.
+ */
+static int link_cage(struct cage *cg)
+{
+	int i, j, c, f, a, b;
+	struct edge_key *keys;
+
+	cg->cface = malloc(cg->num_corners * sizeof *cg->cface);
+	cg->twin = malloc(cg->num_corners * sizeof *cg->twin);
+	keys = malloc(cg->num_corners * sizeof *keys);
+	if(!cg->cface || !cg->twin || !keys) {
+		fprintf(stderr, "load_subdiv: failed to allocate memory\n");
+		free(keys);
+		return -1;
+	}
+
+	for(f=0; f<cg->num_faces; f++) {
+		for(c=cg->fstart[f]; c<cg->fstart[f + 1]; c++) {
+			cg->cface[c] = f;
+		}
+	}
+	for(c=0; c<cg->num_corners; c++) {
+		a = cg->cvert[c];
+		b = cg->cvert[next_corner(cg, c)];
+		keys[c].v0 = MIN(a, b);
+		keys[c].v1 = MAX(a, b);
+		keys[c].c = c;
+		cg->twin[c] = -1;
+	}
+	qsort(keys, cg->num_corners, sizeof *keys, cmp_edge);
+
+	for(i=0; i<cg->num_corners; i=j) {
+		for(j=i+1; j<cg->num_corners; j++) {
+			if(keys[j].v0 != keys[i].v0 || keys[j].v1 != keys[i].v1) break;
+		}
+		if(j - i != 2 || keys[i].v0 == keys[i].v1) continue;
+
+		a = keys[i].c;
+		b = keys[i + 1].c;
+		if(cg->cvert[a] == cg->cvert[next_corner(cg, b)]) {
+			cg->twin[a] = b;
+			cg->twin[b] = a;
+		}
+	}
+	free(keys);
+	return 0;
+}
+
+/* the same for a, b and b, a, so that neighbouring patches agree exactly */
+static void vmid(cgm_vec3 *res, const cgm_vec3 *a, const cgm_vec3 *b)
+{
+	res->x = (a->x + b->x) * 0.5f;
+	res->y = (a->y + b->y) * 0.5f;
+	res->z = (a->z + b->z) * 0.5f;
+}
+
+static void vmadd(cgm_vec3 *res, const cgm_vec3 *v, float s)
+{
+	res->x += v->x * s;
+	res->y += v->y * s;
+	res->z += v->z * s;
+}
+
+/* one step of Catmull-Clark subdivision, which turns every corner of every
+ * face into a quad. Texture coordinates are interpolated linearly.
+ */
+static int refine_cage(struct cage *res, const struct cage *cg)
+{
+	int i, c, f, n, v, w, g, num_edges = 0, *eid, *nface, *nbnd, *cv;
+	cgm_vec3 *fpt, *ftc, *fsum, *rsum, *bsum, mid, *nv, *tc;
+
+	memset(res, 0, sizeof *res);
+	eid = malloc(cg->num_corners * sizeof *eid);
+	fpt = calloc(cg->num_faces, sizeof *fpt);
+	ftc = calloc(cg->num_faces, sizeof *ftc);
+	fsum = calloc(cg->num_verts, sizeof *fsum);
+	rsum = calloc(cg->num_verts, sizeof *rsum);
+	bsum = calloc(cg->num_verts, sizeof *bsum);
+	nface = calloc(cg->num_verts, sizeof *nface);
+	nbnd = calloc(cg->num_verts, sizeof *nbnd);
+	if(!eid || !fpt || !ftc || !fsum || !rsum || !bsum || !nface || !nbnd) {
+		goto nomem;
+	}
+
+	for(c=0; c<cg->num_corners; c++) {
+		eid[c] = -1;
+	}
+	for(c=0; c<cg->num_corners; c++) {
+		if(eid[c] >= 0) continue;
+		eid[c] = num_edges;
+		if(cg->twin[c] >= 0) {
+			eid[cg->twin[c]] = num_edges;
+		}
+		num_edges++;
+	}
+
+	for(f=0; f<cg->num_faces; f++) {
+		n = cg->fstart[f + 1] - cg->fstart[f];
+		for(c=cg->fstart[f]; c<cg->fstart[f + 1]; c++) {
+			vmadd(fpt + f, cg->verts + cg->cvert[c], 1.0f / n);
+			vmadd(ftc + f, cg->ctc + c, 1.0f / n);
+		}
+	}
+
+	res->num_verts = cg->num_verts + num_edges + cg->num_faces;
+	res->num_faces = cg->num_corners;
+	res->num_corners = cg->num_corners * 4;
+	res->verts = calloc(res->num_verts, sizeof *res->verts);
+	res->fstart = malloc((res->num_faces + 1) * sizeof *res->fstart);
+	res->cvert = malloc(res->num_corners * sizeof *res->cvert);
+	res->ctc = malloc(res->num_corners * sizeof *res->ctc);
+	if(!res->verts || !res->fstart || !res->cvert || !res->ctc) {
+		goto nomem;
+	}
+	nv = res->verts;
+
+	/* edge points, and the sums around each vertex for the vertex points */
+	for(c=0; c<cg->num_corners; c++) {
+		v = cg->cvert[c];
+		w = cg->cvert[next_corner(cg, c)];
+		f = cg->cface[c];
+		cgm_vlerp(&mid, cg->verts + v, cg->verts + w, 0.5f);
+
+		cgm_vadd(fsum + v, fpt + f);
+		nface[v]++;
+		cgm_vadd(rsum + v, &mid);
+
+		if((g = cg->twin[c]) < 0) {
+			cgm_vadd(rsum + w, &mid);
+			cgm_vadd(bsum + v, cg->verts + w);
+			cgm_vadd(bsum + w, cg->verts + v);
+			nbnd[v]++;
+			nbnd[w]++;
+			nv[cg->num_verts + eid[c]] = mid;
+		} else if(c < g) {
+			vmadd(nv + cg->num_verts + eid[c], cg->verts + v, 0.25f);
+			vmadd(nv + cg->num_verts + eid[c], cg->verts + w, 0.25f);
+			vmadd(nv + cg->num_verts + eid[c], fpt + f, 0.25f);
+			vmadd(nv + cg->num_verts + eid[c], fpt + cg->cface[g], 0.25f);
+		}
+	}
+
+	for(v=0; v<cg->num_verts; v++) {
+		n = nface[v];
+		if(!nbnd[v] && n > 0) {
+			nv[v] = cg->verts[v];
+			cgm_vscale(nv + v, (float)(n - 3) / n);
+			vmadd(nv + v, fsum + v, 1.0f / ((float)n * n));
+			vmadd(nv + v, rsum + v, 2.0f / ((float)n * n));
+		} else if(nbnd[v] == 2 && n > 1) {
+			nv[v] = cg->verts[v];
+			cgm_vscale(nv + v, 0.75f);
+			vmadd(nv + v, bsum + v, 0.125f);
+		} else {
+			nv[v] = cg->verts[v];
+		}
+	}
+	memcpy(nv + cg->num_verts + num_edges, fpt, cg->num_faces * sizeof *fpt);
+
+	for(c=0; c<cg->num_corners; c++) {
+		i = c * 4;
+		res->fstart[c] = i;
+		cv = res->cvert + i;
+		tc = res->ctc + i;
+		cv[0] = cg->cvert[c];
+		cv[1] = cg->num_verts + eid[c];
+		cv[2] = cg->num_verts + num_edges + cg->cface[c];
+		cv[3] = cg->num_verts + eid[prev_corner(cg, c)];
+		tc[0] = cg->ctc[c];
+		cgm_vlerp(tc + 1, cg->ctc + c, cg->ctc + next_corner(cg, c), 0.5f);
+		tc[2] = ftc[cg->cface[c]];
+		cgm_vlerp(tc + 3, cg->ctc + prev_corner(cg, c), cg->ctc + c, 0.5f);
+	}
+	res->fstart[res->num_faces] = res->num_corners;
+
+	free(eid);
+	free(fpt);
+	free(ftc);
+	free(fsum);
+	free(rsum);
+	free(bsum);
+	free(nface);
+	free(nbnd);
+	return 0;
+
+nomem:
+	fprintf(stderr, "load_subdiv: failed to allocate memory\n");
+	free(eid);
+	free(fpt);
+	free(ftc);
+	free(fsum);
+	free(rsum);
+	free(bsum);
+	free(nface);
+	free(nbnd);
+	return -1;
+}
+
+/* points on the edge of corner c, next to its vertex and next to the other
+ * end of the edge
+ */
+static void edge_points(cgm_vec3 *p0, cgm_vec3 *p1, const struct cage *cg,
+		const cgm_vec3 *ipt, int c)
+{
+	int t = cg->twin[c], n = next_corner(cg, c);
+	const cgm_vec3 *v, *w;
+
+	if(t >= 0) {
+		vmid(p0, ipt + c, ipt + next_corner(cg, t));
+		vmid(p1, ipt + n, ipt + t);
+	} else {
+		v = cg->verts + cg->cvert[c];
+		w = cg->verts + cg->cvert[n];
+		cgm_vlerp(p0, v, w, 1.0f / 3.0f);
+		cgm_vlerp(p1, v, w, 2.0f / 3.0f);
+	}
+}
+
+/* normal of the patch at a corner, from the edges leaving it */
+static void corner_normal(cgm_vec3 *res, const struct subdiv_patch *p, int k)
+{
+	const int *row = edge_row[k][0], *prev = edge_row[(k + 3) & 3][0];
+	cgm_vec3 a, b;
+
+	a = p->cp[row[1]];
+	cgm_vsub(&a, p->cp + row[0]);
+	b = p->cp[prev[2]];
+	cgm_vsub(&b, p->cp + prev[3]);
+	cgm_vcross(res, &a, &b);
+}
+
+static int build_patches(struct subdiv_mesh *sd, const struct cage *cg)
+{
+	int i, j, c, e, f, t, v, n, *nface, *nbnd;
+	float pad = 0.0f;
+	cgm_vec3 *ipt, *isum, *bsum, *corner, *cp, *vnorm, nrm;
+	const struct subdiv_patch *g;
+	const cgm_vec3 *a, *b, *d;
+	struct subdiv_patch *p, *patches = 0;
+	struct build_patch *bp = 0;
+
+	ipt = malloc(cg->num_corners * sizeof *ipt);
+	isum = calloc(cg->num_verts, sizeof *isum);
+	bsum = calloc(cg->num_verts, sizeof *bsum);
+	corner = malloc(cg->num_verts * sizeof *corner);
+	vnorm = calloc(cg->num_verts, sizeof *vnorm);
+	nface = calloc(cg->num_verts, sizeof *nface);
+	nbnd = calloc(cg->num_verts, sizeof *nbnd);
+	if(!ipt || !isum || !bsum || !corner || !vnorm || !nface || !nbnd) {
+		goto nomem;
+	}
+
+	for(c=0; c<cg->num_corners; c++) {
+		v = cg->cvert[c];
+		nface[v]++;
+		if(cg->twin[c] < 0) {
+			n = cg->cvert[next_corner(cg, c)];
+			cgm_vadd(bsum + v, cg->verts + n);
+			cgm_vadd(bsum + n, cg->verts + v);
+			nbnd[v]++;
+			nbnd[n]++;
+		}
+	}
+
+	/* interior points, with regular weights at boundaries */
+	for(c=0; c<cg->num_corners; c++) {
+		v = cg->cvert[c];
+		n = nbnd[v] ? 4 : nface[v];
+		a = cg->verts + cg->cvert[next_corner(cg, c)];
+		d = cg->verts + cg->cvert[next_corner(cg, next_corner(cg, c))];
+		b = cg->verts + cg->cvert[prev_corner(cg, c)];
+		ipt[c] = cg->verts[v];
+		cgm_vscale(ipt + c, (float)n);
+		vmadd(ipt + c, a, 2.0f);
+		vmadd(ipt + c, b, 2.0f);
+		cgm_vadd(ipt + c, d);
+		cgm_vscale(ipt + c, 1.0f / (n + 5));
+		cgm_vadd(isum + v, ipt + c);
+	}
+
+	for(v=0; v<cg->num_verts; v++) {
+		corner[v] = cg->verts[v];
+		if(!nbnd[v] && nface[v] > 0) {
+			corner[v] = isum[v];
+			cgm_vscale(corner + v, 1.0f / nface[v]);
+		} else if(nbnd[v] == 2 && nface[v] > 1) {
+			cgm_vscale(corner + v, 4.0f);
+			cgm_vadd(corner + v, bsum + v);
+			cgm_vscale(corner + v, 1.0f / 6.0f);
+		}
+	}
+
+	patches = calloc(cg->num_faces, sizeof *patches);
+	bp = malloc(cg->num_faces * sizeof *bp);
+	sd->nodes = malloc((2 * cg->num_faces - 1) * sizeof *sd->nodes);
+	if(!patches || !bp || !sd->nodes) {
+		goto nomem;
+	}
+
+	if(sd->disp.name) {
+		pad = fabs(sd->disp_scale);
+	}
+
+	for(f=0; f<cg->num_faces; f++) {
+		p = patches + f;
+		c = cg->fstart[f];
+		cp = p->cp;
+
+		cp[0] = corner[cg->cvert[c]];
+		cp[3] = corner[cg->cvert[c + 1]];
+		cp[15] = corner[cg->cvert[c + 2]];
+		cp[12] = corner[cg->cvert[c + 3]];
+		cp[5] = ipt[c];
+		cp[6] = ipt[c + 1];
+		cp[10] = ipt[c + 2];
+		cp[9] = ipt[c + 3];
+		edge_points(cp + 1, cp + 2, cg, ipt, c);
+		edge_points(cp + 7, cp + 11, cg, ipt, c + 1);
+		edge_points(cp + 14, cp + 13, cg, ipt, c + 2);
+		edge_points(cp + 8, cp + 4, cg, ipt, c + 3);
+		memcpy(p->tc, cg->ctc + c, sizeof p->tc);
+
+		/* the patch is within the convex hull of its control points */
+		aabox_init(&p->bbox);
+		for(i=0; i<16; i++) {
+			aabox_add_point(&p->bbox, cp + i);
+		}
+		p->bbox.vmin.x -= pad;
+		p->bbox.vmin.y -= pad;
+		p->bbox.vmin.z -= pad;
+		p->bbox.vmax.x += pad;
+		p->bbox.vmax.y += pad;
+		p->bbox.vmax.z += pad;
+
+		p->users = -1;
+
+		bp[f].bbox = p->bbox;
+		cgm_vlerp(&bp[f].center, &p->bbox.vmin, &p->bbox.vmax, 0.5f);
+		bp[f].idx = f;
+		aabox_add(&sd->bbox, &p->bbox);
+	}
+
+	/* rows across the edges, mirrored at boundaries, and the corner normals */
+	for(f=0; f<cg->num_faces; f++) {
+		p = patches + f;
+		c = cg->fstart[f];
+		for(e=0; e<4; e++) {
+			if((t = cg->twin[c + e]) >= 0) {
+				g = patches + cg->cface[t];
+				i = t - cg->fstart[cg->cface[t]];
+				for(j=0; j<4; j++) {
+					p->nbr_row[e][j] = g->cp[edge_row[i][1][3 - j]];
+				}
+			} else {
+				for(j=0; j<4; j++) {
+					p->nbr_row[e][j] = p->cp[edge_row[e][0][j]];
+					cgm_vscale(p->nbr_row[e] + j, 2.0f);
+					cgm_vsub(p->nbr_row[e] + j, p->cp + edge_row[e][1][j]);
+				}
+			}
+
+			corner_normal(&nrm, p, e);
+			if(cgm_vlength_sq(&nrm) > 0.0f) {
+				cgm_vnormalize(&nrm);
+				cgm_vadd(vnorm + cg->cvert[c + e], &nrm);
+			}
+		}
+	}
+	for(f=0; f<cg->num_faces; f++) {
+		for(e=0; e<4; e++) {
+			nrm = vnorm[cg->cvert[cg->fstart[f] + e]];
+			if(cgm_vlength_sq(&nrm) > 0.0f) {
+				cgm_vnormalize(&nrm);
+			}
+			patches[f].cnorm[e] = nrm;
+		}
+	}
+
+	sd->num_nodes = 1;
+	build_node(sd, bp, 0, 0, cg->num_faces, 0);
+
+	if(!(sd->patches = malloc(cg->num_faces * sizeof *sd->patches))) {
+		goto nomem;
+	}
+	for(i=0; i<cg->num_faces; i++) {
+		sd->patches[i] = patches[bp[i].idx];
+	}
+	sd->num_patches = cg->num_faces;
+
+	free(patches);
+	free(bp);
+	free(ipt);
+	free(isum);
+	free(bsum);
+	free(corner);
+	free(vnorm);
+	free(nface);
+	free(nbnd);
+	return 0;
+
+nomem:
+	fprintf(stderr, "load_subdiv: failed to allocate %d patches\n", cg->num_faces);
+	free(sd->nodes);
+	sd->nodes = 0;
+	sd->num_nodes = 0;
+	free(patches);
+	free(bp);
+	free(ipt);
+	free(isum);
+	free(bsum);
+	free(corner);
+	free(vnorm);
+	free(nface);
+	free(nbnd);
+	return -1;
+}
+
+/* moves the patch with the k-th smallest center along the axis to position k,
+ * with smaller ones before it, and larger ones after it
+ */
+static void select_patch(struct build_patch *bp, int count, int k, int axis)
+{
+	int i, j, lo = 0, hi = count - 1;
+	float pivot;
+	struct build_patch tmp;
+
+	while(lo < hi) {
+		pivot = (&bp[(lo + hi) / 2].center.x)[axis];
+		i = lo;
+		j = hi;
+		while(i <= j) {
+			while((&bp[i].center.x)[axis] < pivot) i++;
+			while((&bp[j].center.x)[axis] > pivot) j--;
+			if(i <= j) {
+				tmp = bp[i];
+				bp[i++] = bp[j];
+				bp[j--] = tmp;
+			}
+		}
+		if(k <= j) {
+			hi = j;
+		} else if(k >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+}
+
+/* patches are of similar size, so nodes are split at the median of the longest
+ * axis of their centers
+ */
+static void build_node(struct subdiv_mesh *sd, struct build_patch *bp, int nidx, int first,
+		int count, int depth)
+{
+	int i, axis, half;
+	struct aabox cbox;
+	struct subdiv_node *node = sd->nodes + nidx;
+
+	node->child = 0;
+	node->first = first;
+	node->count = count;
+
+	aabox_init(&node->bbox);
+	aabox_init(&cbox);
+	for(i=0; i<count; i++) {
+		aabox_add(&node->bbox, &bp[first + i].bbox);
+		aabox_add_point(&cbox, &bp[first + i].center);
+	}
+	if(count <= SUBDIV_LEAF_PATCHES || depth >= SUBDIV_MAX_DEPTH) {
+		return;
+	}
+
+	axis = 0;
+	for(i=1; i<3; i++) {
+		if((&cbox.vmax.x)[i] - (&cbox.vmin.x)[i] >
+				(&cbox.vmax.x)[axis] - (&cbox.vmin.x)[axis]) {
+			axis = i;
+		}
+	}
+	half = count / 2;
+	select_patch(bp + first, count, half, axis);
+
+	node->child = sd->num_nodes;
+	node->count = 0;
+	sd->num_nodes += 2;
+	build_node(sd, bp, node->child, first, half, depth + 1);
+	build_node(sd, bp, node->child + 1, first + half, count - half, depth + 1);
+}
+
+/* cubic Bernstein polynomials and their derivatives */
+static void bernstein(float *b, float *db, float t)
+{
+	float s = 1.0f - t;
+
+	b[0] = s * s * s;
+	b[1] = 3.0f * t * s * s;
+	b[2] = 3.0f * t * t * s;
+	b[3] = t * t * t;
+	db[0] = -3.0f * s * s;
+	db[1] = 3.0f * s * s - 6.0f * t * s;
+	db[2] = 6.0f * t * s - 3.0f * t * t;
+	db[3] = 3.0f * t * t;
+}
+
+static void bilerp_tc(cgm_vec3 *res, const cgm_vec3 *tc, float u, float v)
+{
+	cgm_vec3 bot, top;
+
+	cgm_vlerp(&bot, tc, tc + 1, u);
+	cgm_vlerp(&top, tc + 3, tc + 2, u);
+	cgm_vlerp(res, &bot, &top, v);
+}
+
+/* direction of the displacement at grid vertex i, j, which is the patch normal
+ * n except on the edges of the patch
+ */
+static void disp_dir(cgm_vec3 *res, const struct subdiv_patch *p, int i, int j, int grid,
+		const cgm_vec3 *n)
+{
+	int e, k, m;
+	float b[4], db[4];
+	cgm_vec3 tang, cross, d;
+
+	if((i == 0 || i == grid) && (j == 0 || j == grid)) {
+		k = j == 0 ? (i == 0 ? 0 : 1) : (i == grid ? 2 : 3);
+		*res = cgm_vlength_sq(p->cnorm + k) > 0.0f ? p->cnorm[k] : *n;
+		return;
+	}
+
+	if(j == 0) {
+		e = 0;
+		m = i;
+	} else if(i == grid) {
+		e = 1;
+		m = j;
+	} else if(j == grid) {
+		e = 2;
+		m = grid - i;
+	} else if(i == 0) {
+		e = 3;
+		m = grid - j;
+	} else {
+		*res = *n;
+		return;
+	}
+
+	/* the tangent along the edge, and the difference of the derivatives
+	 * across it on either side, in which the edge row cancels out
+	 */
+	bernstein(b, db, (float)m / grid);
+	cgm_vcons(&tang, 0, 0, 0);
+	cgm_vcons(&cross, 0, 0, 0);
+	for(k=0; k<4; k++) {
+		vmadd(&tang, p->cp + edge_row[e][0][k], db[k]);
+		d = p->cp[edge_row[e][1][k]];
+		cgm_vsub(&d, p->nbr_row[e] + k);
+		vmadd(&cross, &d, b[k]);
+	}
+	cgm_vcross(res, &tang, &cross);
+	if(cgm_vlength_sq(res) > 0.0f) {
+		cgm_vnormalize(res);
+	} else {
+		*res = *n;
+	}
+}
+
+static int box_base(int level)
+{
+	return ((1 << (2 * level)) - 1) / 3;
+}
+
+static struct subdiv_tess *tessellate(const struct subdiv_mesh *sd,
+		const struct subdiv_patch *p)
+{
+	int i, j, k, r, c, x, y, res, nverts, nboxes, row;
+	float bu[4], bv[4], du[4], dv[4], w, lod = 0.0f, fp;
+	long size;
+	cgm_vec3 tu, tv, n, dn, tc, val, e0, e1, *pos, *norm;
+	struct subdiv_tess *tess;
+	struct aabox *box, *child;
+	struct texture *disp = sd->disp.name ? (struct texture*)&sd->disp : 0;
+
+	res = 1 << sd->level;
+	nverts = (res + 1) * (res + 1);
+	nboxes = box_base(sd->level + 1);
+	size = sizeof *tess + 2 * nverts * sizeof *tess->pos + nboxes * sizeof *tess->bounds;
+	if(!(tess = malloc(size))) {
+		return 0;
+	}
+	tess->res = res;
+	tess->level = sd->level;
+	tess->pos = (cgm_vec3*)(tess + 1);
+	tess->norm = tess->pos + nverts;
+	tess->bounds = (struct aabox*)(tess->norm + nverts);
+	tess->size = size;
+	pos = tess->pos;
+	norm = tess->norm;
+
+	if(disp) {
+		/* texels per grid step along the longer patch edge */
+		e0 = p->tc[1];
+		cgm_vsub(&e0, p->tc);
+		e1 = p->tc[3];
+		cgm_vsub(&e1, p->tc);
+		fp = sqrt(MAX(cgm_vlength_sq(&e0), cgm_vlength_sq(&e1))) *
+			MAX(disp->width, disp->height) / res;
+		if(fp > 1.0f) lod = log2(fp);
+	}
+
+	for(j=0; j<=res; j++) {
+		bernstein(bv, dv, (float)j / res);
+		for(i=0; i<=res; i++) {
+			bernstein(bu, du, (float)i / res);
+			k = j * (res + 1) + i;
+			cgm_vcons(pos + k, 0, 0, 0);
+			cgm_vcons(&tu, 0, 0, 0);
+			cgm_vcons(&tv, 0, 0, 0);
+			for(r=0; r<4; r++) {
+				for(c=0; c<4; c++) {
+					vmadd(pos + k, p->cp + r * 4 + c, bv[r] * bu[c]);
+					vmadd(&tu, p->cp + r * 4 + c, bv[r] * du[c]);
+					vmadd(&tv, p->cp + r * 4 + c, dv[r] * bu[c]);
+				}
+			}
+			cgm_vcross(&n, &tu, &tv);
+			if(cgm_vlength_sq(&n) <= 0.0f) {
+				/* collapsed tangent at a corner, use the patch diagonals */
+				e0 = p->cp[15];
+				cgm_vsub(&e0, p->cp);
+				e1 = p->cp[12];
+				cgm_vsub(&e1, p->cp + 3);
+				cgm_vcross(&n, &e0, &e1);
+			}
+			if(cgm_vlength_sq(&n) > 0.0f) {
+				cgm_vnormalize(&n);
+			}
+			norm[k] = n;
+
+			if(disp) {
+				bilerp_tc(&tc, p->tc, (float)i / res, (float)j / res);
+				if(sample_texture(disp, tc.x, tc.y, lod, 0, &val) != -1) {
+					disp_dir(&dn, p, i, j, res, &n);
+					vmadd(pos + k, &dn, val.x * sd->disp_scale);
+				}
+			}
+		}
+	}
+
+	/* displaced normals from the differences of neighbouring grid vertices */
+	if(disp) {
+		row = res + 1;
+		for(j=0; j<=res; j++) {
+			for(i=0; i<=res; i++) {
+				k = j * row + i;
+				e0 = pos[k + (i < res ? 1 : 0)];
+				cgm_vsub(&e0, pos + k - (i > 0 ? 1 : 0));
+				e1 = pos[k + (j < res ? row : 0)];
+				cgm_vsub(&e1, pos + k - (j > 0 ? row : 0));
+				cgm_vcross(&n, &e0, &e1);
+				if((w = cgm_vlength_sq(&n)) > 0.0f) {
+					cgm_vscale(&n, 1.0f / sqrt(w));
+					norm[k] = n;
+				}
+			}
+		}
+	}
+
+	/* quadtree bounds, from single quads upwards */
+	box = tess->bounds + box_base(sd->level);
+	for(y=0; y<res; y++) {
+		for(x=0; x<res; x++) {
+			k = y * (res + 1) + x;
+			aabox_init(box);
+			aabox_add_point(box, pos + k);
+			aabox_add_point(box, pos + k + 1);
+			aabox_add_point(box, pos + k + res + 1);
+			aabox_add_point(box, pos + k + res + 2);
+			box++;
+		}
+	}
+	for(k=sd->level-1; k>=0; k--) {
+		box = tess->bounds + box_base(k);
+		child = tess->bounds + box_base(k + 1);
+		r = 1 << k;
+		for(y=0; y<r; y++) {
+			for(x=0; x<r; x++) {
+				i = 2 * y * 2 * r + 2 * x;
+				*box = child[i];
+				aabox_add(box, child + i + 1);
+				aabox_add(box, child + i + 2 * r);
+				aabox_add(box, child + i + 2 * r + 1);
+				box++;
+			}
+		}
+	}
+	return tess;
+}
+
+/* returns the tessellation of the patch, tessellating it if necessary, or null
+ * on failure. It stays resident until the matching release_tess call.
+ */
+static const struct subdiv_tess *acquire_tess(const struct subdiv_mesh *sd,
+		struct subdiv_patch *p)
+{
+	int n;
+	struct subdiv_tess *tess;
+
+	n = __atomic_load_n(&p->users, __ATOMIC_ACQUIRE);
+	for(;;) {
+		if(n < 0) {
+			if(!(tess = tessellate(sd, p))) {
+				return 0;
+			}
+			if(insert_tess(p, tess) == -1) {
+				free(tess);
+				return 0;
+			}
+			break;
+		}
+		if(__atomic_compare_exchange_n(&p->users, &n, n + 1, 1, __ATOMIC_ACQUIRE,
+					__ATOMIC_ACQUIRE)) {
+			break;
+		}
+	}
+
+	if(!__atomic_load_n(&p->ref, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&p->ref, 1, __ATOMIC_RELAXED);
+	}
+	return p->tess;
+}
+
+static void release_tess(struct subdiv_patch *p)
+{
+	__atomic_sub_fetch(&p->users, 1, __ATOMIC_RELEASE);
+}
+
+/* makes the tessellation resident and acquires it, or frees it and acquires
+ * the one inserted by another thread in the meantime
+ */
+static int insert_tess(struct subdiv_patch *p, struct subdiv_tess *tess)
+{
+	void *tmp;
+
+	pthread_mutex_lock(&tess_lock);
+	if(__atomic_load_n(&p->users, __ATOMIC_RELAXED) >= 0) {
+		__atomic_add_fetch(&p->users, 1, __ATOMIC_ACQUIRE);
+		pthread_mutex_unlock(&tess_lock);
+		free(tess);
+		return 0;
+	}
+
+	evict_tess(tess->size);
+
+	if(num_resident >= max_resident) {
+		int newsz = max_resident ? max_resident * 2 : 256;
+		if(!(tmp = realloc(resident_patches, newsz * sizeof *resident_patches))) {
+			fprintf(stderr, "failed to allocate tessellation cache\n");
+			pthread_mutex_unlock(&tess_lock);
+			return -1;
+		}
+		resident_patches = tmp;
+		max_resident = newsz;
+	}
+	p->slot = num_resident;
+	resident_patches[num_resident++] = p;
+	resident += tess->size;
+
+	p->tess = tess;
+	__atomic_store_n(&p->ref, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->users, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&tess_lock);
+	return 0;
+}
+
+/* called with the lock held. Patches in use are skipped, and recently used
+ * ones get a second chance. A patch can only be evicted while nobody uses it,
+ * and the transition from 0 users to not resident happens atomically, so any
+ * ray trying to acquire it at the same time ends up tessellating it again. If
+ * everything is in use, the cache size is exceeded temporarily.
+ */
+static void evict_tess(long size)
+{
+	int zero, steps = 0;
+	struct subdiv_patch *p, *last;
+
+	while(num_resident > 0 && resident + size > cache_size && steps < 2 * num_resident) {
+		if(clock_hand >= num_resident) clock_hand = 0;
+		p = resident_patches[clock_hand];
+
+		if(__atomic_exchange_n(&p->ref, 0, __ATOMIC_RELAXED)) {
+			clock_hand++;
+			steps++;
+			continue;
+		}
+		zero = 0;
+		if(!__atomic_compare_exchange_n(&p->users, &zero, -1, 0, __ATOMIC_ACQUIRE,
+					__ATOMIC_RELAXED)) {
+			clock_hand++;
+			steps++;
+			continue;
+		}
+
+		last = resident_patches[--num_resident];
+		resident_patches[clock_hand] = last;
+		last->slot = clock_hand;
+
+		resident -= p->tess->size;
+		free(p->tess);
+		p->tess = 0;
+		steps = 0;
+	}
+}
+
+int find_subdiv_isect(const struct subdiv_mesh *sd, const cgm_ray *ray, float *t,
+		cgm_vec3 *normal, cgm_vec3 *tex, float *uvscale)
+{
+	int i, sp, stack[SUBDIV_MAX_DEPTH + 2];
+	float d0, d1;
+	cgm_vec3 inv_dir;
+	struct subdiv_hit sh;
+	const struct subdiv_node *node, *c;
+	struct subdiv_patch *p;
+	const struct subdiv_tess *tess;
+
+	if(!sd->num_nodes) {
+		return 0;
+	}
+	cgm_vcons(&inv_dir, 1.0f / ray->dir.x, 1.0f / ray->dir.y, 1.0f / ray->dir.z);
+
+	sh.t = FLT_MAX;
+	sh.patch = 0;
+
+	/* nearest child first, by the distance of its center along the ray */
+	stack[0] = 0;
+	sp = 1;
+	while(sp > 0) {
+		node = sd->nodes + stack[--sp];
+		if(!ray_aabox_enter(&node->bbox, &ray->origin, &inv_dir, sh.t)) {
+			continue;
+		}
+		if(node->child) {
+			c = sd->nodes + node->child;
+			d0 = (c[0].bbox.vmin.x + c[0].bbox.vmax.x) * ray->dir.x +
+				(c[0].bbox.vmin.y + c[0].bbox.vmax.y) * ray->dir.y +
+				(c[0].bbox.vmin.z + c[0].bbox.vmax.z) * ray->dir.z;
+			d1 = (c[1].bbox.vmin.x + c[1].bbox.vmax.x) * ray->dir.x +
+				(c[1].bbox.vmin.y + c[1].bbox.vmax.y) * ray->dir.y +
+				(c[1].bbox.vmin.z + c[1].bbox.vmax.z) * ray->dir.z;
+			stack[sp++] = d0 < d1 ? node->child + 1 : node->child;
+			stack[sp++] = d0 < d1 ? node->child : node->child + 1;
+			continue;
+		}
+
+		for(i=0; i<node->count; i++) {
+			p = sd->patches + node->first + i;
+			if(node->count > 1 && !ray_aabox_enter(&p->bbox, &ray->origin, &inv_dir, sh.t)) {
+				continue;
+			}
+			if(!(tess = acquire_tess(sd, p))) {
+				continue;
+			}
+			ray_tess(tess, p, ray, &inv_dir, &sh);
+			release_tess(p);
+		}
+	}
+
+	if(!sh.patch) {
+		return 0;
+	}
+	*t = sh.t;
+	*normal = sh.normal;
+	bilerp_tc(tex, sh.patch->tc, sh.u, sh.v);
+	*uvscale = sh.uvscale;
+	return 1;
+}
+
+/* square root of the ratio of the texture space and object space areas of a
+ * grid quad, used to scale ray footprints to texture space
+ */
+static float quad_uvscale(const struct subdiv_tess *tess, const struct subdiv_patch *p,
+		int k)
+{
+	float uvarea, area;
+	cgm_vec3 e0, e1, n;
+
+	e0 = p->tc[1];
+	cgm_vsub(&e0, p->tc);
+	e1 = p->tc[3];
+	cgm_vsub(&e1, p->tc);
+	if((uvarea = fabs(e0.x * e1.y - e0.y * e1.x)) <= 0.0f) {
+		return 0.0f;
+	}
+	uvarea /= tess->res * tess->res;
+
+	e0 = tess->pos[k + 1];
+	cgm_vsub(&e0, tess->pos + k);
+	e1 = tess->pos[k + tess->res + 1];
+	cgm_vsub(&e1, tess->pos + k);
+	cgm_vcross(&n, &e0, &e1);
+	if((area = cgm_vlength(&n)) <= 0.0f) {
+		return 0.0f;
+	}
+	return sqrt(uvarea / area);
+}
+
+/* fills in the patch parameters and normal of a hit on the triangle of grid
+ * vertices a, b and c, at barycentric coordinates bb and bc
+ */
+static void tess_hit(struct subdiv_hit *sh, const struct subdiv_tess *tess, int a, int b,
+		int c, float bb, float bc)
+{
+	int res = tess->res, row = res + 1;
+	cgm_vec3 n;
+
+	sh->u = ((a % row) * (1.0f - bb - bc) + (b % row) * bb + (c % row) * bc) / res;
+	sh->v = ((a / row) * (1.0f - bb - bc) + (b / row) * bb + (c / row) * bc) / res;
+
+	cgm_vcons(&n, 0, 0, 0);
+	vmadd(&n, tess->norm + a, 1.0f - bb - bc);
+	vmadd(&n, tess->norm + b, bb);
+	vmadd(&n, tess->norm + c, bc);
+	if(cgm_vlength_sq(&n) > 0.0f) {
+		cgm_vnormalize(&n);
+	}
+	sh->normal = n;
+}
+
+/* walks the quadtree of the tessellation, testing the two triangles of each
+ * quad it reaches
+ */
+static void ray_tess(const struct subdiv_tess *tess, const struct subdiv_patch *p,
+		const cgm_ray *ray, const cgm_vec3 *inv_dir, struct subdiv_hit *sh)
+{
+	int i, k, x, y, level, sp, row = tess->res + 1;
+	int stack[3 * SUBDIV_MAX_LEVEL + 1][3];
+	int quad[3];
+	float t;
+	cgm_vec3 v[3], bc;
+
+	stack[0][0] = stack[0][1] = stack[0][2] = 0;
+	sp = 1;
+	while(sp > 0) {
+		sp--;
+		level = stack[sp][0];
+		x = stack[sp][1];
+		y = stack[sp][2];
+		if(!ray_aabox_enter(tess->bounds + box_base(level) + (y << level) + x, &ray->origin,
+					inv_dir, sh->t)) {
+			continue;
+		}
+		if(level < tess->level) {
+			for(i=0; i<4; i++) {
+				stack[sp][0] = level + 1;
+				stack[sp][1] = 2 * x + (i & 1);
+				stack[sp][2] = 2 * y + (i >> 1);
+				sp++;
+			}
+			continue;
+		}
+
+		/* triangles 00 10 11 and 00 11 01, sharing corner 00 at k */
+		k = y * row + x;
+		quad[0] = k + 1;
+		quad[1] = k + row + 1;
+		quad[2] = k + row;
+		for(i=0; i<2; i++) {
+			v[0] = tess->pos[k];
+			v[1] = tess->pos[quad[i]];
+			v[2] = tess->pos[quad[i + 1]];
+			t = ray_triangle(ray, v, &bc);
+			if(t > 0.0f && t < sh->t) {
+				sh->t = t;
+				sh->patch = p;
+				sh->uvscale = quad_uvscale(tess, p, k);
+				tess_hit(sh, tess, k, quad[i], quad[i + 1], bc.y, bc.z);
+			}
+		}
+	}
+}
@@ -0,0 +1,101 @@
+#ifndef SUBDIV_H_
+#define SUBDIV_H_
+
+#include <cgmath/cgmath.h>
+#include "aabox.h"
+#include "texture.h"
+
+#define SUBDIV_MAX_LEVEL	6
+#define DEF_SUBDIV_LEVEL	4
+/* maximum number of patches in each leaf of the bounds hierarchy */
+#define SUBDIV_LEAF_PATCHES	2
+#define SUBDIV_MAX_DEPTH	48
+
+#define DEF_TESS_CACHE_MB	128
+
+/* a patch tessellated into a grid of res x res quads, of two triangles each.
+ * Vertices are stored row by row, with u varying fastest. The bounds form a
+ * quadtree over the quads, stored level by level from the whole grid down to
+ * single quads, each level row by row.
+ */
+struct subdiv_tess {
+	int res, level;
+	cgm_vec3 *pos, *norm;
+	struct aabox *bounds;
+	long size;		/* memory used, including this structure */
+};
+
+/* bicubic Bézier patch approximating the Catmull-Clark limit surface over one
+ * quad of the control mesh, tessellated when first hit by a ray
+ */
+struct subdiv_patch {
+	cgm_vec3 cp[16];	/* control points row by row, with u varying fastest */
+	cgm_vec3 tc[4];		/* texture coordinates at u, v = 00, 10, 11, 01 */
+	struct aabox bbox;	/* including the displacement */
+
+	/* neighbouring patches don't have the same normals along their common
+	 * edges, so the displacement follows directions both sides agree on: the
+	 * normals at the corners averaged over the patches around them, and along
+	 * the edges the average of the derivatives across them, for which each
+	 * edge keeps the second row of control points of the patch on the other
+	 * side. Corners and edges are in the same order as the corner texture
+	 * coordinates, and each edge row runs from its first corner to the next.
+	 */
+	cgm_vec3 cnorm[4];
+	cgm_vec3 nbr_row[4][4];
+
+	struct subdiv_tess *tess;	/* valid while resident */
+	int users;		/* number of rays using the tessellation, -1 while not resident */
+	int ref;		/* used since the clock hand last passed */
+	int slot;		/* index in the resident patch array */
+};
+
+/* nodes are stored in a flat array, with the root first, and the two children
+ * of each internal node in consecutive slots. Leaves reference a range of the
+ * patch array.
+ */
+struct subdiv_node {
+	struct aabox bbox;
+	int child;		/* index of the first child, 0 for leaves */
+	int first, count;
+};
+
+struct subdiv_mesh {
+	struct subdiv_patch *patches;	/* in leaf order */
+	int num_patches;
+	struct subdiv_node *nodes;
+	int num_nodes;
+	struct aabox bbox;
+
+	int level;		/* patches are tessellated into 2^level quads per side */
+	/* displacement along the normal by the red channel of the map, times
+	 * disp_scale. The map has no name if the surface isn't displaced.
+	 */
+	struct texture disp;
+	float disp_scale;
+};
+
+/* size of the tessellation cache shared by all subdivision surfaces */
+void set_tess_cache_size(int mbytes);
+int get_tess_cache_size(void);
+
+void init_subdiv(struct subdiv_mesh *sd);
+/* frees the patches and their tessellations, while nothing is rendering */
+void clear_subdiv(struct subdiv_mesh *sd);
+
+/* opens the displacement map. Call before load_subdiv. */
+int set_subdiv_disp(struct subdiv_mesh *sd, const char *fname, float scale);
+
+/* loads the control mesh from the vertices, texture coordinates and polygons
+ * of an OBJ file, and builds the patches and their hierarchy. Meshes with
+ * faces other than quads are subdivided once first.
+ */
+int load_subdiv(struct subdiv_mesh *sd, const char *fname);
+
+/* returns the distance along the ray to the nearest hit, the shading normal,
+ * the texture coordinates, and the texture space per object space length
+ */
+int find_subdiv_isect(const struct subdiv_mesh *sd, const cgm_ray *ray, float *t,
+		cgm_vec3 *normal, cgm_vec3 *tex, float *uvscale);
+
+#endif	/* SUBDIV_H_ */
@@ -1,9 +1,32 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <float.h>
 #include <assert.h>
 #include "surf.h"
 
-int ray_surface(const union surface *surf, const cgm_ray *ray, struct surf_hit *hit)
+static int ray_surface_type(const union surface *surf, const cgm_ray *ray, float time,
+		struct surf_hit *hit);
+static int ray_moving_surface(const union surface *surf, const cgm_ray *ray, float time,
+		struct surf_hit *hit);
+static void mesh_hit(struct surf_hit *hit, const union surface *surf, const int *mtlmap);
+static float xform_scale(const float *m);
+static void xform_normal(cgm_vec3 *n, const float *inv_xform);
+static enum xform_type classify_xform(const float *m);
+static void xform_bounds(struct aabox *res, const struct aabox *box, enum xform_type type,
+		const float *xform);
+static void calc_motion_bounds(union surface *surf);
+
+int ray_surface(const union surface *surf, const cgm_ray *ray, float time,
+		struct surf_hit *hit)
+{
+	if(surf->any.motion) {
+		return ray_moving_surface(surf, ray, time, hit);
+	}
+	return ray_surface_type(surf, ray, time, hit);
+}
+
+static int ray_surface_type(const union surface *surf, const cgm_ray *ray, float time,
+		struct surf_hit *hit)
 {
 	switch(surf->any.type) {
 	case SURF_SPHERE:
@@ -13,7 +36,22 @@ int ray_surface(const union surface *surf, const cgm_ray *ray, struct surf_hit *
 		return ray_surf_aabox(&surf->box, ray, hit);
 
 	case SURF_MESH:
-		return ray_surf_mesh(&surf->mesh, ray, hit);
+		return ray_surf_mesh(&surf->mesh, ray, time, hit);
+
+	case SURF_INSTANCE:
+		return ray_surf_instance(&surf->inst, ray, time, hit);
+
+	case SURF_PRIMS:
+		return ray_surf_prims(&surf->prims, ray, hit);
+
+	case SURF_VOXELS:
+		return ray_surf_voxels(&surf->vox, ray, hit);
+
+	case SURF_CURVES:
+		return ray_surf_curves(&surf->curves, ray, hit);
+
+	case SURF_SUBDIV:
+		return ray_surf_subdiv(&surf->subdiv, ray, hit);
 
 	default:
 		assert(!"unknown surface type passed to ray_surface");
@@ -22,12 +60,40 @@ int ray_surface(const union surface *surf, const cgm_ray *ray, struct surf_hit *
 	return 0;
 }
 
+/* the surface functions only know the transformation at shutter open, so the
+ * ray is moved from world space at its time to world space at shutter open.
+ * The mapping is affine, so hit distances are the same in both.
+ */
+static int ray_moving_surface(const union surface *surf, const cgm_ray *ray, float time,
+		struct surf_hit *hit)
+{
+	float xform[16], m[16];
+	cgm_ray sray;
+
+	motion_xform(surf->any.motion, time, xform, m);
+	cgm_mmul(m, surf->any.xform);
+
+	sray = *ray;
+	cgm_rmul_mr(&sray, m);
+	if(!ray_surface_type(surf, &sray, time, hit)) {
+		return 0;
+	}
+
+	if(hit) {
+		cgm_raypos(&hit->pos, ray, hit->t);
+		/* m is the inverse of the way back */
+		xform_normal(&hit->normal, m);
+		hit->uvscale *= xform_scale(m);
+	}
+	return 1;
+}
+
 int ray_surf_sphere(const struct surf_sphere *sph, const cgm_ray *ray, struct surf_hit *hit)
 {
 	float a, b, c, d, sqrt_d, t0, t1, t;
-	cgm_ray lray = *ray;
+	cgm_ray lray;
 
-	cgm_rmul_mr(&lray, sph->inv_xform);
+	local_ray(&lray, ray, sph->xform_type, sph->inv_xform);
 
 	a = cgm_vdot(&lray.dir, &lray.dir);
 	b = 2.0f * cgm_vdot(&lray.dir, &lray.origin);
@@ -47,11 +113,13 @@ int ray_surf_sphere(const struct surf_sphere *sph, const cgm_ray *ray, struct su
 
 	if(hit) {
 		hit->t = t;
+		hit->mtl = sph->mtl;
+		hit->uvscale = 0.0f;
 		hit->surf = (void*)sph;
-		hit->pos.x = hit->normal.x = ray->origin.x + ray->dir.x * t;
-		hit->pos.y = hit->normal.y = ray->origin.y + ray->dir.y * t;
-		hit->pos.z = hit->normal.z = ray->origin.z + ray->dir.z * t;
-		cgm_vnormalize(&hit->normal);
+		cgm_raypos(&hit->pos, ray, t);
+		/* on the unit sphere the local position is the local normal */
+		cgm_raypos(&hit->normal, &lray, t);
+		xform_normal(&hit->normal, sph->inv_xform);
 	}
 	return 1;
 }
@@ -61,9 +129,9 @@ int ray_surf_aabox(const struct surf_aabox *box, const cgm_ray *ray, struct surf
 	int sign[3];
 	float t, tmin, tmax, tymin, tymax, tzmin, tzmax, x, y, z;
 	cgm_vec3 inv_dir, param[] = {{-0.5f, -0.5f, -0.5f}, {0.5f, 0.5f, 0.5f}};
-	cgm_ray lray = *ray;
+	cgm_ray lray;
 
-	cgm_rmul_mr(&lray, box->inv_xform);
+	local_ray(&lray, ray, box->xform_type, box->inv_xform);
 
 	cgm_vcons(&inv_dir, 1.0f / lray.dir.x, 1.0f / lray.dir.y, 1.0f / lray.dir.z);
 	sign[0] = inv_dir.x < 0.0f ? 1 : 0;
@@ -95,6 +163,8 @@ int ray_surf_aabox(const struct surf_aabox *box, const cgm_ray *ray, struct surf
 
 	if(hit) {
 		hit->t = t;
+		hit->mtl = box->mtl;
+		hit->uvscale = 0.0f;
 		hit->surf = (void*)box;
 		hit->pos.x = ray->origin.x + ray->dir.x * t;
 		hit->pos.y = ray->origin.y + ray->dir.y * t;
@@ -110,21 +180,181 @@ int ray_surf_aabox(const struct surf_aabox *box, const cgm_ray *ray, struct surf
 		} else {
 			cgm_vcons(&hit->normal, 0, 0, z > 0.0f ? 1.0f : -1.0f);
 		}
+		if(box->xform_type != XFORM_IDENTITY) {
+			xform_normal(&hit->normal, box->inv_xform);
+		}
+	}
+	return 1;
+}
+
+int ray_surf_mesh(const struct surf_mesh *mesh, const cgm_ray *ray, float time,
+		struct surf_hit *hit)
+{
+	cgm_ray lray;
+
+	local_ray(&lray, ray, mesh->xform_type, mesh->inv_xform);
+	if(!find_mesh_isect(&mesh->m, &lray, ray, time, hit)) {
+		return 0;
+	}
+	if(hit) {
+		mesh_hit(hit, (const union surface*)mesh, mesh->mtlmap);
 	}
 	return 1;
 }
 
-int ray_surf_mesh(const struct surf_mesh *mesh, const cgm_ray *ray, struct surf_hit *hit)
+int ray_surf_instance(const struct surf_instance *inst, const cgm_ray *ray, float time,
+		struct surf_hit *hit)
 {
-	int res = find_mesh_isect(&mesh->m, mesh->inv_xform, ray, hit);
+	int res;
+	cgm_ray lray;
+	const struct mesh_geom *geom = inst->geom;
+	const struct mesh *m = &geom->m;
+
+	local_ray(&lray, ray, inst->xform_type, inst->inv_xform);
+
+	if(geom->lazy) {
+		/* don't bring the geometry in, unless the ray enters its bounds */
+		if(!ray_aabox(&geom->aabb, &lray, 0) || !(m = acquire_lazy_mesh(geom->lazy))) {
+			return 0;
+		}
+		res = find_mesh_isect(m, &lray, ray, time, hit);
+		release_lazy_mesh(geom->lazy);
+	} else {
+		res = find_mesh_isect(m, &lray, ray, time, hit);
+	}
+
 	if(res && hit) {
-		hit->surf = (void*)mesh;
+		mesh_hit(hit, (const union surface*)inst, inst->mtlmap);
 	}
 	return res;
 }
 
+int ray_surf_prims(const struct surf_prims *prims, const cgm_ray *ray, struct surf_hit *hit)
+{
+	if(!find_prims_isect(&prims->ps, ray, hit)) {
+		return 0;
+	}
+	if(hit) {
+		hit->surf = (void*)prims;
+	}
+	return 1;
+}
+
+int ray_surf_voxels(const struct surf_voxels *vox, const cgm_ray *ray, struct surf_hit *hit)
+{
+	int mtl;
+	float t;
+	cgm_vec3 n;
+	cgm_ray lray;
+	const float *inv = vox->inv_xform;
+
+	local_ray(&lray, ray, vox->xform_type, inv);
+	if(!find_voxel_isect(vox->vg, &lray, &t, &n, &mtl)) {
+		return 0;
+	}
+
+	if(hit) {
+		hit->t = t;
+		cgm_raypos(&hit->pos, ray, t);
+		hit->normal = n;
+		xform_normal(&hit->normal, inv);
+		cgm_vcons(&hit->tex, 0, 0, 0);
+		hit->uvscale = 0.0f;
+		hit->mtl = mtl >= 0 ? mtl : vox->mtl;
+		hit->surf = (void*)vox;
+	}
+	return 1;
+}
+
+int ray_surf_curves(const struct surf_curves *curves, const cgm_ray *ray,
+		struct surf_hit *hit)
+{
+	float t;
+	cgm_vec3 n, tex;
+	cgm_ray lray;
+	const float *inv = curves->inv_xform;
+
+	local_ray(&lray, ray, curves->xform_type, inv);
+	if(!find_curve_isect(curves->cs, &lray, &t, &n, &tex)) {
+		return 0;
+	}
+
+	if(hit) {
+		hit->t = t;
+		cgm_raypos(&hit->pos, ray, t);
+		hit->normal = n;
+		xform_normal(&hit->normal, inv);
+		hit->tex = tex;
+		hit->uvscale = 0.0f;
+		hit->mtl = curves->mtl;
+		hit->surf = (void*)curves;
+	}
+	return 1;
+}
+
+int ray_surf_subdiv(const struct surf_subdiv *subdiv, const cgm_ray *ray,
+		struct surf_hit *hit)
+{
+	float t, uvscale;
+	cgm_vec3 n, tex;
+	cgm_ray lray;
+	const float *inv = subdiv->inv_xform;
+
+	local_ray(&lray, ray, subdiv->xform_type, inv);
+	if(!find_subdiv_isect(subdiv->sd, &lray, &t, &n, &tex, &uvscale)) {
+		return 0;
+	}
+
+	if(hit) {
+		hit->t = t;
+		cgm_raypos(&hit->pos, ray, t);
+		hit->normal = n;
+		xform_normal(&hit->normal, inv);
+		hit->tex = tex;
+		hit->uvscale = uvscale / xform_scale(subdiv->xform);
+		hit->mtl = subdiv->mtl;
+		hit->surf = (void*)subdiv;
+	}
+	return 1;
+}
+
+/* fills in the surface specific parts of a mesh hit */
+static void mesh_hit(struct surf_hit *hit, const union surface *surf, const int *mtlmap)
+{
+	hit->mtl = hit->mtl >= 0 && mtlmap ? mtlmap[hit->mtl] : surf->any.mtl;
+	hit->surf = (void*)surf;
+	if(surf->any.xform_type != XFORM_IDENTITY) {
+		xform_normal(&hit->normal, surf->any.inv_xform);
+	}
+	if(hit->uvscale > 0.0f) {
+		hit->uvscale /= xform_scale(surf->any.xform);
+	}
+}
+
+/* normals transform with the transpose of the inverse */
+static void xform_normal(cgm_vec3 *n, const float *inv_xform)
+{
+	int i;
+	cgm_vec3 v = *n;
+
+	for(i=0; i<3; i++) {
+		(&n->x)[i] = inv_xform[i * 4] * v.x + inv_xform[i * 4 + 1] * v.y +
+			inv_xform[i * 4 + 2] * v.z;
+	}
+	cgm_vnormalize(n);
+}
+
+/* average scale factor of a transformation, for converting lengths */
+static float xform_scale(const float *m)
+{
+	float det = m[0] * (m[5] * m[10] - m[6] * m[9]) - m[1] * (m[4] * m[10] - m[6] * m[8]) +
+		m[2] * (m[4] * m[9] - m[5] * m[8]);
+	return cbrt(fabs(det));
+}
+
 union surface *create_sphere(float x, float y, float z, float rad)
 {
+	float xform[16];
 	union surface *surf;
 
 	if(rad == 0.0f) return 0;
@@ -133,28 +363,29 @@ union surface *create_sphere(float x, float y, float z, float rad)
 		return 0;
 	}
 	surf->sph.type = SURF_SPHERE;
-	cgm_mscaling(surf->sph.xform, rad, rad, rad);
-	cgm_mtranslate(surf->sph.xform, x, y, z);
-
-	cgm_mcopy(surf->sph.inv_xform, surf->sph.xform);
-	cgm_minverse(surf->sph.inv_xform);
+	surf->sph.mtl = -1;
+	cgm_mscaling(xform, rad, rad, rad);
+	cgm_mtranslate(xform, x, y, z);
+	set_surface_xform(surf, xform, 0);
+	calc_bounds(surf);
 
 	return surf;
 }
 
 union surface *create_aabox(float x, float y, float z, float xsz, float ysz, float zsz)
 {
+	float xform[16];
 	union surface *surf;
 
 	if(!(surf = calloc(1, sizeof *surf))) {
 		return 0;
 	}
 	surf->box.type = SURF_AABOX;
-	cgm_mscaling(surf->box.xform, xsz, ysz, zsz);
-	cgm_mtranslate(surf->box.xform, x, y, z);
-
-	cgm_mcopy(surf->box.inv_xform, surf->box.xform);
-	cgm_minverse(surf->box.inv_xform);
+	surf->box.mtl = -1;
+	cgm_mscaling(xform, xsz, ysz, zsz);
+	cgm_mtranslate(xform, x, y, z);
+	set_surface_xform(surf, xform, 0);
+	calc_bounds(surf);
 
 	return surf;
 }
@@ -167,24 +398,177 @@ union surface *create_mesh(void)
 		return 0;
 	}
 	surf->mesh.type = SURF_MESH;
+	surf->mesh.mtl = -1;
 	cgm_midentity(surf->mesh.xform);
 	cgm_midentity(surf->mesh.inv_xform);
+	surf->mesh.xform_type = XFORM_IDENTITY;
 	init_mesh(&surf->mesh.m);
 
 	return surf;
 }
 
+union surface *create_instance(struct mesh_geom *geom)
+{
+	union surface *surf;
+
+	if(!(surf = calloc(1, sizeof *surf))) {
+		return 0;
+	}
+	surf->inst.type = SURF_INSTANCE;
+	surf->inst.mtl = -1;
+	cgm_midentity(surf->inst.xform);
+	cgm_midentity(surf->inst.inv_xform);
+	surf->inst.xform_type = XFORM_IDENTITY;
+	surf->inst.geom = geom;
+	ref_mesh_geom(geom);
+
+	return surf;
+}
+
+union surface *create_prims(void)
+{
+	union surface *surf;
+
+	if(!(surf = calloc(1, sizeof *surf))) {
+		return 0;
+	}
+	surf->prims.type = SURF_PRIMS;
+	surf->prims.mtl = -1;
+	cgm_midentity(surf->prims.xform);
+	cgm_midentity(surf->prims.inv_xform);
+	surf->prims.xform_type = XFORM_IDENTITY;
+	if(init_prims(&surf->prims.ps) == -1) {
+		free(surf);
+		return 0;
+	}
+	return surf;
+}
+
+union surface *create_voxels(struct voxel_grid *vg)
+{
+	union surface *surf;
+
+	if(!(surf = calloc(1, sizeof *surf))) {
+		return 0;
+	}
+	surf->vox.type = SURF_VOXELS;
+	surf->vox.mtl = -1;
+	cgm_midentity(surf->vox.xform);
+	cgm_midentity(surf->vox.inv_xform);
+	surf->vox.xform_type = XFORM_IDENTITY;
+	surf->vox.vg = vg;
+	return surf;
+}
+
+union surface *create_curves(struct curve_set *cs)
+{
+	union surface *surf;
+
+	if(!(surf = calloc(1, sizeof *surf))) {
+		return 0;
+	}
+	surf->curves.type = SURF_CURVES;
+	surf->curves.mtl = -1;
+	cgm_midentity(surf->curves.xform);
+	cgm_midentity(surf->curves.inv_xform);
+	surf->curves.xform_type = XFORM_IDENTITY;
+	surf->curves.cs = cs;
+	return surf;
+}
+
+union surface *create_subdiv(struct subdiv_mesh *sd)
+{
+	union surface *surf;
+
+	if(!(surf = calloc(1, sizeof *surf))) {
+		return 0;
+	}
+	surf->subdiv.type = SURF_SUBDIV;
+	surf->subdiv.mtl = -1;
+	cgm_midentity(surf->subdiv.xform);
+	cgm_midentity(surf->subdiv.inv_xform);
+	surf->subdiv.xform_type = XFORM_IDENTITY;
+	surf->subdiv.sd = sd;
+	return surf;
+}
+
+struct mesh_geom *create_mesh_geom(void)
+{
+	struct mesh_geom *geom;
+
+	if(!(geom = calloc(1, sizeof *geom))) {
+		return 0;
+	}
+	init_mesh(&geom->m);
+	geom->nref = 1;
+	return geom;
+}
+
+void ref_mesh_geom(struct mesh_geom *geom)
+{
+	__atomic_add_fetch(&geom->nref, 1, __ATOMIC_RELAXED);
+}
+
+void release_mesh_geom(struct mesh_geom *geom)
+{
+	if(!geom || __atomic_sub_fetch(&geom->nref, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+	clear_mesh(&geom->m);
+	free_lazy_mesh(geom->lazy);
+	free(geom);
+}
+
+void calc_geom_bounds(struct mesh_geom *geom)
+{
+	if(geom->lazy) {
+		geom->aabb = geom->lazy->bbox;
+	} else if(geom->m.quant) {
+		geom->aabb = geom->m.quant->bbox;
+	} else if(geom->m.octree) {
+		geom->aabb = geom->m.octree->bbox;
+	} else {
+		calc_mesh_bounds(&geom->m, &geom->aabb);
+	}
+}
+
 void free_surface(union surface *surf)
 {
 	switch(surf->any.type) {
 	case SURF_MESH:
 		clear_mesh(&surf->mesh.m);
+		free(surf->mesh.mtlmap);
+		break;
+
+	case SURF_INSTANCE:
+		release_mesh_geom(surf->inst.geom);
+		free(surf->inst.mtlmap);
+		break;
+
+	case SURF_PRIMS:
+		clear_prims(&surf->prims.ps);
+		break;
+
+	case SURF_VOXELS:
+		clear_voxels(surf->vox.vg);
+		free(surf->vox.vg);
+		break;
+
+	case SURF_CURVES:
+		clear_curves(surf->curves.cs);
+		free(surf->curves.cs);
+		break;
+
+	case SURF_SUBDIV:
+		clear_subdiv(surf->subdiv.sd);
+		free(surf->subdiv.sd);
 		break;
 
 	default:
 		break;
 	}
 
+	free(surf->any.motion);
 	free(surf);
 }
 
@@ -202,10 +586,278 @@ void calc_bounds(union surface *surf)
 		break;
 
 	case SURF_MESH:
-		calc_mesh_bounds(&surf->mesh.m, &surf->mesh.aabb);
+		/* the root of the octree has the bounds of the faces, or of the part
+		 * of the deformation it was refitted to
+		 */
+		if(surf->mesh.m.quant) {
+			surf->mesh.aabb = surf->mesh.m.quant->bbox;
+		} else if(surf->mesh.m.octree) {
+			surf->mesh.aabb = surf->mesh.m.octree->bbox;
+		} else {
+			calc_mesh_bounds(&surf->mesh.m, &surf->mesh.aabb);
+		}
+		break;
+
+	case SURF_INSTANCE:
+		surf->inst.aabb = surf->inst.geom->aabb;
+		break;
+
+	case SURF_PRIMS:
+		surf->prims.aabb = surf->prims.ps.bbox;
+		break;
+
+	case SURF_VOXELS:
+		surf->vox.aabb = surf->vox.vg->bbox;
+		break;
+
+	case SURF_CURVES:
+		surf->curves.aabb = surf->curves.cs->bbox;
+		break;
+
+	case SURF_SUBDIV:
+		surf->subdiv.aabb = surf->subdiv.sd->bbox;
 		break;
 
 	default:
 		break;
 	}
+
+	if(surf->any.motion) {
+		calc_motion_bounds(surf);
+	} else {
+		xform_bounds(&surf->any.world_aabb, &surf->any.aabb, surf->any.xform_type,
+				surf->any.xform);
+	}
+}
+
+void set_surface_xform(union surface *surf, const float *xform, const float *inv_xform)
+{
+	cgm_mcopy(surf->any.xform, xform);
+	cgm_mcopy(surf->any.inv_xform, inv_xform ? inv_xform : xform);
+	if(!inv_xform) {
+		cgm_minverse(surf->any.inv_xform);
+	}
+	surf->any.xform_type = classify_xform(xform);
+}
+
+int set_surface_motion(union surface *surf, const struct xform_key *start,
+		const struct xform_key *end)
+{
+	float xform[16], inv_xform[16];
+	struct surf_motion *mot;
+	cgm_quat *q;
+
+	if(!(mot = surf->any.motion)) {
+		if(!(mot = malloc(sizeof *mot))) {
+			return -1;
+		}
+		surf->any.motion = mot;
+	}
+	mot->key[0] = *start;
+	mot->key[1] = *end;
+	mot->t0 = 0.0f;
+	mot->t1 = 1.0f;
+	mot->num_seg = 1;
+
+	/* q and -q are the same rotation, pick the one closest to the start */
+	q = &mot->key[1].rot;
+	if(q->x * start->rot.x + q->y * start->rot.y + q->z * start->rot.z +
+			q->w * start->rot.w < 0.0f) {
+		cgm_qcons(q, -q->x, -q->y, -q->z, -q->w);
+	}
+
+	motion_xform(mot, 0.0f, xform, inv_xform);
+	set_surface_xform(surf, xform, inv_xform);
+	return 0;
+}
+
+void motion_xform(const struct surf_motion *mot, float time, float *xform, float *inv_xform)
+{
+	int i, j;
+	float rmat[16];
+	cgm_vec3 pos, scale;
+	cgm_quat rot;
+	const struct xform_key *k = mot->key;
+
+	cgm_vlerp(&pos, &k[0].pos, &k[1].pos, time);
+	cgm_vlerp(&scale, &k[0].scale, &k[1].scale, time);
+	cgm_qslerp(&rot, &k[0].rot, &k[1].rot, time);
+	cgm_mrotation_quat(rmat, &rot);
+
+	/* scaled rows of the rotation, followed by the translation */
+	cgm_midentity(xform);
+	for(i=0; i<3; i++) {
+		for(j=0; j<3; j++) {
+			xform[i * 4 + j] = rmat[i * 4 + j] * (&scale.x)[i];
+		}
+	}
+	xform[12] = pos.x;
+	xform[13] = pos.y;
+	xform[14] = pos.z;
+
+	if(inv_xform) {
+		/* transposed rotation, with the columns divided by the scale */
+		cgm_midentity(inv_xform);
+		for(i=0; i<3; i++) {
+			for(j=0; j<3; j++) {
+				inv_xform[i * 4 + j] = rmat[j * 4 + i] / (&scale.x)[j];
+			}
+		}
+		for(j=0; j<3; j++) {
+			inv_xform[12 + j] = -(pos.x * inv_xform[j] + pos.y * inv_xform[4 + j] +
+					pos.z * inv_xform[8 + j]);
+		}
+	}
+}
+
+int set_surface_shutter(union surface *surf, float open, float close)
+{
+	struct mesh *m = 0;
+
+	if(surf->any.type == SURF_MESH) {
+		m = &surf->mesh.m;
+	} else if(surf->any.type == SURF_INSTANCE && !surf->inst.geom->lazy) {
+		m = &surf->inst.geom->m;
+	}
+	if(m && !m->end_faces) {
+		m = 0;
+	}
+
+	if(m && (m->span[0] != open || m->span[1] != close) &&
+			refit_mesh_octree(m, open, close) != -1 && surf->any.type == SURF_INSTANCE) {
+		calc_geom_bounds(surf->inst.geom);
+	}
+	if(surf->any.motion) {
+		surf->any.motion->t0 = open;
+		surf->any.motion->t1 = close;
+	}
+	return surf->any.motion || m ? 1 : 0;
+}
+
+void motion_bounds(struct aabox *res, const struct surf_motion *mot, float time)
+{
+	int seg;
+	float t, span = mot->t1 - mot->t0;
+	const struct aabox *b0, *b1;
+
+	t = span > 0.0f ? (time - mot->t0) / span * mot->num_seg : 0.0f;
+	seg = (int)t;
+	if(seg < 0) seg = 0;
+	if(seg >= mot->num_seg) seg = mot->num_seg - 1;
+	t -= seg;
+
+	b0 = mot->bounds + seg;
+	b1 = b0 + 1;
+	cgm_vlerp(&res->vmin, &b0->vmin, &b1->vmin, t);
+	cgm_vlerp(&res->vmax, &b0->vmax, &b1->vmax, t);
+}
+
+/* points on a moving surface follow straight lines between two times, unless
+ * the surface is rotating, in which case they stray from the line by at most
+ * half the length of their path in between. The translation moves them all
+ * along straight lines, so the path length only depends on the rotation and
+ * scaling around the local origin.
+ */
+static void calc_motion_bounds(union surface *surf)
+{
+	int i, j;
+	float dot, angle, c, s, ds, rmax, dsmax, pad, span, xform[16];
+	struct surf_motion *mot = surf->any.motion;
+	const struct xform_key *k = mot->key;
+	const struct aabox *box = &surf->any.aabb;
+	struct aabox *b, *wbox = &surf->any.world_aabb;
+
+	if(box->vmin.x > box->vmax.x) {
+		mot->num_seg = 1;
+		mot->bounds[0] = mot->bounds[1] = *wbox = *box;	/* empty */
+		return;
+	}
+
+	/* slerp rotates at a constant rate, so the part of the shutter interval
+	 * covered by the bounds rotates by the same part of the whole angle
+	 */
+	span = mot->t1 - mot->t0;
+	dot = fabs(k[0].rot.x * k[1].rot.x + k[0].rot.y * k[1].rot.y + k[0].rot.z * k[1].rot.z +
+			k[0].rot.w * k[1].rot.w);
+	angle = dot < 1.0f ? 2.0f * acos(dot) * span : 0.0f;
+	mot->num_seg = (int)ceil(angle / MOTION_SEG_ANGLE);
+	if(mot->num_seg < 1) mot->num_seg = 1;
+	if(mot->num_seg > MOTION_MAX_SEGS) mot->num_seg = MOTION_MAX_SEGS;
+
+	pad = 0.0f;
+	if(angle > 0.0f) {
+		rmax = dsmax = 0.0f;
+		for(i=0; i<3; i++) {
+			c = fabs((&box->vmin.x)[i]);
+			if(fabs((&box->vmax.x)[i]) > c) c = fabs((&box->vmax.x)[i]);
+			s = fabs((&k[0].scale.x)[i]);
+			if(fabs((&k[1].scale.x)[i]) > s) s = fabs((&k[1].scale.x)[i]);
+			ds = fabs((&k[1].scale.x)[i] - (&k[0].scale.x)[i]) * c * span;
+			rmax += c * c * s * s;
+			dsmax += ds * ds;
+		}
+		pad = 0.5f * (sqrt(rmax) * angle + sqrt(dsmax)) / mot->num_seg;
+	}
+
+	for(i=0; i<=mot->num_seg; i++) {
+		b = mot->bounds + i;
+		motion_xform(mot, mot->t0 + span * i / mot->num_seg, xform, 0);
+		xform_bounds(b, box, XFORM_AFFINE, xform);
+		for(j=0; j<3; j++) {
+			(&b->vmin.x)[j] -= pad;
+			(&b->vmax.x)[j] += pad;
+		}
+
+		if(i == 0) {
+			*wbox = *b;
+			continue;
+		}
+		if(b->vmin.x < wbox->vmin.x) wbox->vmin.x = b->vmin.x;
+		if(b->vmax.x > wbox->vmax.x) wbox->vmax.x = b->vmax.x;
+		if(b->vmin.y < wbox->vmin.y) wbox->vmin.y = b->vmin.y;
+		if(b->vmax.y > wbox->vmax.y) wbox->vmax.y = b->vmax.y;
+		if(b->vmin.z < wbox->vmin.z) wbox->vmin.z = b->vmin.z;
+		if(b->vmax.z > wbox->vmax.z) wbox->vmax.z = b->vmax.z;
+	}
+}
+
+static enum xform_type classify_xform(const float *m)
+{
+	if(m[1] != 0.0f || m[2] != 0.0f || m[3] != 0.0f || m[4] != 0.0f || m[6] != 0.0f ||
+			m[7] != 0.0f || m[8] != 0.0f || m[9] != 0.0f || m[11] != 0.0f || m[15] != 1.0f) {
+		return XFORM_AFFINE;
+	}
+	if(m[0] == 1.0f && m[5] == 1.0f && m[10] == 1.0f && m[12] == 0.0f && m[13] == 0.0f &&
+			m[14] == 0.0f) {
+		return XFORM_IDENTITY;
+	}
+	return XFORM_SCALE_TRANS;
+}
+
+/* bounds of the transformed corners of a box */
+static void xform_bounds(struct aabox *res, const struct aabox *box, enum xform_type type,
+		const float *xform)
+{
+	int i;
+	cgm_vec3 v;
+
+	if(type == XFORM_IDENTITY || box->vmin.x > box->vmax.x) {
+		*res = *box;	/* nothing to do, or empty */
+		return;
+	}
+
+	cgm_vcons(&res->vmin, FLT_MAX, FLT_MAX, FLT_MAX);
+	cgm_vcons(&res->vmax, -FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for(i=0; i<8; i++) {
+		v.x = i & 1 ? box->vmax.x : box->vmin.x;
+		v.y = i & 2 ? box->vmax.y : box->vmin.y;
+		v.z = i & 4 ? box->vmax.z : box->vmin.z;
+		cgm_vmul_m4v3(&v, xform);
+		if(v.x < res->vmin.x) res->vmin.x = v.x;
+		if(v.x > res->vmax.x) res->vmax.x = v.x;
+		if(v.y < res->vmin.y) res->vmin.y = v.y;
+		if(v.y > res->vmax.y) res->vmax.y = v.y;
+		if(v.z < res->vmin.z) res->vmin.z = v.z;
+		if(v.z > res->vmax.z) res->vmax.z = v.z;
+	}
 }
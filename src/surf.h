@@ -4,6 +4,10 @@
 #include <cgmath/cgmath.h>
 #include "aabox.h"
 #include "mesh.h"
+#include "prims.h"
+#include "voxel.h"
+#include "curve.h"
+#include "subdiv.h"
 #include "material.h"
 
 union surface;
@@ -13,6 +17,8 @@ struct surf_hit {
 	cgm_vec3 pos;
 	cgm_vec3 normal;
 	cgm_vec3 tex;
+	float uvscale;	/* texture space per world space length, 0 without texcoords */
+	int mtl;		/* scene material index, -1 for the default material */
 	void *surf;
 };
 
@@ -20,16 +26,61 @@ enum surf_type {
 	SURF_UNKNOWN,
 	SURF_SPHERE,
 	SURF_AABOX,
-	SURF_MESH
+	SURF_MESH,
+	SURF_INSTANCE,
+	SURF_PRIMS,
+	SURF_VOXELS,
+	SURF_CURVES,
+	SURF_SUBDIV
+};
+
+/* transformations are classified when set, so that rays can be brought to
+ * local space without a full matrix multiplication in the common cases
+ */
+enum xform_type {
+	XFORM_IDENTITY,
+	XFORM_SCALE_TRANS,	/* axis aligned scaling followed by a translation */
+	XFORM_AFFINE
+};
+
+/* transformation of a moving surface at one end of the shutter interval, kept
+ * as separate scale, rotation and translation, which are interpolated
+ * independently: scale, then rotate, then translate
+ */
+struct xform_key {
+	cgm_vec3 pos, scale;
+	cgm_quat rot;
+};
+
+/* surfaces rotating by more than this many radians over the shutter interval
+ * get more than one bounds segment
+ */
+#define MOTION_SEG_ANGLE	0.1f
+#define MOTION_MAX_SEGS		32
+
+/* motion of a surface over the shutter interval. Ray times go from 0 at shutter
+ * open to 1 at shutter close. The world bounds are kept at num_seg + 1 evenly
+ * spaced times between t0 and t1, padded so that interpolating linearly between
+ * consecutive ones contains the surface at any time in between. They cover the
+ * whole interval, unless restricted by set_surface_shutter.
+ */
+struct surf_motion {
+	struct xform_key key[2];
+	float t0, t1;
+	int num_seg;
+	struct aabox bounds[MOTION_MAX_SEGS + 1];
 };
 
 union surface;
 
 #define COMMON_SURFACE_VARS \
 	enum surf_type type; \
-	float xform[16], inv_xform[16]; \
-	struct material *mtl; \
-	struct aabox aabb; \
+	float xform[16], inv_xform[16];	/* at shutter open, for moving surfaces */ \
+	enum xform_type xform_type; \
+	struct surf_motion *motion;	/* null for static surfaces */ \
+	int mtl;	/* scene material index, -1 for the default material */ \
+	struct aabox aabb;	/* local space bounds */ \
+	struct aabox world_aabb;	/* over the whole shutter interval */ \
 	union surface *next, *emnext
 
 struct surf_any {
@@ -47,6 +98,52 @@ struct surf_aabox {
 struct surf_mesh {
 	COMMON_SURFACE_VARS;
 	struct mesh m;
+	/* maps mesh material indices to scene materials. Faces without a
+	 * material, or with one not found in the scene, use the surface mtl.
+	 */
+	int *mtlmap;
+};
+
+/* mesh geometry shared by any number of instance surfaces, and freed with the
+ * last reference to it
+ */
+struct mesh_geom {
+	struct mesh m;
+	/* geometry loaded on demand, in which case m only holds the material names */
+	struct lazy_mesh *lazy;
+	struct aabox aabb;	/* mesh space bounds, see calc_geom_bounds */
+	int nref;
+};
+
+/* a mesh placed with its own transformation and materials */
+struct surf_instance {
+	COMMON_SURFACE_VARS;
+	struct mesh_geom *geom;
+	int *mtlmap;	/* same as in surf_mesh */
+};
+
+/* many spheres and boxes in world space, without a transformation */
+struct surf_prims {
+	COMMON_SURFACE_VARS;
+	struct prim_set ps;
+};
+
+/* sparse voxel grid, placed with the surface transformation */
+struct surf_voxels {
+	COMMON_SURFACE_VARS;
+	struct voxel_grid *vg;
+};
+
+/* hair or grass strands, placed with the surface transformation */
+struct surf_curves {
+	COMMON_SURFACE_VARS;
+	struct curve_set *cs;
+};
+
+/* subdivision surface, placed with the surface transformation */
+struct surf_subdiv {
+	COMMON_SURFACE_VARS;
+	struct subdiv_mesh *sd;
 };
 
 union surface {
@@ -54,19 +151,106 @@ union surface {
 	struct surf_sphere sph;
 	struct surf_aabox box;
 	struct surf_mesh mesh;
+	struct surf_instance inst;
+	struct surf_prims prims;
+	struct surf_voxels vox;
+	struct surf_curves curves;
+	struct surf_subdiv subdiv;
 };
 
-int ray_surface(const union surface *surf, const cgm_ray *ray, struct surf_hit *hit);
+/* transforms a world space ray to the local space of a surface */
+static inline void local_ray(cgm_ray *lray, const cgm_ray *ray, enum xform_type type,
+		const float *inv_xform)
+{
+	switch(type) {
+	case XFORM_IDENTITY:
+		*lray = *ray;
+		break;
+
+	case XFORM_SCALE_TRANS:
+		lray->origin.x = ray->origin.x * inv_xform[0] + inv_xform[12];
+		lray->origin.y = ray->origin.y * inv_xform[5] + inv_xform[13];
+		lray->origin.z = ray->origin.z * inv_xform[10] + inv_xform[14];
+		lray->dir.x = ray->dir.x * inv_xform[0];
+		lray->dir.y = ray->dir.y * inv_xform[5];
+		lray->dir.z = ray->dir.z * inv_xform[10];
+		break;
+
+	default:
+		*lray = *ray;
+		cgm_rmul_mr(lray, inv_xform);
+	}
+}
+
+/* time is the shutter time of the ray, from 0 to 1. Transformation motion is
+ * handled by ray_surface, so only surfaces with deforming geometry need it.
+ */
+int ray_surface(const union surface *surf, const cgm_ray *ray, float time,
+		struct surf_hit *hit);
 int ray_surf_sphere(const struct surf_sphere *sph, const cgm_ray *ray, struct surf_hit *hit);
 int ray_surf_aabox(const struct surf_aabox *box, const cgm_ray *ray, struct surf_hit *hit);
-int ray_surf_mesh(const struct surf_mesh *mesh, const cgm_ray *ray, struct surf_hit *hit);
+int ray_surf_mesh(const struct surf_mesh *mesh, const cgm_ray *ray, float time,
+		struct surf_hit *hit);
+int ray_surf_instance(const struct surf_instance *inst, const cgm_ray *ray, float time,
+		struct surf_hit *hit);
+int ray_surf_prims(const struct surf_prims *prims, const cgm_ray *ray, struct surf_hit *hit);
+int ray_surf_voxels(const struct surf_voxels *vox, const cgm_ray *ray, struct surf_hit *hit);
+int ray_surf_curves(const struct surf_curves *curves, const cgm_ray *ray,
+		struct surf_hit *hit);
+int ray_surf_subdiv(const struct surf_subdiv *subdiv, const cgm_ray *ray,
+		struct surf_hit *hit);
 
 union surface *create_sphere(float x, float y, float z, float rad);
 union surface *create_aabox(float x, float y, float z, float xsz, float ysz, float zsz);
 union surface *create_mesh(void);
+/* adds a reference to geom, which is released by free_surface */
+union surface *create_instance(struct mesh_geom *geom);
+
+/* add primitives to the prim_set, and call build_prims before using it */
+union surface *create_prims(void);
+/* takes ownership of the voxel grid */
+union surface *create_voxels(struct voxel_grid *vg);
+/* takes ownership of the curve set, after build_curves */
+union surface *create_curves(struct curve_set *cs);
+/* takes ownership of the subdivision surface, after load_subdiv */
+union surface *create_subdiv(struct subdiv_mesh *sd);
+
+/* a new geometry starts with one reference, held by the caller */
+struct mesh_geom *create_mesh_geom(void);
+void ref_mesh_geom(struct mesh_geom *geom);
+void release_mesh_geom(struct mesh_geom *geom);
+/* call after loading the mesh, refitting its octree, or registering it as a
+ * lazy mesh
+ */
+void calc_geom_bounds(struct mesh_geom *geom);
 
 void free_surface(union surface *surf);
 
+/* sets the transformation of the surface and classifies it. The inverse is
+ * computed if inv_xform is null. Call calc_bounds afterwards.
+ */
+void set_surface_xform(union surface *surf, const float *xform, const float *inv_xform);
+
+/* makes the surface move from the start to the end transformation over the
+ * shutter interval, replacing its static transformation. Call calc_bounds
+ * afterwards.
+ */
+int set_surface_motion(union surface *surf, const struct xform_key *start,
+		const struct xform_key *end);
+/* transformation and its inverse at a shutter time */
+void motion_xform(const struct surf_motion *mot, float time, float *xform, float *inv_xform);
+/* world bounds of a moving surface at a shutter time */
+void motion_bounds(struct aabox *res, const struct surf_motion *mot, float time);
+
+/* restricts the bounds of a moving surface, or of the octree of a deforming
+ * mesh, to the part of the shutter interval between open and close, for
+ * rendering the motion as a sequence of frames. Instances sharing geometry only
+ * refit it once per interval. Returns 1 if the bounds of the surface depend on
+ * the interval, in which case call calc_bounds afterwards, 0 otherwise.
+ */
+int set_surface_shutter(union surface *surf, float open, float close);
+
+/* computes the local bounds, and the world space bounds which contain them */
 void calc_bounds(union surface *surf);
 
 #endif	/* SURF_H_ */
@@ -0,0 +1,361 @@
+/* texture tile files
+ *
+ * The tile file of an image is built the first time the image is used, next
+ * to it, with a .tiles suffix. It contains a header, followed by the tiles of
+ * all mip levels, largest level first, and each level in row-major tile order.
+ * Tiles extending past the right or bottom edge of a level replicate the edge
+ * texels. Tiles are page aligned, so each one is read with a single pread.
+ *
+ * Source images are binary PPM (P6) or PGM (P5) files. Unlike the mesh cache,
+ * staleness is detected by the size and modification time of the source, to
+ * avoid reading through huge images every time a scene is loaded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "texture.h"
+
+#define TILES_MAGIC		"EREBUSTX"
+#define TILES_VERSION	1
+
+struct tiles_header {
+	char magic[8];
+	int32_t version, hdr_size;
+	int32_t width, height, num_levels, tile_size;
+	uint64_t src_size, src_mtime;
+	uint64_t tile_offs, file_size;
+};
+
+static char *tiles_filename(const char *fname);
+static int init_levels(struct texture *tex, int width, int height);
+static unsigned char *load_pnm(const char *fname, int *width, int *height);
+static int write_level(FILE *fp, const unsigned char *img, int width, int height);
+static void downsample(unsigned char *img, int width, int height);
+
+int load_tex_tiles(struct texture *tex)
+{
+	int fd;
+	char *tfname;
+	struct stat st, srcst;
+	struct tiles_header hdr;
+
+	if(stat(tex->name, &srcst) == -1) {
+		fprintf(stderr, "load_tex_tiles: failed to open texture: %s\n", tex->name);
+		return -1;
+	}
+
+	if(!(tfname = tiles_filename(tex->name))) {
+		return -1;
+	}
+	if((fd = open(tfname, O_RDONLY)) == -1) {
+		free(tfname);
+		return -1;
+	}
+	if(fstat(fd, &st) == -1 || read(fd, &hdr, sizeof hdr) != sizeof hdr) {
+		goto stale;
+	}
+
+	if(memcmp(hdr.magic, TILES_MAGIC, sizeof hdr.magic) != 0 || hdr.version != TILES_VERSION ||
+			hdr.hdr_size != sizeof hdr || hdr.tile_size != TEX_TILE_SIZE ||
+			hdr.file_size != st.st_size || hdr.width <= 0 || hdr.height <= 0) {
+		fprintf(stderr, "load_tex_tiles: ignoring invalid tile file: %s\n", tfname);
+		goto stale;
+	}
+	if(hdr.src_size != srcst.st_size || hdr.src_mtime != srcst.st_mtime) {
+		printf("texture tiles %s are out of date\n", tfname);
+		goto stale;
+	}
+
+	if(init_levels(tex, hdr.width, hdr.height) == -1) {
+		goto stale;
+	}
+	if(hdr.num_levels != tex->num_levels ||
+			hdr.tile_offs + (uint64_t)tex->num_tiles * TEX_TILE_BYTES != hdr.file_size) {
+		fprintf(stderr, "load_tex_tiles: ignoring corrupted tile file: %s\n", tfname);
+		goto stale;
+	}
+	if(!(tex->tiles = calloc(tex->num_tiles, sizeof *tex->tiles))) {
+		goto stale;
+	}
+	tex->fd = fd;
+	tex->tile_offs = hdr.tile_offs;
+
+	printf("loaded texture: %s: %dx%d, %d levels, %d tiles\n", tex->name, tex->width,
+			tex->height, tex->num_levels, tex->num_tiles);
+	free(tfname);
+	return 0;
+
+stale:
+	free(tex->levels);
+	tex->levels = 0;
+	close(fd);
+	free(tfname);
+	return -1;
+}
+
+int build_tex_tiles(struct texture *tex)
+{
+	int i, width, height;
+	FILE *fp = 0;
+	char *tfname = 0, *tmpname = 0;
+	unsigned char *img;
+	struct stat srcst;
+	struct tiles_header hdr;
+
+	if(stat(tex->name, &srcst) == -1 || !(img = load_pnm(tex->name, &width, &height))) {
+		fprintf(stderr, "build_tex_tiles: failed to load texture: %s\n", tex->name);
+		return -1;
+	}
+
+	if(init_levels(tex, width, height) == -1) {
+		goto err;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, TILES_MAGIC, sizeof hdr.magic);
+	hdr.version = TILES_VERSION;
+	hdr.hdr_size = sizeof hdr;
+	hdr.width = width;
+	hdr.height = height;
+	hdr.num_levels = tex->num_levels;
+	hdr.tile_size = TEX_TILE_SIZE;
+	hdr.src_size = srcst.st_size;
+	hdr.src_mtime = srcst.st_mtime;
+	hdr.tile_offs = TEX_TILE_BYTES;
+	hdr.file_size = hdr.tile_offs + (uint64_t)tex->num_tiles * TEX_TILE_BYTES;
+
+	if(!(tfname = tiles_filename(tex->name)) || !(tmpname = malloc(strlen(tfname) + 5))) {
+		goto err;
+	}
+	sprintf(tmpname, "%s.tmp", tfname);
+
+	/* write to a temporary file and rename it when complete, like the mesh cache */
+	if(!(fp = fopen(tmpname, "wb"))) {
+		fprintf(stderr, "build_tex_tiles: failed to open %s for writing\n", tmpname);
+		goto err;
+	}
+	if(fwrite(&hdr, sizeof hdr, 1, fp) != 1 || fseek(fp, hdr.tile_offs, SEEK_SET) == -1) {
+		goto write_err;
+	}
+	for(i=0; i<tex->num_levels; i++) {
+		if(write_level(fp, img, tex->levels[i].width, tex->levels[i].height) == -1) {
+			goto write_err;
+		}
+		if(i < tex->num_levels - 1) {
+			downsample(img, tex->levels[i].width, tex->levels[i].height);
+		}
+	}
+	if(fclose(fp) != 0 || rename(tmpname, tfname) == -1) {
+		fp = 0;
+		goto write_err;
+	}
+
+	printf("built texture tiles: %s\n", tfname);
+	free(img);
+	free(tex->levels);
+	tex->levels = 0;
+	free(tmpname);
+	free(tfname);
+	return 0;
+
+write_err:
+	fprintf(stderr, "build_tex_tiles: failed to write %s\n", tmpname);
+	if(fp) fclose(fp);
+	remove(tmpname);
+err:
+	free(img);
+	free(tex->levels);
+	tex->levels = 0;
+	free(tmpname);
+	free(tfname);
+	return -1;
+}
+
+static char *tiles_filename(const char *fname)
+{
+	char *tfname;
+
+	if(!(tfname = malloc(strlen(fname) + 7))) {
+		return 0;
+	}
+	sprintf(tfname, "%s.tiles", fname);
+	return tfname;
+}
+
+static int init_levels(struct texture *tex, int width, int height)
+{
+	int i, sz, tbase = 0;
+	struct tex_level *lvl;
+
+	tex->width = width;
+	tex->height = height;
+
+	tex->num_levels = 1;
+	sz = width > height ? width : height;
+	while(sz > 1) {
+		sz >>= 1;
+		tex->num_levels++;
+	}
+
+	if(!(tex->levels = malloc(tex->num_levels * sizeof *tex->levels))) {
+		return -1;
+	}
+	for(i=0; i<tex->num_levels; i++) {
+		lvl = tex->levels + i;
+		lvl->width = width;
+		lvl->height = height;
+		lvl->xtiles = (width + TEX_TILE_SIZE - 1) >> TEX_TILE_SHIFT;
+		lvl->ytiles = (height + TEX_TILE_SIZE - 1) >> TEX_TILE_SHIFT;
+		lvl->tbase = tbase;
+		tbase += lvl->xtiles * lvl->ytiles;
+
+		if(width > 1) width >>= 1;
+		if(height > 1) height >>= 1;
+	}
+	tex->num_tiles = tbase;
+	return 0;
+}
+
+/* reads the next header value, skipping whitespace and comments, and the
+ * single whitespace character following it
+ */
+static int pnm_value(FILE *fp)
+{
+	int c, val = 0;
+
+	while((c = fgetc(fp)) != EOF) {
+		if(c == '#') {
+			while((c = fgetc(fp)) != EOF && c != '\n');
+		} else if(!isspace(c)) {
+			break;
+		}
+	}
+	if(c == EOF || !isdigit(c)) return -1;
+
+	while(isdigit(c)) {
+		val = val * 10 + c - '0';
+		c = fgetc(fp);
+	}
+	return val;
+}
+
+/* returns the image as RGBA8 */
+static unsigned char *load_pnm(const char *fname, int *width, int *height)
+{
+	FILE *fp;
+	int i, j, nchan, maxval, bpc;
+	unsigned int val;
+	unsigned char *img = 0, *row = 0, *src, *dest;
+	char magic[2];
+
+	if(!(fp = fopen(fname, "rb"))) {
+		return 0;
+	}
+	if(fread(magic, 1, 2, fp) != 2 || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6')) {
+		fprintf(stderr, "load_pnm: %s: only binary PPM and PGM images are supported\n", fname);
+		goto end;
+	}
+	nchan = magic[1] == '6' ? 3 : 1;
+	*width = pnm_value(fp);
+	*height = pnm_value(fp);
+	maxval = pnm_value(fp);
+	if(*width <= 0 || *height <= 0 || maxval <= 0 || maxval > 65535) {
+		fprintf(stderr, "load_pnm: %s: invalid header\n", fname);
+		goto end;
+	}
+	bpc = maxval > 255 ? 2 : 1;
+
+	if(!(img = malloc((long)*width * *height * 4)) || !(row = malloc(*width * nchan * bpc))) {
+		free(img);
+		img = 0;
+		goto end;
+	}
+
+	dest = img;
+	for(i=0; i<*height; i++) {
+		if(fread(row, bpc * nchan, *width, fp) != *width) {
+			fprintf(stderr, "load_pnm: %s: unexpected end of file\n", fname);
+			free(img);
+			img = 0;
+			goto end;
+		}
+		/* rescale to 8 bits in place, the source never falls behind */
+		src = row;
+		for(j=0; j<*width * nchan; j++) {
+			val = bpc > 1 ? (src[0] << 8) | src[1] : src[0];
+			row[j] = val * 255 / maxval;
+			src += bpc;
+		}
+		for(j=0; j<*width; j++) {
+			src = row + j * nchan;
+			dest[0] = src[0];
+			dest[1] = src[nchan > 1 ? 1 : 0];
+			dest[2] = src[nchan > 1 ? 2 : 0];
+			dest[3] = 255;
+			dest += 4;
+		}
+	}
+
+end:
+	free(row);
+	fclose(fp);
+	return img;
+}
+
+static int write_level(FILE *fp, const unsigned char *img, int width, int height)
+{
+	int i, j, tx, ty, sx, sy, xtiles, ytiles;
+	uint32_t tile[TEX_TILE_SIZE * TEX_TILE_SIZE], *dest;
+	const uint32_t *pixels = (const uint32_t*)img;
+
+	xtiles = (width + TEX_TILE_SIZE - 1) >> TEX_TILE_SHIFT;
+	ytiles = (height + TEX_TILE_SIZE - 1) >> TEX_TILE_SHIFT;
+
+	for(ty=0; ty<ytiles; ty++) {
+		for(tx=0; tx<xtiles; tx++) {
+			dest = tile;
+			for(i=0; i<TEX_TILE_SIZE; i++) {
+				sy = (ty << TEX_TILE_SHIFT) + i;
+				if(sy >= height) sy = height - 1;
+				for(j=0; j<TEX_TILE_SIZE; j++) {
+					sx = (tx << TEX_TILE_SHIFT) + j;
+					if(sx >= width) sx = width - 1;
+					*dest++ = pixels[(long)sy * width + sx];
+				}
+			}
+			if(fwrite(tile, 1, sizeof tile, fp) != sizeof tile) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* box filters the image down to the next mip level, in place. Each texel of
+ * the next level only depends on texels at or after its own position.
+ */
+static void downsample(unsigned char *img, int width, int height)
+{
+	int i, j, c, x1, nwidth, nheight;
+	unsigned char *dest = img, *row0, *row1;
+
+	nwidth = width > 1 ? width >> 1 : 1;
+	nheight = height > 1 ? height >> 1 : 1;
+
+	for(i=0; i<nheight; i++) {
+		row0 = img + (long)i * 2 * width * 4;
+		row1 = i * 2 + 1 < height ? row0 + width * 4 : row0;
+		for(j=0; j<nwidth; j++) {
+			x1 = j * 2 + 1 < width ? 4 : 0;
+			for(c=0; c<4; c++) {
+				*dest++ = (row0[c] + row0[x1 + c] + row1[c] + row1[x1 + c] + 2) >> 2;
+			}
+			row0 += 8;
+			row1 += 8;
+		}
+	}
+}
@@ -0,0 +1,301 @@
+/* texture tile cache
+ *
+ * All textures share a fixed number of tile slots. The tile table of a texture
+ * points to the slots holding its resident tiles, and each slot points back to
+ * the tile table entry which owns it. Lookups don't take any locks: slots are
+ * versioned with a sequence number, which is odd while the slot is refilled,
+ * and a lookup which sees the sequence number change while reading a texel
+ * starts over. Misses read the tile from disk without holding the lock, and
+ * then lock the cache just to pick a slot with the clock algorithm.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "texture.h"
+
+#define TILE_TEXELS		(TEX_TILE_SIZE * TEX_TILE_SIZE)
+
+struct tile_slot {
+	unsigned int seq;
+	int *owner;		/* tile table entry of the tile in this slot */
+	int ref;		/* accessed since the clock hand last passed */
+};
+
+static int init_cache(void);
+static int bilerp(struct texture *tex, const struct tex_level *lvl, float u, float v,
+		const float *lut, cgm_vec3 *res);
+static int fetch_texel(struct texture *tex, const struct tex_level *lvl, int x, int y,
+		uint32_t *res);
+static int load_tile(struct texture *tex, int tidx);
+
+static int cache_mbytes = DEF_TEX_CACHE_MB;
+static struct tile_slot *slots;
+static uint32_t *slot_texels;
+static int num_slots, clock_hand;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static float srgb_lut[256], linear_lut[256];
+
+void set_texture_cache_size(int mbytes)
+{
+	cache_mbytes = mbytes;
+}
+
+void init_texture(struct texture *tex)
+{
+	memset(tex, 0, sizeof *tex);
+	tex->fd = -1;
+}
+
+void destroy_texture(struct texture *tex)
+{
+	int i;
+	struct tile_slot *slot;
+
+	if(tex->tiles) {
+		pthread_mutex_lock(&cache_lock);
+		for(i=0; i<num_slots; i++) {
+			slot = slots + i;
+			if(slot->owner >= tex->tiles && slot->owner < tex->tiles + tex->num_tiles) {
+				__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+				__atomic_thread_fence(__ATOMIC_RELEASE);
+				__atomic_store_n(&slot->owner, 0, __ATOMIC_RELAXED);
+				__atomic_store_n(&slot->ref, 0, __ATOMIC_RELAXED);
+				__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+			}
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+	if(tex->fd != -1) {
+		close(tex->fd);
+	}
+	free(tex->tiles);
+	free(tex->levels);
+	free(tex->name);
+	init_texture(tex);
+}
+
+int open_texture(struct texture *tex)
+{
+	if(init_cache() == -1) {
+		return -1;
+	}
+	if(load_tex_tiles(tex) == -1) {
+		if(build_tex_tiles(tex) == -1 || load_tex_tiles(tex) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int sample_texture(struct texture *tex, float u, float v, float lod, int srgb, cgm_vec3 *res)
+{
+	int lvl;
+	cgm_vec3 c0, c1;
+	const float *lut = srgb ? srgb_lut : linear_lut;
+
+	if(tex->fd == -1) {
+		return -1;
+	}
+
+	if(lod <= 0.0f) {
+		return bilerp(tex, tex->levels, u, v, lut, res);
+	}
+	if(lod >= tex->num_levels - 1) {
+		return bilerp(tex, tex->levels + tex->num_levels - 1, u, v, lut, res);
+	}
+
+	lvl = (int)lod;
+	if(bilerp(tex, tex->levels + lvl, u, v, lut, &c0) == -1 ||
+			bilerp(tex, tex->levels + lvl + 1, u, v, lut, &c1) == -1) {
+		return -1;
+	}
+	cgm_vlerp(res, &c0, &c1, lod - lvl);
+	return 0;
+}
+
+static int init_cache(void)
+{
+	int i;
+	float x;
+
+	pthread_mutex_lock(&cache_lock);
+	if(slots) {
+		pthread_mutex_unlock(&cache_lock);
+		return 0;
+	}
+
+	if((num_slots = (long)cache_mbytes * 1048576 / TEX_TILE_BYTES) < 1) {
+		num_slots = 1;
+	}
+	slots = calloc(num_slots, sizeof *slots);
+	slot_texels = malloc((long)num_slots * TEX_TILE_BYTES);
+	if(!slots || !slot_texels) {
+		fprintf(stderr, "failed to allocate %d MB texture cache\n", cache_mbytes);
+		free(slots);
+		free(slot_texels);
+		slots = 0;
+		slot_texels = 0;
+		pthread_mutex_unlock(&cache_lock);
+		return -1;
+	}
+
+	for(i=0; i<256; i++) {
+		x = i / 255.0f;
+		linear_lut[i] = x;
+		srgb_lut[i] = x <= 0.04045f ? x / 12.92f : pow((x + 0.055f) / 1.055f, 2.4f);
+	}
+
+	printf("texture cache: %d MB, %d tiles\n", cache_mbytes, num_slots);
+	pthread_mutex_unlock(&cache_lock);
+	return 0;
+}
+
+static inline void decode_texel(uint32_t texel, const float *lut, float *res)
+{
+	unsigned char *rgba = (unsigned char*)&texel;
+
+	res[0] = lut[rgba[0]];
+	res[1] = lut[rgba[1]];
+	res[2] = lut[rgba[2]];
+}
+
+static int bilerp(struct texture *tex, const struct tex_level *lvl, float u, float v,
+		const float *lut, cgm_vec3 *res)
+{
+	int i, x0, y0, x1, y1;
+	float fx, fy, tx, ty, c[4][3];
+	uint32_t texel[4];
+
+	/* image rows are stored top to bottom, texture coordinates start at the
+	 * bottom left corner
+	 */
+	fx = (u - floor(u)) * lvl->width - 0.5f;
+	fy = (1.0f - (v - floor(v))) * lvl->height - 0.5f;
+	x0 = (int)floor(fx);
+	y0 = (int)floor(fy);
+	tx = fx - x0;
+	ty = fy - y0;
+
+	if(x0 < 0) x0 += lvl->width;
+	if(y0 < 0) y0 += lvl->height;
+	if(x0 >= lvl->width) x0 = lvl->width - 1;
+	if(y0 >= lvl->height) y0 = lvl->height - 1;
+	if((x1 = x0 + 1) >= lvl->width) x1 = 0;
+	if((y1 = y0 + 1) >= lvl->height) y1 = 0;
+
+	if(fetch_texel(tex, lvl, x0, y0, texel) == -1 ||
+			fetch_texel(tex, lvl, x1, y0, texel + 1) == -1 ||
+			fetch_texel(tex, lvl, x0, y1, texel + 2) == -1 ||
+			fetch_texel(tex, lvl, x1, y1, texel + 3) == -1) {
+		return -1;
+	}
+	for(i=0; i<4; i++) {
+		decode_texel(texel[i], lut, c[i]);
+	}
+
+	res->x = cgm_lerp(cgm_lerp(c[0][0], c[1][0], tx), cgm_lerp(c[2][0], c[3][0], tx), ty);
+	res->y = cgm_lerp(cgm_lerp(c[0][1], c[1][1], tx), cgm_lerp(c[2][1], c[3][1], tx), ty);
+	res->z = cgm_lerp(cgm_lerp(c[0][2], c[1][2], tx), cgm_lerp(c[2][2], c[3][2], tx), ty);
+	return 0;
+}
+
+static int fetch_texel(struct texture *tex, const struct tex_level *lvl, int x, int y,
+		uint32_t *res)
+{
+	int s, *entry;
+	unsigned int seq;
+	uint32_t texel;
+	struct tile_slot *slot;
+
+	entry = tex->tiles + lvl->tbase + (y >> TEX_TILE_SHIFT) * lvl->xtiles +
+		(x >> TEX_TILE_SHIFT);
+	x &= TEX_TILE_SIZE - 1;
+	y &= TEX_TILE_SIZE - 1;
+
+	for(;;) {
+		if(!(s = __atomic_load_n(entry, __ATOMIC_ACQUIRE))) {
+			if(load_tile(tex, entry - tex->tiles) == -1) {
+				return -1;
+			}
+			continue;
+		}
+
+		/* if the slot is refilled while we read it, the entry is cleared
+		 * before the slot is ready, and the next iteration loads the tile again
+		 */
+		slot = slots + s - 1;
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if((seq & 1) || __atomic_load_n(&slot->owner, __ATOMIC_RELAXED) != entry) {
+			continue;
+		}
+		texel = __atomic_load_n(slot_texels + (long)(s - 1) * TILE_TEXELS +
+				(y << TEX_TILE_SHIFT) + x, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+			continue;
+		}
+
+		if(!__atomic_load_n(&slot->ref, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&slot->ref, 1, __ATOMIC_RELAXED);
+		}
+		*res = texel;
+		return 0;
+	}
+}
+
+static int load_tile(struct texture *tex, int tidx)
+{
+	int i, s;
+	uint32_t buf[TILE_TEXELS], *dest;
+	struct tile_slot *slot;
+	int *entry = tex->tiles + tidx;
+
+	if(pread(tex->fd, buf, TEX_TILE_BYTES, tex->tile_offs + (uint64_t)tidx * TEX_TILE_BYTES)
+			!= TEX_TILE_BYTES) {
+		fprintf(stderr, "failed to read tile %d of texture: %s\n", tidx, tex->name);
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	if(*entry) {
+		/* another thread loaded it while we were reading */
+		pthread_mutex_unlock(&cache_lock);
+		return 0;
+	}
+
+	/* evict the first slot not accessed since the last pass of the clock hand,
+	 * which takes at most two passes
+	 */
+	for(;;) {
+		s = clock_hand;
+		slot = slots + s;
+		if(++clock_hand >= num_slots) clock_hand = 0;
+
+		if(!slot->owner || !__atomic_exchange_n(&slot->ref, 0, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if(slot->owner) {
+		__atomic_store_n(slot->owner, 0, __ATOMIC_RELAXED);
+	}
+
+	dest = slot_texels + (long)s * TILE_TEXELS;
+	for(i=0; i<TILE_TEXELS; i++) {
+		__atomic_store_n(dest + i, buf[i], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&slot->owner, entry, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->ref, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+	__atomic_store_n(entry, s + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&cache_lock);
+	return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef TEXTURE_H_
+#define TEXTURE_H_
+
+#include <stdint.h>
+#include <cgmath/cgmath.h>
+
+/* textures are stored on disk as a mip pyramid of square RGBA8 tiles, and
+ * tiles are paged in on demand into a fixed size cache shared by all textures
+ */
+#define TEX_TILE_SHIFT	5
+#define TEX_TILE_SIZE	(1 << TEX_TILE_SHIFT)
+#define TEX_TILE_BYTES	(TEX_TILE_SIZE * TEX_TILE_SIZE * 4)
+
+#define DEF_TEX_CACHE_MB	256
+
+struct tex_level {
+	int width, height;
+	int xtiles, ytiles;
+	int tbase;		/* index of the first tile of this level */
+};
+
+struct texture {
+	char *name;		/* source image path */
+	int width, height;
+	int num_levels;
+	struct tex_level *levels;
+
+	int fd;			/* tile file, -1 if the texture isn't open */
+	uint64_t tile_offs;	/* offset of the first tile in the tile file */
+
+	/* cache slot + 1 of every tile of every level, 0 if not resident. Written
+	 * only by the cache, with the cache lock held, read without locking.
+	 */
+	int *tiles;
+	int num_tiles;
+};
+
+/* sets the tile cache size, before any texture is opened */
+void set_texture_cache_size(int mbytes);
+
+void init_texture(struct texture *tex);
+/* evicts all its tiles from the cache, and closes the tile file */
+void destroy_texture(struct texture *tex);
+
+/* opens the tile file of the texture, building it from the source image if
+ * it's missing or out of date. Tiles are loaded later, on first access.
+ */
+int open_texture(struct texture *tex);
+
+/* trilinear lookup at texture coordinates u, v (v pointing up, as in OBJ
+ * files, wrapping around), at mip level lod. Returns -1 if the texture isn't
+ * open, or the tiles can't be read. Color textures are converted from sRGB.
+ */
+int sample_texture(struct texture *tex, float u, float v, float lod, int srgb, cgm_vec3 *res);
+
+/* tile file management (texcache.c) */
+int load_tex_tiles(struct texture *tex);
+int build_tex_tiles(struct texture *tex);
+
+#endif	/* TEXTURE_H_ */
@@ -2,6 +2,9 @@
  * author: John Tsiombikas <nuclear@member.fsf.org>
  * This code is public domain.
  */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	/* for pthread_setaffinity_np */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -220,15 +223,22 @@ int tpool_enqueue(struct thread_pool *tpool, void *data,
 
 void tpool_clear(struct thread_pool *tpool)
 {
+	struct work_item *list;
+
 	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->workq) {
-		void *tmp = tpool->workq;
-		tpool->workq = tpool->workq->next;
-		free(tmp);
-	}
+	list = tpool->workq;
 	tpool->workq = tpool->workq_tail = 0;
 	tpool->qsize = 0;
 	pthread_mutex_unlock(&tpool->workq_mutex);
+
+	/* wake up anyone waiting for the queue to drain */
+	pthread_cond_broadcast(&tpool->done_condvar);
+
+	while(list) {
+		struct work_item *tmp = list;
+		list = list->next;
+		free_work_item(tmp);
+	}
 }
 
 int tpool_queued_jobs(struct thread_pool *tpool)
@@ -418,6 +428,35 @@ int tpool_thread_id(struct thread_pool *tpool)
 	return id;
 }
 
+int tpool_num_threads(struct thread_pool *tpool)
+{
+	return tpool->num_threads;
+}
+
+int tpool_set_thread_cpus(struct thread_pool *tpool, int thread, const int *cpus, int num_cpus)
+{
+#ifdef __linux__
+	int i;
+	cpu_set_t set;
+
+	if(thread < 0 || thread >= tpool->num_threads) {
+		return -1;
+	}
+	CPU_ZERO(&set);
+	for(i=0; i<num_cpus; i++) {
+		if(cpus[i] >= 0 && cpus[i] < CPU_SETSIZE) {
+			CPU_SET(cpus[i], &set);
+		}
+	}
+	if(pthread_setaffinity_np(tpool->threads[thread], sizeof set, &set) != 0) {
+		return -1;
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
 
 /* The following highly platform-specific code detects the number
  * of processors available in the system. It's used by the thread pool
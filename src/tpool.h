@@ -73,6 +73,14 @@ void *tpool_get_wait_handle(struct thread_pool *tpool);
  */
 int tpool_thread_id(struct thread_pool *tpool);
 
+/* returns the number of worker threads in the pool */
+int tpool_num_threads(struct thread_pool *tpool);
+
+/* restricts a worker thread to the listed processors.
+ * This is a Linux-specific call. Elsewhere it does nothing and returns -1.
+ */
+int tpool_set_thread_cpus(struct thread_pool *tpool, int thread, const int *cpus, int num_cpus);
+
 
 /* returns the number of processors on the system.
  * individual cores in multi-core processors are counted as processors.
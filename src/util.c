@@ -0,0 +1,9 @@
+#include <sys/time.h>
+#include "util.h"
+
+long get_msec(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
@@ -0,0 +1,7 @@
+#ifndef UTIL_H_
+#define UTIL_H_
+
+/* wall clock time in milliseconds, for measuring intervals */
+long get_msec(void);
+
+#endif	/* UTIL_H_ */
@@ -0,0 +1,311 @@
+/* sparse voxel grids
+ *
+ * Rays are traversed with a 3D DDA at two levels: the brick level steps over
+ * empty bricks without looking at their voxels, and each solid brick is
+ * traversed voxel by voxel, from the point where the ray enters it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "voxel.h"
+#include "dynarr.h"
+
+#define EPSILON		1e-5f
+
+static int clip_ray(const struct aabox *box, const cgm_ray *ray, float *tnear, float *tfar,
+		int *axis);
+static int ray_brick(const struct voxel_brick *brick, const int *bcell, const cgm_ray *ray,
+		float t, float tend, int axis, float *thit, int *hit_axis, int *pal);
+
+int init_voxels(struct voxel_grid *vg, int xsz, int ysz, int zsz)
+{
+	int i, num_bricks;
+
+	memset(vg, 0, sizeof *vg);
+	if(xsz <= 0 || ysz <= 0 || zsz <= 0) {
+		return -1;
+	}
+	vg->size[0] = xsz;
+	vg->size[1] = ysz;
+	vg->size[2] = zsz;
+	for(i=0; i<3; i++) {
+		vg->bsize[i] = (vg->size[i] + BRICK_SIZE - 1) >> BRICK_SHIFT;
+	}
+	num_bricks = vg->bsize[0] * vg->bsize[1] * vg->bsize[2];
+
+	if(!(vg->brick_idx = malloc(num_bricks * sizeof *vg->brick_idx))) {
+		return -1;
+	}
+	for(i=0; i<num_bricks; i++) {
+		vg->brick_idx[i] = -1;
+	}
+	if(!(vg->bricks = dynarr_alloc(0, sizeof *vg->bricks))) {
+		free(vg->brick_idx);
+		vg->brick_idx = 0;
+		return -1;
+	}
+
+	cgm_vcons(&vg->bbox.vmin, FLT_MAX, FLT_MAX, FLT_MAX);
+	cgm_vcons(&vg->bbox.vmax, -FLT_MAX, -FLT_MAX, -FLT_MAX);
+	return 0;
+}
+
+void clear_voxels(struct voxel_grid *vg)
+{
+	free(vg->brick_idx);
+	if(vg->bricks) {
+		dynarr_free(vg->bricks);
+	}
+	memset(vg, 0, sizeof *vg);
+}
+
+int set_voxel(struct voxel_grid *vg, int x, int y, int z, int mtl)
+{
+	int i, bidx, *bptr;
+	void *tmp;
+	struct voxel_brick *brick;
+	unsigned char *vox;
+
+	if(x < 0 || y < 0 || z < 0 || x >= vg->size[0] || y >= vg->size[1] || z >= vg->size[2]) {
+		return -1;
+	}
+
+	for(i=0; i<vg->num_mtls; i++) {
+		if(vg->mtl[i] == mtl) break;
+	}
+	if(i >= vg->num_mtls) {
+		if(vg->num_mtls >= MAX_VOXEL_MTLS) {
+			return -1;
+		}
+		vg->mtl[vg->num_mtls++] = mtl;
+	}
+
+	bptr = vg->brick_idx + ((z >> BRICK_SHIFT) * vg->bsize[1] + (y >> BRICK_SHIFT)) *
+		vg->bsize[0] + (x >> BRICK_SHIFT);
+	if((bidx = *bptr) == -1) {
+		bidx = dynarr_size(vg->bricks);
+		if(!(tmp = dynarr_resize(vg->bricks, bidx + 1))) {
+			return -1;
+		}
+		vg->bricks = tmp;
+		memset(vg->bricks + bidx, 0, sizeof *vg->bricks);
+		*bptr = bidx;
+	}
+	brick = vg->bricks + bidx;
+
+	vox = brick->vox + ((((z & (BRICK_SIZE - 1)) << BRICK_SHIFT) | (y & (BRICK_SIZE - 1))) <<
+			BRICK_SHIFT) + (x & (BRICK_SIZE - 1));
+	if(!*vox) {
+		vg->num_voxels++;
+	}
+	*vox = i + 1;
+
+	if(x < vg->bbox.vmin.x) vg->bbox.vmin.x = x;
+	if(y < vg->bbox.vmin.y) vg->bbox.vmin.y = y;
+	if(z < vg->bbox.vmin.z) vg->bbox.vmin.z = z;
+	if(x + 1 > vg->bbox.vmax.x) vg->bbox.vmax.x = x + 1;
+	if(y + 1 > vg->bbox.vmax.y) vg->bbox.vmax.y = y + 1;
+	if(z + 1 > vg->bbox.vmax.z) vg->bbox.vmax.z = z + 1;
+	return 0;
+}
+
+int load_voxels_raw(struct voxel_grid *vg, const char *fname, int xsz, int ysz, int zsz,
+		int threshold, int mtl)
+{
+	FILE *fp;
+	int x, y, z;
+	unsigned char *row;
+
+	if(!(fp = fopen(fname, "rb"))) {
+		fprintf(stderr, "load_voxels_raw: failed to open: %s\n", fname);
+		return -1;
+	}
+	if(init_voxels(vg, xsz, ysz, zsz) == -1 || !(row = malloc(xsz))) {
+		fprintf(stderr, "load_voxels_raw: failed to allocate %dx%dx%d grid\n", xsz, ysz, zsz);
+		clear_voxels(vg);
+		fclose(fp);
+		return -1;
+	}
+
+	for(z=0; z<zsz; z++) {
+		for(y=0; y<ysz; y++) {
+			if(fread(row, 1, xsz, fp) < xsz) {
+				fprintf(stderr, "load_voxels_raw: %s: unexpected end of file\n", fname);
+				goto err;
+			}
+			for(x=0; x<xsz; x++) {
+				if(row[x] >= threshold && set_voxel(vg, x, y, z, mtl) == -1) {
+					fprintf(stderr, "load_voxels_raw: failed to allocate bricks\n");
+					goto err;
+				}
+			}
+		}
+	}
+	free(row);
+	fclose(fp);
+
+	printf("loaded voxels: %s: %dx%dx%d, %ld solid voxels in %d bricks\n", fname, xsz, ysz,
+			zsz, vg->num_voxels, dynarr_size(vg->bricks));
+	return 0;
+
+err:
+	free(row);
+	fclose(fp);
+	clear_voxels(vg);
+	return -1;
+}
+
+int find_voxel_isect(const struct voxel_grid *vg, const cgm_ray *ray, float *t,
+		cgm_vec3 *normal, int *mtl)
+{
+	int i, axis, bidx, pal, cell[3], step[3];
+	float tcur, tfar, tend, tmax[3], tdelta[3], dir, p;
+	const float *org = &ray->origin.x;
+
+	if(!vg->num_voxels || !clip_ray(&vg->bbox, ray, &tcur, &tfar, &axis)) {
+		return 0;
+	}
+
+	/* brick level DDA, starting from the brick where the ray enters the bounds */
+	for(i=0; i<3; i++) {
+		dir = (&ray->dir.x)[i];
+		p = org[i] + dir * tcur;
+		cell[i] = (int)floor(p) >> BRICK_SHIFT;
+		if(cell[i] < 0) cell[i] = 0;
+		if(cell[i] >= vg->bsize[i]) cell[i] = vg->bsize[i] - 1;
+
+		if(dir > 0.0f) {
+			step[i] = 1;
+			tmax[i] = ((float)((cell[i] + 1) << BRICK_SHIFT) - org[i]) / dir;
+			tdelta[i] = BRICK_SIZE / dir;
+		} else if(dir < 0.0f) {
+			step[i] = -1;
+			tmax[i] = ((float)(cell[i] << BRICK_SHIFT) - org[i]) / dir;
+			tdelta[i] = -BRICK_SIZE / dir;
+		} else {
+			step[i] = 0;
+			tmax[i] = tdelta[i] = FLT_MAX;
+		}
+	}
+
+	for(;;) {
+		i = tmax[0] < tmax[1] ? (tmax[0] < tmax[2] ? 0 : 2) : (tmax[1] < tmax[2] ? 1 : 2);
+		tend = tmax[i] < tfar ? tmax[i] : tfar;
+
+		bidx = vg->brick_idx[(cell[2] * vg->bsize[1] + cell[1]) * vg->bsize[0] + cell[0]];
+		if(bidx >= 0 && ray_brick(vg->bricks + bidx, cell, ray, tcur, tend, axis, t, &axis,
+					&pal)) {
+			cgm_vcons(normal, 0, 0, 0);
+			(&normal->x)[axis] = (&ray->dir.x)[axis] > 0.0f ? -1.0f : 1.0f;
+			*mtl = vg->mtl[pal];
+			return 1;
+		}
+
+		if(tmax[i] > tfar) {
+			return 0;
+		}
+		tcur = tmax[i];
+		axis = i;
+		cell[i] += step[i];
+		if(cell[i] < 0 || cell[i] >= vg->bsize[i]) {
+			return 0;
+		}
+		tmax[i] += tdelta[i];
+	}
+}
+
+/* range of ray distances inside the box, and the axis of the face the ray
+ * enters through, or -1 if it starts inside
+ */
+static int clip_ray(const struct aabox *box, const cgm_ray *ray, float *tnear, float *tfar,
+		int *axis)
+{
+	int i;
+	float t0, t1, tmp, dir, org;
+
+	*tnear = 0.0f;
+	*tfar = FLT_MAX;
+	*axis = -1;
+
+	for(i=0; i<3; i++) {
+		dir = (&ray->dir.x)[i];
+		org = (&ray->origin.x)[i];
+		if(dir == 0.0f) {
+			if(org < (&box->vmin.x)[i] || org > (&box->vmax.x)[i]) {
+				return 0;
+			}
+			continue;
+		}
+		t0 = ((&box->vmin.x)[i] - org) / dir;
+		t1 = ((&box->vmax.x)[i] - org) / dir;
+		if(t0 > t1) {
+			tmp = t0;
+			t0 = t1;
+			t1 = tmp;
+		}
+		if(t0 > *tnear) {
+			*tnear = t0;
+			*axis = i;
+		}
+		if(t1 < *tfar) *tfar = t1;
+	}
+	return *tnear <= *tfar;
+}
+
+/* voxel level DDA through a brick, from distance t to tend. axis is the axis of
+ * the face the ray entered through at t, or -1. Voxels the ray starts in don't
+ * count, so that rays leaving a voxel face don't hit it again.
+ */
+static int ray_brick(const struct voxel_brick *brick, const int *bcell, const cgm_ray *ray,
+		float t, float tend, int axis, float *thit, int *hit_axis, int *pal)
+{
+	int i, v, lo[3], cell[3], step[3];
+	float tmax[3], tdelta[3], dir, p;
+	const float *org = &ray->origin.x;
+
+	for(i=0; i<3; i++) {
+		lo[i] = bcell[i] << BRICK_SHIFT;
+		dir = (&ray->dir.x)[i];
+		p = org[i] + dir * t;
+		cell[i] = (int)floor(p) - lo[i];
+		if(cell[i] < 0) cell[i] = 0;
+		if(cell[i] >= BRICK_SIZE) cell[i] = BRICK_SIZE - 1;
+
+		if(dir > 0.0f) {
+			step[i] = 1;
+			tmax[i] = ((float)(lo[i] + cell[i] + 1) - org[i]) / dir;
+			tdelta[i] = 1.0f / dir;
+		} else if(dir < 0.0f) {
+			step[i] = -1;
+			tmax[i] = ((float)(lo[i] + cell[i]) - org[i]) / dir;
+			tdelta[i] = -1.0f / dir;
+		} else {
+			step[i] = 0;
+			tmax[i] = tdelta[i] = FLT_MAX;
+		}
+	}
+
+	for(;;) {
+		v = brick->vox[(((cell[2] << BRICK_SHIFT) | cell[1]) << BRICK_SHIFT) | cell[0]];
+		if(v && axis >= 0 && t > EPSILON) {
+			*thit = t;
+			*hit_axis = axis;
+			*pal = v - 1;
+			return 1;
+		}
+
+		i = tmax[0] < tmax[1] ? (tmax[0] < tmax[2] ? 0 : 2) : (tmax[1] < tmax[2] ? 1 : 2);
+		if(tmax[i] > tend) {
+			return 0;
+		}
+		t = tmax[i];
+		axis = i;
+		cell[i] += step[i];
+		if(cell[i] < 0 || cell[i] >= BRICK_SIZE) {
+			return 0;
+		}
+		tmax[i] += tdelta[i];
+	}
+}
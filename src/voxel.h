@@ -0,0 +1,56 @@
+#ifndef VOXEL_H_
+#define VOXEL_H_
+
+#include <cgmath/cgmath.h>
+#include "aabox.h"
+
+/* voxel grids are split into cubic bricks, and only bricks with solid voxels
+ * are allocated. Voxel x, y, z covers [x, x+1] * [y, y+1] * [z, z+1] of the
+ * grid space.
+ */
+#define BRICK_SHIFT		3
+#define BRICK_SIZE		(1 << BRICK_SHIFT)
+#define BRICK_VOXELS	(BRICK_SIZE * BRICK_SIZE * BRICK_SIZE)
+
+#define MAX_VOXEL_MTLS	255
+
+struct voxel_brick {
+	/* palette index + 1 of each voxel, 0 for empty, x varying fastest */
+	unsigned char vox[BRICK_VOXELS];
+};
+
+struct voxel_grid {
+	int size[3];		/* in voxels */
+	int bsize[3];		/* in bricks */
+	int *brick_idx;		/* index in bricks of each brick, -1 if empty */
+	struct voxel_brick *bricks;	/* dynarr */
+
+	/* scene material index of each palette entry, -1 for the surface material */
+	int mtl[MAX_VOXEL_MTLS];
+	int num_mtls;
+
+	long num_voxels;
+	struct aabox bbox;	/* bounds of the solid voxels, in grid space */
+};
+
+int init_voxels(struct voxel_grid *vg, int xsz, int ysz, int zsz);
+void clear_voxels(struct voxel_grid *vg);
+
+/* makes a voxel solid, with a scene material index, or -1. Fails if the
+ * coordinates are out of range, or the palette is full.
+ */
+int set_voxel(struct voxel_grid *vg, int x, int y, int z, int mtl);
+
+/* loads a raw volume of xsz * ysz * zsz bytes, x varying fastest, making the
+ * voxels with values greater than or equal to threshold solid
+ */
+int load_voxels_raw(struct voxel_grid *vg, const char *fname, int xsz, int ysz, int zsz,
+		int threshold, int mtl);
+
+/* traverses the grid with a ray in grid space. Returns the distance along the
+ * ray, the grid space normal of the face hit, and the material of the voxel.
+ */
+int find_voxel_isect(const struct voxel_grid *vg, const cgm_ray *ray, float *t,
+		cgm_vec3 *normal, int *mtl);
+
+#endif	/* VOXEL_H_ */